@@ -4,6 +4,7 @@
 #include "Vector.h"
 #include "BST.h"
 #include "BSTv1.h"
+#include "Memory/ScopedArena.h"
 
 void TestVector()
 {
@@ -65,10 +66,26 @@ void TestVector()
 		data.Emplace(12);
 		ASSERT(data.At(2).value == 12, "Emplace with arguments");
 	}
+	{
+		Vector<char> data;
+		data.Add('a');
+		ASSERT(data.Capacity() == Memory::GoodSize(2), "Capacity takes the good size of the allocator");
+		data.Reserve(100000);
+		ASSERT(data.Capacity() >= 100000 && data.At(0) == 'a', "Reserve keeps the elements");
+	}
+	{
+		Memory::ScopedArena arena;
+		Vector<int, Memory::ArenaAllocation> data;
+		for (int i = 0; i < 1000; ++i)
+		{
+			data.Add(i);
+		}
+		ASSERT(data.Count() == 1000 && data.At(999) == 999, "Vector grows in the arena");
+	}
 }
 
 
-template <template <typename> class T, typename V>
+template <template <typename...> class T, typename V>
 void TestBST(std::string const& testName = "Test Binary Search Tree")
 {
 	TEST(testName);
@@ -224,10 +241,17 @@ void TestBST(std::string const& testName = "Test Binary Search Tree")
 	}
 }
 
+template <typename V>
+using ArenaBSTv1 = BSTv1<V, Memory::ArenaAllocation>;
+
 void TestDataStructures()
 {
 	TestVector();
 	TestBST<BST, int>("Test BST<int>");
 	TestBST<BST, double>("Test BST<double>");
 	TestBST<BSTv1, int>("Test BSTv1<int>");
+	{
+		Memory::ScopedArena arena;
+		TestBST<ArenaBSTv1, int>("Test BSTv1<int> in the arena");
+	}
 }
\ No newline at end of file
@@ -1,15 +1,18 @@
 #pragma once
 #include "TreesCommon.h"
+#include <type_traits>
 #include "Memory/Memory.h"
 
-template <typename T>
+// Allocation is where the nodes live, see Memory::GlobalAllocation.
+// Nodes of trivially destructible values aren't visited on destruction when it frees in bulk.
+template <typename T, typename Allocation = Memory::GlobalAllocation>
 class BSTv1
 {
 public:
 	BSTv1() = default;
 	~BSTv1()
 	{
-		if (m_root)
+		if (m_root && !(Allocation::FreesInBulk && std::is_trivially_destructible<T>::value))
 		{
 			m_root->~Node();
 		}
@@ -71,7 +74,7 @@ private:
 
 		Node* clone() const 
 		{
-			Memory::MemDesc desc = ALLOCATE(sizeof(Node));
+			Memory::MemDesc desc = ALLOCATE_FROM(Allocation, sizeof(Node), alignof(Node));
 			return new (desc.ptr) Node(desc, value);
 		}
 
@@ -85,7 +88,7 @@ private:
 			{
 				right->~Node();
 			}
-			Memory::Deallocate(myDesc);
+			Allocation::Deallocate(myDesc);
 		}
 	private:
 		Memory::MemDesc myDesc;
@@ -95,70 +98,70 @@ private:
 	uint32_t m_count = 0;
 };
 
-template <typename T>
-void BSTv1<T>::swap(BSTv1<T>&& rhs) noexcept
+template <typename T, typename Allocation>
+void BSTv1<T, Allocation>::swap(BSTv1<T, Allocation>&& rhs) noexcept
 {
 	std::swap(m_root, rhs.m_root);
 	std::swap(m_count, rhs.m_count);
 }
 
-template <typename T>
-BSTv1<T> BSTv1<T>::copy() const noexcept
+template <typename T, typename Allocation>
+BSTv1<T, Allocation> BSTv1<T, Allocation>::copy() const noexcept
 {
-	BSTv1<T> res;
+	BSTv1<T, Allocation> res;
 	res.m_count = m_count;
 	res.m_root = BinaryNodes::CloneTree(m_root);
 	return res;
 }
 
-template <typename T>
-BSTv1<T>::BSTv1(BSTv1 const& rhs)
+template <typename T, typename Allocation>
+BSTv1<T, Allocation>::BSTv1(BSTv1 const& rhs)
 {
 	swap(rhs.copy());
 }
 
-template <typename T>
-BSTv1<T>::BSTv1(BSTv1&& rhs) noexcept
+template <typename T, typename Allocation>
+BSTv1<T, Allocation>::BSTv1(BSTv1&& rhs) noexcept
 {
 	swap(std::move(rhs));
 }
 
-template <typename T>
-BSTv1<T>& BSTv1<T>::operator=(BSTv1 rhs)
+template <typename T, typename Allocation>
+BSTv1<T, Allocation>& BSTv1<T, Allocation>::operator=(BSTv1 rhs)
 {
 	swap(std::move(rhs));
 	return *this;
 }
 
-template <typename T>
-BSTv1<T>& BSTv1<T>::operator=(BSTv1&& rhs) noexcept
+template <typename T, typename Allocation>
+BSTv1<T, Allocation>& BSTv1<T, Allocation>::operator=(BSTv1&& rhs) noexcept
 {
 	swap(std::move(rhs));
 	return *this;
 }
 
-template <typename T>
-void BSTv1<T>::Add(T const& value)
+template <typename T, typename Allocation>
+void BSTv1<T, Allocation>::Add(T const& value)
 {
 	T copy = value;
 	InsertNode(std::move(copy));
 }
 
-template <typename T>
-void BSTv1<T>::Add(T&& value)
+template <typename T, typename Allocation>
+void BSTv1<T, Allocation>::Add(T&& value)
 {
 	InsertNode(std::move(value));
 }
 
-template <typename T>
+template <typename T, typename Allocation>
 template <typename ...Args>
-void BSTv1<T>::Emplace(Args&& ...args)
+void BSTv1<T, Allocation>::Emplace(Args&& ...args)
 {
 	InsertNode({ std::forward<Args>(args)... });
 }
 
-template <typename T>
-void BSTv1<T>::InsertNode(T&& value)
+template <typename T, typename Allocation>
+void BSTv1<T, Allocation>::InsertNode(T&& value)
 {
 	Node* parent = nullptr;
 	Node* it = m_root;
@@ -177,7 +180,7 @@ void BSTv1<T>::InsertNode(T&& value)
 			left = false;
 		}
 	}
-	Memory::MemDesc desc = ALLOCATE(sizeof(Node));
+	Memory::MemDesc desc = ALLOCATE_FROM(Allocation, sizeof(Node), alignof(Node));
 	Node* nodePtr = new (desc.ptr) Node(desc, std::move(value));
 	if (parent == nullptr)
 	{
@@ -196,8 +199,8 @@ void BSTv1<T>::InsertNode(T&& value)
 	++m_count;
 }
 
-template <typename T>
-void BSTv1<T>::Erase(Iterator const& it)
+template <typename T, typename Allocation>
+void BSTv1<T, Allocation>::Erase(Iterator const& it)
 {
 	MY_ASSERT(it, "Erasing invalid iterator");
 
@@ -259,8 +262,8 @@ void BSTv1<T>::Erase(Iterator const& it)
 	--m_count;
 }
 
-template <typename T>
-void BSTv1<T>::Erase(T const& v)
+template <typename T, typename Allocation>
+void BSTv1<T, Allocation>::Erase(T const& v)
 {
 	while (auto it = Find(v))
 	{
@@ -1,8 +1,13 @@
 #pragma once
-#include <memory>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <utility>
+#include "Memory/Memory.h"
 #include "Utils/Assert.h"
 
-template <typename T>
+// Allocation is where the elements live, see Memory::GlobalAllocation
+template <typename T, typename Allocation = Memory::GlobalAllocation>
 class Vector
 {
 public:
@@ -11,44 +16,42 @@ public:
 	~Vector()
 	{
 		Clear();
+		Release();
 	}
 
 	Vector(Vector const& rhs)
-		: m_data(std::make_unique<uint8_t[]>(rhs.Count() * sizeof T))
-		, m_capacity(rhs.Count())
-		, m_count(rhs.Count())
 	{
-		for (size_t i = 0; i < m_count; ++i)
+		Reserve(rhs.Count());
+		for (size_t i = 0; i < rhs.Count(); ++i)
 		{
-			new (m_data.get() + i * sizeof T) T(rhs.At(i));
+			new (Data() + i * sizeof T) T(rhs.At(i));
 		}
+		m_count = rhs.Count();
 	}
 
 	Vector(Vector&& rhs)
-		: m_data(std::move(rhs.m_data))
-		, m_capacity(rhs.m_capacity)
-		, m_count(rhs.m_count)
 	{
+		Swap(rhs);
 	}
 
 	Vector& operator=(Vector const& rhs)
 	{
-		m_data = std::make_unique<uint8_t[]>(rhs.Count() * sizeof T);
-		m_count = rhs.m_count;
-		m_capacity = rhs.m_capacity;
-
-		for (size_t i = 0; i < m_count; ++i)
+		if (this != &rhs)
 		{
-			new (m_data.get() + i * sizeof T) T(rhs.At(i));
+			Clear();
+			Reserve(rhs.Count());
+			for (size_t i = 0; i < rhs.Count(); ++i)
+			{
+				new (Data() + i * sizeof T) T(rhs.At(i));
+			}
+			m_count = rhs.Count();
 		}
 		return *this;
 	}
 
 	Vector& operator=(Vector&& rhs)
 	{
-		m_data = std::move(rhs.m_data);
-		m_capacity = rhs.m_capacity;
-		m_count = rhs.m_count;
+		Swap(rhs);
 		return *this;
 	}
 
@@ -60,7 +63,7 @@ public:
 		{
 			Resize((m_capacity + 1) * 2);
 		}
-		new (m_data.get() + m_count * sizeof T) T(v);
+		new (Data() + m_count * sizeof T) T(v);
 		return m_count++;
 	}
 
@@ -70,7 +73,7 @@ public:
 		{
 			Resize((m_capacity + 1) * 2);
 		}
-		new(m_data.get() + m_count * sizeof T) T(std::move(v));
+		new(Data() + m_count * sizeof T) T(std::move(v));
 		return m_count++;
 	}
 
@@ -81,7 +84,7 @@ public:
 		{
 			Resize((m_capacity + 1) * 2);
 		}
-		T* ptr = new(m_data.get() + m_count * sizeof T) T(std::forward<Args>(args)...);
+		T* ptr = new(Data() + m_count * sizeof T) T(std::forward<Args>(args)...);
 		m_count++;
 		return *ptr;
 	}
@@ -93,7 +96,7 @@ public:
 		size_t const nextElementsCount = m_count - (idx + 1);
 		if (nextElementsCount)
 		{
-			std::memmove(m_data.get() + idx * sizeof T, m_data.get() + (idx + 1) * sizeof T, nextElementsCount * sizeof T);
+			std::memmove(Data() + idx * sizeof T, Data() + (idx + 1) * sizeof T, nextElementsCount * sizeof T);
 		}
 		m_count--;
 	}
@@ -110,13 +113,13 @@ public:
 	T& At(size_t idx)
 	{
 		MY_ASSERT(idx < m_count, "Index out of bounds");
-		return *reinterpret_cast<T*>(m_data.get() + idx * sizeof T);
+		return *reinterpret_cast<T*>(Data() + idx * sizeof T);
 	}
 
 	T const& At(size_t idx) const
 	{
 		MY_ASSERT(idx < m_count, "Index out of bounds");
-		return *reinterpret_cast<T const*>(m_data.get() + idx * sizeof T);
+		return *reinterpret_cast<T const*>(Data() + idx * sizeof T);
 	}
 
 	T& operator[](size_t idx) { return At(idx); }
@@ -141,16 +144,53 @@ public:
 		}
 	}
 
+	size_t Capacity() const { return m_capacity; }
+
 private:
+	uint8_t* Data() const { return reinterpret_cast<uint8_t*>(m_data.ptr); }
+
+	void Swap(Vector& rhs)
+	{
+		std::swap(m_data, rhs.m_data);
+		std::swap(m_capacity, rhs.m_capacity);
+		std::swap(m_count, rhs.m_count);
+	}
+
+	// Elements are moved with memcpy, so the block can be reallocated in place
+	// or have its pages remapped. Capacity takes all the allocator gives.
 	void Resize(size_t newCapacity)
 	{
-		auto newData = std::make_unique<uint8_t[]>(sizeof T * newCapacity);
-		std::memcpy(newData.get(), m_data.get(), sizeof T * m_count);
-		m_data = std::move(newData);
-		m_capacity = newCapacity;
+		uint64_t const size = Allocation::GoodSize(sizeof T * newCapacity);
+		Memory::MemDesc desc;
+		if (m_data.ptr && alignof(T) <= alignof(std::max_align_t))
+		{
+			desc = Allocation::Reallocate(m_data, size);
+		}
+		else
+		{
+			desc = Allocation::Allocate(size, alignof(T));
+			if (desc.ptr && m_data.ptr)
+			{
+				std::memcpy(desc.ptr, m_data.ptr, sizeof T * m_count);
+				Allocation::Deallocate(m_data);
+			}
+		}
+		MY_ASSERT(desc.ptr, "Failed to allocate memory");
+		m_data = desc;
+		m_capacity = desc.size / sizeof T;
+	}
+
+	void Release()
+	{
+		if (m_data.ptr)
+		{
+			Allocation::Deallocate(m_data);
+			m_data = {};
+			m_capacity = 0;
+		}
 	}
 
-	std::unique_ptr<uint8_t[]> m_data = nullptr;
+	Memory::MemDesc m_data;
 	size_t m_capacity = 0;
 	size_t m_count = 0;
 };
\ No newline at end of file
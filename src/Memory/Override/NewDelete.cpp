@@ -0,0 +1,138 @@
+/*
+Replaces the global operator new and delete with Memory::Allocate() and Memory::Deallocate(),
+so containers and std:: types run on the Memory allocators as well.
+
+Not part of the Memory library, a program opts in by linking the MemoryNewDelete objects,
+or on Linux by preloading the MemoryPreload library:
+
+	LD_PRELOAD=libMemoryPreload.so ./exercises
+
+Memory::Deallocate() needs the size of the block, and the allocators don't keep it.
+Blocks are allocated with Memory::GoodSize() of what was asked, which is what the allocators
+give back, so sized deletes free with Memory::GoodSize() of their size and look nothing up.
+Unsized deletes find it in the page map: blocks under a page keep their size in 16 bytes
+in a byte of its size lane, bigger ones in the word of the page they start in.
+*/
+#include "BitUtils.h"
+#include "Memory.h"
+#include "PageMap.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace
+{
+	using Memory::Private::PageMap;
+
+	constexpr uint64_t MaxByteSize = 255ull << PageMap::ByteShift;
+
+	static_assert(MaxByteSize < (1ull << PageMap::PageShift), "Blocks kept in a page word should be a page or more");
+
+	// What the allocators give back for the block, 0 when it can't be that big
+	uint64_t BlockSize(std::size_t size, std::size_t alignment) noexcept
+	{
+		if (size > SIZE_MAX - alignment)
+		{
+			return 0;
+		}
+		// new of nothing still gets a block of its own
+		return Memory::GoodSize(Memory::Private::AlignUp(size ? size : 1, alignment));
+	}
+
+	void* Allocate(std::size_t size, std::size_t alignment) noexcept
+	{
+		uint64_t const blockSize = BlockSize(size, alignment);
+		if (!blockSize)
+		{
+			return nullptr;
+		}
+		Memory::MemDesc const desc = Memory::Allocate(blockSize, alignment);
+		if (!desc.ptr)
+		{
+			return nullptr;
+		}
+		PageMap& pageMap = Memory::Private::GetPageMap();
+		if (desc.size <= MaxByteSize)
+		{
+			pageMap.SetByte(desc.ptr, PageMap::SizeLane, static_cast<uint8_t>(desc.size >> PageMap::ByteShift));
+		}
+		else
+		{
+			pageMap.SetByte(desc.ptr, PageMap::SizeLane, 0);
+			pageMap.SetWord(desc.ptr, desc.size);
+		}
+		return desc.ptr;
+	}
+
+	void* Allocate(std::size_t size) noexcept
+	{
+		return Allocate(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+	}
+
+	void* Allocate(std::size_t size, std::align_val_t align) noexcept
+	{
+		return Allocate(size, static_cast<std::size_t>(align));
+	}
+
+	void Deallocate(void* ptr) noexcept
+	{
+		if (ptr)
+		{
+			PageMap const& pageMap = Memory::Private::GetPageMap();
+			uint64_t const granules = pageMap.GetByte(ptr, PageMap::SizeLane);
+			Memory::Deallocate({ ptr, granules ? granules << PageMap::ByteShift : pageMap.GetWord(ptr) });
+		}
+	}
+
+	void Deallocate(void* ptr, std::size_t size, std::size_t alignment) noexcept
+	{
+		if (ptr)
+		{
+			Memory::Deallocate({ ptr, BlockSize(size, alignment) });
+		}
+	}
+
+	// Throwing versions give the new handler a chance to free memory before giving up
+	template <typename... Alignment>
+	void* AllocateOrThrow(std::size_t size, Alignment... align)
+	{
+		for (;;)
+		{
+			if (void* ptr = Allocate(size, align...))
+			{
+				return ptr;
+			}
+			std::new_handler handler = std::get_new_handler();
+			if (!handler)
+			{
+				throw std::bad_alloc();
+			}
+			handler();
+		}
+	}
+} // namespace
+
+void* operator new(std::size_t size) { return AllocateOrThrow(size); }
+void* operator new[](std::size_t size) { return AllocateOrThrow(size); }
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept { return Allocate(size); }
+void* operator new[](std::size_t size, std::nothrow_t const&) noexcept { return Allocate(size); }
+
+void* operator new(std::size_t size, std::align_val_t align) { return AllocateOrThrow(size, align); }
+void* operator new[](std::size_t size, std::align_val_t align) { return AllocateOrThrow(size, align); }
+void* operator new(std::size_t size, std::align_val_t align, std::nothrow_t const&) noexcept { return Allocate(size, align); }
+void* operator new[](std::size_t size, std::align_val_t align, std::nothrow_t const&) noexcept { return Allocate(size, align); }
+
+void operator delete(void* ptr) noexcept { Deallocate(ptr); }
+void operator delete[](void* ptr) noexcept { Deallocate(ptr); }
+void operator delete(void* ptr, std::nothrow_t const&) noexcept { Deallocate(ptr); }
+void operator delete[](void* ptr, std::nothrow_t const&) noexcept { Deallocate(ptr); }
+void operator delete(void* ptr, std::size_t size) noexcept { Deallocate(ptr, size, __STDCPP_DEFAULT_NEW_ALIGNMENT__); }
+void operator delete[](void* ptr, std::size_t size) noexcept { Deallocate(ptr, size, __STDCPP_DEFAULT_NEW_ALIGNMENT__); }
+
+void operator delete(void* ptr, std::align_val_t) noexcept { Deallocate(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { Deallocate(ptr); }
+void operator delete(void* ptr, std::align_val_t, std::nothrow_t const&) noexcept { Deallocate(ptr); }
+void operator delete[](void* ptr, std::align_val_t, std::nothrow_t const&) noexcept { Deallocate(ptr); }
+void operator delete(void* ptr, std::size_t size, std::align_val_t align) noexcept { Deallocate(ptr, size, static_cast<std::size_t>(align)); }
+void operator delete[](void* ptr, std::size_t size, std::align_val_t align) noexcept { Deallocate(ptr, size, static_cast<std::size_t>(align)); }
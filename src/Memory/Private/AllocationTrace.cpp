@@ -0,0 +1,213 @@
+#include "AllocationTrace.h"
+#include "BitUtils.h"
+#include "Memory.h"
+#include "Utils/Benchy.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace Memory
+{
+namespace Private
+{
+	std::atomic<bool> TraceEnabled{ false };
+
+	static constexpr char TraceMagic[4] = { 'M', 'T', 'R', 'C' };
+	static constexpr uint32_t BufferEvents = 4096;
+
+	// Events are buffered per thread and written in chunks with the file lock held.
+	// Lock order is registry, buffer, file.
+	struct TraceBuffer
+	{
+		std::mutex mutex;
+		TraceBuffer* prev = nullptr;
+		TraceBuffer* next = nullptr;
+		uint32_t thread = 0;
+		uint32_t count = 0;
+		TraceEvent events[BufferEvents];
+	};
+
+	static std::mutex RegistryMutex;
+	static TraceBuffer* Buffers = nullptr;
+	static std::atomic<uint32_t> NextThread{ 0 };
+
+	static std::mutex FileMutex;
+	static std::FILE* TraceFile = nullptr;
+	static uint64_t StartTime = 0;
+
+	static void FlushBuffer(TraceBuffer& buffer)
+	{
+		std::lock_guard<std::mutex> lock(FileMutex);
+		if (TraceFile && buffer.count)
+		{
+			std::fwrite(buffer.events, sizeof(TraceEvent), buffer.count, TraceFile);
+		}
+		buffer.count = 0;
+	}
+
+	// Buffers come from malloc, the trace shouldn't trace itself
+	struct ThreadTrace
+	{
+		TraceBuffer* buffer = nullptr;
+
+		~ThreadTrace()
+		{
+			if (!buffer)
+			{
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> registryLock(RegistryMutex);
+				(buffer->prev ? buffer->prev->next : Buffers) = buffer->next;
+				if (buffer->next)
+				{
+					buffer->next->prev = buffer->prev;
+				}
+				std::lock_guard<std::mutex> lock(buffer->mutex);
+				FlushBuffer(*buffer);
+			}
+			buffer->~TraceBuffer();
+			std::free(buffer);
+		}
+	};
+
+	static TraceBuffer* GetThreadBuffer()
+	{
+		static thread_local ThreadTrace threadTrace;
+		if (!threadTrace.buffer)
+		{
+			void* memory = std::malloc(sizeof(TraceBuffer));
+			if (!memory)
+			{
+				return nullptr;
+			}
+			TraceBuffer* buffer = new (memory) TraceBuffer();
+			buffer->thread = NextThread.fetch_add(1, std::memory_order_relaxed);
+			std::lock_guard<std::mutex> lock(RegistryMutex);
+			buffer->next = Buffers;
+			if (Buffers)
+			{
+				Buffers->prev = buffer;
+			}
+			Buffers = buffer;
+			threadTrace.buffer = buffer;
+		}
+		return threadTrace.buffer;
+	}
+
+	void RecordTraceEvent(TraceEventType type, void const* ptr, uint64_t size, uint64_t alignment)
+	{
+		TraceBuffer* buffer = GetThreadBuffer();
+		if (!buffer)
+		{
+			return;
+		}
+		std::lock_guard<std::mutex> lock(buffer->mutex);
+		if (buffer->count == BufferEvents)
+		{
+			FlushBuffer(*buffer);
+		}
+		TraceEvent& event = buffer->events[buffer->count++];
+		event.time = Benchy::GetCPUCycles() - StartTime;
+		event.id = reinterpret_cast<uint64_t>(ptr);
+		event.size = size;
+		event.thread = buffer->thread;
+		event.type = type;
+		event.alignmentLog2 = static_cast<uint8_t>(alignment ? CountTrailingZeros(alignment) : 0);
+		event.reserved = 0;
+	}
+
+	bool ReadTrace(char const* path, std::vector<TraceEvent>& events)
+	{
+		std::FILE* file = std::fopen(path, "rb");
+		if (!file)
+		{
+			return false;
+		}
+		TraceHeader header;
+		bool const valid = std::fread(&header, sizeof(header), 1, file) == 1
+			&& std::memcmp(header.magic, TraceMagic, sizeof(TraceMagic)) == 0
+			&& header.version == TraceVersion
+			&& header.eventSize == sizeof(TraceEvent);
+		if (valid)
+		{
+			TraceEvent chunk[256];
+			size_t read = 0;
+			while ((read = std::fread(chunk, sizeof(TraceEvent), 256, file)) > 0)
+			{
+				events.insert(events.end(), chunk, chunk + read);
+			}
+		}
+		std::fclose(file);
+
+		// Chunks of different threads overlap in time, the stable sort keeps the order of
+		// events of a thread that got the same timestamp
+		std::stable_sort(events.begin(), events.end(), [](TraceEvent const& lhs, TraceEvent const& rhs)
+		{
+			return lhs.time < rhs.time || (lhs.time == rhs.time && lhs.thread < rhs.thread);
+		});
+		return valid;
+	}
+} // namespace Private
+
+bool StartTrace(char const* path)
+{
+	if (Private::TraceEnabled.load(std::memory_order_acquire))
+	{
+		return false;
+	}
+	{
+		// Drops what was recorded after the last trace stopped
+		std::lock_guard<std::mutex> registryLock(Private::RegistryMutex);
+		for (Private::TraceBuffer* it = Private::Buffers; it; it = it->next)
+		{
+			std::lock_guard<std::mutex> lock(it->mutex);
+			it->count = 0;
+		}
+	}
+	std::lock_guard<std::mutex> lock(Private::FileMutex);
+	if (Private::TraceFile)
+	{
+		return false;
+	}
+	std::FILE* file = std::fopen(path, "wb");
+	if (!file)
+	{
+		return false;
+	}
+	Private::TraceHeader header = {};
+	std::memcpy(header.magic, Private::TraceMagic, sizeof(header.magic));
+	header.version = Private::TraceVersion;
+	header.eventSize = sizeof(Private::TraceEvent);
+	std::fwrite(&header, sizeof(header), 1, file);
+
+	Private::TraceFile = file;
+	Private::StartTime = Benchy::GetCPUCycles();
+	Private::TraceEnabled.store(true, std::memory_order_release);
+	return true;
+}
+
+void StopTrace()
+{
+	Private::TraceEnabled.store(false, std::memory_order_release);
+	{
+		std::lock_guard<std::mutex> registryLock(Private::RegistryMutex);
+		for (Private::TraceBuffer* it = Private::Buffers; it; it = it->next)
+		{
+			std::lock_guard<std::mutex> lock(it->mutex);
+			Private::FlushBuffer(*it);
+		}
+	}
+	std::lock_guard<std::mutex> lock(Private::FileMutex);
+	if (Private::TraceFile)
+	{
+		std::fclose(Private::TraceFile);
+		Private::TraceFile = nullptr;
+	}
+}
+
+} // namespace Memory
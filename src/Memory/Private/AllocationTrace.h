@@ -0,0 +1,67 @@
+#pragma once
+#include "MemDesc.h"
+
+#include <atomic>
+#include <vector>
+
+namespace Memory
+{
+namespace Private
+{
+	enum class TraceEventType : uint8_t
+	{
+		Allocate,
+		Deallocate,
+		// Recorded before the allocator call like Deallocate, the next Reallocated event of the
+		// same thread carries the new block, or the old one again when the call failed
+		Reallocate,
+		Reallocated,
+	};
+
+	/*
+	One allocator call. Blocks are identified by their address, ids are reused
+	once a block is freed. Timestamps are CPU cycles, threads are numbered
+	in the order they first hit the trace.
+	*/
+	struct TraceEvent
+	{
+		uint64_t time;
+		uint64_t id;
+		// Requested size, the returned one for Deallocate
+		uint64_t size;
+		uint32_t thread;
+		TraceEventType type;
+		// 0 for the default alignment
+		uint8_t alignmentLog2;
+		uint16_t reserved;
+	};
+	static_assert(sizeof(TraceEvent) == 32, "Trace events are written as is");
+
+	struct TraceHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t eventSize;
+		uint32_t reserved;
+	};
+
+	constexpr uint32_t TraceVersion = 1;
+
+	extern std::atomic<bool> TraceEnabled;
+
+	void RecordTraceEvent(TraceEventType type, void const* ptr, uint64_t size, uint64_t alignment);
+
+	// Costs a relaxed load while no trace is running
+	inline void Trace(TraceEventType type, void const* ptr, uint64_t size, uint64_t alignment = 0)
+	{
+		if (TraceEnabled.load(std::memory_order_relaxed))
+		{
+			RecordTraceEvent(type, ptr, size, alignment);
+		}
+	}
+
+	// Events of all threads ordered by time, events of other threads can come between
+	// a Reallocate and its Reallocated. Returns false when the file isn't a trace.
+	bool ReadTrace(char const* path, std::vector<TraceEvent>& events);
+} // namespace Private
+} // namespace Memory
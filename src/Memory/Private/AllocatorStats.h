@@ -0,0 +1,380 @@
+#pragma once
+#include "BitUtils.h"
+#include "Utils/Benchy.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace Memory
+{
+namespace Private
+{
+	// Bucket i holds sizes in [2^i, 2^(i+1)), zero sized requests go to the first one
+	constexpr uint32_t SizeBuckets = 40;
+	// Bucket i holds calls that took [2^i, 2^(i+1)) CPU cycles
+	constexpr uint32_t LatencyBuckets = 32;
+
+	struct AllocatorStats
+	{
+		AllocatorStats() = delete;
+		AllocatorStats(const char* n) : name(n) {}
+
+		const char* name = nullptr;
+		uint64_t countAllocated = 0;
+		uint64_t totalAllocated = 0;
+		uint64_t countDeallocated = 0;
+		uint64_t totalDeallocated = 0;
+		uint64_t unallocated = 0;
+		// High-water mark of unallocated
+		uint64_t peakUnallocated = 0;
+		// Bytes lost to alignment, in front of blocks and rounding up their size
+		uint64_t padding = 0;
+		// Filled in by GetStats() of allocators that can reuse blocks in any order
+		uint64_t freeBytes = 0;
+		uint64_t largestFreeBlock = 0;
+		// Requests served from a cache of free blocks, and the ones that had to refill it
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t sizes[SizeBuckets] = {};
+		// Only sampled calls, see AllocatorCounters::LatencySamplePeriod
+		uint64_t allocateLatency[LatencyBuckets] = {};
+		uint64_t deallocateLatency[LatencyBuckets] = {};
+		uint64_t allocateCycles = 0;
+		uint64_t deallocateCycles = 0;
+	};
+
+	inline uint32_t Log2Bucket(uint64_t v, uint32_t buckets)
+	{
+		uint32_t const bucket = v ? Log2Floor(v) : 0;
+		return bucket < buckets ? bucket : buckets - 1;
+	}
+
+	constexpr uint32_t StatsShardCount = 16;
+
+	/*
+	Threads take one of the StatsShardCount shard slots for themselves while they live,
+	and only update shards they own with plain relaxed loads and stores. Threads beyond
+	that share one more shard, index StatsShardCount, that is only updated with atomic adds.
+	*/
+	class ThreadStatsShard
+	{
+	public:
+		static ThreadStatsShard const& Get()
+		{
+			static thread_local ThreadStatsShard shard;
+			return shard;
+		}
+
+		uint32_t Index() const { return m_index; }
+		bool Exclusive() const { return m_exclusive; }
+
+		ThreadStatsShard(ThreadStatsShard const&) = delete;
+		ThreadStatsShard& operator=(ThreadStatsShard const&) = delete;
+
+	private:
+		ThreadStatsShard()
+		{
+			uint32_t taken = Slots().load(std::memory_order_relaxed);
+			while (~taken)
+			{
+				uint32_t const index = CountTrailingZeros(~static_cast<uint64_t>(taken));
+				if (Slots().compare_exchange_weak(taken, taken | (1u << index), std::memory_order_acquire, std::memory_order_relaxed))
+				{
+					m_index = index;
+					m_exclusive = true;
+					return;
+				}
+			}
+			m_index = StatsShardCount;
+		}
+
+		~ThreadStatsShard()
+		{
+			if (m_exclusive)
+			{
+				Slots().fetch_and(~(1u << m_index), std::memory_order_release);
+			}
+		}
+
+		// Bits of the taken slots, the ones above StatsShardCount are always set
+		static std::atomic<uint32_t>& Slots()
+		{
+			static std::atomic<uint32_t> slots = { ~((1u << StatsShardCount) - 1) };
+			return slots;
+		}
+
+		uint32_t m_index = StatsShardCount;
+		bool m_exclusive = false;
+	};
+
+	/*
+	Live counters behind AllocatorStats, cheap enough to stay on in production.
+
+	Counters are sharded by ThreadStatsShard, so threads sharing an allocator don't fight
+	over cache lines, and a thread that owns its shard updates it without atomic adds.
+	Read() merges the shards and can run while other threads allocate.
+	Allocation counts come from the size histogram. Sampled latencies are rare enough to go
+	to one shared histogram.
+
+	The high-water mark of the allocator is refreshed from the live bytes of all the shards
+	summed, every PeakGranularity bytes a shard grows. Blocks freed on another thread than
+	the one that allocated them leave a shard's own live count meaningless, so a shard's
+	high-water mark only stands for the allocator when no other shard was ever used.
+	With one thread the peak is exact, with more it can miss up to a PeakGranularity per shard.
+	*/
+	class AllocatorCounters
+	{
+	public:
+		// One in LatencySamplePeriod allocator calls of a thread is timed
+		static constexpr uint32_t LatencySamplePeriod = 64;
+		static constexpr int64_t PeakGranularity = 64 * 1024;
+
+		AllocatorCounters(const char* name) : m_name(name) {}
+		AllocatorCounters(AllocatorCounters&&) = delete;
+		AllocatorCounters(AllocatorCounters const&) = delete;
+		AllocatorCounters& operator=(AllocatorCounters&&) = delete;
+		AllocatorCounters& operator=(AllocatorCounters const&) = delete;
+
+		void Allocated(uint64_t size)
+		{
+			ThreadStatsShard const& thread = ThreadStatsShard::Get();
+			Shard& shard = m_shards[thread.Index()];
+			Add(shard.sizes[Log2Bucket(size, SizeBuckets)], 1, thread);
+			Grow(shard, size, thread);
+		}
+
+		void Deallocated(uint64_t size)
+		{
+			ThreadStatsShard const& thread = ThreadStatsShard::Get();
+			Shard& shard = m_shards[thread.Index()];
+			Add(shard.countDeallocated, 1, thread);
+			Add(shard.totalDeallocated, size, thread);
+		}
+
+		void Resized(uint64_t oldSize, uint64_t newSize)
+		{
+			ThreadStatsShard const& thread = ThreadStatsShard::Get();
+			Shard& shard = m_shards[thread.Index()];
+			if (newSize > oldSize)
+			{
+				Grow(shard, newSize - oldSize, thread);
+			}
+			else
+			{
+				Add(shard.totalDeallocated, oldSize - newSize, thread);
+			}
+		}
+
+		void Rewound(uint64_t size) { Add(&AllocatorCounters::Shard::totalDeallocated, size); }
+		void Padded(uint64_t size) { Add(&AllocatorCounters::Shard::padding, size); }
+		void Hit() { Add(&AllocatorCounters::Shard::hits, 1); }
+		void Missed() { Add(&AllocatorCounters::Shard::misses, 1); }
+
+		void Timed(bool deallocation, uint64_t cycles)
+		{
+			(deallocation ? m_deallocateLatency : m_allocateLatency)[Log2Bucket(cycles, LatencyBuckets)].fetch_add(1, std::memory_order_relaxed);
+			(deallocation ? m_deallocateCycles : m_allocateCycles).fetch_add(cycles, std::memory_order_relaxed);
+		}
+
+		AllocatorStats Read() const
+		{
+			AllocatorStats stats = m_name;
+			uint64_t peak = m_peak.load(std::memory_order_relaxed);
+			uint32_t usedShards = 0;
+			int64_t shardPeak = 0;
+			for (Shard const& shard : m_shards)
+			{
+				if (shard.totalAllocated.load(std::memory_order_relaxed) || shard.totalDeallocated.load(std::memory_order_relaxed))
+				{
+					++usedShards;
+					shardPeak = shard.peak.load(std::memory_order_relaxed);
+				}
+				stats.totalAllocated += shard.totalAllocated.load(std::memory_order_relaxed);
+				stats.countDeallocated += shard.countDeallocated.load(std::memory_order_relaxed);
+				stats.totalDeallocated += shard.totalDeallocated.load(std::memory_order_relaxed);
+				stats.padding += shard.padding.load(std::memory_order_relaxed);
+				stats.hits += shard.hits.load(std::memory_order_relaxed);
+				stats.misses += shard.misses.load(std::memory_order_relaxed);
+				for (uint32_t i = 0; i < SizeBuckets; ++i)
+				{
+					uint64_t const count = shard.sizes[i].load(std::memory_order_relaxed);
+					stats.sizes[i] += count;
+					stats.countAllocated += count;
+				}
+			}
+			if (usedShards == 1 && shardPeak > 0 && static_cast<uint64_t>(shardPeak) > peak)
+			{
+				peak = shardPeak;
+			}
+			for (uint32_t i = 0; i < LatencyBuckets; ++i)
+			{
+				stats.allocateLatency[i] = m_allocateLatency[i].load(std::memory_order_relaxed);
+				stats.deallocateLatency[i] = m_deallocateLatency[i].load(std::memory_order_relaxed);
+			}
+			stats.allocateCycles = m_allocateCycles.load(std::memory_order_relaxed);
+			stats.deallocateCycles = m_deallocateCycles.load(std::memory_order_relaxed);
+			stats.unallocated = stats.totalAllocated - stats.totalDeallocated;
+			// Shards are read one by one, unallocated can be off while other threads run
+			bool const consistent = stats.unallocated < (1ull << 63);
+			stats.peakUnallocated = consistent && stats.unallocated > peak ? stats.unallocated : peak;
+			return stats;
+		}
+
+	private:
+		struct alignas(64) Shard
+		{
+			std::atomic<uint64_t> totalAllocated = { 0 };
+			std::atomic<uint64_t> countDeallocated = { 0 };
+			std::atomic<uint64_t> totalDeallocated = { 0 };
+			std::atomic<uint64_t> padding = { 0 };
+			std::atomic<uint64_t> hits = { 0 };
+			std::atomic<uint64_t> misses = { 0 };
+			// Highest totalAllocated - totalDeallocated of this shard, and where the allocator's peak was
+			// last refreshed or where the shard shrank to since
+			std::atomic<int64_t> peak = { 0 };
+			std::atomic<int64_t> refreshedAt = { 0 };
+			std::atomic<uint64_t> sizes[SizeBuckets] = {};
+		};
+
+		static void Add(std::atomic<uint64_t>& counter, uint64_t value, ThreadStatsShard const& thread)
+		{
+			if (thread.Exclusive())
+			{
+				counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+			}
+			else
+			{
+				counter.fetch_add(value, std::memory_order_relaxed);
+			}
+		}
+
+		void Add(std::atomic<uint64_t> Shard::* counter, uint64_t value)
+		{
+			ThreadStatsShard const& thread = ThreadStatsShard::Get();
+			Add(m_shards[thread.Index()].*counter, value, thread);
+		}
+
+		// Plain store on an owned shard, false when another thread changed a shared one first
+		static bool Exchange(std::atomic<int64_t>& value, int64_t& expected, int64_t desired, ThreadStatsShard const& thread)
+		{
+			if (thread.Exclusive())
+			{
+				value.store(desired, std::memory_order_relaxed);
+				return true;
+			}
+			return value.compare_exchange_weak(expected, desired, std::memory_order_relaxed);
+		}
+
+		void Grow(Shard& shard, uint64_t size, ThreadStatsShard const& thread)
+		{
+			uint64_t const allocated = thread.Exclusive() ? shard.totalAllocated.load(std::memory_order_relaxed) + size
+				: shard.totalAllocated.fetch_add(size, std::memory_order_relaxed) + size;
+			if (thread.Exclusive())
+			{
+				shard.totalAllocated.store(allocated, std::memory_order_relaxed);
+			}
+			int64_t const live = static_cast<int64_t>(allocated - shard.totalDeallocated.load(std::memory_order_relaxed));
+			int64_t peak = shard.peak.load(std::memory_order_relaxed);
+			while (live > peak && !Exchange(shard.peak, peak, live, thread))
+			{
+			}
+			int64_t refreshedAt = shard.refreshedAt.load(std::memory_order_relaxed);
+			if (live < refreshedAt)
+			{
+				// Growing back from here counts towards the next refresh
+				Exchange(shard.refreshedAt, refreshedAt, live, thread);
+			}
+			else if (live - refreshedAt >= PeakGranularity && Exchange(shard.refreshedAt, refreshedAt, live, thread))
+			{
+				RefreshPeak();
+			}
+		}
+
+		void RefreshPeak()
+		{
+			int64_t live = 0;
+			for (Shard const& shard : m_shards)
+			{
+				live += static_cast<int64_t>(shard.totalAllocated.load(std::memory_order_relaxed) - shard.totalDeallocated.load(std::memory_order_relaxed));
+			}
+			uint64_t peak = m_peak.load(std::memory_order_relaxed);
+			while (live > 0 && static_cast<uint64_t>(live) > peak && !m_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+			{
+			}
+		}
+
+		const char* m_name;
+		// The last one is shared by the threads that didn't get a slot
+		Shard m_shards[StatsShardCount + 1];
+		std::atomic<uint64_t> m_peak = { 0 };
+		std::atomic<uint64_t> m_allocateLatency[LatencyBuckets] = {};
+		std::atomic<uint64_t> m_deallocateLatency[LatencyBuckets] = {};
+		std::atomic<uint64_t> m_allocateCycles = { 0 };
+		std::atomic<uint64_t> m_deallocateCycles = { 0 };
+	};
+
+	/*
+	Times the enclosing allocator call when the calling thread's sample countdown
+	runs out, put one at the top of Allocate() and Deallocate().
+	*/
+	class LatencySample
+	{
+	public:
+		LatencySample(AllocatorCounters& counters, bool deallocation)
+			: m_counters(counters)
+			, m_deallocation(deallocation)
+		{
+			uint32_t& countdown = Countdown();
+			if (countdown-- == 0)
+			{
+				countdown = AllocatorCounters::LatencySamplePeriod - 1;
+				m_start = Benchy::GetCPUCycles();
+			}
+		}
+
+		~LatencySample()
+		{
+			if (m_start)
+			{
+				m_counters.Timed(m_deallocation, Benchy::GetCPUCycles() - m_start);
+			}
+		}
+
+		LatencySample(LatencySample const&) = delete;
+		LatencySample& operator=(LatencySample const&) = delete;
+
+	private:
+		static uint32_t& Countdown()
+		{
+			static thread_local uint32_t countdown = 0;
+			return countdown;
+		}
+
+		AllocatorCounters& m_counters;
+		uint64_t m_start = 0;
+		bool m_deallocation;
+	};
+
+	inline void AddAllocationStat(AllocatorCounters& s, uint64_t size) { s.Allocated(size); }
+	inline void AddDeallocateStat(AllocatorCounters& s, uint64_t size) { s.Deallocated(size); }
+	inline void AddPaddingStat(AllocatorCounters& s, uint64_t size) { s.Padded(size); }
+	inline void AddHitStat(AllocatorCounters& s) { s.Hit(); }
+	inline void AddMissStat(AllocatorCounters& s) { s.Missed(); }
+
+	// Rewinding a linear allocator frees many blocks at once, only the bytes are known
+	inline void AddRewindStat(AllocatorCounters& s, uint64_t size) { s.Rewound(size); }
+
+	// A block resized in place keeps its allocation, only the bytes change
+	inline void AddResizeStat(AllocatorCounters& s, uint64_t oldSize, uint64_t newSize) { s.Resized(oldSize, newSize); }
+
+	struct AllocatorStatsReport
+	{
+		bool isProxyAllocator = false;
+		AllocatorStats stats = "";
+		std::vector<std::unique_ptr<AllocatorStatsReport>> nested;
+	};
+	using AllocatorStatsReportPtr = std::unique_ptr<AllocatorStatsReport>;
+} // namespace Private
+} // namespace Memory
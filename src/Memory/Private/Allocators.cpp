@@ -1,8 +1,14 @@
 #include "Allocators.h"
+#include "VirtualMemory.h"
 
+#include <cstddef>
 #include <cstdlib>
 #include <iostream>
 
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
 namespace Memory
 {
 
@@ -11,20 +17,160 @@ MemDesc NullAllocator::Allocate(uint64_t size)
 	return { nullptr, 0 };
 }
 
+MemDesc NullAllocator::Allocate(uint64_t size, uint64_t alignment)
+{
+	return { nullptr, 0 };
+}
+
+MemDesc NullAllocator::Reallocate(MemDesc desc, uint64_t newSize)
+{
+	return { nullptr, 0 };
+}
+
+bool NullAllocator::Expand(MemDesc& desc, uint64_t delta)
+{
+	return false;
+}
+
+uint64_t NullAllocator::GoodSize(uint64_t size) const
+{
+	return size;
+}
+
 void NullAllocator::Deallocate(MemDesc desc)
 {
 }
 
+static void* MapBlock(uint64_t size, uint64_t alignment)
+{
+	uint64_t const pageSize = Private::GetPageSize();
+	if (alignment <= pageSize)
+	{
+		return Private::MapPages(size);
+	}
+	uint64_t const mappedSize = Private::AlignUp(size, pageSize);
+	void* ptr = Private::ReserveAddressSpace(mappedSize, alignment);
+	if (ptr && !Private::CommitPages(ptr, mappedSize))
+	{
+		Private::ReleaseAddressSpace(ptr, mappedSize);
+		return nullptr;
+	}
+	return ptr;
+}
+
+// Windows can't free() what _aligned_malloc() returns, so everything goes through
+// _aligned_malloc() there and Deallocate() doesn't need to know the alignment.
 MemDesc MallocAllocator::Allocate(uint64_t size)
 {
+	Private::LatencySample sample(m_stats, false);
+	void* ptr = nullptr;
+	if (size >= MapThreshold)
+	{
+		ptr = MapBlock(size, 1);
+	}
+	else
+	{
+#ifdef _WIN32
+		ptr = _aligned_malloc(size, alignof(std::max_align_t));
+#else
+		ptr = std::malloc(size);
+#endif
+	}
+	if (!ptr)
+	{
+		return { nullptr, 0 };
+	}
 	Private::AddAllocationStat(m_stats, size);
-	return { std::malloc(size), size };
+	return { ptr, size };
+}
+
+MemDesc MallocAllocator::Allocate(uint64_t size, uint64_t alignment)
+{
+	Private::LatencySample sample(m_stats, false);
+	MY_ASSERT(alignment && (alignment & (alignment - 1)) == 0, "Alignment should be a power of two");
+	uint64_t const alignedSize = Private::AlignUp(size, alignment);
+	void* ptr = nullptr;
+	if (alignedSize >= MapThreshold)
+	{
+		ptr = MapBlock(alignedSize, alignment);
+	}
+	else
+	{
+#ifdef _WIN32
+		ptr = _aligned_malloc(alignedSize, alignment < alignof(std::max_align_t) ? alignof(std::max_align_t) : alignment);
+#else
+		if (alignment <= alignof(std::max_align_t))
+		{
+			ptr = std::malloc(alignedSize);
+		}
+		else if (posix_memalign(&ptr, alignment, alignedSize) != 0)
+		{
+			ptr = nullptr;
+		}
+#endif
+	}
+	if (!ptr)
+	{
+		return { nullptr, 0 };
+	}
+	Private::AddAllocationStat(m_stats, alignedSize);
+	Private::AddPaddingStat(m_stats, alignedSize - size);
+	return { ptr, alignedSize };
+}
+
+MemDesc MallocAllocator::Reallocate(MemDesc desc, uint64_t newSize)
+{
+	void* ptr = nullptr;
+	if (desc.size >= MapThreshold && newSize >= MapThreshold)
+	{
+		ptr = Private::RemapPages(desc.ptr, desc.size, newSize);
+	}
+	else if (desc.size < MapThreshold && newSize < MapThreshold)
+	{
+#ifdef _WIN32
+		ptr = _aligned_realloc(desc.ptr, newSize, alignof(std::max_align_t));
+#else
+		ptr = std::realloc(desc.ptr, newSize);
+#endif
+	}
+	if (!ptr)
+	{
+		return Private::ReallocateByCopy(*this, *this, desc, newSize);
+	}
+	Private::AddResizeStat(m_stats, desc.size, newSize);
+	return { ptr, newSize };
+}
+
+bool MallocAllocator::Expand(MemDesc& desc, uint64_t delta)
+{
+	if (desc.size < MapThreshold || !Private::ResizePagesInPlace(desc.ptr, desc.size, desc.size + delta))
+	{
+		return false;
+	}
+	Private::AddResizeStat(m_stats, desc.size, desc.size + delta);
+	desc.size += delta;
+	return true;
+}
+
+uint64_t MallocAllocator::GoodSize(uint64_t size) const
+{
+	return size >= MapThreshold ? Private::AlignUp(size, Private::GetPageSize()) : size;
 }
 
 void MallocAllocator::Deallocate(MemDesc desc)
 {
+	Private::LatencySample sample(m_stats, true);
 	Private::AddDeallocateStat(m_stats, desc.size);
+	if (desc.size >= MapThreshold)
+	{
+		Private::ReleaseAddressSpace(desc.ptr, Private::AlignUp(desc.size, Private::GetPageSize()));
+		return;
+	}
+#ifdef _WIN32
+	_aligned_free(desc.ptr);
+#else
 	std::free(desc.ptr);
+#endif
 }
 
 } // namespace Memory
@@ -1,81 +1,86 @@
 #pragma once
+#include "AllocatorStats.h"
+#include "BitUtils.h"
 #include "MemDesc.h"
+#include "PageMap.h"
 #include "Utils/Assert.h"
 
+#include <cstdint>
+#include <cstring>
+
 #include <memory>
 #include <vector>
 
 namespace Memory
 {
 
-//#define __ENABLE_ALLOCATOR_STATS
-
 namespace Private
 {
-	struct AllocatorStats
-	{
-		AllocatorStats() = delete;
-		AllocatorStats(const char* n) : name(n) {}
-
-		const char* name = nullptr;
-		uint64_t countAllocated = 0;
-		uint64_t totalAllocated = 0;
-		uint64_t countDeallocated = 0;
-		uint64_t totalDeallocated = 0;
-		uint64_t unallocated = 0;
-	};
-
-	inline void AddAllocationStat(AllocatorStats& s, uint64_t size)
+	// Reallocate() for blocks that can't be resized in place: the new block
+	// comes from to, the old one goes back to from.
+	template <typename From, typename To>
+	MemDesc ReallocateByCopy(From& from, To& to, MemDesc desc, uint64_t newSize)
 	{
-#ifdef __ENABLE_ALLOCATOR_STATS
-		++s.countAllocated; 
-		s.totalAllocated += size;
-		s.unallocated += size;
-#else
-		(void)s;(void)size;
-#endif
-	}
-	inline void AddDeallocateStat(AllocatorStats& s, uint64_t size)
-	{
-#ifdef __ENABLE_ALLOCATOR_STATS
-		++s.countDeallocated;
-		s.totalDeallocated += size;
-		s.unallocated -= size;
-#else
-		(void)s;(void)size;
-#endif
+		MemDesc newDesc = to.Allocate(newSize);
+		if (newDesc.ptr)
+		{
+			std::memcpy(newDesc.ptr, desc.ptr, desc.size < newSize ? desc.size : newSize);
+			from.Deallocate(desc);
+		}
+		return newDesc;
 	}
-
-	struct AllocatorStatsReport
-	{
-		bool isProxyAllocator = false;
-		AllocatorStats stats = "";
-		std::vector<std::unique_ptr<AllocatorStatsReport>> nested;
-	};
-	using AllocatorStatsReportPtr = std::unique_ptr<AllocatorStatsReport>;
 }
 
+/*
+Every allocator has Allocate(size, alignment) next to Allocate(size).
+alignment is a power of two, and the block is rounded up to a multiple of it
+(or to a size class that is). The returned MemDesc has the rounded size,
+which is what Deallocate expects back.
+Allocate(size) doesn't align and doesn't round.
+
+Reallocate(desc, newSize) returns the resized block, in place when it can,
+and keeps alignment only up to alignof(std::max_align_t). When it fails it
+returns an invalid MemDesc and desc is still valid.
+Expand(desc, delta) grows a block in place or returns false.
+GoodSize(size) is the size the allocator would use for size anyway,
+containers ask for it to make use of the slack.
+*/
+
 class NullAllocator
 {
 public:
 	MemDesc Allocate(uint64_t size);
+	MemDesc Allocate(uint64_t size, uint64_t alignment);
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize);
+	bool Expand(MemDesc& desc, uint64_t delta);
+	uint64_t GoodSize(uint64_t size) const;
 	void Deallocate(MemDesc desc);
 };
 
+/*
+Blocks of MapThreshold bytes and more are mapped straight from the OS,
+so Reallocate() can move their pages with mremap() instead of copying them.
+*/
 class MallocAllocator
 {
 public:
+	static constexpr uint64_t MapThreshold = 256 * 1024;
+
 	MemDesc Allocate(uint64_t size);
+	MemDesc Allocate(uint64_t size, uint64_t alignment);
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize);
+	bool Expand(MemDesc& desc, uint64_t delta);
+	uint64_t GoodSize(uint64_t size) const;
 	void Deallocate(MemDesc desc);
 
 	Private::AllocatorStatsReportPtr GetStats() const
 	{
 		auto report = std::make_unique<Private::AllocatorStatsReport>();
-		report->stats = m_stats;
+		report->stats = m_stats.Read();
 		return std::move(report);
 	}
 private:
-	Private::AllocatorStats m_stats = "MallocAllocator";
+	Private::AllocatorCounters m_stats = "MallocAllocator";
 };
 
 template <size_t Size>
@@ -94,18 +99,62 @@ public:
 
 	MemDesc Allocate(uint64_t size)
 	{
-		if (Size - (ptr - stack) < size)
+		return Allocate(size, 1);
+	}
+
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		Private::LatencySample sample(m_stats, false);
+		uint64_t const padding = Private::AlignUp(reinterpret_cast<uintptr_t>(ptr), alignment) - reinterpret_cast<uintptr_t>(ptr);
+		uint64_t const alignedSize = Private::AlignUp(size, alignment);
+		if (Size - (ptr - stack) < padding + alignedSize)
 		{
 			return { nullptr, 0 };
 		}
-		Private::AddAllocationStat(m_stats, size);
-		MemDesc result = { ptr, size };
-		ptr += size;
+		Private::AddAllocationStat(m_stats, alignedSize);
+		Private::AddPaddingStat(m_stats, padding + alignedSize - size);
+		MemDesc result = { ptr + padding, alignedSize };
+		ptr += padding + alignedSize;
 		return result;
 	}
 
+	uint64_t GoodSize(uint64_t size) const { return size; }
+
+	// Only the last block can grow in place
+	bool Expand(MemDesc& desc, uint64_t delta)
+	{
+		if (ptr != reinterpret_cast<uint8_t*>(desc.ptr) + desc.size || Size - (ptr - stack) < delta)
+		{
+			return false;
+		}
+		Private::AddResizeStat(m_stats, desc.size, desc.size + delta);
+		ptr += delta;
+		desc.size += delta;
+		return true;
+	}
+
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize)
+	{
+		if (newSize <= desc.size)
+		{
+			// The tail is given back only by the last block
+			if (ptr == reinterpret_cast<uint8_t*>(desc.ptr) + desc.size)
+			{
+				ptr -= desc.size - newSize;
+			}
+			Private::AddResizeStat(m_stats, desc.size, newSize);
+			return { desc.ptr, newSize };
+		}
+		if (Expand(desc, newSize - desc.size))
+		{
+			return desc;
+		}
+		return Private::ReallocateByCopy(*this, *this, desc, newSize);
+	}
+
 	void Deallocate(MemDesc desc)
 	{
+		Private::LatencySample sample(m_stats, true);
 		MY_ASSERT(Owns(desc), "Stack allocator should own memory you are trying to free");
 		Private::AddDeallocateStat(m_stats, desc.size);
 		if ((ptr - desc.size) == desc.ptr)
@@ -119,16 +168,26 @@ public:
 		return desc.ptr >= stack && desc.ptr < stack + Size;
 	}
 
+	// Everything allocated after the mark goes back at once
+	uint64_t Mark() const { return ptr - stack; }
+
+	void Rewind(uint64_t mark)
+	{
+		MY_ASSERT(mark <= static_cast<uint64_t>(ptr - stack), "Rewinding past the top of the stack");
+		Private::AddRewindStat(m_stats, (ptr - stack) - mark);
+		ptr = stack + mark;
+	}
+
 	Private::AllocatorStatsReportPtr GetStats() const
 	{
 		auto report = std::make_unique<Private::AllocatorStatsReport>();
-		report->stats = m_stats;
+		report->stats = m_stats.Read();
 		return std::move(report);
 	}
 private:
 	uint8_t stack[Size];
 	uint8_t* ptr = nullptr;
-	Private::AllocatorStats m_stats = "StackAllocator";
+	Private::AllocatorCounters m_stats = "StackAllocator";
 };
 
 template <size_t Size>
@@ -153,18 +212,62 @@ public:
 
 	MemDesc Allocate(uint64_t size)
 	{
-		if (Size - (ptr - heap) < size)
+		return Allocate(size, 1);
+	}
+
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		Private::LatencySample sample(m_stats, false);
+		uint64_t const padding = Private::AlignUp(reinterpret_cast<uintptr_t>(ptr), alignment) - reinterpret_cast<uintptr_t>(ptr);
+		uint64_t const alignedSize = Private::AlignUp(size, alignment);
+		if (Size - (ptr - heap) < padding + alignedSize)
 		{
 			return { nullptr, 0 };
 		}
-		Private::AddAllocationStat(m_stats, size);
-		MemDesc result = { ptr, size };
-		ptr += size;
+		Private::AddAllocationStat(m_stats, alignedSize);
+		Private::AddPaddingStat(m_stats, padding + alignedSize - size);
+		MemDesc result = { ptr + padding, alignedSize };
+		ptr += padding + alignedSize;
 		return result;
 	}
 
+	uint64_t GoodSize(uint64_t size) const { return size; }
+
+	// Only the last block can grow in place
+	bool Expand(MemDesc& desc, uint64_t delta)
+	{
+		if (ptr != reinterpret_cast<uint8_t*>(desc.ptr) + desc.size || Size - (ptr - heap) < delta)
+		{
+			return false;
+		}
+		Private::AddResizeStat(m_stats, desc.size, desc.size + delta);
+		ptr += delta;
+		desc.size += delta;
+		return true;
+	}
+
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize)
+	{
+		if (newSize <= desc.size)
+		{
+			// The tail is given back only by the last block
+			if (ptr == reinterpret_cast<uint8_t*>(desc.ptr) + desc.size)
+			{
+				ptr -= desc.size - newSize;
+			}
+			Private::AddResizeStat(m_stats, desc.size, newSize);
+			return { desc.ptr, newSize };
+		}
+		if (Expand(desc, newSize - desc.size))
+		{
+			return desc;
+		}
+		return Private::ReallocateByCopy(*this, *this, desc, newSize);
+	}
+
 	void Deallocate(MemDesc desc)
 	{
+		Private::LatencySample sample(m_stats, true);
 		MY_ASSERT(Owns(desc), "Heap allocator should own memory you are trying to free");
 		Private::AddDeallocateStat(m_stats, desc.size);
 		if ((ptr - desc.size) == desc.ptr)
@@ -178,59 +281,201 @@ public:
 		return desc.ptr >= heap && desc.ptr < heap + Size;
 	}
 
+	// Everything allocated after the mark goes back at once
+	uint64_t Mark() const { return ptr - heap; }
+
+	void Rewind(uint64_t mark)
+	{
+		MY_ASSERT(mark <= static_cast<uint64_t>(ptr - heap), "Rewinding past the top of the heap");
+		Private::AddRewindStat(m_stats, (ptr - heap) - mark);
+		ptr = heap + mark;
+	}
+
 	Private::AllocatorStatsReportPtr GetStats() const
 	{
 		auto report = std::make_unique<Private::AllocatorStatsReport>();
-		report->stats = m_stats;
+		report->stats = m_stats.Read();
 		return std::move(report);
 	}
 private:
 	uint8_t* heap = nullptr;
 	uint8_t* ptr = nullptr;
-	Private::AllocatorStats m_stats = "HeapAllocator";
+	Private::AllocatorCounters m_stats = "HeapAllocator";
 };
 
-template <typename Allocator, size_t blockSize>
+/*
+Recycles blocks of minSize to maxSize bytes, they are all maxSize bytes big.
+An empty list is refilled with batchSize blocks at once, a list of maxLength
+blocks gives the next ones back to Allocator. Other sizes go straight to Allocator.
+Every block is a separate Allocator allocation, so any of them can go back on its own.
+*/
+template <typename Allocator, size_t minSize, size_t maxSize = minSize, size_t batchSize = 1, size_t maxLength = SIZE_MAX>
 class FreelistAllocator
 {
 public:
-	MemDesc Allocate(uint64_t size)
+	static_assert(minSize <= maxSize && maxSize >= sizeof(void*), "Blocks should fit the list node");
+	static_assert(batchSize >= 1 && batchSize <= maxLength, "Refill should fit the list");
+
+	FreelistAllocator() = default;
+	FreelistAllocator(FreelistAllocator&&) = delete;
+	FreelistAllocator(FreelistAllocator const&) = delete;
+	FreelistAllocator& operator=(FreelistAllocator&&) = delete;
+	FreelistAllocator& operator=(FreelistAllocator const&) = delete;
+
+	~FreelistAllocator()
 	{
-		if (size == blockSize && list)
+		while (list)
 		{
-			Private::AddAllocationStat(m_stats, size);
-			MemDesc result = { list, size };
+			Node* node = list;
 			list = list->next;
-			return result;
+			allocator.Deallocate({ node, maxSize });
+		}
+	}
+
+	MemDesc Allocate(uint64_t size)
+	{
+		Private::LatencySample sample(m_stats, false);
+		if (!InRange(size))
+		{
+			return allocator.Allocate(size);
 		}
-		return allocator.Allocate(size);
+		void* ptr = Pop();
+		return { ptr, ptr ? size : 0 };
 	}
 
+	// Blocks are only as aligned as Allocator made them. Unless maxSize is a multiple
+	// of the alignment, the block is bigger than maxSize and belongs to Allocator.
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		Private::LatencySample sample(m_stats, false);
+		uint64_t const alignedSize = Private::AlignUp(size, alignment);
+		if (!InRange(alignedSize) || maxSize % alignment)
+		{
+			return allocator.Allocate(InRange(alignedSize) ? maxSize : size, alignment);
+		}
+		if (list && (reinterpret_cast<uintptr_t>(list) & (alignment - 1)) == 0)
+		{
+			void* ptr = Pop();
+			Private::AddPaddingStat(m_stats, alignedSize - size);
+			return { ptr, alignedSize };
+		}
+		Private::AddMissStat(m_stats);
+		MemDesc desc = allocator.Allocate(maxSize, alignment);
+		if (!desc.ptr)
+		{
+			return { nullptr, 0 };
+		}
+		Private::AddAllocationStat(m_stats, maxSize);
+		return { desc.ptr, alignedSize };
+	}
+
+	// List blocks are resized in place within the range, and move out of it
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize)
+	{
+		if (InRange(desc.size) && InRange(newSize))
+		{
+			return { desc.ptr, newSize };
+		}
+		if (InRange(desc.size) || InRange(newSize))
+		{
+			return Private::ReallocateByCopy(*this, *this, desc, newSize);
+		}
+		return allocator.Reallocate(desc, newSize);
+	}
+
+	bool Expand(MemDesc& desc, uint64_t delta)
+	{
+		if (InRange(desc.size))
+		{
+			if (desc.size + delta > maxSize)
+			{
+				return false;
+			}
+			desc.size += delta;
+			return true;
+		}
+		return !InRange(desc.size + delta) && allocator.Expand(desc, delta);
+	}
+
+	uint64_t GoodSize(uint64_t size) const { return InRange(size) ? maxSize : allocator.GoodSize(size); }
+
 	void Deallocate(MemDesc desc)
 	{
-		if (desc.size != blockSize)
+		Private::LatencySample sample(m_stats, true);
+		if (!InRange(desc.size))
 		{
 			allocator.Deallocate(desc);
 		}
+		else if (length == maxLength)
+		{
+			Private::AddDeallocateStat(m_stats, maxSize);
+			allocator.Deallocate({ desc.ptr, maxSize });
+		}
 		else
 		{
-			Private::AddDeallocateStat(m_stats, desc.size);
+			Private::AddDeallocateStat(m_stats, maxSize);
 			Node* node = reinterpret_cast<Node*>(desc.ptr);
 			node->next = list;
 			list = node;
+			++length;
 		}
 	}
 
-	bool Owns(MemDesc desc) const { return desc.size == blockSize || allocator.Owns(desc); }
+	// List blocks came from Allocator, a block of the right size from anywhere else isn't ours
+	bool Owns(MemDesc desc) const { return allocator.Owns(desc); }
+
+	bool Owns(MemDesc desc, void const* owner) const { return Private::Owns(allocator, desc, owner); }
+
+	uint64_t Length() const { return length; }
 
 	Private::AllocatorStatsReportPtr GetStats() const
 	{
 		auto report = std::make_unique<Private::AllocatorStatsReport>();
-		report->stats = m_stats;
+		report->stats = m_stats.Read();
 		report->nested.push_back(std::move(allocator.GetStats()));
 		return std::move(report);
 	}
 private:
+	static bool InRange(uint64_t size) { return size >= minSize && size <= maxSize; }
+
+	void* Pop()
+	{
+		if (list)
+		{
+			Private::AddHitStat(m_stats);
+		}
+		else
+		{
+			Private::AddMissStat(m_stats);
+			Refill();
+			if (!list)
+			{
+				return nullptr;
+			}
+		}
+		Node* node = list;
+		list = list->next;
+		--length;
+		Private::AddAllocationStat(m_stats, maxSize);
+		return node;
+	}
+
+	void Refill()
+	{
+		for (size_t i = 0; i < batchSize; ++i)
+		{
+			MemDesc desc = allocator.Allocate(maxSize);
+			if (!desc.ptr)
+			{
+				break;
+			}
+			Node* node = reinterpret_cast<Node*>(desc.ptr);
+			node->next = list;
+			list = node;
+			++length;
+		}
+	}
+
 	Allocator allocator;
 
 	struct Node
@@ -238,7 +483,8 @@ private:
 		Node* next;
 	};
 	Node* list = nullptr;
-	Private::AllocatorStats m_stats = "FreelistAllocator";
+	uint64_t length = 0;
+	Private::AllocatorCounters m_stats = "FreelistAllocator";
 };
 
 template <typename Primary, typename Fallback>
@@ -261,18 +507,70 @@ public:
 		return primaryDesc;
 	}
 
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		MemDesc primaryDesc = primary.Allocate(size, alignment);
+		if (!primaryDesc.ptr)
+		{
+			return fallback.Allocate(size, alignment);
+		}
+		return primaryDesc;
+	}
+
+	// A block that doesn't fit in Primary anymore moves to Fallback
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize)
+	{
+		if (!Private::Owns(primary, desc, LookupOwner(desc)))
+		{
+			return fallback.Reallocate(desc, newSize);
+		}
+		MemDesc primaryDesc = primary.Reallocate(desc, newSize);
+		if (!primaryDesc.ptr)
+		{
+			return Private::ReallocateByCopy(primary, fallback, desc, newSize);
+		}
+		return primaryDesc;
+	}
+
+	bool Expand(MemDesc& desc, uint64_t delta)
+	{
+		if (Private::Owns(primary, desc, LookupOwner(desc)))
+		{
+			return primary.Expand(desc, delta);
+		}
+		return fallback.Expand(desc, delta);
+	}
+
+	uint64_t GoodSize(uint64_t size) const { return primary.GoodSize(size); }
+
 	void Deallocate(MemDesc desc)
 	{
-		if (primary.Owns(desc))
+		Deallocate(desc, LookupOwner(desc));
+	}
+
+	// owner is what the page map has for desc, nested fallbacks don't look it up again
+	void Deallocate(MemDesc desc, void const* owner)
+	{
+		if (Private::Owns(primary, desc, owner))
 		{
-			primary.Deallocate(desc);
+			Private::Deallocate(primary, desc, owner);
 		}
 		else
 		{
-			fallback.Deallocate(desc);
+			Private::Deallocate(fallback, desc, owner);
 		}
 	}
 
+	bool Owns(MemDesc desc) const
+	{
+		return Owns(desc, LookupOwner(desc));
+	}
+
+	bool Owns(MemDesc desc, void const* owner) const
+	{
+		return Private::Owns(primary, desc, owner) || Private::Owns(fallback, desc, owner);
+	}
+
 	Private::AllocatorStatsReportPtr GetStats() const
 	{
 		auto report = std::make_unique<Private::AllocatorStatsReport>();
@@ -283,6 +581,19 @@ public:
 		return std::move(report);
 	}
 private:
+	// Only worth a lookup when Primary answers from the page map
+	void const* LookupOwner(MemDesc desc) const
+	{
+		if constexpr (Private::HasMappedOwnership<Primary>::value)
+		{
+			return Private::GetPageMap().Lookup(desc.ptr);
+		}
+		else
+		{
+			return nullptr;
+		}
+	}
+
 	Primary primary;
 	Fallback fallback;
 };
@@ -302,6 +613,53 @@ public:
 		return greaterAllocator.Allocate(size);
 	}
 
+	// Blocks come back with the rounded size, so that is what picks the allocator
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		if (Private::AlignUp(size, alignment) <= Segregator)
+		{
+			return loeAllocator.Allocate(size, alignment);
+		}
+		return greaterAllocator.Allocate(size, alignment);
+	}
+
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize)
+	{
+		if (desc.size <= Segregator)
+		{
+			if (newSize <= Segregator)
+			{
+				return loeAllocator.Reallocate(desc, newSize);
+			}
+			return Private::ReallocateByCopy(loeAllocator, greaterAllocator, desc, newSize);
+		}
+		if (newSize > Segregator)
+		{
+			return greaterAllocator.Reallocate(desc, newSize);
+		}
+		return Private::ReallocateByCopy(greaterAllocator, loeAllocator, desc, newSize);
+	}
+
+	bool Expand(MemDesc& desc, uint64_t delta)
+	{
+		if (desc.size > Segregator)
+		{
+			return greaterAllocator.Expand(desc, delta);
+		}
+		return desc.size + delta <= Segregator && loeAllocator.Expand(desc, delta);
+	}
+
+	// The good size of the smaller allocator is no good if it would route the block to the other one
+	uint64_t GoodSize(uint64_t size) const
+	{
+		if (size <= Segregator)
+		{
+			uint64_t const goodSize = loeAllocator.GoodSize(size);
+			return goodSize <= Segregator ? goodSize : size;
+		}
+		return greaterAllocator.GoodSize(size);
+	}
+
 	void Deallocate(MemDesc desc)
 	{
 		if (desc.size <= Segregator)
@@ -314,6 +672,18 @@ public:
 		}
 	}
 
+	void Deallocate(MemDesc desc, void const* owner)
+	{
+		if (desc.size <= Segregator)
+		{
+			Private::Deallocate(loeAllocator, desc, owner);
+		}
+		else
+		{
+			Private::Deallocate(greaterAllocator, desc, owner);
+		}
+	}
+
 	bool Owns(MemDesc desc) const
 	{
 		if (desc.size <= Segregator)
@@ -326,6 +696,18 @@ public:
 		}
 	}
 
+	bool Owns(MemDesc desc, void const* owner) const
+	{
+		if (desc.size <= Segregator)
+		{
+			return Private::Owns(loeAllocator, desc, owner);
+		}
+		else
+		{
+			return Private::Owns(greaterAllocator, desc, owner);
+		}
+	}
+
 	Private::AllocatorStatsReportPtr GetStats() const
 	{
 		auto report = std::make_unique<Private::AllocatorStatsReport>();
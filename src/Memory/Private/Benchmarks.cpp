@@ -0,0 +1,699 @@
+#include "Benchmarks.h"
+#include "Utils/Benchy.h"
+
+#include "Memory.h"
+#include "MemoryResource.h"
+#include "Reclamation.h"
+#include "AtomicSharedHandle.h"
+#include "CompactingHeap.h"
+#include "IntrusiveHandle.h"
+#include "SharedHandle.h"
+#include "StdAllocator.h"
+#include "Allocators.h"
+#include "BitmappedBlockAllocator.h"
+#include "ConcurrentFreelistAllocator.h"
+#include "RegionAllocator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace Memory;
+
+namespace
+{
+	// A node of std::map<int, int> is three pointers, the colour and the pair
+	// in MSVC, libstdc++ and libc++ alike
+	constexpr size_t MapNodeSize = 40;
+
+	using MapNodeAllocator = FreelistAllocator<HeapAllocator<128_mB>, MapNodeSize>;
+
+	template <typename Map>
+	void FillAndEraseMap(Benchy::Report& report, std::string const& name, Map& map, std::mt19937& gen)
+	{
+		int const count = 1000000;
+		std::uniform_int_distribution<> dist(0, count);
+		{
+			Benchy::Stopwatch sw(report, name + ": adding 1 million random elements");
+			for (int i = 0; i < count; ++i)
+			{
+				map.emplace(dist(gen), i);
+			}
+		}
+		{
+			Benchy::Stopwatch sw(report, name + ": erasing every other element and adding them back");
+			for (int i = 0; i < count; i += 2)
+			{
+				map.erase(i);
+			}
+			for (int i = 0; i < count; i += 2)
+			{
+				map.emplace(i, i);
+			}
+		}
+		{
+			Benchy::Stopwatch sw(report, name + ": clearing");
+			map.clear();
+		}
+	}
+}
+
+// Same map, nodes from operator new against nodes recycled by a freelist over a HeapAllocator
+void BenchStdMap()
+{
+	Benchy::Report report("Bench std::map<int, int> allocators");
+	std::random_device rd;
+	std::mt19937 gen(rd());
+
+	for (int run = 0; run < 10; ++run)
+	{
+		{
+			std::map<int, int> map;
+			FillAndEraseMap(report, "std::allocator", map, gen);
+		}
+		{
+			MapNodeAllocator allocator;
+			using Alloc = StdAllocator<std::pair<int const, int>, MapNodeAllocator>;
+			std::map<int, int, std::less<int>, Alloc> map{ Alloc(allocator) };
+			FillAndEraseMap(report, "StdAllocator<FreelistAllocator<HeapAllocator>>", map, gen);
+		}
+		{
+			MapNodeAllocator allocator;
+			MemoryResource<MapNodeAllocator> resource(allocator);
+			std::pmr::map<int, int> map{ &resource };
+			FillAndEraseMap(report, "MemoryResource<FreelistAllocator<HeapAllocator>>", map, gen);
+		}
+	}
+}
+
+// Tree node sized blocks: allocate them all, free a random half, allocate it back and free everything
+void BenchBlockAllocators()
+{
+	Benchy::Report report("Bench 32 byte block allocators");
+	constexpr size_t count = 1000000;
+	std::random_device rd;
+	std::mt19937 gen(rd());
+
+	auto const Run = [&report, &gen, count](std::string const& name, auto& allocator, auto const& freeAll)
+	{
+		std::vector<MemDesc> blocks(count);
+		{
+			Benchy::Stopwatch sw(report, name + ": allocating 1 million blocks");
+			for (MemDesc& desc : blocks)
+			{
+				desc = allocator.Allocate(32);
+			}
+		}
+		std::shuffle(blocks.begin(), blocks.end(), gen);
+		{
+			Benchy::Stopwatch sw(report, name + ": freeing and allocating back half of them in random order");
+			for (size_t i = 0; i < count / 2; ++i)
+			{
+				allocator.Deallocate(blocks[i]);
+			}
+			for (size_t i = 0; i < count / 2; ++i)
+			{
+				blocks[i] = allocator.Allocate(32);
+			}
+		}
+		{
+			Benchy::Stopwatch sw(report, name + ": freeing all of them");
+			freeAll(blocks);
+		}
+	};
+
+	for (int run = 0; run < 10; ++run)
+	{
+		{
+			auto allocator = std::make_unique<FreelistAllocator<HeapAllocator<64_mB>, 32>>();
+			Run("FreelistAllocator", *allocator, [&allocator](std::vector<MemDesc> const& blocks)
+			{
+				for (MemDesc desc : blocks)
+				{
+					allocator->Deallocate(desc);
+				}
+			});
+		}
+		{
+			auto allocator = std::make_unique<BitmappedBlockAllocator<MallocAllocator, 32, count>>();
+			Run("BitmappedBlockAllocator", *allocator, [&allocator](std::vector<MemDesc> const& blocks)
+			{
+				for (MemDesc desc : blocks)
+				{
+					allocator->Deallocate(desc);
+				}
+			});
+		}
+		{
+			auto allocator = std::make_unique<BitmappedBlockAllocator<MallocAllocator, 32, count>>();
+			Run("BitmappedBlockAllocator DeallocateAll", *allocator, [&allocator](std::vector<MemDesc> const&)
+			{
+				allocator->DeallocateAll();
+			});
+		}
+	}
+}
+
+namespace
+{
+	// Hides the page map from Allocator, so a composition asks every level with Owns(desc)
+	template <typename Allocator>
+	struct RangeOwned
+	{
+		MemDesc Allocate(uint64_t size) { return allocator.Allocate(size); }
+		void Deallocate(MemDesc desc) { allocator.Deallocate(desc); }
+		bool Owns(MemDesc desc) const { return allocator.Owns(desc); }
+		Allocator allocator;
+	};
+
+	template <typename Allocator>
+	using PageMapped = Allocator;
+
+	// Depth regions chained with FallbackAllocator, malloc at the bottom
+	template <template <typename> class Leaf, size_t Depth>
+	struct DeepComposition
+	{
+		using Type = FallbackAllocator<Leaf<RegionAllocator<1_mB>>, typename DeepComposition<Leaf, Depth - 1>::Type>;
+	};
+
+	template <template <typename> class Leaf>
+	struct DeepComposition<Leaf, 0>
+	{
+		using Type = MallocAllocator;
+	};
+
+	template <template <typename> class Leaf, size_t Depth>
+	void BenchDeepDeallocation(Benchy::Report& report, std::string const& name, std::mt19937& gen)
+	{
+		using Allocator = typename DeepComposition<Leaf, Depth>::Type;
+		auto allocator = std::make_unique<Allocator>();
+		std::vector<MemDesc> blocks(Depth * 1_mB / 64);
+		for (MemDesc& desc : blocks)
+		{
+			desc = allocator->Allocate(64);
+		}
+		std::shuffle(blocks.begin(), blocks.end(), gen);
+		Benchy::Stopwatch sw(report, name + ", depth " + std::to_string(Depth) + ": deallocating " + std::to_string(blocks.size()) + " blocks");
+		for (MemDesc desc : blocks)
+		{
+			allocator->Deallocate(desc);
+		}
+	}
+}
+
+// Blocks spread over every level of a fallback chain, freed in random order
+void BenchDeepDeallocation()
+{
+	Benchy::Report report("Bench deallocation through nested FallbackAllocators");
+	std::random_device rd;
+	std::mt19937 gen(rd());
+
+	for (int run = 0; run < 10; ++run)
+	{
+		BenchDeepDeallocation<RangeOwned, 2>(report, "Owns() at every level", gen);
+		BenchDeepDeallocation<PageMapped, 2>(report, "Page map lookup", gen);
+		BenchDeepDeallocation<RangeOwned, 4>(report, "Owns() at every level", gen);
+		BenchDeepDeallocation<PageMapped, 4>(report, "Page map lookup", gen);
+		BenchDeepDeallocation<RangeOwned, 8>(report, "Owns() at every level", gen);
+		BenchDeepDeallocation<PageMapped, 8>(report, "Page map lookup", gen);
+		BenchDeepDeallocation<RangeOwned, 16>(report, "Owns() at every level", gen);
+		BenchDeepDeallocation<PageMapped, 16>(report, "Page map lookup", gen);
+	}
+}
+
+namespace
+{
+	// The baseline for the lock-free list: the same list behind a mutex
+	template <typename Parent, size_t BlockSize>
+	struct LockedFreelistAllocator
+	{
+		MemDesc Allocate(uint64_t size)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return allocator.Allocate(size);
+		}
+
+		void Deallocate(MemDesc desc)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			allocator.Deallocate(desc);
+		}
+
+		std::mutex mutex;
+		FreelistAllocator<Parent, BlockSize, BlockSize, 32> allocator;
+	};
+
+	template <typename Allocator>
+	void BenchContention(Benchy::Report& report, std::string const& name, unsigned threads)
+	{
+		auto allocator = std::make_unique<Allocator>();
+		Benchy::Stopwatch sw(report, name + ", " + std::to_string(threads) + " threads");
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < threads; ++t)
+		{
+			workers.emplace_back([&allocator]()
+			{
+				MemDesc held[8];
+				for (int i = 0; i < 100000; ++i)
+				{
+					for (MemDesc& desc : held)
+					{
+						desc = allocator->Allocate(64);
+					}
+					for (MemDesc desc : held)
+					{
+						allocator->Deallocate(desc);
+					}
+				}
+			});
+		}
+		for (std::thread& worker : workers)
+		{
+			worker.join();
+		}
+	}
+}
+
+// Every thread pops and pushes 800 thousand 64 byte blocks, so flat cycle counts mean no contention
+void BenchConcurrentFreelist()
+{
+	Benchy::Report report("Bench freelist contention");
+	for (unsigned threads = 1; threads <= 64; threads *= 2)
+	{
+		for (int run = 0; run < 5; ++run)
+		{
+			BenchContention<LockedFreelistAllocator<RegionAllocator<256_mB>, 64>>(report, "FreelistAllocator with a mutex", threads);
+			BenchContention<ConcurrentFreelistAllocator<RegionAllocator<256_mB>, 64>>(report, "ConcurrentFreelistAllocator", threads);
+		}
+	}
+}
+
+namespace
+{
+	struct Counted : RefCounted<>
+	{
+		uint64_t payload = 0;
+	};
+
+	// Every thread copies and drops the same handle, all of them hit one counter
+	template <typename Handle>
+	void BenchCopies(Benchy::Report& report, std::string const& name, Handle const& handle, unsigned threads)
+	{
+		Benchy::Stopwatch sw(report, name + ", " + std::to_string(threads) + " threads");
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < threads; ++t)
+		{
+			workers.emplace_back([&handle]()
+			{
+				for (int i = 0; i < 1000000; ++i)
+				{
+					Handle copy = handle;
+				}
+			});
+		}
+		for (std::thread& worker : workers)
+		{
+			worker.join();
+		}
+	}
+}
+
+// A million copies and destructions per thread of one shared object
+void BenchSharedHandles()
+{
+	Benchy::Report report("Bench shared handle copies under contention");
+	SharedHandle<Counted> shared = MakeShared<Counted>();
+	IntrusiveHandle<Counted> intrusive = MakeIntrusive<Counted>();
+	std::shared_ptr<Counted> stdShared = std::make_shared<Counted>();
+	for (unsigned threads = 1; threads <= 16; threads *= 2)
+	{
+		for (int run = 0; run < 5; ++run)
+		{
+			BenchCopies(report, "SharedHandle", shared, threads);
+			BenchCopies(report, "IntrusiveHandle", intrusive, threads);
+			BenchCopies(report, "std::shared_ptr", stdShared, threads);
+		}
+	}
+}
+
+namespace
+{
+	struct RoutingTable
+	{
+		uint64_t version = 0;
+		uint64_t routes[16] = {};
+	};
+
+	// Readers load the table a million times each while one writer keeps publishing new versions
+	template <typename Load, typename Publish>
+	void BenchSnapshotReaders(Benchy::Report& report, std::string const& name, unsigned readers, Load const& load, Publish const& publish)
+	{
+		std::atomic<bool> done{ false };
+		std::thread writer([&done, &publish]()
+		{
+			for (uint64_t version = 1; !done; ++version)
+			{
+				publish(version);
+				std::this_thread::yield();
+			}
+		});
+		{
+			Benchy::Stopwatch sw(report, name + ", " + std::to_string(readers) + " readers");
+			std::vector<std::thread> workers;
+			for (unsigned t = 0; t < readers; ++t)
+			{
+				workers.emplace_back([&load]()
+				{
+					uint64_t sum = 0;
+					for (int i = 0; i < 1000000; ++i)
+					{
+						sum += load();
+					}
+					volatile uint64_t sink = sum;
+					(void)sink;
+				});
+			}
+			for (std::thread& worker : workers)
+			{
+				worker.join();
+			}
+		}
+		done = true;
+		writer.join();
+	}
+}
+
+// Publishing read-mostly snapshots: a mutex around a SharedHandle, std::shared_ptr atomics and AtomicSharedHandle
+void BenchSnapshotPublishing()
+{
+	Benchy::Report report("Bench 1 writer and N readers of a shared snapshot");
+	for (unsigned readers = 1; readers <= 16; readers *= 2)
+	{
+		for (int run = 0; run < 5; ++run)
+		{
+			{
+				std::mutex mutex;
+				SharedHandle<RoutingTable> table = MakeShared<RoutingTable>();
+				BenchSnapshotReaders(report, "SharedHandle with a mutex", readers, [&mutex, &table]()
+				{
+					SharedHandle<RoutingTable> snapshot;
+					{
+						std::lock_guard<std::mutex> lock(mutex);
+						snapshot = table;
+					}
+					return snapshot->version;
+				},
+				[&mutex, &table](uint64_t version)
+				{
+					SharedHandle<RoutingTable> next = MakeShared<RoutingTable>();
+					next->version = version;
+					std::lock_guard<std::mutex> lock(mutex);
+					table.Swap(std::move(next));
+				});
+			}
+			{
+				std::shared_ptr<RoutingTable> table = std::make_shared<RoutingTable>();
+				BenchSnapshotReaders(report, "std::atomic_load of std::shared_ptr", readers, [&table]()
+				{
+					return std::atomic_load(&table)->version;
+				},
+				[&table](uint64_t version)
+				{
+					std::shared_ptr<RoutingTable> next = std::make_shared<RoutingTable>();
+					next->version = version;
+					std::atomic_store(&table, std::move(next));
+				});
+			}
+			{
+				AtomicSharedHandle<RoutingTable> table = MakeShared<RoutingTable>();
+				BenchSnapshotReaders(report, "AtomicSharedHandle", readers, [&table]()
+				{
+					return table.Load()->version;
+				},
+				[&table](uint64_t version)
+				{
+					SharedHandle<RoutingTable> next = MakeShared<RoutingTable>();
+					next->version = version;
+					table.Store(std::move(next));
+				});
+			}
+		}
+	}
+}
+
+namespace
+{
+	// Every thread allocates a million nodes and retires them from inside a guard
+	template <typename Reclamation>
+	void BenchRetire(Benchy::Report& report, std::string const& name, unsigned threads)
+	{
+		Benchy::Stopwatch sw(report, name + ": retiring, " + std::to_string(threads) + " threads");
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < threads; ++t)
+		{
+			workers.emplace_back([]()
+			{
+				for (int i = 0; i < 1000000; ++i)
+				{
+					typename Reclamation::Guard guard;
+					Reclamation::Retire(Memory::Allocate(32));
+				}
+				Reclamation::Flush();
+			});
+		}
+		for (std::thread& worker : workers)
+		{
+			worker.join();
+		}
+	}
+
+	// A reader keeps protecting the newest node while the writer retires the ones before,
+	// how many blocks wait to be freed is what the delay costs in memory
+	template <typename Reclamation>
+	void BenchReclamationDelay(Benchy::Report& report, std::string const& name)
+	{
+		std::atomic<void*> newest{ nullptr };
+		std::atomic<bool> done{ false };
+		std::thread reader([&newest, &done]()
+		{
+			while (!done)
+			{
+				typename Reclamation::Guard guard;
+				for (int i = 0; i < 100; ++i)
+				{
+					guard.Protect(newest);
+				}
+			}
+		});
+		uint64_t maxPending = 0;
+		uint64_t totalPending = 0;
+		{
+			Benchy::Stopwatch sw(report, name + ": retiring a million nodes next to a reader");
+			MemDesc previous = Memory::Allocate(32);
+			for (int i = 0; i < 1000000; ++i)
+			{
+				MemDesc const next = Memory::Allocate(32);
+				newest.store(next.ptr, std::memory_order_release);
+				Reclamation::Retire(previous);
+				previous = next;
+				uint64_t const pending = Reclamation::GetPendingCount();
+				maxPending = std::max(maxPending, pending);
+				totalPending += pending;
+			}
+			newest = nullptr;
+			Reclamation::Retire(previous);
+		}
+		done = true;
+		reader.join();
+		{
+			Benchy::Stopwatch sw(report, name + ": flushing what is left");
+			Reclamation::Flush();
+		}
+		std::cout << name << ": " << totalPending / 1000000 << " blocks waiting on average, " << maxPending << " at most" << std::endl;
+	}
+}
+
+// Retire throughput against freeing right away, and how long retired blocks wait
+void BenchReclamation()
+{
+	Benchy::Report report("Bench epoch and hazard pointer reclamation");
+	for (unsigned threads = 1; threads <= 8; threads *= 2)
+	{
+		for (int run = 0; run < 5; ++run)
+		{
+			{
+				Benchy::Stopwatch sw(report, "Memory::Deallocate right away, " + std::to_string(threads) + " threads");
+				std::vector<std::thread> workers;
+				for (unsigned t = 0; t < threads; ++t)
+				{
+					workers.emplace_back([]()
+					{
+						for (int i = 0; i < 1000000; ++i)
+						{
+							Memory::Deallocate(Memory::Allocate(32));
+						}
+					});
+				}
+				for (std::thread& worker : workers)
+				{
+					worker.join();
+				}
+			}
+			BenchRetire<EpochReclamation>(report, "EpochReclamation", threads);
+			BenchRetire<HazardPointerReclamation>(report, "HazardPointerReclamation", threads);
+		}
+	}
+	for (int run = 0; run < 5; ++run)
+	{
+		BenchReclamationDelay<EpochReclamation>(report, "EpochReclamation");
+		BenchReclamationDelay<HazardPointerReclamation>(report, "HazardPointerReclamation");
+	}
+}
+
+// Half a million blocks of 16 to 1024 bytes with a random half freed, the holes are what a HeapAllocator would keep
+void BenchCompaction()
+{
+	Benchy::Report report("Bench fragmentation and compaction");
+	constexpr size_t count = 500000;
+	std::random_device rd;
+	std::mt19937 gen(rd());
+	std::uniform_int_distribution<uint64_t> sizes(16, 1024);
+
+	for (int run = 0; run < 5; ++run)
+	{
+		auto heap = std::make_unique<CompactingHeap>(1_gB);
+		std::vector<CompactingHeap::Handle> handles(count);
+		{
+			Benchy::Stopwatch sw(report, "CompactingHeap: allocating half a million blocks");
+			for (CompactingHeap::Handle& handle : handles)
+			{
+				handle = heap->Allocate(sizes(gen));
+			}
+		}
+		std::shuffle(handles.begin(), handles.end(), gen);
+		{
+			Benchy::Stopwatch sw(report, "CompactingHeap: freeing half of them in random order");
+			for (size_t i = 0; i < count / 2; ++i)
+			{
+				heap->Deallocate(handles[i]);
+			}
+		}
+
+		uint64_t const usedBefore = heap->GetUsedBytes();
+		uint64_t const freeBefore = heap->GetFreeBytes();
+		uint64_t const residentBefore = GetResidentMemory();
+		int steps = 0;
+		{
+			Benchy::Stopwatch sw(report, "CompactingHeap: compacting in 100 us steps");
+			bool done = false;
+			while (!done)
+			{
+				Benchy::Stopwatch step(report, "CompactingHeap: one 100 us step");
+				done = heap->Compact(std::chrono::microseconds(100));
+				++steps;
+			}
+		}
+		std::cout << "Used " << usedBefore / 1_mB << " Mb with " << freeBefore / 1_mB << " Mb in holes, "
+			<< heap->GetUsedBytes() / 1_mB << " Mb after " << steps << " steps, resident "
+			<< residentBefore / 1_mB << " -> " << GetResidentMemory() / 1_mB << " Mb" << std::endl;
+
+		// Same pattern again, compacted in one go
+		for (size_t i = 0; i < count / 2; ++i)
+		{
+			handles[i] = heap->Allocate(sizes(gen));
+		}
+		std::shuffle(handles.begin(), handles.end(), gen);
+		for (size_t i = 0; i < count / 2; ++i)
+		{
+			heap->Deallocate(handles[i]);
+		}
+		{
+			Benchy::Stopwatch sw(report, "CompactingHeap: compacting in one go");
+			heap->Compact(std::chrono::nanoseconds::max());
+		}
+	}
+}
+
+namespace
+{
+	// Every thread allocates and frees a million 64 byte blocks, counting each one under the same tag
+	template <typename Body>
+	void BenchTagThreads(Benchy::Report& report, std::string const& name, unsigned threads, Body const& body)
+	{
+		Benchy::Stopwatch sw(report, name + ", " + std::to_string(threads) + " threads");
+		std::vector<std::thread> workers;
+		for (unsigned t = 0; t < threads; ++t)
+		{
+			workers.emplace_back([&body]()
+			{
+				for (int i = 0; i < 1000000; ++i)
+				{
+					body();
+				}
+			});
+		}
+		for (std::thread& worker : workers)
+		{
+			worker.join();
+		}
+	}
+}
+
+// Tag counts in per-thread shards against one atomic counter all threads add to.
+// Every variant goes through the same thread caches, the Untagged one is the baseline.
+void BenchMemoryTags()
+{
+	Benchy::Report report("Bench memory tag accounting");
+	MemoryTag const tag = RegisterMemoryTag("Bench tag");
+	std::atomic<int64_t> shared{ 0 };
+	for (unsigned threads = 1; threads <= 8; threads *= 2)
+	{
+		for (int run = 0; run < 5; ++run)
+		{
+			BenchTagThreads(report, "Memory::Allocate Untagged", threads, []()
+			{
+				Memory::Deallocate(Memory::Allocate(64));
+			});
+			BenchTagThreads(report, "Memory::Allocate with a tag", threads, [tag]()
+			{
+				Memory::Deallocate(Memory::Allocate(64, tag));
+			});
+			BenchTagThreads(report, "Memory::Allocate under ScopedMemoryTag", threads, [tag]()
+			{
+				ScopedMemoryTag guard(tag);
+				Memory::Deallocate(Memory::Allocate(64));
+			});
+			BenchTagThreads(report, "Memory::Allocate Untagged and a shared atomic counter", threads, [&shared]()
+			{
+				MemDesc desc = Memory::Allocate(64);
+				shared.fetch_add(desc.size, std::memory_order_relaxed);
+				shared.fetch_sub(desc.size, std::memory_order_relaxed);
+				Memory::Deallocate(desc);
+			});
+		}
+	}
+}
+
+void BenchMemory()
+{
+	BenchStdMap();
+	BenchBlockAllocators();
+	BenchDeepDeallocation();
+	BenchConcurrentFreelist();
+	BenchSharedHandles();
+	BenchSnapshotPublishing();
+	BenchReclamation();
+	BenchCompaction();
+	BenchMemoryTags();
+}
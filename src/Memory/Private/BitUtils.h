@@ -0,0 +1,66 @@
+#pragma once
+#include <cinttypes>
+
+#if defined ( _MSC_VER )
+#include <intrin.h>
+#endif
+
+namespace Memory
+{
+namespace Private
+{
+	// Undefined for 0
+	inline uint32_t CountTrailingZeros(uint64_t v)
+	{
+#if defined ( _MSC_VER )
+		unsigned long idx;
+		_BitScanForward64(&idx, v);
+		return idx;
+#else
+		return __builtin_ctzll(v);
+#endif
+	}
+
+	// Undefined for 0
+	inline uint32_t CountLeadingZeros(uint64_t v)
+	{
+#if defined ( _MSC_VER )
+		unsigned long idx;
+		_BitScanReverse64(&idx, v);
+		return 63 - idx;
+#else
+		return __builtin_clzll(v);
+#endif
+	}
+
+	inline uint32_t PopCount(uint64_t v)
+	{
+#if defined ( _MSC_VER )
+		return static_cast<uint32_t>(__popcnt64(v));
+#else
+		return __builtin_popcountll(v);
+#endif
+	}
+
+	// Undefined for 0
+	inline uint32_t Log2Floor(uint64_t v)
+	{
+		return 63 - CountLeadingZeros(v);
+	}
+
+	inline uint32_t Log2Ceil(uint64_t v)
+	{
+		return v <= 1 ? 0 : Log2Floor(v - 1) + 1;
+	}
+
+	constexpr uint32_t StaticLog2(uint64_t v)
+	{
+		return v <= 1 ? 0 : 1 + StaticLog2(v / 2);
+	}
+
+	inline uint64_t AlignUp(uint64_t v, uint64_t alignment)
+	{
+		return (v + alignment - 1) & ~(alignment - 1);
+	}
+} // namespace Private
+} // namespace Memory
@@ -0,0 +1,184 @@
+#pragma once
+#include "Allocators.h"
+#include "BitUtils.h"
+
+namespace Memory
+{
+
+/*
+Count blocks of BlockSize bytes in one chunk taken from Parent on first use.
+Occupancy is kept in a bitmap next to the allocator instead of in the blocks,
+so free blocks aren't touched until they are handed out, a free slot is found
+with a bit scan of 64 blocks at a time and free blocks are counted with popcount.
+Owns() is an address range check, DeallocateAll() frees every block at once.
+
+Requests bigger than BlockSize fail, put it in front of a FallbackAllocator.
+The chunk is aligned to the biggest power of two dividing BlockSize (up to a page),
+and so is every block.
+*/
+template <typename Parent, size_t BlockSize, size_t Count>
+class BitmappedBlockAllocator
+{
+public:
+	static constexpr uint64_t BlockAlignment = (BlockSize & (~BlockSize + 1)) < 4096 ? (BlockSize & (~BlockSize + 1)) : 4096;
+
+	static_assert(BlockSize > 0 && Count > 0, "Need at least one block");
+
+	BitmappedBlockAllocator()
+	{
+		SetAllFree();
+	}
+
+	~BitmappedBlockAllocator()
+	{
+		if (chunk.ptr)
+		{
+			parent.Deallocate(chunk);
+		}
+	}
+
+	BitmappedBlockAllocator(BitmappedBlockAllocator&&) = delete;
+	BitmappedBlockAllocator(BitmappedBlockAllocator const&) = delete;
+	BitmappedBlockAllocator& operator=(BitmappedBlockAllocator&&) = delete;
+	BitmappedBlockAllocator& operator=(BitmappedBlockAllocator const&) = delete;
+
+	MemDesc Allocate(uint64_t size)
+	{
+		Private::LatencySample sample(m_stats, false);
+		if (size == 0 || size > BlockSize)
+		{
+			return { nullptr, 0 };
+		}
+		void* ptr = AllocateBlock();
+		return { ptr, ptr ? size : 0 };
+	}
+
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		Private::LatencySample sample(m_stats, false);
+		uint64_t const alignedSize = Private::AlignUp(size, alignment);
+		if (size == 0 || alignedSize > BlockSize || alignment > BlockAlignment)
+		{
+			return { nullptr, 0 };
+		}
+		void* ptr = AllocateBlock();
+		return { ptr, ptr ? alignedSize : 0 };
+	}
+
+	// Blocks are resized in place up to BlockSize and never move
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize)
+	{
+		if (newSize > BlockSize)
+		{
+			return { nullptr, 0 };
+		}
+		return { desc.ptr, newSize };
+	}
+
+	bool Expand(MemDesc& desc, uint64_t delta)
+	{
+		if (desc.size + delta > BlockSize)
+		{
+			return false;
+		}
+		desc.size += delta;
+		return true;
+	}
+
+	uint64_t GoodSize(uint64_t size) const { return size <= BlockSize ? BlockSize : size; }
+
+	void Deallocate(MemDesc desc)
+	{
+		Private::LatencySample sample(m_stats, true);
+		MY_ASSERT(Owns(desc), "Bitmapped block allocator should own memory you are trying to free");
+		uint64_t const idx = (reinterpret_cast<uint8_t*>(desc.ptr) - blocks) / BlockSize;
+		MY_ASSERT(!(freeBits[idx / 64] & (1ull << (idx % 64))), "Block is freed twice");
+		Private::AddDeallocateStat(m_stats, BlockSize);
+		freeBits[idx / 64] |= 1ull << (idx % 64);
+		// The block just freed is still in cache, hand it out next
+		hint = idx / 64;
+	}
+
+	void DeallocateAll()
+	{
+		Private::AddRewindStat(m_stats, (Count - FreeBlocks()) * BlockSize);
+		SetAllFree();
+	}
+
+	bool Owns(MemDesc desc) const
+	{
+		return blocks && desc.ptr >= blocks && desc.ptr < blocks + BlockSize * Count;
+	}
+
+	uint64_t FreeBlocks() const
+	{
+		uint64_t count = 0;
+		for (uint64_t word : freeBits)
+		{
+			count += Private::PopCount(word);
+		}
+		return count;
+	}
+
+	Private::AllocatorStatsReportPtr GetStats() const
+	{
+		auto report = std::make_unique<Private::AllocatorStatsReport>();
+		report->stats = m_stats.Read();
+		report->stats.freeBytes = FreeBlocks() * BlockSize;
+		report->stats.largestFreeBlock = report->stats.freeBytes ? BlockSize : 0;
+		report->nested.push_back(std::move(parent.GetStats()));
+		return std::move(report);
+	}
+
+private:
+	static constexpr uint64_t Words = (Count + 63) / 64;
+
+	void SetAllFree()
+	{
+		for (uint64_t& word : freeBits)
+		{
+			word = ~0ull;
+		}
+		if (Count % 64)
+		{
+			freeBits[Words - 1] = (1ull << (Count % 64)) - 1;
+		}
+		hint = 0;
+	}
+
+	void* AllocateBlock()
+	{
+		if (!blocks)
+		{
+			chunk = parent.Allocate(BlockSize * Count, BlockAlignment);
+			blocks = reinterpret_cast<uint8_t*>(chunk.ptr);
+			if (!blocks)
+			{
+				return nullptr;
+			}
+		}
+		uint64_t word = hint;
+		for (uint64_t i = 0; i < Words; ++i)
+		{
+			if (freeBits[word])
+			{
+				uint64_t const idx = word * 64 + Private::CountTrailingZeros(freeBits[word]);
+				freeBits[word] &= freeBits[word] - 1;
+				hint = word;
+				Private::AddAllocationStat(m_stats, BlockSize);
+				return blocks + idx * BlockSize;
+			}
+			word = word + 1 == Words ? 0 : word + 1;
+		}
+		return nullptr;
+	}
+
+	Parent parent;
+	MemDesc chunk;
+	uint8_t* blocks = nullptr;
+	uint64_t hint = 0;
+	uint64_t freeBits[Words];
+	Private::AllocatorCounters m_stats = "BitmappedBlockAllocator";
+};
+
+} // namespace Memory
@@ -0,0 +1,296 @@
+#pragma once
+#include "Allocators.h"
+#include "HierarchicalBitmap.h"
+#include "Memory.h"
+#include "VirtualMemory.h"
+
+#include <algorithm>
+
+namespace Memory
+{
+
+/*
+Buddy allocator over a Size bytes region.
+Blocks are powers of two from MinBlock up to Size. Level 0 is the whole region
+and every next level halves the block size. The free list of each level is a
+HierarchicalBitmap of its blocks, so looking for a free block, splitting it and
+merging a freed block with its free buddies are all O(log n).
+
+The region is reserved address space. Free blocks are found lowest address
+first, so it is committed up to a high-water mark that grows in
+CommitGranularity steps. Once PurgeThreshold bytes of page-sized or bigger
+blocks have been freed, the pages of all free blocks are given back to the OS.
+
+A block is aligned to its size, up to the alignment of the region itself,
+which is 2 Mb or Size if that is smaller.
+*/
+template <size_t Size, size_t MinBlock>
+class BuddyAllocator
+{
+public:
+	static_assert(Size && (Size & (Size - 1)) == 0, "Size should be a power of two");
+	static_assert(MinBlock >= 16 && (MinBlock & (MinBlock - 1)) == 0, "MinBlock should be a power of two, at least 16 bytes");
+	static_assert(MinBlock <= Size, "MinBlock should fit in Size");
+
+	static constexpr uint64_t CommitGranularity = 64_kB;
+	static constexpr uint64_t PurgeThreshold = 32_mB;
+	static constexpr uint64_t RegionAlignment = Size < 2_mB ? Size : 2_mB;
+
+	BuddyAllocator(BuddyAllocator&&) = delete;
+	BuddyAllocator(BuddyAllocator const&) = delete;
+	BuddyAllocator& operator=(BuddyAllocator&&) = delete;
+	BuddyAllocator& operator=(BuddyAllocator const&) = delete;
+
+	BuddyAllocator()
+		: reservedSize(Private::AlignUp(Size, Private::GetPageSize()))
+	{
+		heap = reinterpret_cast<uint8_t*>(Private::ReserveAddressSpace(reservedSize, std::max<uint64_t>(RegionAlignment, Private::GetPageSize())));
+		MY_ASSERT(heap, "Failed to reserve address space");
+		committedEnd = heap;
+		for (uint32_t level = 0; level < LevelCount; ++level)
+		{
+			freeBlocks[level] = Private::HierarchicalBitmap(1ull << level);
+		}
+		freeBlocks[0].Set(0);
+	}
+
+	~BuddyAllocator()
+	{
+		if (heap)
+		{
+			if (committedEnd > heap)
+			{
+				Private::GetPageMap().Unregister(heap, committedEnd - heap);
+			}
+			Private::ReleaseAddressSpace(heap, reservedSize);
+		}
+	}
+
+	MemDesc Allocate(uint64_t size)
+	{
+		return Allocate(size, 1);
+	}
+
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		Private::LatencySample sample(m_stats, false);
+		uint64_t const alignedSize = Private::AlignUp(size, alignment);
+		if (size == 0 || alignedSize > Size || alignment > RegionAlignment || !heap)
+		{
+			return { nullptr, 0 };
+		}
+
+		// Blocks are aligned to their size, so a block big enough is aligned enough
+		uint32_t const level = LevelOf(alignedSize);
+		uint32_t freeLevel = level;
+		uint64_t idx = freeBlocks[freeLevel].FindFirstSet();
+		while (idx == Private::HierarchicalBitmap::NotFound && freeLevel > 0)
+		{
+			idx = freeBlocks[--freeLevel].FindFirstSet();
+		}
+		if (idx == Private::HierarchicalBitmap::NotFound)
+		{
+			return { nullptr, 0 };
+		}
+
+		uint64_t const blockSize = BlockSize(level);
+		if (!CommitUpTo(heap + (idx << (level - freeLevel)) * blockSize + blockSize))
+		{
+			return { nullptr, 0 };
+		}
+
+		// Split the free block down to the requested level, freeing the right halves
+		freeBlocks[freeLevel].Clear(idx);
+		while (freeLevel < level)
+		{
+			++freeLevel;
+			idx *= 2;
+			freeBlocks[freeLevel].Set(idx + 1);
+		}
+
+		freeBytes -= blockSize;
+		Private::AddAllocationStat(m_stats, blockSize);
+		Private::AddPaddingStat(m_stats, alignedSize - size);
+		return { heap + idx * blockSize, alignedSize };
+	}
+
+	uint64_t GoodSize(uint64_t size) const
+	{
+		return size && size <= Size ? BlockSize(LevelOf(size)) : size;
+	}
+
+	// A block grows in place while it is the left half of a block whose right half is free
+	bool Expand(MemDesc& desc, uint64_t delta)
+	{
+		uint64_t const newSize = desc.size + delta;
+		if (newSize > Size)
+		{
+			return false;
+		}
+		uint32_t const level = LevelOf(desc.size);
+		uint32_t const newLevel = LevelOf(newSize);
+		if (newLevel < level)
+		{
+			uint64_t idx = (reinterpret_cast<uint8_t*>(desc.ptr) - heap) / BlockSize(level);
+			for (uint32_t l = level, i = 0; l > newLevel; --l, ++i)
+			{
+				uint64_t const levelIdx = idx >> i;
+				if ((levelIdx & 1) || !freeBlocks[l].Test(levelIdx + 1))
+				{
+					return false;
+				}
+			}
+			if (!CommitUpTo(reinterpret_cast<uint8_t*>(desc.ptr) + BlockSize(newLevel)))
+			{
+				return false;
+			}
+			for (uint32_t l = level; l > newLevel; --l, idx /= 2)
+			{
+				freeBlocks[l].Clear(idx + 1);
+			}
+			freeBytes -= BlockSize(newLevel) - BlockSize(level);
+			Private::AddResizeStat(m_stats, BlockSize(level), BlockSize(newLevel));
+		}
+		desc.size = newSize;
+		return true;
+	}
+
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize)
+	{
+		if (newSize > desc.size)
+		{
+			if (Expand(desc, newSize - desc.size))
+			{
+				return desc;
+			}
+			return Private::ReallocateByCopy(*this, *this, desc, newSize);
+		}
+
+		// Shrink by freeing right halves, they can't merge as their left buddies are in use
+		uint32_t level = LevelOf(desc.size);
+		uint32_t const newLevel = LevelOf(newSize);
+		if (newLevel > level)
+		{
+			uint64_t idx = (reinterpret_cast<uint8_t*>(desc.ptr) - heap) / BlockSize(level);
+			Private::AddResizeStat(m_stats, BlockSize(level), BlockSize(newLevel));
+			freeBytes += BlockSize(level) - BlockSize(newLevel);
+			while (level < newLevel)
+			{
+				++level;
+				idx *= 2;
+				freeBlocks[level].Set(idx + 1);
+			}
+		}
+		return { desc.ptr, newSize };
+	}
+
+	void Deallocate(MemDesc desc)
+	{
+		Private::LatencySample sample(m_stats, true);
+		MY_ASSERT(Owns(desc), "Buddy allocator should own memory you are trying to free");
+		uint32_t level = LevelOf(desc.size);
+		uint64_t const blockSize = BlockSize(level);
+		uint64_t idx = (reinterpret_cast<uint8_t*>(desc.ptr) - heap) / blockSize;
+		freeBytes += blockSize;
+		Private::AddDeallocateStat(m_stats, blockSize);
+		if (blockSize >= Private::GetPageSize())
+		{
+			dirtyBytes += blockSize;
+		}
+
+		// Merge with free buddies on the way up
+		while (level > 0 && freeBlocks[level].Test(idx ^ 1))
+		{
+			freeBlocks[level].Clear(idx ^ 1);
+			idx /= 2;
+			--level;
+		}
+		freeBlocks[level].Set(idx);
+
+		if (dirtyBytes >= PurgeThreshold)
+		{
+			PurgeFreeBlocks();
+		}
+	}
+
+	bool Owns(MemDesc desc) const
+	{
+		return desc.ptr >= heap && desc.ptr < heap + Size;
+	}
+
+	// Committed pages are in the page map
+	bool Owns(MemDesc, void const* owner) const { return owner == this; }
+
+	Private::AllocatorStatsReportPtr GetStats() const
+	{
+		auto report = std::make_unique<Private::AllocatorStatsReport>();
+		report->stats = m_stats.Read();
+		report->stats.freeBytes = freeBytes;
+		for (uint32_t level = 0; level < LevelCount; ++level)
+		{
+			if (freeBlocks[level].Any())
+			{
+				report->stats.largestFreeBlock = BlockSize(level);
+				break;
+			}
+		}
+		return std::move(report);
+	}
+
+private:
+	bool CommitUpTo(uint8_t* end)
+	{
+		if (end > committedEnd)
+		{
+			uint8_t* const newCommittedEnd = heap + std::min<uint64_t>(Private::AlignUp(end - heap, CommitGranularity), reservedSize);
+			if (!Private::CommitPages(committedEnd, newCommittedEnd - committedEnd))
+			{
+				return false;
+			}
+			Private::GetPageMap().Register(committedEnd, newCommittedEnd - committedEnd, this);
+			committedEnd = newCommittedEnd;
+		}
+		return true;
+	}
+
+	void PurgeFreeBlocks()
+	{
+		uint64_t const pageSize = Private::GetPageSize();
+		for (uint32_t level = 0; level < LevelCount && BlockSize(level) >= pageSize; ++level)
+		{
+			uint64_t const blockSize = BlockSize(level);
+			Private::HierarchicalBitmap const& blocks = freeBlocks[level];
+			for (uint64_t idx = blocks.FindFirstSet(); idx != Private::HierarchicalBitmap::NotFound; idx = blocks.FindNextSet(idx + 1))
+			{
+				uint8_t* const begin = heap + idx * blockSize;
+				if (begin >= committedEnd)
+				{
+					break;
+				}
+				Private::PurgePages(begin, std::min<uint64_t>(blockSize, committedEnd - begin), false);
+			}
+		}
+		dirtyBytes = 0;
+	}
+
+	static constexpr uint32_t MaxLevel = Private::StaticLog2(Size / MinBlock);
+	static constexpr uint32_t LevelCount = MaxLevel + 1;
+
+	static constexpr uint64_t BlockSize(uint32_t level) { return Size >> level; }
+
+	static uint32_t LevelOf(uint64_t size)
+	{
+		uint32_t const blockLog = Private::Log2Ceil(size < MinBlock ? MinBlock : size);
+		return Private::StaticLog2(Size) - blockLog;
+	}
+
+	uint64_t reservedSize = 0;
+	uint8_t* heap = nullptr;
+	uint8_t* committedEnd = nullptr;
+	uint64_t freeBytes = Size;
+	uint64_t dirtyBytes = 0;
+	Private::HierarchicalBitmap freeBlocks[LevelCount];
+	Private::AllocatorCounters m_stats = "BuddyAllocator";
+};
+
+} // namespace Memory
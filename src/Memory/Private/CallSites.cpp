@@ -0,0 +1,231 @@
+#include "CallSites.h"
+#include "AllocationTrace.h"
+#include "HeapProfile.h"
+#include "MemoryTags.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+namespace Memory
+{
+namespace Private
+{
+	std::atomic<uint32_t> CallSiteRouteCount{ 0 };
+
+	// Sites and routes are linked and made under it, allocating never takes it
+	static std::mutex& GetCallSitesMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	static CallSite* CallSites = nullptr;
+	static uint32_t CallSiteCount = 0;
+
+	// Never destroyed, routed blocks can still be freed by static destructors and exiting threads
+	alignas(CallSiteRoute) static uint8_t RouteStorage[MaxCallSiteRoutes][sizeof(CallSiteRoute)];
+	// Routes of the last profile loaded, the others only take back their blocks
+	static bool RouteInProfile[MaxCallSiteRoutes] = {};
+
+	CallSiteRoute& GetCallSiteRoute(uint32_t index)
+	{
+		return *reinterpret_cast<CallSiteRoute*>(RouteStorage[index]);
+	}
+
+	// 1 + index of the route of function and line, 0 when there's none
+	static uint32_t FindRouteIndex(char const* function, uint32_t line)
+	{
+		uint32_t const count = CallSiteRouteCount.load(std::memory_order_relaxed);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			CallSiteRoute const& route = GetCallSiteRoute(i);
+			if (route.line == line && route.function == function)
+			{
+				return i + 1;
+			}
+		}
+		return 0;
+	}
+
+	static uint32_t ResolveRoute(char const* function, uint32_t line)
+	{
+		uint32_t const index = FindRouteIndex(function, line);
+		return index && RouteInProfile[index - 1] ? index : 0;
+	}
+
+	// The current tag was charged sizeInBytes for desc
+	static MemDesc AllocateRouted(MemDesc desc, uint64_t sizeInBytes, uint64_t alignment)
+	{
+		MemoryTag const tag = GetCurrentTag();
+		if (desc.size != sizeInBytes)
+		{
+			AdjustTag(tag, static_cast<int64_t>(desc.size - sizeInBytes));
+		}
+		if (tag != MemoryTag::Untagged)
+		{
+			SetBlockTag(desc.ptr, tag);
+		}
+		ProfileAllocation(desc.ptr, sizeInBytes);
+		Trace(TraceEventType::Allocate, desc.ptr, sizeInBytes, alignment);
+		return desc;
+	}
+
+	static void CountAllocation(CallSite& site, uint64_t sizeInBytes)
+	{
+		site.count.store(site.count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		site.bytes.store(site.bytes.load(std::memory_order_relaxed) + sizeInBytes, std::memory_order_relaxed);
+	}
+} // namespace Private
+
+CallSite::CallSite(char const* file, uint32_t line, char const* function)
+	: file(file)
+	, function(function)
+	, line(line)
+{
+	std::lock_guard<std::mutex> lock(Private::GetCallSitesMutex());
+	id = Private::CallSiteCount++;
+	route.store(Private::ResolveRoute(function, line), std::memory_order_relaxed);
+	next = Private::CallSites;
+	Private::CallSites = this;
+}
+
+MemDesc Allocate(uint64_t sizeInBytes, CallSite& site)
+{
+	Private::CountAllocation(site, sizeInBytes);
+	uint32_t const route = site.route.load(std::memory_order_relaxed);
+	if (route && sizeInBytes && sizeInBytes <= Private::CallSiteRoute::MaxSize)
+	{
+		if (!Private::ChargeTag(Private::GetCurrentTag(), sizeInBytes))
+		{
+			return {};
+		}
+		MemDesc desc = Private::GetCallSiteRoute(route - 1).Allocate(sizeInBytes);
+		if (desc.ptr)
+		{
+			return Private::AllocateRouted(desc, sizeInBytes, 0);
+		}
+		Private::AdjustTag(Private::GetCurrentTag(), -static_cast<int64_t>(sizeInBytes));
+	}
+	return Allocate(sizeInBytes);
+}
+
+MemDesc Allocate(uint64_t sizeInBytes, uint64_t alignment, CallSite& site)
+{
+	MY_ASSERT(alignment && (alignment & (alignment - 1)) == 0, "Alignment should be a power of two");
+	Private::CountAllocation(site, sizeInBytes);
+	uint32_t const route = site.route.load(std::memory_order_relaxed);
+	if (route && sizeInBytes && Private::AlignUp(sizeInBytes, alignment) <= Private::CallSiteRoute::MaxSize)
+	{
+		if (!Private::ChargeTag(Private::GetCurrentTag(), sizeInBytes))
+		{
+			return {};
+		}
+		MemDesc desc = Private::GetCallSiteRoute(route - 1).Allocate(sizeInBytes, alignment);
+		if (desc.ptr)
+		{
+			return Private::AllocateRouted(desc, sizeInBytes, alignment);
+		}
+		Private::AdjustTag(Private::GetCurrentTag(), -static_cast<int64_t>(sizeInBytes));
+	}
+	return Allocate(sizeInBytes, alignment);
+}
+
+bool WriteCallSiteProfile(char const* path)
+{
+	std::vector<CallSite*> sites;
+	{
+		std::lock_guard<std::mutex> lock(Private::GetCallSitesMutex());
+		for (CallSite* it = Private::CallSites; it; it = it->next)
+		{
+			if (it->count.load(std::memory_order_relaxed))
+			{
+				sites.push_back(it);
+			}
+		}
+	}
+	std::stable_sort(sites.begin(), sites.end(), [](CallSite const* a, CallSite const* b)
+	{
+		return a->count.load(std::memory_order_relaxed) > b->count.load(std::memory_order_relaxed);
+	});
+
+	FILE* file = std::fopen(path, "w");
+	if (!file)
+	{
+		return false;
+	}
+	std::fprintf(file, "# allocations\tbytes\tline\tfile\tfunction\n");
+	for (CallSite const* site : sites)
+	{
+		std::fprintf(file, "%" PRIu64 "\t%" PRIu64 "\t%u\t%s\t%s\n", site->count.load(std::memory_order_relaxed), site->bytes.load(std::memory_order_relaxed), site->line, site->file, site->function);
+	}
+	return std::fclose(file) == 0;
+}
+
+bool LoadCallSiteProfile(char const* path, uint32_t maxRoutes)
+{
+	FILE* file = std::fopen(path, "r");
+	if (!file)
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(Private::GetCallSitesMutex());
+	std::fill(std::begin(Private::RouteInProfile), std::end(Private::RouteInProfile), false);
+	uint32_t routes = 0;
+	char buffer[4096];
+	while (routes < maxRoutes && std::fgets(buffer, sizeof(buffer), file))
+	{
+		buffer[std::strcspn(buffer, "\r\n")] = 0;
+		if (buffer[0] == '#' || buffer[0] == 0)
+		{
+			continue;
+		}
+		// allocations, bytes, line, file, function; the function is the rest of the line
+		char* fields[5] = { buffer };
+		uint32_t fieldCount = 1;
+		for (char* it = buffer; *it && fieldCount < 5; ++it)
+		{
+			if (*it == '\t')
+			{
+				*it = 0;
+				fields[fieldCount++] = it + 1;
+			}
+		}
+		if (fieldCount < 5)
+		{
+			continue;
+		}
+		uint32_t const line = static_cast<uint32_t>(std::strtoul(fields[2], nullptr, 10));
+		uint32_t index = Private::FindRouteIndex(fields[4], line);
+		if (!index)
+		{
+			uint32_t const count = Private::CallSiteRouteCount.load(std::memory_order_relaxed);
+			if (count == Private::MaxCallSiteRoutes)
+			{
+				continue;
+			}
+			new (Private::RouteStorage[count]) Private::CallSiteRoute(fields[4], line);
+			Private::CallSiteRouteCount.store(count + 1, std::memory_order_release);
+			index = count + 1;
+		}
+		if (!Private::RouteInProfile[index - 1])
+		{
+			Private::RouteInProfile[index - 1] = true;
+			++routes;
+		}
+	}
+	std::fclose(file);
+
+	for (CallSite* it = Private::CallSites; it; it = it->next)
+	{
+		it->route.store(Private::ResolveRoute(it->function, it->line), std::memory_order_relaxed);
+	}
+	return true;
+}
+
+} // namespace Memory
@@ -0,0 +1,71 @@
+#pragma once
+#include "LockedAllocator.h"
+#include "Memory.h"
+#include "PageMap.h"
+#include "RegionAllocator.h"
+#include "SlabAllocator.h"
+
+#include <atomic>
+#include <string>
+
+namespace Memory
+{
+namespace Private
+{
+	constexpr uint32_t MaxCallSiteRoutes = 16;
+
+	/*
+	Pool of the sites a profile matched to one function and line. Only sizes
+	of the slab classes are served, bigger ones go to the global allocator.
+	Its pages are in the page map, Memory::Deallocate() finds its blocks there.
+	Only address space is reserved, pages are committed as the site uses them.
+	*/
+	class CallSiteRoute : public LockedAllocator<SlabAllocator<RegionAllocator<1_gB>>>
+	{
+	public:
+		static constexpr uint64_t MaxSize = SizeClasses::MaxSize;
+
+		CallSiteRoute(std::string function, uint32_t line)
+			: function(std::move(function))
+			, line(line)
+		{
+		}
+
+		std::string const function;
+		uint32_t const line;
+	};
+
+	extern std::atomic<uint32_t> CallSiteRouteCount;
+
+	// index below CallSiteRouteCount
+	CallSiteRoute& GetCallSiteRoute(uint32_t index);
+
+	// owner is what the page map has for desc
+	inline CallSiteRoute* FindCallSiteRoute(MemDesc desc, void const* owner)
+	{
+		uint32_t const count = CallSiteRouteCount.load(std::memory_order_acquire);
+		if (!owner)
+		{
+			return nullptr;
+		}
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			CallSiteRoute& route = GetCallSiteRoute(i);
+			if (route.Owns(desc, owner))
+			{
+				return &route;
+			}
+		}
+		return nullptr;
+	}
+
+	inline CallSiteRoute* FindCallSiteRoute(MemDesc desc)
+	{
+		if (!CallSiteRouteCount.load(std::memory_order_acquire) || !desc.ptr)
+		{
+			return nullptr;
+		}
+		return FindCallSiteRoute(desc, GetPageMap().Lookup(desc.ptr));
+	}
+} // namespace Private
+} // namespace Memory
@@ -0,0 +1,218 @@
+#include "CompactingHeap.h"
+#include "AllocatorStats.h"
+#include "BitUtils.h"
+#include "VirtualMemory.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace Memory
+{
+
+CompactingHeap::CompactingHeap(uint64_t size)
+	: capacity(size)
+	, reservedSize(Private::AlignUp(size, Private::GetPageSize()))
+	, m_stats(std::make_unique<Private::AllocatorCounters>("CompactingHeap"))
+{
+	region = reinterpret_cast<uint8_t*>(Private::ReserveAddressSpace(reservedSize, Private::GetPageSize()));
+	MY_ASSERT(region, "Failed to reserve address space");
+	top = committedEnd = touchedEnd = region;
+}
+
+CompactingHeap::~CompactingHeap()
+{
+	if (region)
+	{
+		Private::ReleaseAddressSpace(region, reservedSize);
+	}
+	std::free(table);
+}
+
+CompactingHeap::Handle CompactingHeap::Allocate(uint64_t size)
+{
+	Private::LatencySample sample(*m_stats, false);
+	uint64_t const blockSize = Private::AlignUp(size + sizeof(BlockHeader), Granularity);
+	if (Room() < blockSize && holeBytes)
+	{
+		while (!Compact(std::chrono::nanoseconds::max()))
+		{
+		}
+	}
+	if (!region || Room() < blockSize || !CommitUpTo(top + blockSize))
+	{
+		return {};
+	}
+
+	uint32_t index = freeEntry;
+	if (index != NoEntry)
+	{
+		freeEntry = table[index].nextFree;
+	}
+	else
+	{
+		if (entryCount == entryCapacity && !GrowTable())
+		{
+			return {};
+		}
+		index = entryCount++;
+		table[index].generation = 0;
+	}
+	Entry& entry = table[index];
+	++entry.generation;
+	entry.block = top;
+
+	BlockHeader* header = reinterpret_cast<BlockHeader*>(top);
+	header->size = blockSize;
+	header->entry = index;
+	top += blockSize;
+	Private::AddAllocationStat(*m_stats, blockSize);
+	Private::AddPaddingStat(*m_stats, blockSize - size);
+	return { index, entry.generation };
+}
+
+void CompactingHeap::Deallocate(Handle handle)
+{
+	Private::LatencySample sample(*m_stats, true);
+	MY_ASSERT(IsValid(handle), "Freeing a stale handle");
+	Entry& entry = table[handle.GetIndex()];
+	BlockHeader* header = reinterpret_cast<BlockHeader*>(entry.block);
+	header->entry = FreeBlock;
+	Private::AddDeallocateStat(*m_stats, header->size);
+	// The last block goes back right away unless a pass is walking the heap
+	if (!scan && entry.block + header->size == top)
+	{
+		top = entry.block;
+	}
+	else
+	{
+		holeBytes += header->size;
+	}
+
+	entry.generation = (entry.generation + 1) & Handle::GenerationMask;
+	if (entry.generation)
+	{
+		entry.nextFree = freeEntry;
+		freeEntry = handle.GetIndex();
+	}
+}
+
+bool CompactingHeap::Compact(std::chrono::nanoseconds budget)
+{
+	if (!scan)
+	{
+		if (!holeBytes)
+		{
+			return true;
+		}
+		scan = destination = region;
+	}
+
+	auto const start = std::chrono::steady_clock::now();
+	uint64_t walked = 0;
+	while (scan < top)
+	{
+		BlockHeader* header = reinterpret_cast<BlockHeader*>(scan);
+		uint64_t const size = header->size;
+		if (header->entry != FreeBlock)
+		{
+			if (destination != scan)
+			{
+				std::memmove(destination, scan, size);
+				table[header->entry].block = destination;
+				movedBytes += size;
+			}
+			destination += size;
+		}
+		scan += size;
+		walked += size;
+		if (walked >= BudgetCheckBytes)
+		{
+			walked = 0;
+			if (std::chrono::steady_clock::now() - start >= budget)
+			{
+				break;
+			}
+		}
+	}
+
+	if (scan < top)
+	{
+		// Keeps the heap walkable, the gap reads as one free block
+		if (destination < scan)
+		{
+			BlockHeader* gap = reinterpret_cast<BlockHeader*>(destination);
+			gap->size = scan - destination;
+			gap->entry = FreeBlock;
+		}
+		return false;
+	}
+
+	holeBytes -= top - destination;
+	top = destination;
+	scan = destination = nullptr;
+	PurgeTail();
+	return holeBytes == 0;
+}
+
+Private::AllocatorStatsReportPtr CompactingHeap::GetStats() const
+{
+	auto report = std::make_unique<Private::AllocatorStatsReport>();
+	report->stats = m_stats->Read();
+	report->stats.freeBytes = holeBytes;
+	for (uint8_t* it = region; it < top; it += reinterpret_cast<BlockHeader*>(it)->size)
+	{
+		BlockHeader const* header = reinterpret_cast<BlockHeader*>(it);
+		if (header->entry == FreeBlock)
+		{
+			report->stats.largestFreeBlock = std::max(report->stats.largestFreeBlock, header->size);
+		}
+	}
+	return report;
+}
+
+// Entries are found by index, the table can move
+bool CompactingHeap::GrowTable()
+{
+	uint64_t const newCapacity = entryCapacity ? entryCapacity * 2 : 1024;
+	if (newCapacity > Handle::IndexMask)
+	{
+		return false;
+	}
+	Entry* grown = static_cast<Entry*>(std::realloc(table, newCapacity * sizeof(Entry)));
+	if (!grown)
+	{
+		return false;
+	}
+	table = grown;
+	entryCapacity = newCapacity;
+	return true;
+}
+
+bool CompactingHeap::CommitUpTo(uint8_t* end)
+{
+	if (end > committedEnd)
+	{
+		uint8_t* const newCommittedEnd = region + std::min<uint64_t>(Private::AlignUp(end - region, CommitGranularity), reservedSize);
+		if (!Private::CommitPages(committedEnd, newCommittedEnd - committedEnd))
+		{
+			return false;
+		}
+		committedEnd = newCommittedEnd;
+	}
+	touchedEnd = std::max(touchedEnd, end);
+	return true;
+}
+
+// Compaction is when memory is handed back, so the pages go right away
+void CompactingHeap::PurgeTail()
+{
+	uint8_t* const purgeBegin = region + Private::AlignUp(top - region, Private::GetPageSize());
+	if (touchedEnd > purgeBegin)
+	{
+		Private::PurgePages(purgeBegin, Private::AlignUp(touchedEnd - purgeBegin, Private::GetPageSize()), false);
+		touchedEnd = purgeBegin;
+	}
+}
+
+} // namespace Memory
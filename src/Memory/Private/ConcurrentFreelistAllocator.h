@@ -0,0 +1,230 @@
+#pragma once
+#include "Allocators.h"
+#include "BitUtils.h"
+
+#include <atomic>
+#include <mutex>
+
+namespace Memory
+{
+
+/*
+FreelistAllocator that any number of threads can push blocks to and pop them from without a lock.
+The list is a Treiber stack. Its head keeps a 16 bit version above the 48 bits of the pointer,
+and every pop and push bumps it, so a pop that saw a head which was popped and pushed back
+in the meantime (ABA) fails its compare exchange instead of corrupting the list.
+A popping thread may read the link of a block another thread just took, that block is still
+mapped as list blocks only go back to Parent on destruction, and the stale link fails the exchange.
+
+Parent is only touched with the mutex held: to refill an empty list with BatchSize blocks
+and to serve other sizes. List blocks are aligned to the biggest power of two dividing BlockSize.
+*/
+template <typename Parent, size_t BlockSize, size_t BatchSize = 32>
+class ConcurrentFreelistAllocator
+{
+public:
+	static constexpr uint64_t BlockAlignment = (BlockSize & (~BlockSize + 1)) < 4096 ? (BlockSize & (~BlockSize + 1)) : 4096;
+
+	static_assert(BlockSize >= sizeof(void*), "Blocks should fit the list node");
+	static_assert(BatchSize >= 1, "Refill at least one block");
+
+	ConcurrentFreelistAllocator() = default;
+	ConcurrentFreelistAllocator(ConcurrentFreelistAllocator&&) = delete;
+	ConcurrentFreelistAllocator(ConcurrentFreelistAllocator const&) = delete;
+	ConcurrentFreelistAllocator& operator=(ConcurrentFreelistAllocator&&) = delete;
+	ConcurrentFreelistAllocator& operator=(ConcurrentFreelistAllocator const&) = delete;
+
+	// Other threads should be done with the allocator by now
+	~ConcurrentFreelistAllocator()
+	{
+		Node* node = Pointer(head.load(std::memory_order_acquire));
+		while (node)
+		{
+			Node* next = node->next.load(std::memory_order_relaxed);
+			parent.Deallocate({ node, BlockSize });
+			node = next;
+		}
+	}
+
+	MemDesc Allocate(uint64_t size)
+	{
+		Private::LatencySample sample(m_stats, false);
+		if (size != BlockSize)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return parent.Allocate(size);
+		}
+		void* ptr = AllocateBlock();
+		return { ptr, ptr ? size : 0 };
+	}
+
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		Private::LatencySample sample(m_stats, false);
+		uint64_t const alignedSize = Private::AlignUp(size, alignment);
+		if (alignedSize != BlockSize || alignment > BlockAlignment)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return parent.Allocate(size, alignment);
+		}
+		void* ptr = AllocateBlock();
+		return { ptr, ptr ? alignedSize : 0 };
+	}
+
+	// Blocks of other sizes belong to Parent, list blocks can only move
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize)
+	{
+		if (desc.size == BlockSize || newSize == BlockSize)
+		{
+			return Private::ReallocateByCopy(*this, *this, desc, newSize);
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return parent.Reallocate(desc, newSize);
+	}
+
+	bool Expand(MemDesc& desc, uint64_t delta)
+	{
+		if (desc.size == BlockSize || desc.size + delta == BlockSize)
+		{
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return parent.Expand(desc, delta);
+	}
+
+	uint64_t GoodSize(uint64_t size) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return parent.GoodSize(size);
+	}
+
+	void Deallocate(MemDesc desc)
+	{
+		Private::LatencySample sample(m_stats, true);
+		if (desc.size != BlockSize)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			parent.Deallocate(desc);
+			return;
+		}
+		Private::AddDeallocateStat(m_stats, BlockSize);
+		Node* node = reinterpret_cast<Node*>(desc.ptr);
+		Push(node, node);
+	}
+
+	bool Owns(MemDesc desc) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return parent.Owns(desc);
+	}
+
+	bool Owns(MemDesc desc, void const* owner) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return Private::Owns(parent, desc, owner);
+	}
+
+	Private::AllocatorStatsReportPtr GetStats() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto report = std::make_unique<Private::AllocatorStatsReport>();
+		report->stats = m_stats.Read();
+		report->nested.push_back(std::move(parent.GetStats()));
+		return std::move(report);
+	}
+
+private:
+	struct Node
+	{
+		std::atomic<Node*> next;
+	};
+
+	static constexpr uint64_t PointerBits = 48;
+	static constexpr uint64_t PointerMask = (1ull << PointerBits) - 1;
+
+	static Node* Pointer(uint64_t tagged) { return reinterpret_cast<Node*>(tagged & PointerMask); }
+
+	static uint64_t Tagged(Node* node, uint64_t previous)
+	{
+		MY_ASSERT((reinterpret_cast<uintptr_t>(node) & ~PointerMask) == 0, "Block address doesn't fit in 48 bits");
+		return (((previous >> PointerBits) + 1) << PointerBits) | reinterpret_cast<uintptr_t>(node);
+	}
+
+	// Links first to last in front of the list in one exchange
+	void Push(Node* first, Node* last)
+	{
+		uint64_t current = head.load(std::memory_order_relaxed);
+		do
+		{
+			last->next.store(Pointer(current), std::memory_order_relaxed);
+		} while (!head.compare_exchange_weak(current, Tagged(first, current), std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	Node* Pop()
+	{
+		uint64_t current = head.load(std::memory_order_acquire);
+		while (Node* node = Pointer(current))
+		{
+			Node* next = node->next.load(std::memory_order_relaxed);
+			if (head.compare_exchange_weak(current, Tagged(next, current), std::memory_order_acquire, std::memory_order_acquire))
+			{
+				return node;
+			}
+		}
+		return nullptr;
+	}
+
+	void* AllocateBlock()
+	{
+		Node* node = Pop();
+		if (node)
+		{
+			Private::AddHitStat(m_stats);
+		}
+		else
+		{
+			node = Refill();
+			if (!node)
+			{
+				return nullptr;
+			}
+		}
+		Private::AddAllocationStat(m_stats, BlockSize);
+		return node;
+	}
+
+	// Keeps the first block for the caller and pushes the rest as one chain
+	Node* Refill()
+	{
+		Private::AddMissStat(m_stats);
+		Node* first = nullptr;
+		Node* last = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (size_t i = 0; i < BatchSize; ++i)
+			{
+				Node* node = reinterpret_cast<Node*>(parent.Allocate(BlockSize, BlockAlignment).ptr);
+				if (!node)
+				{
+					break;
+				}
+				node->next.store(first, std::memory_order_relaxed);
+				first = node;
+				last = last ? last : node;
+			}
+		}
+		if (first && first != last)
+		{
+			Push(first->next.load(std::memory_order_relaxed), last);
+		}
+		return first;
+	}
+
+	Parent parent;
+	mutable std::mutex m_mutex;
+	std::atomic<uint64_t> head = { 0 };
+	// Sharded, threads don't contend on the counters more than on the list
+	Private::AllocatorCounters m_stats = "ConcurrentFreelistAllocator";
+};
+
+} // namespace Memory
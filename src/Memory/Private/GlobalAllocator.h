@@ -0,0 +1,29 @@
+#pragma once
+#include "Allocators.h"
+#include "BuddyAllocator.h"
+#include "RegionAllocator.h"
+#include "SlabAllocator.h"
+#include "ThreadCachedAllocator.h"
+
+namespace Memory
+{
+namespace Private
+{
+	// The composition behind Memory::Allocate(), Terminal takes what the pools can't.
+	// TraceReplay puts a counting allocator there to measure the fallback rate.
+	template <typename Terminal>
+	using GlobalComposition =
+		ThreadCachedAllocator<
+			FallbackAllocator<
+				SlabAllocator<RegionAllocator<16_mB, true>>,
+				FallbackAllocator<
+					SlabAllocator<BuddyAllocator<512_mB, 4_kB>>,
+					Terminal
+				>
+			>
+		>;
+
+	// Stats of the allocator behind Memory::Allocate()
+	AllocatorStatsReportPtr GetGlobalAllocatorStats();
+} // namespace Private
+} // namespace Memory
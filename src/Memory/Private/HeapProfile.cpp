@@ -0,0 +1,348 @@
+#include "HeapProfile.h"
+#include "Memory.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include "Windows.h"
+#include <dbghelp.h>
+#else
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#endif
+
+namespace Memory
+{
+namespace Private
+{
+	thread_local int64_t BytesUntilSample = 0;
+	std::atomic<uint32_t> SampledFilter[1 << SampledFilterBits];
+
+	static constexpr int64_t ProfileRecheckBytes = 1_mB;
+	static constexpr int MaxStackDepth = 32;
+	// CaptureStack() and SampleAllocation(), stacks start at the Memory call
+	static constexpr int SkippedFrames = 2;
+
+	static std::atomic<uint64_t> SampleRate{ 0 };
+
+	struct StackProfile
+	{
+		void* frames[MaxStackDepth];
+		int depth = 0;
+		uint64_t liveCount = 0;
+		uint64_t liveBytes = 0;
+		uint64_t totalCount = 0;
+		uint64_t totalBytes = 0;
+	};
+
+	struct Sample
+	{
+		uint64_t stack;
+		uint64_t size;
+	};
+
+	static std::mutex ProfileMutex;
+	static std::unordered_map<uint64_t, StackProfile> Stacks;
+	static std::unordered_map<void const*, Sample> Samples;
+
+	// The profile's own containers allocate, and those allocations may come back here
+	static thread_local bool InProfiler = false;
+
+	struct ProfilerScope
+	{
+		ProfilerScope() { InProfiler = true; }
+		~ProfilerScope() { InProfiler = false; }
+	};
+
+	static int64_t NextSampleDistance(uint64_t rate)
+	{
+		// xorshift, seeded by the address of a thread local so threads differ
+		static thread_local uint64_t state = reinterpret_cast<uintptr_t>(&state) | 1;
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		double const uniform = ((state >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+		return static_cast<int64_t>(-std::log(uniform) * rate) + 1;
+	}
+
+	static int CaptureStack(void** frames, int maxDepth)
+	{
+#ifdef _WIN32
+		return CaptureStackBackTrace(SkippedFrames, maxDepth, frames, nullptr);
+#else
+		void* all[MaxStackDepth + SkippedFrames];
+		int const depth = backtrace(all, MaxStackDepth + SkippedFrames) - SkippedFrames;
+		if (depth <= 0)
+		{
+			return 0;
+		}
+		std::copy(all + SkippedFrames, all + SkippedFrames + std::min(depth, maxDepth), frames);
+		return std::min(depth, maxDepth);
+#endif
+	}
+
+	static uint64_t HashStack(void* const* frames, int depth)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		for (int i = 0; i < depth; ++i)
+		{
+			hash = (hash ^ reinterpret_cast<uintptr_t>(frames[i])) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+	static std::string Symbolize(void* frame)
+	{
+		char fallback[32];
+		std::snprintf(fallback, sizeof(fallback), "0x%" PRIxPTR, reinterpret_cast<uintptr_t>(frame));
+#ifdef _WIN32
+		static bool const initialized = SymInitialize(GetCurrentProcess(), nullptr, TRUE) != FALSE;
+		alignas(SYMBOL_INFO) char buffer[sizeof(SYMBOL_INFO) + MAX_SYM_NAME];
+		SYMBOL_INFO* symbol = reinterpret_cast<SYMBOL_INFO*>(buffer);
+		symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+		symbol->MaxNameLen = MAX_SYM_NAME;
+		if (initialized && SymFromAddr(GetCurrentProcess(), reinterpret_cast<DWORD64>(frame), nullptr, symbol))
+		{
+			return symbol->Name;
+		}
+		return fallback;
+#else
+		// Return addresses point past the call
+		Dl_info info;
+		if (!dladdr(static_cast<char*>(frame) - 1, &info))
+		{
+			return fallback;
+		}
+		if (info.dli_sname)
+		{
+			int status = 0;
+			char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+			std::string name = status == 0 ? demangled : info.dli_sname;
+			std::free(demangled);
+			return name;
+		}
+		// Symbols of the executable are only visible with -rdynamic, the module offset still tells them apart
+		std::string module = info.dli_fname ? info.dli_fname : "?";
+		module = module.substr(module.find_last_of('/') + 1);
+		std::snprintf(fallback, sizeof(fallback), "+0x%" PRIxPTR, reinterpret_cast<uintptr_t>(frame) - reinterpret_cast<uintptr_t>(info.dli_fbase));
+		return module + fallback;
+#endif
+	}
+
+	// A sample of size bytes stands for 1 / (1 - e^(-size / rate)) allocations like it
+	static double SampleScale(uint64_t count, uint64_t bytes, uint64_t rate)
+	{
+		if (!count || !rate)
+		{
+			return 1.;
+		}
+		double const averageSize = bytes / static_cast<double>(count);
+		return 1. / (1. - std::exp(-averageSize / rate));
+	}
+
+	void SampleAllocation(void const* ptr, uint64_t size)
+	{
+		if (InProfiler)
+		{
+			return;
+		}
+		ProfilerScope scope;
+
+		uint64_t const rate = SampleRate.load(std::memory_order_relaxed);
+		BytesUntilSample = rate ? NextSampleDistance(rate) : ProfileRecheckBytes;
+		if (!rate)
+		{
+			return;
+		}
+
+		void* frames[MaxStackDepth];
+		int const depth = CaptureStack(frames, MaxStackDepth);
+		uint64_t const hash = HashStack(frames, depth);
+
+		std::lock_guard<std::mutex> lock(ProfileMutex);
+		StackProfile& stack = Stacks[hash];
+		if (stack.totalCount == 0)
+		{
+			std::copy(frames, frames + depth, stack.frames);
+			stack.depth = depth;
+		}
+		++stack.liveCount;
+		stack.liveBytes += size;
+		++stack.totalCount;
+		stack.totalBytes += size;
+		Samples[ptr] = { hash, size };
+		SampledFilter[SampledFilterSlot(ptr)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void ForgetSample(void const* ptr)
+	{
+		if (InProfiler)
+		{
+			return;
+		}
+		ProfilerScope scope;
+
+		std::lock_guard<std::mutex> lock(ProfileMutex);
+		auto it = Samples.find(ptr);
+		if (it == Samples.end())
+		{
+			return;
+		}
+		StackProfile& stack = Stacks[it->second.stack];
+		--stack.liveCount;
+		stack.liveBytes -= it->second.size;
+		Samples.erase(it);
+		SampledFilter[SampledFilterSlot(ptr)].fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	static void WritePprof(std::FILE* file, std::vector<StackProfile> const& stacks, uint64_t rate)
+	{
+		StackProfile total;
+		for (StackProfile const& stack : stacks)
+		{
+			total.liveCount += stack.liveCount;
+			total.liveBytes += stack.liveBytes;
+			total.totalCount += stack.totalCount;
+			total.totalBytes += stack.totalBytes;
+		}
+		// pprof scales the samples back itself from the rate in the header
+		std::fprintf(file, "heap profile: %" PRIu64 ": %" PRIu64 " [%" PRIu64 ": %" PRIu64 "] @ heap_v2/%" PRIu64 "\n",
+			total.liveCount, total.liveBytes, total.totalCount, total.totalBytes, rate);
+		for (StackProfile const& stack : stacks)
+		{
+			std::fprintf(file, "%" PRIu64 ": %" PRIu64 " [%" PRIu64 ": %" PRIu64 "] @",
+				stack.liveCount, stack.liveBytes, stack.totalCount, stack.totalBytes);
+			for (int i = 0; i < stack.depth; ++i)
+			{
+				std::fprintf(file, " 0x%" PRIxPTR, reinterpret_cast<uintptr_t>(stack.frames[i]));
+			}
+			std::fprintf(file, "\n");
+		}
+#ifndef _WIN32
+		// Lets pprof map the addresses back to the binaries
+		std::fprintf(file, "\nMAPPED_LIBRARIES:\n");
+		if (std::FILE* maps = std::fopen("/proc/self/maps", "r"))
+		{
+			char buffer[4096];
+			size_t read = 0;
+			while ((read = std::fread(buffer, 1, sizeof(buffer), maps)) > 0)
+			{
+				std::fwrite(buffer, 1, read, file);
+			}
+			std::fclose(maps);
+		}
+#endif
+	}
+
+	static void WriteFolded(std::FILE* file, std::vector<StackProfile> const& stacks, uint64_t rate, bool live)
+	{
+		for (StackProfile const& stack : stacks)
+		{
+			uint64_t const bytes = live ? stack.liveBytes : stack.totalBytes;
+			if (!bytes)
+			{
+				continue;
+			}
+			std::string line;
+			for (int i = stack.depth - 1; i >= 0; --i)
+			{
+				line += Symbolize(stack.frames[i]);
+				line += i ? ";" : "";
+			}
+			double const scale = SampleScale(stack.totalCount, stack.totalBytes, rate);
+			std::fprintf(file, "%s %" PRIu64 "\n", line.c_str(), static_cast<uint64_t>(bytes * scale));
+		}
+	}
+
+	static std::vector<StackProfile> CopyStacks()
+	{
+		std::vector<StackProfile> stacks;
+		{
+			ProfilerScope scope;
+			std::lock_guard<std::mutex> lock(ProfileMutex);
+			stacks.reserve(Stacks.size());
+			for (auto const& stack : Stacks)
+			{
+				stacks.push_back(stack.second);
+			}
+		}
+		std::sort(stacks.begin(), stacks.end(), [](StackProfile const& lhs, StackProfile const& rhs)
+		{
+			return lhs.totalBytes > rhs.totalBytes;
+		});
+		return stacks;
+	}
+
+	static uint64_t LastSampleRate = 0;
+} // namespace Private
+
+void StartHeapProfile(uint64_t sampleRate)
+{
+	Private::LastSampleRate = sampleRate;
+	Private::SampleRate.store(sampleRate, std::memory_order_relaxed);
+	Private::BytesUntilSample = Private::NextSampleDistance(sampleRate);
+}
+
+void StopHeapProfile()
+{
+	Private::SampleRate.store(0, std::memory_order_relaxed);
+}
+
+bool WriteHeapProfile(char const* path, HeapProfileFormat format)
+{
+	std::FILE* file = std::fopen(path, "w");
+	if (!file)
+	{
+		return false;
+	}
+	std::vector<Private::StackProfile> const stacks = Private::CopyStacks();
+	if (format == HeapProfileFormat::Pprof)
+	{
+		Private::WritePprof(file, stacks, Private::LastSampleRate);
+	}
+	else
+	{
+		Private::WriteFolded(file, stacks, Private::LastSampleRate, format == HeapProfileFormat::FoldedLive);
+	}
+	std::fclose(file);
+	return true;
+}
+
+void DumpAllocInfo()
+{
+	std::vector<Private::StackProfile> const stacks = Private::CopyStacks();
+	std::printf("\nMEMORY ALLOCATION PROFILE\n");
+	if (stacks.empty())
+	{
+		std::printf("Nothing sampled, see StartHeapProfile()\n");
+		return;
+	}
+	uint64_t const rate = Private::LastSampleRate;
+	for (size_t i = 0; i < stacks.size() && i < 10; ++i)
+	{
+		Private::StackProfile const& stack = stacks[i];
+		double const scale = Private::SampleScale(stack.totalCount, stack.totalBytes, rate);
+		std::printf("~%" PRIu64 " bytes in ~%" PRIu64 " allocations, ~%" PRIu64 " bytes live:",
+			static_cast<uint64_t>(stack.totalBytes * scale), static_cast<uint64_t>(stack.totalCount * scale), static_cast<uint64_t>(stack.liveBytes * scale));
+		for (int frame = 0; frame < stack.depth && frame < 3; ++frame)
+		{
+			std::printf("%s %s", frame ? " <-" : "", Private::Symbolize(stack.frames[frame]).c_str());
+		}
+		std::printf("\n");
+	}
+}
+
+#ifdef __ENABLE_ALLOCINFO
+// Profiles from the start of the program
+static bool const ProfileFromStartup = (StartHeapProfile(), true);
+#endif
+
+} // namespace Memory
@@ -0,0 +1,53 @@
+#pragma once
+#include <atomic>
+#include <cinttypes>
+
+namespace Memory
+{
+namespace Private
+{
+	/*
+	Hooks of the sampling heap profiler, see Memory::StartHeapProfile().
+
+	Each thread counts down the bytes it allocates and takes a sample when the
+	count crosses zero, so an allocation is sampled with a probability that grows
+	with its size. The distance to the next sample is drawn from an exponential
+	distribution, which makes the samples a Poisson process over allocated bytes.
+	While profiling is off the countdown only runs into the slow path every
+	ProfileRecheckBytes to see whether it was turned on.
+
+	Frees look up a small counting filter of sampled addresses and only take
+	the profiler lock when it says the block may be sampled.
+	*/
+	extern thread_local int64_t BytesUntilSample;
+
+	constexpr uint32_t SampledFilterBits = 12;
+	extern std::atomic<uint32_t> SampledFilter[1 << SampledFilterBits];
+
+	inline uint32_t SampledFilterSlot(void const* ptr)
+	{
+		return static_cast<uint32_t>(((reinterpret_cast<uintptr_t>(ptr) >> 4) * 0x9E3779B97F4A7C15ull) >> (64 - SampledFilterBits));
+	}
+
+	void SampleAllocation(void const* ptr, uint64_t size);
+
+	void ForgetSample(void const* ptr);
+
+	inline void ProfileAllocation(void const* ptr, uint64_t size)
+	{
+		BytesUntilSample -= static_cast<int64_t>(size);
+		if (BytesUntilSample < 0 && ptr)
+		{
+			SampleAllocation(ptr, size);
+		}
+	}
+
+	inline void ProfileDeallocation(void const* ptr)
+	{
+		if (SampledFilter[SampledFilterSlot(ptr)].load(std::memory_order_relaxed))
+		{
+			ForgetSample(ptr);
+		}
+	}
+} // namespace Private
+} // namespace Memory
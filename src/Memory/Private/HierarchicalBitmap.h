@@ -0,0 +1,144 @@
+#pragma once
+#include "BitUtils.h"
+#include "Utils/Assert.h"
+
+#include <cstdlib>
+#include <memory>
+
+namespace Memory
+{
+namespace Private
+{
+	/*
+	Bitmap with summary layers on top: bit i of layer k + 1 is set when word i
+	of layer k has any bit set. Finding the first set bit and updating a bit
+	touch one word per layer, which is log64 of the bit count.
+	Words come from calloc rather than new, allocators under a replaced
+	operator new build these.
+	*/
+	class HierarchicalBitmap
+	{
+	public:
+		static constexpr uint64_t NotFound = ~0ull;
+
+		HierarchicalBitmap() = default;
+		HierarchicalBitmap(HierarchicalBitmap&&) = default;
+		HierarchicalBitmap& operator=(HierarchicalBitmap&&) = default;
+
+		explicit HierarchicalBitmap(uint64_t bitCount)
+		{
+			uint64_t totalWords = 0;
+			uint64_t bits = bitCount;
+			do
+			{
+				uint64_t const words = (bits + 63) / 64;
+				MY_ASSERT(m_layerCount < MaxLayers, "Too many bitmap layers");
+				m_layerBits[m_layerCount] = bits;
+				m_layerOffsets[m_layerCount++] = totalWords;
+				totalWords += words;
+				bits = words;
+			} while (bits > 1);
+			m_words.reset(static_cast<uint64_t*>(std::calloc(totalWords, sizeof(uint64_t))));
+			MY_ASSERT(m_words, "Failed to allocate bitmap words");
+		}
+
+		bool Test(uint64_t idx) const
+		{
+			return (Layer(0)[idx / 64] >> (idx % 64)) & 1;
+		}
+
+		void Set(uint64_t idx)
+		{
+			for (uint32_t layer = 0; layer < m_layerCount; ++layer)
+			{
+				uint64_t& word = Layer(layer)[idx / 64];
+				bool const wasEmpty = word == 0;
+				word |= 1ull << (idx % 64);
+				if (!wasEmpty)
+				{
+					break;
+				}
+				idx /= 64;
+			}
+		}
+
+		void Clear(uint64_t idx)
+		{
+			for (uint32_t layer = 0; layer < m_layerCount; ++layer)
+			{
+				uint64_t& word = Layer(layer)[idx / 64];
+				word &= ~(1ull << (idx % 64));
+				if (word != 0)
+				{
+					break;
+				}
+				idx /= 64;
+			}
+		}
+
+		bool Any() const
+		{
+			return m_layerCount && Layer(m_layerCount - 1)[0] != 0;
+		}
+
+		uint64_t FindFirstSet() const
+		{
+			if (!Any())
+			{
+				return NotFound;
+			}
+			uint64_t idx = 0;
+			for (uint32_t layer = m_layerCount; layer-- > 0;)
+			{
+				idx = idx * 64 + CountTrailingZeros(Layer(layer)[idx]);
+			}
+			return idx;
+		}
+
+		// First set bit at idx or after it
+		uint64_t FindNextSet(uint64_t idx) const
+		{
+			// Go up while the rest of the word is empty, then down to the first set bit
+			uint32_t layer = 0;
+			for (; layer < m_layerCount; ++layer)
+			{
+				if (idx >= m_layerBits[layer])
+				{
+					return NotFound;
+				}
+				uint64_t const word = Layer(layer)[idx / 64] & (~0ull << (idx % 64));
+				if (word)
+				{
+					idx = (idx & ~63ull) + CountTrailingZeros(word);
+					break;
+				}
+				idx = idx / 64 + 1;
+			}
+			if (layer == m_layerCount)
+			{
+				return NotFound;
+			}
+			while (layer-- > 0)
+			{
+				idx = idx * 64 + CountTrailingZeros(Layer(layer)[idx]);
+			}
+			return idx;
+		}
+
+	private:
+		static constexpr uint32_t MaxLayers = 11;
+
+		struct FreeWords
+		{
+			void operator()(uint64_t* words) const { std::free(words); }
+		};
+
+		uint64_t* Layer(uint32_t layer) const { return m_words.get() + m_layerOffsets[layer]; }
+
+		std::unique_ptr<uint64_t[], FreeWords> m_words;
+		uint64_t m_layerOffsets[MaxLayers] = {};
+		uint64_t m_layerBits[MaxLayers] = {};
+		uint32_t m_layerCount = 0;
+	};
+} // namespace Private
+} // namespace Memory
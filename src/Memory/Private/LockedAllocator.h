@@ -0,0 +1,79 @@
+#pragma once
+#include "Allocators.h"
+#include "PageMap.h"
+
+#include <mutex>
+
+namespace Memory
+{
+
+/*
+Allocator behind a mutex, so any thread can use an allocator that isn't thread safe.
+Every call takes the lock but Owns(desc, owner): allocators that register their pages
+answer it from the owner the page map gave, without touching what the lock guards.
+*/
+template <typename Allocator>
+class LockedAllocator
+{
+public:
+	LockedAllocator() = default;
+	LockedAllocator(LockedAllocator const&) = delete;
+	LockedAllocator& operator=(LockedAllocator const&) = delete;
+
+	MemDesc Allocate(uint64_t size)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return allocator.Allocate(size);
+	}
+
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return allocator.Allocate(size, alignment);
+	}
+
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return allocator.Reallocate(desc, newSize);
+	}
+
+	bool Expand(MemDesc& desc, uint64_t delta)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return allocator.Expand(desc, delta);
+	}
+
+	uint64_t GoodSize(uint64_t size) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return allocator.GoodSize(size);
+	}
+
+	void Deallocate(MemDesc desc)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		allocator.Deallocate(desc);
+	}
+
+	bool Owns(MemDesc desc) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return allocator.Owns(desc);
+	}
+
+	// owner is what the page map has for the block
+	bool Owns(MemDesc desc, void const* owner) const { return Private::Owns(allocator, desc, owner); }
+
+	Private::AllocatorStatsReportPtr GetStats() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return allocator.GetStats();
+	}
+
+private:
+	mutable std::mutex m_mutex;
+	Allocator allocator;
+};
+
+} // namespace Memory
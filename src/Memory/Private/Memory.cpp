@@ -1,49 +1,218 @@
 #include "Memory.h"
 #include "Allocators.h"
+#include "AllocationTrace.h"
+#include "CallSites.h"
+#include "GlobalAllocator.h"
+#include "HeapProfile.h"
+#include "MemoryTags.h"
 #include <iostream>
+#include <new>
 
 namespace Memory
 {
 namespace Private
 {
-	using GlobalAllocatorType = 
-		FallbackAllocator<
-			FreelistAllocator<StackAllocator<16_mB>, 48>,
-			FallbackAllocator<
-				FreelistAllocator<HeapAllocator<512_mB>, 48>,
-				MallocAllocator
-			>
-		>;
+	using GlobalAllocatorType = GlobalComposition<MallocAllocator>;
 
+	// Never destroyed, blocks can still be freed by static destructors and exiting threads
 	static GlobalAllocatorType& GetGlobalAllocator()
 	{
-		static GlobalAllocatorType globalAllocator;
-		return globalAllocator;
+		alignas(GlobalAllocatorType) static uint8_t storage[sizeof(GlobalAllocatorType)];
+		static GlobalAllocatorType* globalAllocator = new (storage) GlobalAllocatorType();
+		return *globalAllocator;
 	}
 
-	AllocInfo FirstAllocInfo;
-	AllocInfo* NextAllocInfo = &FirstAllocInfo;
+	AllocatorStatsReportPtr GetGlobalAllocatorStats()
+	{
+		return GetGlobalAllocator().GetStats();
+	}
 } // namespace Private
 
 MemDesc Allocate(uint64_t sizeInBytes)
 {
-	return Private::GetGlobalAllocator().Allocate(sizeInBytes);
+	return Allocate(sizeInBytes, Private::GetCurrentTag());
 }
 
-void Deallocate(MemDesc descriptor)
+MemDesc Allocate(uint64_t sizeInBytes, uint64_t alignment)
+{
+	return Allocate(sizeInBytes, alignment, Private::GetCurrentTag());
+}
+
+MemDesc Allocate(uint64_t sizeInBytes, MemoryTag tag)
+{
+	if (!Private::ChargeTag(tag, sizeInBytes))
+	{
+		return {};
+	}
+	MemDesc desc = Private::GetGlobalAllocator().Allocate(sizeInBytes);
+	if (desc.size != sizeInBytes)
+	{
+		Private::AdjustTag(tag, static_cast<int64_t>(desc.size - sizeInBytes));
+	}
+	if (desc.ptr && tag != MemoryTag::Untagged)
+	{
+		Private::SetBlockTag(desc.ptr, tag);
+	}
+	Private::ProfileAllocation(desc.ptr, sizeInBytes);
+	Private::Trace(Private::TraceEventType::Allocate, desc.ptr, sizeInBytes);
+	return desc;
+}
+
+MemDesc Allocate(uint64_t sizeInBytes, uint64_t alignment, MemoryTag tag)
+{
+	MY_ASSERT(alignment && (alignment & (alignment - 1)) == 0, "Alignment should be a power of two");
+	if (!Private::ChargeTag(tag, sizeInBytes))
+	{
+		return {};
+	}
+	MemDesc desc = Private::GetGlobalAllocator().Allocate(sizeInBytes, alignment);
+	if (desc.size != sizeInBytes)
+	{
+		Private::AdjustTag(tag, static_cast<int64_t>(desc.size - sizeInBytes));
+	}
+	if (desc.ptr && tag != MemoryTag::Untagged)
+	{
+		Private::SetBlockTag(desc.ptr, tag);
+	}
+	Private::ProfileAllocation(desc.ptr, sizeInBytes);
+	Private::Trace(Private::TraceEventType::Allocate, desc.ptr, sizeInBytes, alignment);
+	return desc;
+}
+
+namespace Private
+{
+	struct BlockInfo
+	{
+		// What the page map has for the block, only looked up when mapped is set
+		void const* owner = nullptr;
+		MemoryTag tag = MemoryTag::Untagged;
+		bool mapped = false;
+	};
+
+	// Until a tag is registered or a site is routed every block is Untagged and
+	// goes back to the global allocator, after that one lookup tells both
+	static BlockInfo LookupBlock(MemDesc desc)
+	{
+		BlockInfo block;
+		if (GetTagCount() > 1 || CallSiteRouteCount.load(std::memory_order_acquire))
+		{
+			uint8_t tag = 0;
+			block.owner = GetPageMap().Lookup(desc.ptr, tag);
+			block.tag = static_cast<MemoryTag>(tag);
+			block.mapped = true;
+		}
+		return block;
+	}
+} // namespace Private
+
+MemDesc Reallocate(MemDesc descriptor, uint64_t newSizeInBytes)
+{
+	if (!descriptor.ptr)
+	{
+		return Allocate(newSizeInBytes);
+	}
+	if (newSizeInBytes == 0)
+	{
+		Deallocate(descriptor);
+		return {};
+	}
+	// The block stays with the tag it was allocated with
+	Private::BlockInfo const block = Private::LookupBlock(descriptor);
+	// Growth is charged up front so the hard budget can refuse it
+	uint64_t const charged = newSizeInBytes > descriptor.size ? newSizeInBytes - descriptor.size : 0;
+	if (charged && !Private::ChargeTag(block.tag, charged))
+	{
+		return {};
+	}
+	// The free half goes in before the old block can be reused by another thread, its tag goes then too
+	Private::Trace(Private::TraceEventType::Reallocate, descriptor.ptr, newSizeInBytes);
+	if (block.tag != MemoryTag::Untagged)
+	{
+		Private::SetBlockTag(descriptor.ptr, MemoryTag::Untagged);
+	}
+	MemDesc desc;
+	if (Private::CallSiteRoute* route = Private::FindCallSiteRoute(descriptor, block.owner))
+	{
+		// Past the pool's sizes the block moves to the global allocator
+		desc = newSizeInBytes <= Private::CallSiteRoute::MaxSize ? route->Reallocate(descriptor, newSizeInBytes)
+			: Private::ReallocateByCopy(*route, Private::GetGlobalAllocator(), descriptor, newSizeInBytes);
+	}
+	else
+	{
+		desc = Private::GetGlobalAllocator().Reallocate(descriptor, newSizeInBytes);
+	}
+	if (block.tag != MemoryTag::Untagged)
+	{
+		Private::SetBlockTag(desc.ptr ? desc.ptr : descriptor.ptr, block.tag);
+	}
+	if (desc.ptr)
+	{
+		Private::AdjustTag(block.tag, static_cast<int64_t>(desc.size - descriptor.size - charged));
+		// A sample of the old block is dropped, the new one is sampled like an allocation
+		Private::ProfileDeallocation(descriptor.ptr);
+		Private::ProfileAllocation(desc.ptr, newSizeInBytes);
+		Private::Trace(Private::TraceEventType::Reallocated, desc.ptr, newSizeInBytes);
+	}
+	else
+	{
+		Private::AdjustTag(block.tag, -static_cast<int64_t>(charged));
+		Private::Trace(Private::TraceEventType::Reallocated, descriptor.ptr, descriptor.size);
+	}
+	return desc;
+}
+
+bool Expand(MemDesc& descriptor, uint64_t deltaInBytes)
 {
-	Private::GetGlobalAllocator().Deallocate(descriptor);
+	if (!descriptor.ptr)
+	{
+		return false;
+	}
+	Private::BlockInfo const block = Private::LookupBlock(descriptor);
+	if (!Private::ChargeTag(block.tag, deltaInBytes))
+	{
+		return false;
+	}
+	uint64_t const size = descriptor.size;
+	Private::CallSiteRoute* route = Private::FindCallSiteRoute(descriptor, block.owner);
+	if (route ? route->Expand(descriptor, deltaInBytes) : Private::GetGlobalAllocator().Expand(descriptor, deltaInBytes))
+	{
+		Private::AdjustTag(block.tag, static_cast<int64_t>(descriptor.size - size - deltaInBytes));
+		// The block doesn't move, so no other thread can get its address in between
+		Private::Trace(Private::TraceEventType::Reallocate, descriptor.ptr, descriptor.size);
+		Private::Trace(Private::TraceEventType::Reallocated, descriptor.ptr, descriptor.size);
+		return true;
+	}
+	Private::AdjustTag(block.tag, -static_cast<int64_t>(deltaInBytes));
+	return false;
 }
 
-void DumpAllocInfo()
+uint64_t GoodSize(uint64_t sizeInBytes)
 {
-	std::cout << "\nMEMORY ALLOCATION STATISTICS" << std::endl;
-	Private::AllocInfo* it = Private::FirstAllocInfo.next;
-	while (it)
+	return Private::GetGlobalAllocator().GoodSize(sizeInBytes);
+}
+
+// Recorded before the block can be reused by another thread
+void Deallocate(MemDesc descriptor)
+{
+	Private::BlockInfo const block = Private::LookupBlock(descriptor);
+	if (block.tag != MemoryTag::Untagged)
+	{
+		Private::SetBlockTag(descriptor.ptr, MemoryTag::Untagged);
+	}
+	Private::CreditTag(block.tag, descriptor.size);
+	Private::ProfileDeallocation(descriptor.ptr);
+	Private::Trace(Private::TraceEventType::Deallocate, descriptor.ptr, descriptor.size);
+	if (!block.mapped)
 	{
-		std::cout << it->filename << ":" << it->line << " " << it->function << "(): " << it->count << " allocations (" << it->totalBytes << " bytes)" << std::endl;
-		it = it->next;
+		Private::GetGlobalAllocator().Deallocate(descriptor);
+		return;
 	}
+	if (Private::CallSiteRoute* route = Private::FindCallSiteRoute(descriptor, block.owner))
+	{
+		route->Deallocate(descriptor);
+		return;
+	}
+	Private::GetGlobalAllocator().Deallocate(descriptor, block.owner);
 }
 
 static inline uint64_t ToMB(uint64_t bytes)
@@ -51,7 +220,43 @@ static inline uint64_t ToMB(uint64_t bytes)
 	return static_cast<uint64_t>(bytes / (1024. * 1024.));
 }
 
-static void PrintAllocatorMemoryUsage(Private::AllocatorStatsReportPtr const& ptr, int depth, uint64_t& totalAlloc, uint64_t& totalDealloc)
+// One row per log2 bucket from the first to the last one used, bars scaled to the biggest
+static void PrintHistogram(char const* title, char const* unit, uint64_t const* buckets, uint32_t count, int depth)
+{
+	uint32_t first = count;
+	uint32_t last = 0;
+	uint64_t biggest = 0;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (buckets[i])
+		{
+			first = i < first ? i : first;
+			last = i;
+			biggest = buckets[i] > biggest ? buckets[i] : biggest;
+		}
+	}
+	if (!biggest)
+	{
+		return;
+	}
+	int const barWidth = 30;
+	for (int i = 0; i < depth; ++i)
+	{
+		printf("    ");
+	}
+	printf("%s\n", title);
+	for (uint32_t i = first; i <= last; ++i)
+	{
+		for (int tab = 0; tab < depth; ++tab)
+		{
+			printf("    ");
+		}
+		int const width = static_cast<int>((buckets[i] * barWidth + biggest - 1) / biggest);
+		printf("    %12" PRIu64 " %-6s |%-*.*s| %" PRIu64 "\n", uint64_t(1) << i, unit, barWidth, width, "##############################", buckets[i]);
+	}
+}
+
+static void PrintAllocatorMemoryUsage(Private::AllocatorStatsReportPtr const& ptr, int depth, uint64_t& totalAlloc, uint64_t& totalDealloc, uint64_t& totalPadding)
 {
 	using namespace std;
 	auto const tabs = [] (int tabs) 
@@ -72,26 +277,72 @@ static void PrintAllocatorMemoryUsage(Private::AllocatorStatsReportPtr const& pt
 		tabs(depth + 1); printf("|Alloc  |%9" PRIu64 "|%11" PRIu64 "|%9" PRIu64 "|\n", s.countAllocated, s.totalAllocated, ToMB(s.totalAllocated));
 		tabs(depth + 1); printf("|Dealloc|%9" PRIu64 "|%11" PRIu64 "|%9" PRIu64 "|\n", s.countDeallocated, s.totalDeallocated, ToMB(s.totalDeallocated));
 		tabs(depth + 1); printf("-----------------------------------------\n");
+		if (s.freeBytes)
+		{
+			double const fragmentation = 100. * (1. - s.largestFreeBlock / static_cast<double>(s.freeBytes));
+			tabs(depth + 1); printf("Free: %" PRIu64 " bytes, largest free block: %" PRIu64 " bytes, fragmentation: %.2f%%\n", s.freeBytes, s.largestFreeBlock, fragmentation);
+		}
+		if (s.hits || s.misses)
+		{
+			double const hitRate = 100. * s.hits / static_cast<double>(s.hits + s.misses);
+			tabs(depth + 1); printf("Hits: %" PRIu64 ", misses: %" PRIu64 ", hit rate: %.2f%%\n", s.hits, s.misses, hitRate);
+		}
+		if (s.padding)
+		{
+			tabs(depth + 1); printf("Alignment padding: %" PRIu64 " bytes\n", s.padding);
+		}
+		if (s.peakUnallocated)
+		{
+			tabs(depth + 1); printf("Peak in use: %" PRIu64 " bytes (%" PRIu64 " Mb)\n", s.peakUnallocated, ToMB(s.peakUnallocated));
+		}
+		PrintHistogram("Allocation sizes, from:", "bytes", s.sizes, Private::SizeBuckets, depth + 1);
+		PrintHistogram("Allocate latency, sampled, from:", "cycles", s.allocateLatency, Private::LatencyBuckets, depth + 1);
+		PrintHistogram("Deallocate latency, sampled, from:", "cycles", s.deallocateLatency, Private::LatencyBuckets, depth + 1);
 		totalAlloc += s.totalAllocated;
 		totalDealloc += s.totalDeallocated;
+		totalPadding += s.padding;
 	}
 	for (auto const& nested : ptr->nested)
 	{
-		PrintAllocatorMemoryUsage(nested, depth + 1, totalAlloc, totalDealloc);
+		PrintAllocatorMemoryUsage(nested, depth + 1, totalAlloc, totalDealloc, totalPadding);
 	}
 	tabs(depth); cout << "}" << endl;
 }
 
 void DumpMemoryUsage()
 {
-	Private::AllocatorStatsReportPtr report = std::move(Private::GetGlobalAllocator().GetStats());
+	Private::AllocatorStatsReportPtr report = Private::GetGlobalAllocatorStats();
 	std::cout << "\nMEMORY USAGE STATISTICS" << std::endl;
 	uint64_t aTotal = 0;
 	uint64_t dTotal = 0;
-	PrintAllocatorMemoryUsage(report, 0, aTotal, dTotal);
+	uint64_t paddingTotal = 0;
+	PrintAllocatorMemoryUsage(report, 0, aTotal, dTotal, paddingTotal);
+	uint32_t const routeCount = Private::CallSiteRouteCount.load(std::memory_order_acquire);
+	for (uint32_t i = 0; i < routeCount; ++i)
+	{
+		Private::CallSiteRoute const& route = Private::GetCallSiteRoute(i);
+		std::cout << "Pool of " << route.function << ", line " << route.line << std::endl;
+		PrintAllocatorMemoryUsage(route.GetStats(), 0, aTotal, dTotal, paddingTotal);
+	}
 	std::cout << "Total allocated memory:   " << aTotal <<" bytes (" << ToMB(aTotal) << " Mb)" << std::endl;
 	std::cout << "Total deallocated memory: " << dTotal <<" bytes (" << ToMB(dTotal) << " Mb)" << std::endl;
 	std::cout << "Memory leaked: " << aTotal - dTotal << " bytes" << std::endl;
+	std::cout << "Alignment padding: " << paddingTotal << " bytes" << std::endl;
+	std::cout << "Resident memory: " << GetResidentMemory() << " bytes (" << ToMB(GetResidentMemory()) << " Mb)" << std::endl;
+
+	// What this thread hasn't folded yet goes in, other threads are up to 64 kB each behind
+	std::cout << "\nMEMORY TAGS" << std::endl;
+	printf("-------------------------------------------------------------------------------------------\n");
+	printf("|Tag                             |    In use   |     Peak    | Soft budget | Hard budget |\n");
+	uint32_t const tagCount = Private::GetTagCount();
+	for (uint32_t i = 0; i < tagCount; ++i)
+	{
+		MemoryTag const tag = static_cast<MemoryTag>(i);
+		uint64_t const inUse = GetMemoryTagUsage(tag);
+		Private::TagStats const stats = Private::GetTagStats(tag);
+		printf("|%-32s|%13" PRIu64 "|%13" PRIu64 "|%13" PRIu64 "|%13" PRIu64 "|\n", GetMemoryTagName(tag), inUse, stats.peak, stats.softBudget, stats.hardBudget);
+	}
+	printf("-------------------------------------------------------------------------------------------\n");
 }
 
 } // namespace Memory
\ No newline at end of file
@@ -0,0 +1,489 @@
+#include "MemoryExport.h"
+#include "GlobalAllocator.h"
+#include "Memory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include "Windows.h"
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Memory
+{
+namespace Private
+{
+	static void Append(std::string& out, char const* format, ...)
+	{
+		char buffer[256];
+		va_list args;
+		va_start(args, format);
+		int const length = std::vsnprintf(buffer, sizeof(buffer), format, args);
+		va_end(args);
+		out.append(buffer, length < 0 ? 0 : std::min<size_t>(length, sizeof(buffer) - 1));
+	}
+
+	static void AppendJsonArray(std::string& out, char const* key, uint64_t const* values, uint32_t count)
+	{
+		Append(out, ",\"%s\":[", key);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			Append(out, i ? ",%" PRIu64 : "%" PRIu64, values[i]);
+		}
+		out += ']';
+	}
+
+	// Allocator names are identifiers, nothing in them needs escaping
+	static void AppendJsonNode(std::string& out, AllocatorStatsReport const& report)
+	{
+		AllocatorStats const& s = report.stats;
+		Append(out, "{\"name\":\"%s\",\"proxy\":%s", s.name, report.isProxyAllocator ? "true" : "false");
+		if (!report.isProxyAllocator)
+		{
+			Append(out, ",\"countAllocated\":%" PRIu64 ",\"totalAllocated\":%" PRIu64, s.countAllocated, s.totalAllocated);
+			Append(out, ",\"countDeallocated\":%" PRIu64 ",\"totalDeallocated\":%" PRIu64, s.countDeallocated, s.totalDeallocated);
+			Append(out, ",\"inUse\":%" PRIu64 ",\"peakInUse\":%" PRIu64 ",\"padding\":%" PRIu64, s.unallocated, s.peakUnallocated, s.padding);
+			Append(out, ",\"freeBytes\":%" PRIu64 ",\"largestFreeBlock\":%" PRIu64, s.freeBytes, s.largestFreeBlock);
+			Append(out, ",\"hits\":%" PRIu64 ",\"misses\":%" PRIu64, s.hits, s.misses);
+			AppendJsonArray(out, "sizes", s.sizes, SizeBuckets);
+			AppendJsonArray(out, "allocateLatency", s.allocateLatency, LatencyBuckets);
+			AppendJsonArray(out, "deallocateLatency", s.deallocateLatency, LatencyBuckets);
+			Append(out, ",\"allocateCycles\":%" PRIu64 ",\"deallocateCycles\":%" PRIu64, s.allocateCycles, s.deallocateCycles);
+		}
+		out += ",\"nested\":[";
+		for (size_t i = 0; i < report.nested.size(); ++i)
+		{
+			out += i ? "," : "";
+			AppendJsonNode(out, *report.nested[i]);
+		}
+		out += "]}";
+	}
+
+	void WriteJson(std::string& out, AllocatorStatsReport const& report, uint64_t resident)
+	{
+		using namespace std::chrono;
+		uint64_t const timestamp = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+		Append(out, "{\"timestamp\":%" PRIu64 ",\"resident\":%" PRIu64 ",\"allocator\":", timestamp, resident);
+		AppendJsonNode(out, report);
+		out += "}\n";
+	}
+
+	struct LabelledStats
+	{
+		std::string path;
+		AllocatorStats const* stats;
+	};
+
+	// Paths name the allocators from the root down, siblings of the same type get their index
+	static void FlattenReport(AllocatorStatsReport const& report, std::string const& path, std::vector<LabelledStats>& out)
+	{
+		if (!report.isProxyAllocator)
+		{
+			out.push_back({ path, &report.stats });
+		}
+		for (size_t i = 0; i < report.nested.size(); ++i)
+		{
+			char const* name = report.nested[i]->stats.name;
+			bool unique = true;
+			for (size_t j = 0; j < report.nested.size(); ++j)
+			{
+				unique &= j == i || std::strcmp(report.nested[j]->stats.name, name) != 0;
+			}
+			std::string nestedPath = path + "/" + name;
+			if (!unique)
+			{
+				nestedPath += "[" + std::to_string(i) + "]";
+			}
+			FlattenReport(*report.nested[i], nestedPath, out);
+		}
+	}
+
+	static void AppendCounter(std::string& out, std::vector<LabelledStats> const& nodes, char const* metric, char const* type, char const* help, uint64_t AllocatorStats::* field)
+	{
+		Append(out, "# HELP %s %s\n# TYPE %s %s\n", metric, help, metric, type);
+		for (LabelledStats const& node : nodes)
+		{
+			Append(out, "%s{allocator=\"%s\",path=\"", metric, node.stats->name);
+			out += node.path;
+			Append(out, "\"} %" PRIu64 "\n", node.stats->*field);
+		}
+	}
+
+	// Buckets become cumulative with an inclusive upper bound, bucket i ends at 2^(i+1) - 1
+	static void AppendHistogram(std::string& out, std::vector<LabelledStats> const& nodes, char const* metric, char const* help,
+		uint64_t const* (*buckets)(AllocatorStats const&), uint32_t count, uint64_t (*sum)(AllocatorStats const&))
+	{
+		Append(out, "# HELP %s %s\n# TYPE %s histogram\n", metric, help, metric);
+		for (LabelledStats const& node : nodes)
+		{
+			std::string labels;
+			Append(labels, "allocator=\"%s\",path=\"", node.stats->name);
+			labels += node.path;
+			labels += '"';
+			uint64_t const* values = buckets(*node.stats);
+			uint64_t cumulative = 0;
+			for (uint32_t i = 0; i + 1 < count; ++i)
+			{
+				cumulative += values[i];
+				Append(out, "%s_bucket{%s,le=\"%" PRIu64 "\"} %" PRIu64 "\n", metric, labels.c_str(), (uint64_t(2) << i) - 1, cumulative);
+			}
+			cumulative += values[count - 1];
+			Append(out, "%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n", metric, labels.c_str(), cumulative);
+			Append(out, "%s_sum{%s} %" PRIu64 "\n", metric, labels.c_str(), sum(*node.stats));
+			Append(out, "%s_count{%s} %" PRIu64 "\n", metric, labels.c_str(), cumulative);
+		}
+	}
+
+	void WritePrometheus(std::string& out, AllocatorStatsReport const& report, uint64_t resident)
+	{
+		std::vector<LabelledStats> nodes;
+		FlattenReport(report, report.stats.name, nodes);
+
+		Append(out, "# HELP memory_resident_bytes Physical memory used by the process.\n# TYPE memory_resident_bytes gauge\n");
+		Append(out, "memory_resident_bytes %" PRIu64 "\n", resident);
+		AppendCounter(out, nodes, "memory_allocations_total", "counter", "Allocations served.", &AllocatorStats::countAllocated);
+		AppendCounter(out, nodes, "memory_allocated_bytes_total", "counter", "Bytes allocated.", &AllocatorStats::totalAllocated);
+		AppendCounter(out, nodes, "memory_deallocations_total", "counter", "Blocks deallocated.", &AllocatorStats::countDeallocated);
+		AppendCounter(out, nodes, "memory_deallocated_bytes_total", "counter", "Bytes deallocated.", &AllocatorStats::totalDeallocated);
+		AppendCounter(out, nodes, "memory_in_use_bytes", "gauge", "Bytes handed out and not freed yet.", &AllocatorStats::unallocated);
+		AppendCounter(out, nodes, "memory_peak_in_use_bytes", "gauge", "High-water mark of the bytes in use.", &AllocatorStats::peakUnallocated);
+		AppendCounter(out, nodes, "memory_padding_bytes", "gauge", "Bytes lost to alignment.", &AllocatorStats::padding);
+		AppendCounter(out, nodes, "memory_free_bytes", "gauge", "Bytes held free for reuse.", &AllocatorStats::freeBytes);
+		AppendCounter(out, nodes, "memory_largest_free_block_bytes", "gauge", "Largest free block held for reuse.", &AllocatorStats::largestFreeBlock);
+		AppendCounter(out, nodes, "memory_cache_hits_total", "counter", "Requests served from a cache of free blocks.", &AllocatorStats::hits);
+		AppendCounter(out, nodes, "memory_cache_misses_total", "counter", "Requests that had to refill the cache.", &AllocatorStats::misses);
+		AppendHistogram(out, nodes, "memory_allocation_size_bytes", "Requested allocation sizes.",
+			[](AllocatorStats const& s) { return static_cast<uint64_t const*>(s.sizes); }, SizeBuckets,
+			[](AllocatorStats const& s) { return s.totalAllocated; });
+		AppendHistogram(out, nodes, "memory_allocate_latency_cycles", "CPU cycles of sampled allocations.",
+			[](AllocatorStats const& s) { return static_cast<uint64_t const*>(s.allocateLatency); }, LatencyBuckets,
+			[](AllocatorStats const& s) { return s.allocateCycles; });
+		AppendHistogram(out, nodes, "memory_deallocate_latency_cycles", "CPU cycles of sampled deallocations.",
+			[](AllocatorStats const& s) { return static_cast<uint64_t const*>(s.deallocateLatency); }, LatencyBuckets,
+			[](AllocatorStats const& s) { return s.deallocateCycles; });
+	}
+
+	static std::string SerializeMemoryUsage(MemoryUsageFormat format)
+	{
+		AllocatorStatsReportPtr report = GetGlobalAllocatorStats();
+		std::string out;
+		if (format == MemoryUsageFormat::Json)
+		{
+			WriteJson(out, *report, GetResidentMemory());
+		}
+		else
+		{
+			WritePrometheus(out, *report, GetResidentMemory());
+		}
+		return out;
+	}
+
+	static bool WriteFile(char const* path, std::string const& text)
+	{
+		std::FILE* file = std::fopen(path, "wb");
+		if (!file)
+		{
+			return false;
+		}
+		bool const written = std::fwrite(text.data(), 1, text.size(), file) == text.size();
+		return std::fclose(file) == 0 && written;
+	}
+
+	// Written next to the target and renamed over it, readers see either snapshot whole
+	static bool ReplaceFile(char const* path, std::string const& text)
+	{
+		std::string const temporary = std::string(path) + ".tmp";
+		if (!WriteFile(temporary.c_str(), text))
+		{
+			return false;
+		}
+#ifdef _WIN32
+		return MoveFileExA(temporary.c_str(), path, MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+		return std::rename(temporary.c_str(), path) == 0;
+#endif
+	}
+
+	class SharedSegment
+	{
+	public:
+		SharedSegment() = default;
+		SharedSegment(SharedSegment const&) = delete;
+		SharedSegment& operator=(SharedSegment const&) = delete;
+
+		~SharedSegment()
+		{
+			Close();
+		}
+
+		bool Create(char const* name)
+		{
+			m_name = SegmentName(name);
+			m_mappedSize = sizeof(SharedSnapshotHeader) + SharedSnapshotCapacity;
+#ifdef _WIN32
+			m_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(m_mappedSize), m_name.c_str());
+			void* view = m_mapping ? MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, 0) : nullptr;
+#else
+			int const fd = shm_open(m_name.c_str(), O_CREAT | O_RDWR, 0644);
+			void* view = nullptr;
+			if (fd >= 0 && ftruncate(fd, m_mappedSize) == 0)
+			{
+				view = mmap(nullptr, m_mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				view = view == MAP_FAILED ? nullptr : view;
+			}
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+			m_owner = true;
+#endif
+			if (!view)
+			{
+				Close();
+				return false;
+			}
+			m_header = static_cast<SharedSnapshotHeader*>(view);
+			std::memcpy(m_header->magic, SharedSnapshotMagic, sizeof(SharedSnapshotMagic));
+			m_header->version = SharedSnapshotVersion;
+			m_header->capacity = SharedSnapshotCapacity;
+			m_header->size.store(0, std::memory_order_relaxed);
+			m_header->sequence.store(0, std::memory_order_release);
+			return true;
+		}
+
+		bool Open(char const* name)
+		{
+			m_name = SegmentName(name);
+#ifdef _WIN32
+			m_mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, m_name.c_str());
+			void* view = m_mapping ? MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+#else
+			int const fd = shm_open(m_name.c_str(), O_RDONLY, 0);
+			void* view = nullptr;
+			struct stat info;
+			if (fd >= 0 && fstat(fd, &info) == 0 && static_cast<uint64_t>(info.st_size) > sizeof(SharedSnapshotHeader))
+			{
+				m_mappedSize = info.st_size;
+				view = mmap(nullptr, m_mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+				view = view == MAP_FAILED ? nullptr : view;
+			}
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+#endif
+			m_header = static_cast<SharedSnapshotHeader*>(view);
+			if (!m_header || std::memcmp(m_header->magic, SharedSnapshotMagic, sizeof(SharedSnapshotMagic)) != 0 || m_header->version != SharedSnapshotVersion)
+			{
+				Close();
+				return false;
+			}
+			return true;
+		}
+
+		void Publish(std::string const& text, MemoryUsageFormat format)
+		{
+			if (text.size() > m_header->capacity)
+			{
+				// Keeps the last snapshot that fit rather than a torn one
+				return;
+			}
+			uint64_t const sequence = m_header->sequence.load(std::memory_order_relaxed);
+			m_header->sequence.store(sequence + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			std::memcpy(Data(), text.data(), text.size());
+			m_header->size.store(text.size(), std::memory_order_relaxed);
+			m_header->format.store(static_cast<uint32_t>(format), std::memory_order_relaxed);
+			m_header->sequence.store(sequence + 2, std::memory_order_release);
+		}
+
+		bool Read(std::string& text) const
+		{
+			for (;;)
+			{
+				uint64_t const sequence = m_header->sequence.load(std::memory_order_acquire);
+				if (sequence == 0)
+				{
+					return false;
+				}
+				if (sequence & 1)
+				{
+					std::this_thread::yield();
+					continue;
+				}
+				uint64_t const size = m_header->size.load(std::memory_order_relaxed);
+				text.assign(Data(), size <= m_header->capacity ? size : 0);
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (m_header->sequence.load(std::memory_order_relaxed) == sequence)
+				{
+					return true;
+				}
+			}
+		}
+
+		void Close()
+		{
+#ifdef _WIN32
+			if (m_header)
+			{
+				UnmapViewOfFile(m_header);
+			}
+			if (m_mapping)
+			{
+				CloseHandle(m_mapping);
+			}
+			m_mapping = nullptr;
+#else
+			if (m_header)
+			{
+				munmap(m_header, m_mappedSize);
+			}
+			if (m_owner)
+			{
+				shm_unlink(m_name.c_str());
+			}
+			m_owner = false;
+#endif
+			m_header = nullptr;
+		}
+
+	private:
+		// Windows keeps the name per session, POSIX wants a single leading slash
+		static std::string SegmentName(char const* name)
+		{
+#ifdef _WIN32
+			return std::string("Local\\") + name;
+#else
+			return name[0] == '/' ? name : std::string("/") + name;
+#endif
+		}
+
+		char* Data() const
+		{
+			return reinterpret_cast<char*>(m_header + 1);
+		}
+
+		std::string m_name;
+		SharedSnapshotHeader* m_header = nullptr;
+		uint64_t m_mappedSize = 0;
+#ifdef _WIN32
+		HANDLE m_mapping = nullptr;
+#else
+		bool m_owner = false;
+#endif
+	};
+
+	bool ReadSharedSnapshot(char const* name, std::string& snapshot)
+	{
+		SharedSegment segment;
+		return segment.Open(name) && segment.Read(snapshot);
+	}
+
+	// One exporter per process, Start and Stop are serialized by StateMutex
+	struct Exporter
+	{
+		std::string name;
+		MemoryExportTarget target = MemoryExportTarget::File;
+		MemoryUsageFormat format = MemoryUsageFormat::Json;
+		std::chrono::milliseconds period{ 0 };
+		SharedSegment segment;
+
+		std::mutex mutex;
+		std::condition_variable wakeUp;
+		bool stopping = false;
+		std::thread thread;
+	};
+
+	static std::mutex StateMutex;
+	static std::unique_ptr<Exporter> RunningExporter;
+
+	static void Export(Exporter& exporter)
+	{
+		std::string const text = SerializeMemoryUsage(exporter.format);
+		if (exporter.target == MemoryExportTarget::File)
+		{
+			ReplaceFile(exporter.name.c_str(), text);
+		}
+		else
+		{
+			exporter.segment.Publish(text, exporter.format);
+		}
+	}
+
+	static void RunExporter(Exporter& exporter)
+	{
+		std::unique_lock<std::mutex> lock(exporter.mutex);
+		while (!exporter.stopping)
+		{
+			lock.unlock();
+			Export(exporter);
+			lock.lock();
+			exporter.wakeUp.wait_for(lock, exporter.period, [&exporter]() { return exporter.stopping; });
+		}
+	}
+} // namespace Private
+
+bool WriteMemoryUsage(char const* path, MemoryUsageFormat format)
+{
+	return Private::WriteFile(path, Private::SerializeMemoryUsage(format));
+}
+
+bool StartMemoryExporter(char const* name, MemoryExportTarget target, MemoryUsageFormat format, uint32_t periodMs)
+{
+	std::lock_guard<std::mutex> lock(Private::StateMutex);
+	if (Private::RunningExporter)
+	{
+		return false;
+	}
+	std::unique_ptr<Private::Exporter> exporter(new Private::Exporter());
+	exporter->name = name;
+	exporter->target = target;
+	exporter->format = format;
+	exporter->period = std::chrono::milliseconds(periodMs);
+	if (target == MemoryExportTarget::SharedMemory && !exporter->segment.Create(name))
+	{
+		return false;
+	}
+	Private::Exporter& running = *exporter;
+	exporter->thread = std::thread([&running]() { Private::RunExporter(running); });
+	Private::RunningExporter = std::move(exporter);
+	return true;
+}
+
+void StopMemoryExporter()
+{
+	std::lock_guard<std::mutex> lock(Private::StateMutex);
+	if (!Private::RunningExporter)
+	{
+		return;
+	}
+	Private::Exporter& exporter = *Private::RunningExporter;
+	{
+		std::lock_guard<std::mutex> stopLock(exporter.mutex);
+		exporter.stopping = true;
+	}
+	exporter.wakeUp.notify_one();
+	exporter.thread.join();
+	// The file outlives the process, short runs still leave their last snapshot in it
+	if (exporter.target == MemoryExportTarget::File)
+	{
+		Private::Export(exporter);
+	}
+	Private::RunningExporter.reset();
+}
+
+} // namespace Memory
@@ -0,0 +1,45 @@
+#pragma once
+#include "AllocatorStats.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace Memory
+{
+namespace Private
+{
+	/*
+	Layout of the shared-memory segment Memory::StartMemoryExporter() publishes to.
+
+	The exporter is the only writer and guards each snapshot with a sequence lock:
+	the sequence is odd while the text is being copied in and even once it's whole.
+	Readers copy the text out and retry when the sequence moved under them, so
+	neither side ever waits for the other.
+	*/
+	struct SharedSnapshotHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t capacity;
+		std::atomic<uint64_t> sequence;
+		std::atomic<uint64_t> size;
+		std::atomic<uint32_t> format;
+		uint32_t reserved;
+	};
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "Segment atomics are shared between processes");
+
+	constexpr char SharedSnapshotMagic[4] = { 'M', 'E', 'M', 'U' };
+	constexpr uint32_t SharedSnapshotVersion = 1;
+	// Text of a snapshot, the segment is that much past the header
+	constexpr uint64_t SharedSnapshotCapacity = 1 << 20;
+
+	void WriteJson(std::string& out, AllocatorStatsReport const& report, uint64_t resident);
+
+	void WritePrometheus(std::string& out, AllocatorStatsReport const& report, uint64_t resident);
+
+	// Copies the latest snapshot out of the segment another process publishes under name.
+	// Returns false when there is no such segment or nothing was published yet.
+	bool ReadSharedSnapshot(char const* name, std::string& snapshot);
+} // namespace Private
+} // namespace Memory
@@ -0,0 +1,208 @@
+#include "MemoryTags.h"
+#include "Utils/Assert.h"
+
+#include <atomic>
+#include <cstring>
+#include <mutex>
+
+namespace Memory
+{
+namespace Private
+{
+	struct TagInfo
+	{
+		// Can go below zero for a while, a thread may fold frees before another folds their allocations
+		std::atomic<int64_t> total{ 0 };
+		std::atomic<int64_t> peak{ 0 };
+		std::atomic<uint64_t> softBudget{ 0 };
+		std::atomic<uint64_t> hardBudget{ 0 };
+		std::atomic<MemoryBudgetCallback> onSoft{ nullptr };
+		std::atomic<MemoryBudgetCallback> onHard{ nullptr };
+		char name[32] = {};
+	};
+
+	static TagInfo Tags[MaxMemoryTags];
+	std::atomic<bool> TagNearHardBudget[MaxMemoryTags] = {};
+	static std::atomic<uint32_t> TagCount{ 1 };
+
+	static std::mutex& GetTagsMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	static uint64_t ToUsage(int64_t bytes)
+	{
+		return bytes > 0 ? static_cast<uint64_t>(bytes) : 0;
+	}
+
+	static void UpdatePeak(TagInfo& info, int64_t total)
+	{
+		int64_t peak = info.peak.load(std::memory_order_relaxed);
+		while (total > peak && !info.peak.compare_exchange_weak(peak, total, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	// Returns the total with the thread's bytes in, the peak is left to the caller
+	static int64_t AddPending(TagShard& shard, uint32_t index)
+	{
+		int64_t const pending = shard.pending[index];
+		shard.pending[index] = 0;
+		return pending ? Tags[index].total.fetch_add(pending, std::memory_order_relaxed) + pending : Tags[index].total.load(std::memory_order_relaxed);
+	}
+
+	static void FoldPending(TagShard& shard, uint32_t index)
+	{
+		UpdatePeak(Tags[index], AddPending(shard, index));
+	}
+
+	// Folds what a thread left pending when it exits
+	struct TagShardFolder
+	{
+		~TagShardFolder()
+		{
+			TagShard& shard = GetTagShard();
+			for (uint32_t i = 0; i < MaxMemoryTags; ++i)
+			{
+				FoldPending(shard, i);
+			}
+		}
+	};
+
+	static void UpdateNearHardBudget(TagInfo const& info, uint32_t index, int64_t total)
+	{
+		uint64_t const hard = info.hardBudget.load(std::memory_order_relaxed);
+		bool const near = hard && ToUsage(total) + TagFoldBytes > hard;
+		if (TagNearHardBudget[index].load(std::memory_order_relaxed) != near)
+		{
+			TagNearHardBudget[index].store(near, std::memory_order_relaxed);
+		}
+	}
+
+	static void RunBudgetCallback(TagShard& shard, MemoryBudgetCallback callback, MemoryTag tag, int64_t total)
+	{
+		shard.inCallback = true;
+		callback(tag, ToUsage(total));
+		shard.inCallback = false;
+	}
+
+	bool FoldTag(TagShard& shard, MemoryTag tag, int64_t bytes)
+	{
+		uint32_t const index = static_cast<uint16_t>(tag);
+		MY_ASSERT(index < TagCount.load(std::memory_order_relaxed), "Memory tag isn't registered");
+		if (!shard.registered)
+		{
+			static thread_local TagShardFolder folder;
+			(void)folder;
+			shard.registered = true;
+		}
+
+		TagInfo& info = Tags[index];
+		int64_t const pending = shard.pending[index];
+		int64_t total = AddPending(shard, index);
+		if (bytes <= 0 || shard.inCallback)
+		{
+			UpdatePeak(info, total);
+			UpdateNearHardBudget(info, index, total);
+			return true;
+		}
+		int64_t const before = total - pending;
+
+		uint64_t const soft = info.softBudget.load(std::memory_order_relaxed);
+		MemoryBudgetCallback const onSoft = info.onSoft.load(std::memory_order_relaxed);
+		if (soft && onSoft && ToUsage(before) <= soft && ToUsage(total) > soft)
+		{
+			RunBudgetCallback(shard, onSoft, tag, total);
+			total = info.total.load(std::memory_order_relaxed) + shard.pending[index];
+		}
+
+		uint64_t const hard = info.hardBudget.load(std::memory_order_relaxed);
+		if (!hard || ToUsage(total) <= hard)
+		{
+			UpdatePeak(info, total);
+			UpdateNearHardBudget(info, index, total);
+			return true;
+		}
+		if (MemoryBudgetCallback const onHard = info.onHard.load(std::memory_order_relaxed))
+		{
+			RunBudgetCallback(shard, onHard, tag, total);
+			total = info.total.load(std::memory_order_relaxed) + shard.pending[index];
+		}
+		if (ToUsage(total) <= hard)
+		{
+			UpdatePeak(info, total);
+			UpdateNearHardBudget(info, index, total);
+			return true;
+		}
+		info.total.fetch_sub(bytes, std::memory_order_relaxed);
+		TagNearHardBudget[index].store(true, std::memory_order_relaxed);
+		return false;
+	}
+
+	uint32_t GetTagCount()
+	{
+		return TagCount.load(std::memory_order_acquire);
+	}
+
+	TagStats GetTagStats(MemoryTag tag)
+	{
+		TagInfo const& info = Tags[static_cast<uint16_t>(tag)];
+		return { ToUsage(info.total.load(std::memory_order_relaxed)), ToUsage(info.peak.load(std::memory_order_relaxed)),
+			info.softBudget.load(std::memory_order_relaxed), info.hardBudget.load(std::memory_order_relaxed) };
+	}
+} // namespace Private
+
+MemoryTag RegisterMemoryTag(char const* name)
+{
+	std::lock_guard<std::mutex> lock(Private::GetTagsMutex());
+	uint32_t const count = Private::TagCount.load(std::memory_order_relaxed);
+	for (uint32_t i = 1; i < count; ++i)
+	{
+		if (std::strncmp(Private::Tags[i].name, name, sizeof(Private::Tags[i].name) - 1) == 0)
+		{
+			return static_cast<MemoryTag>(i);
+		}
+	}
+	MY_ASSERT(count < MaxMemoryTags, "Out of memory tags");
+	std::strncpy(Private::Tags[count].name, name, sizeof(Private::Tags[count].name) - 1);
+	Private::TagCount.store(count + 1, std::memory_order_release);
+	return static_cast<MemoryTag>(count);
+}
+
+char const* GetMemoryTagName(MemoryTag tag)
+{
+	return tag == MemoryTag::Untagged ? "Untagged" : Private::Tags[static_cast<uint16_t>(tag)].name;
+}
+
+uint64_t GetMemoryTagUsage(MemoryTag tag)
+{
+	uint32_t const index = static_cast<uint16_t>(tag);
+	// Exact for the calling thread
+	Private::FoldPending(Private::GetTagShard(), index);
+	return Private::ToUsage(Private::Tags[index].total.load(std::memory_order_relaxed));
+}
+
+void SetMemoryBudget(MemoryTag tag, uint64_t softBytes, MemoryBudgetCallback onSoft, uint64_t hardBytes, MemoryBudgetCallback onHard)
+{
+	Private::TagInfo& info = Private::Tags[static_cast<uint16_t>(tag)];
+	info.onSoft.store(onSoft, std::memory_order_relaxed);
+	info.onHard.store(onHard, std::memory_order_relaxed);
+	info.softBudget.store(softBytes, std::memory_order_relaxed);
+	info.hardBudget.store(hardBytes, std::memory_order_relaxed);
+	// The next fold clears it when the tag is far enough below
+	Private::TagNearHardBudget[static_cast<uint16_t>(tag)].store(hardBytes != 0, std::memory_order_relaxed);
+}
+
+ScopedMemoryTag::ScopedMemoryTag(MemoryTag tag)
+	: m_previous(Private::GetCurrentTag())
+{
+	Private::GetTagShard().current = tag;
+}
+
+ScopedMemoryTag::~ScopedMemoryTag()
+{
+	Private::GetTagShard().current = m_previous;
+}
+
+} // namespace Memory
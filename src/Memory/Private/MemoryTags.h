@@ -0,0 +1,99 @@
+#pragma once
+#include "Memory.h"
+#include "PageMap.h"
+
+#include <atomic>
+
+namespace Memory
+{
+namespace Private
+{
+	// A thread folds the bytes of a tag into its total once they are this far off
+	constexpr int64_t TagFoldBytes = 64_kB;
+
+	static_assert(MaxMemoryTags <= 256, "The tag of a block is kept in a byte of the page map");
+
+	// Only blocks that aren't Untagged are set, Memory::Deallocate() finds their tag whatever tag is current then
+	inline void SetBlockTag(void const* ptr, MemoryTag tag)
+	{
+		GetPageMap().SetByte(ptr, PageMap::TagLane, static_cast<uint8_t>(tag));
+	}
+
+	// Zero initialized, nothing to construct on the allocation path
+	struct TagShard
+	{
+		// Bytes of each tag the thread allocated less what it freed since it last folded them
+		int64_t pending[MaxMemoryTags];
+		MemoryTag current;
+		// Folds what is pending when the thread exits once set
+		bool registered;
+		// Set while a budget callback runs
+		bool inCallback;
+	};
+
+	inline TagShard& GetTagShard()
+	{
+		static thread_local TagShard shard;
+		return shard;
+	}
+
+	// Set while a tag is within TagFoldBytes of its hard budget or over it,
+	// every thread folds each charge and credit then
+	extern std::atomic<bool> TagNearHardBudget[MaxMemoryTags];
+
+	// Adds pending bytes to the total and checks the budgets of tag, bytes is what the
+	// calling allocation adds. False when the hard budget refuses it, it isn't counted then.
+	bool FoldTag(TagShard& shard, MemoryTag tag, int64_t bytes);
+
+	// False when the hard budget of tag refuses bytes more
+	inline bool ChargeTag(MemoryTag tag, uint64_t bytes)
+	{
+		TagShard& shard = GetTagShard();
+		uint32_t const index = static_cast<uint16_t>(tag);
+		int64_t& pending = shard.pending[index];
+		pending += static_cast<int64_t>(bytes);
+		if (pending >= TagFoldBytes || !shard.registered || TagNearHardBudget[index].load(std::memory_order_relaxed))
+		{
+			return FoldTag(shard, tag, static_cast<int64_t>(bytes));
+		}
+		return true;
+	}
+
+	inline void CreditTag(MemoryTag tag, uint64_t bytes)
+	{
+		TagShard& shard = GetTagShard();
+		uint32_t const index = static_cast<uint16_t>(tag);
+		int64_t& pending = shard.pending[index];
+		pending -= static_cast<int64_t>(bytes);
+		if (pending <= -TagFoldBytes || !shard.registered || TagNearHardBudget[index].load(std::memory_order_relaxed))
+		{
+			FoldTag(shard, tag, 0);
+		}
+	}
+
+	// Corrects what was charged for a block without checking budgets
+	inline void AdjustTag(MemoryTag tag, int64_t bytes)
+	{
+		GetTagShard().pending[static_cast<uint16_t>(tag)] += bytes;
+	}
+
+	struct TagStats
+	{
+		uint64_t bytes;
+		uint64_t peak;
+		uint64_t softBudget;
+		uint64_t hardBudget;
+	};
+
+	// Tags registered so far, Untagged included
+	uint32_t GetTagCount();
+
+	// Totals as other threads last folded them
+	TagStats GetTagStats(MemoryTag tag);
+
+	inline MemoryTag GetCurrentTag()
+	{
+		return GetTagShard().current;
+	}
+} // namespace Private
+} // namespace Memory
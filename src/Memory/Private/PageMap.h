@@ -0,0 +1,231 @@
+#pragma once
+#include "MemDesc.h"
+#include "VirtualMemory.h"
+#include "Utils/Assert.h"
+
+#include <atomic>
+#include <type_traits>
+#include <utility>
+
+namespace Memory
+{
+namespace Private
+{
+	/*
+	Radix tree from the page of an address to the allocator that owns it.
+	The 36 bit page number of a 48 bit address is split into two 18 bit levels.
+	The root is 2 Mb of zeroes that the OS maps on first touch, leaves are mapped
+	straight from the OS when first needed and never given back.
+	Lookups take two loads and no locks, registering is safe from any thread.
+	Next to the owners it keeps lanes of a byte per 16 bytes for the block that starts
+	there, Memory::Allocate() puts the tag of a block in one, the global operator new
+	its size in another. It also keeps a word per page for blocks of a page or more,
+	at most one of those starts in a page. The bytes and words of a leaf are mapped
+	when the first one is set, so only the blocks that use them pay for them.
+	*/
+	class PageMap
+	{
+	public:
+		static constexpr uint32_t PageShift = 12;
+		static constexpr uint32_t LevelBits = 18;
+		static constexpr uint64_t LevelSize = 1ull << LevelBits;
+		static constexpr uint32_t AddressBits = PageShift + 2 * LevelBits;
+		static constexpr uint32_t ByteShift = 4;
+		static constexpr uint64_t BytesPerLeaf = LevelSize << (PageShift - ByteShift);
+
+		enum Lane : uint32_t
+		{
+			// MemoryTag of the block
+			TagLane,
+			// Size of a block under a page in 16 bytes, see Override/NewDelete.cpp
+			SizeLane,
+			LaneCount,
+		};
+
+		constexpr PageMap() = default;
+		PageMap(PageMap const&) = delete;
+		PageMap& operator=(PageMap const&) = delete;
+
+		// Every page touching [ptr, ptr + size) is owned by owner from now on
+		void Register(void const* ptr, uint64_t size, void const* owner)
+		{
+			uintptr_t const first = reinterpret_cast<uintptr_t>(ptr) >> PageShift;
+			uintptr_t const last = (reinterpret_cast<uintptr_t>(ptr) + size - 1) >> PageShift;
+			for (uintptr_t page = first; page <= last; ++page)
+			{
+				GetLeaf(page)->entries[page & (LevelSize - 1)].store(owner, std::memory_order_release);
+			}
+		}
+
+		void Unregister(void const* ptr, uint64_t size)
+		{
+			Register(ptr, size, nullptr);
+		}
+
+		// nullptr for pages nobody registered
+		void const* Lookup(void const* ptr) const
+		{
+			uintptr_t const page = reinterpret_cast<uintptr_t>(ptr) >> PageShift;
+			Leaf* leaf = FindLeaf(page);
+			return leaf ? leaf->entries[page & (LevelSize - 1)].load(std::memory_order_acquire) : nullptr;
+		}
+
+		// The owner and the tag of the block at ptr in one walk, tag is 0 when none was set
+		void const* Lookup(void const* ptr, uint8_t& tag) const
+		{
+			uintptr_t const address = reinterpret_cast<uintptr_t>(ptr);
+			uintptr_t const page = address >> PageShift;
+			tag = 0;
+			Leaf* leaf = FindLeaf(page);
+			if (!leaf)
+			{
+				return nullptr;
+			}
+			if (Bytes* tags = leaf->lanes[TagLane].load(std::memory_order_acquire))
+			{
+				tag = tags->bytes[(address >> ByteShift) & (BytesPerLeaf - 1)].load(std::memory_order_relaxed);
+			}
+			return leaf->entries[page & (LevelSize - 1)].load(std::memory_order_acquire);
+		}
+
+		// 0 when none was set
+		uint8_t GetByte(void const* ptr, Lane lane) const
+		{
+			uintptr_t const address = reinterpret_cast<uintptr_t>(ptr);
+			Leaf* leaf = FindLeaf(address >> PageShift);
+			Bytes* bytes = leaf ? leaf->lanes[lane].load(std::memory_order_acquire) : nullptr;
+			return bytes ? bytes->bytes[(address >> ByteShift) & (BytesPerLeaf - 1)].load(std::memory_order_relaxed) : 0;
+		}
+
+		// Blocks should start at least 16 bytes apart. The byte stays until it is set again,
+		// clear it before the block can go to another thread.
+		void SetByte(void const* ptr, Lane lane, uint8_t value)
+		{
+			uintptr_t const address = reinterpret_cast<uintptr_t>(ptr);
+			Bytes* bytes = GetOrCreate(GetLeaf(address >> PageShift)->lanes[lane]);
+			bytes->bytes[(address >> ByteShift) & (BytesPerLeaf - 1)].store(value, std::memory_order_relaxed);
+		}
+
+		// 0 when none was set
+		uint64_t GetWord(void const* ptr) const
+		{
+			uintptr_t const page = reinterpret_cast<uintptr_t>(ptr) >> PageShift;
+			Leaf* leaf = FindLeaf(page);
+			Words* words = leaf ? leaf->words.load(std::memory_order_acquire) : nullptr;
+			return words ? words->words[page & (LevelSize - 1)].load(std::memory_order_relaxed) : 0;
+		}
+
+		// Blocks should be a page or more, so no two start in the same page
+		void SetWord(void const* ptr, uint64_t value)
+		{
+			uintptr_t const page = reinterpret_cast<uintptr_t>(ptr) >> PageShift;
+			Words* words = GetOrCreate(GetLeaf(page)->words);
+			words->words[page & (LevelSize - 1)].store(value, std::memory_order_relaxed);
+		}
+
+	private:
+		struct Bytes
+		{
+			std::atomic<uint8_t> bytes[BytesPerLeaf];
+		};
+
+		struct Words
+		{
+			std::atomic<uint64_t> words[LevelSize];
+		};
+
+		struct Leaf
+		{
+			std::atomic<void const*> entries[LevelSize];
+			std::atomic<Bytes*> lanes[LaneCount];
+			std::atomic<Words*> words;
+		};
+
+		// Mapped pages are zeroed, which is a valid state for the atomics
+		template <typename T>
+		static T* GetOrCreate(std::atomic<T*>& slot)
+		{
+			T* ptr = slot.load(std::memory_order_acquire);
+			if (ptr)
+			{
+				return ptr;
+			}
+			T* created = reinterpret_cast<T*>(MapPages(sizeof(T)));
+			MY_ASSERT(created, "Failed to map a page map node");
+			if (!slot.compare_exchange_strong(ptr, created, std::memory_order_acq_rel))
+			{
+				ReleaseAddressSpace(created, sizeof(T));
+				return ptr;
+			}
+			return created;
+		}
+
+		Leaf* FindLeaf(uintptr_t page) const
+		{
+			if (page >> (2 * LevelBits))
+			{
+				return nullptr;
+			}
+			return root[page >> LevelBits].load(std::memory_order_acquire);
+		}
+
+		Leaf* GetLeaf(uintptr_t page)
+		{
+			MY_ASSERT(!(page >> (2 * LevelBits)), "Address doesn't fit the page map");
+			return GetOrCreate(root[page >> LevelBits]);
+		}
+
+		std::atomic<Leaf*> root[LevelSize] = {};
+	};
+
+	// Constant initialized, so allocators can register from static constructors
+	inline PageMap& GetPageMap()
+	{
+		static PageMap pageMap;
+		return pageMap;
+	}
+
+	/*
+	Allocators that register their pages answer Owns(desc, owner) with the owner
+	the page map has for desc, composites pass it down. That way a composition
+	looks the owner up once however deep it is. Allocators without it fall back to Owns(desc).
+	*/
+	template <typename Allocator, typename = void>
+	struct HasMappedOwnership : std::false_type {};
+
+	template <typename Allocator>
+	struct HasMappedOwnership<Allocator, std::void_t<decltype(std::declval<Allocator const&>().Owns(MemDesc{}, static_cast<void const*>(nullptr)))>> : std::true_type {};
+
+	template <typename Allocator>
+	bool Owns(Allocator const& allocator, MemDesc desc, void const* owner)
+	{
+		if constexpr (HasMappedOwnership<Allocator>::value)
+		{
+			return allocator.Owns(desc, owner);
+		}
+		else
+		{
+			return allocator.Owns(desc);
+		}
+	}
+
+	template <typename Allocator, typename = void>
+	struct HasMappedDeallocate : std::false_type {};
+
+	template <typename Allocator>
+	struct HasMappedDeallocate<Allocator, std::void_t<decltype(std::declval<Allocator&>().Deallocate(MemDesc{}, static_cast<void const*>(nullptr)))>> : std::true_type {};
+
+	template <typename Allocator>
+	void Deallocate(Allocator& allocator, MemDesc desc, void const* owner)
+	{
+		if constexpr (HasMappedDeallocate<Allocator>::value)
+		{
+			allocator.Deallocate(desc, owner);
+		}
+		else
+		{
+			allocator.Deallocate(desc);
+		}
+	}
+} // namespace Private
+} // namespace Memory
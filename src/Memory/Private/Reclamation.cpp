@@ -0,0 +1,334 @@
+#include "Reclamation.h"
+#include "BitUtils.h"
+#include "Utils/Assert.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace Memory
+{
+namespace Private
+{
+	// Retire() tries to free once this many more blocks are queued
+	static constexpr uint64_t RetireBatch = 64;
+
+	struct RetiredBlock
+	{
+		MemDesc desc;
+		uint64_t epoch;
+	};
+
+	// Storage comes from malloc, queueing a block never goes back into the allocator
+	struct RetiredList
+	{
+		RetiredBlock* blocks = nullptr;
+		uint64_t count = 0;
+		uint64_t capacity = 0;
+		// Count at which Retire() tries to free again
+		uint64_t collectAt = RetireBatch;
+
+		void Push(MemDesc desc, uint64_t epoch)
+		{
+			if (count == capacity)
+			{
+				uint64_t const newCapacity = capacity ? capacity * 2 : RetireBatch * 2;
+				RetiredBlock* grown = static_cast<RetiredBlock*>(std::realloc(blocks, newCapacity * sizeof(RetiredBlock)));
+				MY_ASSERT(grown, "Failed to allocate memory");
+				blocks = grown;
+				capacity = newCapacity;
+			}
+			blocks[count++] = { desc, epoch };
+		}
+
+		template <typename IsSafe>
+		void FreeIf(IsSafe const& isSafe)
+		{
+			uint64_t kept = 0;
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				if (isSafe(blocks[i]))
+				{
+					Memory::Deallocate(blocks[i].desc);
+				}
+				else
+				{
+					blocks[kept++] = blocks[i];
+				}
+			}
+			count = kept;
+			collectAt = count + RetireBatch;
+		}
+	};
+
+	// Records are linked once and never freed. A thread that exits leaves its
+	// record, and whatever it couldn't free, to the next thread that starts.
+	template <typename Record>
+	class RecordRegistry
+	{
+	public:
+		Record* Acquire()
+		{
+			for (Record* it = Head(); it; it = it->next)
+			{
+				bool owned = false;
+				if (it->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+				{
+					return it;
+				}
+			}
+			void* memory = std::calloc(1, sizeof(Record));
+			MY_ASSERT(memory, "Failed to allocate memory");
+			Record* record = new (memory) Record();
+			record->owned.store(true, std::memory_order_relaxed);
+			record->next = m_head.load(std::memory_order_relaxed);
+			while (!m_head.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed))
+			{
+			}
+			m_count.fetch_add(1, std::memory_order_relaxed);
+			return record;
+		}
+
+		void Release(Record* record)
+		{
+			record->owned.store(false, std::memory_order_release);
+		}
+
+		Record* Head() const { return m_head.load(std::memory_order_acquire); }
+
+		uint64_t Count() const { return m_count.load(std::memory_order_relaxed); }
+
+		// Runs function on the records no thread owns right now
+		template <typename Function>
+		void ForEachOrphan(Function const& function)
+		{
+			for (Record* it = Head(); it; it = it->next)
+			{
+				bool owned = false;
+				if (it->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+				{
+					function(*it);
+					Release(it);
+				}
+			}
+		}
+
+	private:
+		std::atomic<Record*> m_head{ nullptr };
+		std::atomic<uint64_t> m_count{ 0 };
+	};
+
+	struct EpochRecord
+	{
+		std::atomic<bool> owned{ false };
+		EpochRecord* next = nullptr;
+		// Epoch the thread's region started in shifted up one, the low bit is set while it's in one
+		std::atomic<uint64_t> state{ 0 };
+		uint32_t nesting = 0;
+		RetiredList retired;
+		// Nothing more can be freed until the epoch moves on from the one of the last scan
+		uint64_t scannedEpoch = ~0ull;
+	};
+
+	struct HazardRecord
+	{
+		std::atomic<bool> owned{ false };
+		HazardRecord* next = nullptr;
+		std::atomic<void*> slots[HazardPointerReclamation::SlotsPerThread] = {};
+		// Slots guards of the owner hold, only the owner looks at it
+		uint32_t usedSlots = 0;
+		RetiredList retired;
+	};
+
+	static std::atomic<uint64_t> GlobalEpoch{ 0 };
+	static RecordRegistry<EpochRecord> EpochRecords;
+	static RecordRegistry<HazardRecord> HazardRecords;
+
+	// Moves on only when every thread in a region has seen the current epoch
+	static bool TryAdvanceEpoch()
+	{
+		uint64_t epoch = GlobalEpoch.load(std::memory_order_seq_cst);
+		for (EpochRecord* it = EpochRecords.Head(); it; it = it->next)
+		{
+			uint64_t const state = it->state.load(std::memory_order_seq_cst);
+			if ((state & 1) && (state >> 1) != epoch)
+			{
+				return false;
+			}
+		}
+		return GlobalEpoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+	}
+
+	static void Collect(EpochRecord& record)
+	{
+		TryAdvanceEpoch();
+		uint64_t const epoch = GlobalEpoch.load(std::memory_order_acquire);
+		if (epoch == record.scannedEpoch)
+		{
+			record.retired.collectAt = record.retired.count + RetireBatch;
+			return;
+		}
+		record.scannedEpoch = epoch;
+		record.retired.FreeIf([epoch](RetiredBlock const& block)
+		{
+			return block.epoch + 2 <= epoch;
+		});
+	}
+
+	static void Collect(HazardRecord& record)
+	{
+		// Blocks were unlinked before they were retired, a reader that protects one from here on fails to validate it
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::vector<void*> hazards;
+		hazards.reserve(HazardRecords.Count() * HazardPointerReclamation::SlotsPerThread);
+		for (HazardRecord* it = HazardRecords.Head(); it; it = it->next)
+		{
+			for (std::atomic<void*>& slot : it->slots)
+			{
+				if (void* hazard = slot.load(std::memory_order_seq_cst))
+				{
+					hazards.push_back(hazard);
+				}
+			}
+		}
+		std::sort(hazards.begin(), hazards.end());
+		record.retired.FreeIf([&hazards](RetiredBlock const& block)
+		{
+			return !std::binary_search(hazards.begin(), hazards.end(), block.desc.ptr);
+		});
+	}
+
+	// Tries to free what the thread retired on the way out, then lets the record go
+	template <typename Record>
+	struct ThreadRecord
+	{
+		RecordRegistry<Record>& registry;
+		Record* record = nullptr;
+
+		ThreadRecord(RecordRegistry<Record>& registry)
+			: registry(registry)
+		{
+		}
+
+		~ThreadRecord()
+		{
+			if (record)
+			{
+				Collect(*record);
+				registry.Release(record);
+			}
+		}
+
+		Record& Get()
+		{
+			if (!record)
+			{
+				record = registry.Acquire();
+			}
+			return *record;
+		}
+	};
+
+	static EpochRecord& GetEpochRecord()
+	{
+		static thread_local ThreadRecord<EpochRecord> threadRecord(EpochRecords);
+		return threadRecord.Get();
+	}
+
+	static HazardRecord& GetHazardRecord()
+	{
+		static thread_local ThreadRecord<HazardRecord> threadRecord(HazardRecords);
+		return threadRecord.Get();
+	}
+} // namespace Private
+
+EpochReclamation::Guard::Guard()
+{
+	Private::EpochRecord& record = Private::GetEpochRecord();
+	if (record.nesting++ == 0)
+	{
+		record.state.store((Private::GlobalEpoch.load(std::memory_order_relaxed) << 1) | 1, std::memory_order_relaxed);
+		// The region is visible before any shared pointer is loaded in it
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+}
+
+EpochReclamation::Guard::~Guard()
+{
+	Private::EpochRecord& record = Private::GetEpochRecord();
+	if (--record.nesting == 0)
+	{
+		record.state.store(0, std::memory_order_release);
+	}
+}
+
+void EpochReclamation::Retire(MemDesc descriptor)
+{
+	Private::EpochRecord& record = Private::GetEpochRecord();
+	record.retired.Push(descriptor, Private::GlobalEpoch.load(std::memory_order_seq_cst));
+	if (record.retired.count >= record.retired.collectAt)
+	{
+		Private::Collect(record);
+	}
+}
+
+void EpochReclamation::Flush()
+{
+	// With Collect() that is two steps, everything retired so far goes unless a thread is in a region
+	Private::TryAdvanceEpoch();
+	Private::Collect(Private::GetEpochRecord());
+	Private::EpochRecords.ForEachOrphan([](Private::EpochRecord& record)
+	{
+		Private::Collect(record);
+	});
+}
+
+uint64_t EpochReclamation::GetPendingCount()
+{
+	return Private::GetEpochRecord().retired.count;
+}
+
+HazardPointerReclamation::Guard::Guard()
+{
+	Private::HazardRecord& record = Private::GetHazardRecord();
+	uint32_t const freeSlots = ~record.usedSlots & ((1u << SlotsPerThread) - 1);
+	MY_ASSERT(freeSlots, "Thread is out of hazard slots");
+	uint32_t const index = Private::CountTrailingZeros(freeSlots);
+	record.usedSlots |= 1u << index;
+	m_slot = &record.slots[index];
+}
+
+HazardPointerReclamation::Guard::~Guard()
+{
+	Private::HazardRecord& record = Private::GetHazardRecord();
+	m_slot->store(nullptr, std::memory_order_release);
+	record.usedSlots &= ~(1u << (m_slot - record.slots));
+}
+
+void HazardPointerReclamation::Retire(MemDesc descriptor)
+{
+	Private::HazardRecord& record = Private::GetHazardRecord();
+	record.retired.Push(descriptor, 0);
+	// A scan costs all the slots, it has to free about as many blocks to pay off
+	if (record.retired.count >= std::max(record.retired.collectAt, Private::HazardRecords.Count() * SlotsPerThread * 2))
+	{
+		Private::Collect(record);
+	}
+}
+
+void HazardPointerReclamation::Flush()
+{
+	Private::Collect(Private::GetHazardRecord());
+	Private::HazardRecords.ForEachOrphan([](Private::HazardRecord& record)
+	{
+		Private::Collect(record);
+	});
+}
+
+uint64_t HazardPointerReclamation::GetPendingCount()
+{
+	return Private::GetHazardRecord().retired.count;
+}
+
+} // namespace Memory
@@ -0,0 +1,194 @@
+#pragma once
+#include "Allocators.h"
+#include "BitUtils.h"
+#include "Memory.h"
+#include "VirtualMemory.h"
+
+#include <algorithm>
+
+namespace Memory
+{
+
+/*
+Linear allocator like HeapAllocator, but over reserved address space:
+pages are committed in CommitGranularity steps as the top of the region grows.
+When the top goes down and more than PurgeThreshold bytes of touched pages
+are left above it, they are given back to the OS.
+HugePages aligns the region to 2 Mb and asks for transparent huge pages,
+that is meant for hot arenas.
+*/
+template <size_t Size, bool HugePages = false>
+class RegionAllocator
+{
+public:
+	static constexpr uint64_t HugePageSize = 2_mB;
+	static constexpr uint64_t CommitGranularity = HugePages ? HugePageSize : 64_kB;
+	static constexpr uint64_t PurgeThreshold = 4_mB;
+
+	RegionAllocator(RegionAllocator&&) = delete;
+	RegionAllocator(RegionAllocator const&) = delete;
+	RegionAllocator& operator=(RegionAllocator&&) = delete;
+	RegionAllocator& operator=(RegionAllocator const&) = delete;
+
+	RegionAllocator()
+		: reservedSize(Private::AlignUp(Size, HugePages ? HugePageSize : Private::GetPageSize()))
+	{
+		region = reinterpret_cast<uint8_t*>(Private::ReserveAddressSpace(reservedSize, HugePages ? HugePageSize : Private::GetPageSize()));
+		MY_ASSERT(region, "Failed to reserve address space");
+		if (HugePages && region)
+		{
+			Private::AdviseHugePages(region, reservedSize);
+		}
+		ptr = committedEnd = touchedEnd = region;
+	}
+
+	~RegionAllocator()
+	{
+		if (region)
+		{
+			if (committedEnd > region)
+			{
+				Private::GetPageMap().Unregister(region, committedEnd - region);
+			}
+			Private::ReleaseAddressSpace(region, reservedSize);
+		}
+	}
+
+	MemDesc Allocate(uint64_t size)
+	{
+		return Allocate(size, 1);
+	}
+
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		Private::LatencySample sample(m_stats, false);
+		uint64_t const padding = Private::AlignUp(reinterpret_cast<uintptr_t>(ptr), alignment) - reinterpret_cast<uintptr_t>(ptr);
+		uint64_t const alignedSize = Private::AlignUp(size, alignment);
+		if (!region || Size - (ptr - region) < padding + alignedSize)
+		{
+			return { nullptr, 0 };
+		}
+		uint8_t* const end = ptr + padding + alignedSize;
+		if (!CommitUpTo(end))
+		{
+			return { nullptr, 0 };
+		}
+		Private::AddAllocationStat(m_stats, alignedSize);
+		Private::AddPaddingStat(m_stats, padding + alignedSize - size);
+		MemDesc result = { ptr + padding, alignedSize };
+		ptr = end;
+		return result;
+	}
+
+	uint64_t GoodSize(uint64_t size) const { return size; }
+
+	// Only the last block can grow in place
+	bool Expand(MemDesc& desc, uint64_t delta)
+	{
+		if (ptr != reinterpret_cast<uint8_t*>(desc.ptr) + desc.size || Size - (ptr - region) < delta || !CommitUpTo(ptr + delta))
+		{
+			return false;
+		}
+		Private::AddResizeStat(m_stats, desc.size, desc.size + delta);
+		ptr += delta;
+		desc.size += delta;
+		return true;
+	}
+
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize)
+	{
+		if (newSize <= desc.size)
+		{
+			// The tail is given back only by the last block
+			if (ptr == reinterpret_cast<uint8_t*>(desc.ptr) + desc.size)
+			{
+				ptr -= desc.size - newSize;
+			}
+			Private::AddResizeStat(m_stats, desc.size, newSize);
+			return { desc.ptr, newSize };
+		}
+		if (Expand(desc, newSize - desc.size))
+		{
+			return desc;
+		}
+		return Private::ReallocateByCopy(*this, *this, desc, newSize);
+	}
+
+	void Deallocate(MemDesc desc)
+	{
+		Private::LatencySample sample(m_stats, true);
+		MY_ASSERT(Owns(desc), "Region allocator should own memory you are trying to free");
+		Private::AddDeallocateStat(m_stats, desc.size);
+		if ((ptr - desc.size) == desc.ptr)
+		{
+			ptr = reinterpret_cast<uint8_t*>(desc.ptr);
+			PurgeTail();
+		}
+	}
+
+	bool Owns(MemDesc desc) const
+	{
+		return desc.ptr >= region && desc.ptr < region + Size;
+	}
+
+	// Committed pages are in the page map
+	bool Owns(MemDesc, void const* owner) const { return owner == this; }
+
+	bool IsLast(MemDesc desc) const
+	{
+		return reinterpret_cast<uint8_t*>(desc.ptr) + desc.size == ptr;
+	}
+
+	// Everything allocated after the mark goes back at once
+	uint64_t Mark() const { return ptr - region; }
+
+	void Rewind(uint64_t mark)
+	{
+		MY_ASSERT(mark <= static_cast<uint64_t>(ptr - region), "Rewinding past the top of the region");
+		Private::AddRewindStat(m_stats, (ptr - region) - mark);
+		ptr = region + mark;
+		PurgeTail();
+	}
+
+	Private::AllocatorStatsReportPtr GetStats() const
+	{
+		auto report = std::make_unique<Private::AllocatorStatsReport>();
+		report->stats = m_stats.Read();
+		return std::move(report);
+	}
+private:
+	void PurgeTail()
+	{
+		uint8_t* const purgeBegin = region + Private::AlignUp(ptr - region, Private::GetPageSize());
+		if (touchedEnd > purgeBegin && static_cast<uint64_t>(touchedEnd - purgeBegin) >= PurgeThreshold)
+		{
+			Private::PurgePages(purgeBegin, Private::AlignUp(touchedEnd - purgeBegin, Private::GetPageSize()), true);
+			touchedEnd = purgeBegin;
+		}
+	}
+
+	bool CommitUpTo(uint8_t* end)
+	{
+		if (end > committedEnd)
+		{
+			uint8_t* const newCommittedEnd = region + std::min<uint64_t>(Private::AlignUp(end - region, CommitGranularity), reservedSize);
+			if (!Private::CommitPages(committedEnd, newCommittedEnd - committedEnd))
+			{
+				return false;
+			}
+			Private::GetPageMap().Register(committedEnd, newCommittedEnd - committedEnd, this);
+			committedEnd = newCommittedEnd;
+		}
+		touchedEnd = std::max(touchedEnd, end);
+		return true;
+	}
+
+	uint64_t reservedSize = 0;
+	uint8_t* region = nullptr;
+	uint8_t* ptr = nullptr;
+	uint8_t* committedEnd = nullptr;
+	uint8_t* touchedEnd = nullptr;
+	Private::AllocatorCounters m_stats = "RegionAllocator";
+};
+
+} // namespace Memory
@@ -0,0 +1,86 @@
+#include "ScopedArena.h"
+#include "RegionAllocator.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+namespace Memory
+{
+namespace Private
+{
+	// Only address space is reserved, a thread pays for the pages it touches
+	using ArenaType = RegionAllocator<1_gB>;
+
+	static ArenaType& GetThreadArena()
+	{
+		static thread_local ArenaType arena;
+		return arena;
+	}
+
+	// At or above the innermost mark still in use, blocks below it can't change the top:
+	// a rewind to that mark would free part of them or move the top under it
+	static ArenaMark& GetInnermostMark()
+	{
+		static thread_local ArenaMark mark = 0;
+		return mark;
+	}
+
+	static bool IsLastInScope(ArenaType const& arena, MemDesc descriptor)
+	{
+		return arena.IsLast(descriptor) && arena.Mark() - descriptor.size >= GetInnermostMark();
+	}
+} // namespace Private
+
+MemDesc ArenaAllocate(uint64_t sizeInBytes, uint64_t alignment)
+{
+	MY_ASSERT(alignment && (alignment & (alignment - 1)) == 0, "Alignment should be a power of two");
+	return Private::GetThreadArena().Allocate(sizeInBytes, alignment);
+}
+
+MemDesc ArenaReallocate(MemDesc descriptor, uint64_t newSizeInBytes)
+{
+	Private::ArenaType& arena = Private::GetThreadArena();
+	if (!descriptor.ptr)
+	{
+		return arena.Allocate(newSizeInBytes, alignof(std::max_align_t));
+	}
+	if (newSizeInBytes <= descriptor.size || (Private::IsLastInScope(arena, descriptor) && arena.Expand(descriptor, newSizeInBytes - descriptor.size)))
+	{
+		return { descriptor.ptr, newSizeInBytes };
+	}
+	// The old block isn't deallocated, it only goes back with a rewind
+	MemDesc desc = arena.Allocate(newSizeInBytes, alignof(std::max_align_t));
+	if (desc.ptr)
+	{
+		std::memcpy(desc.ptr, descriptor.ptr, descriptor.size);
+	}
+	return desc;
+}
+
+void ArenaDeallocate(MemDesc descriptor)
+{
+	Private::ArenaType& arena = Private::GetThreadArena();
+	if (descriptor.ptr && Private::IsLastInScope(arena, descriptor))
+	{
+		arena.Deallocate(descriptor);
+	}
+}
+
+ArenaMark GetArenaMark()
+{
+	ArenaMark const mark = Private::GetThreadArena().Mark();
+	ArenaMark& innermost = Private::GetInnermostMark();
+	innermost = std::max(innermost, mark);
+	return mark;
+}
+
+// Marks nest, the ones above mark are gone and the ones below are at most mark
+void ArenaRewind(ArenaMark mark)
+{
+	Private::GetThreadArena().Rewind(mark);
+	ArenaMark& innermost = Private::GetInnermostMark();
+	innermost = std::min(innermost, mark);
+}
+
+} // namespace Memory
@@ -0,0 +1,226 @@
+#pragma once
+#include "Allocators.h"
+#include "BitUtils.h"
+
+namespace Memory
+{
+
+namespace Private
+{
+	/*
+	Size classes from 8 to 4096 bytes.
+	Up to 128 bytes classes are 8 bytes apart, above that every power of two
+	is split into 4 classes: 160, 192, 224, 256, 320, ... 3584, 4096.
+	*/
+	struct SizeClasses
+	{
+		static constexpr uint64_t Count = 36;
+		static constexpr uint64_t MaxSize = 4096;
+
+		static uint64_t Index(uint64_t size)
+		{
+			if (size <= 128)
+			{
+				return size <= 8 ? 0 : (size + 7) / 8 - 1;
+			}
+			uint32_t const lg = Log2Floor(size - 1);
+			return 16 + (lg - 7) * 4 + ((size - 1) >> (lg - 2)) - 4;
+		}
+
+		static uint64_t Size(uint64_t idx)
+		{
+			if (idx < 16)
+			{
+				return (idx + 1) * 8;
+			}
+			uint64_t const group = (idx - 16) / 4;
+			uint64_t const step = idx - 16 - group * 4;
+			return (step + 5) << (group + 5);
+		}
+	};
+} // namespace Private
+
+/*
+Serves sizes up to 4096 bytes from per size class free lists.
+Empty lists are refilled by carving fixed-size slots out of slabs:
+whole pages taken from Allocator, big enough for at least MinSlotsPerSlab slots.
+Bigger sizes go straight to Allocator. Slabs are never given back.
+
+Slabs are page aligned, so a slot is aligned to the biggest power of two
+dividing its size. Aligned allocations take the first class that is a multiple
+of the alignment, and return its size so Deallocate() finds the same class.
+*/
+template <typename Allocator, size_t PageSize = 4096>
+class SlabAllocator
+{
+public:
+	static constexpr uint64_t MinSlotsPerSlab = 8;
+
+	static_assert(PageSize >= Private::SizeClasses::MaxSize, "Any slot alignment should fit in a page");
+
+	SlabAllocator() = default;
+	SlabAllocator(SlabAllocator&&) = delete;
+	SlabAllocator(SlabAllocator const&) = delete;
+	SlabAllocator& operator=(SlabAllocator&&) = delete;
+	SlabAllocator& operator=(SlabAllocator const&) = delete;
+
+	MemDesc Allocate(uint64_t size)
+	{
+		Private::LatencySample sample(m_stats, false);
+		if (size == 0 || size > Private::SizeClasses::MaxSize)
+		{
+			return allocator.Allocate(size);
+		}
+
+		uint64_t const idx = Private::SizeClasses::Index(size);
+		void* ptr = AllocateSlot(idx);
+		return { ptr, ptr ? size : 0 };
+	}
+
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		Private::LatencySample sample(m_stats, false);
+		uint64_t const alignedSize = Private::AlignUp(size, alignment);
+		if (size == 0 || alignedSize > Private::SizeClasses::MaxSize)
+		{
+			return allocator.Allocate(size, alignment);
+		}
+
+		uint64_t idx = Private::SizeClasses::Index(alignedSize);
+		while (Private::SizeClasses::Size(idx) & (alignment - 1))
+		{
+			++idx;
+		}
+		void* ptr = AllocateSlot(idx);
+		if (!ptr)
+		{
+			return { nullptr, 0 };
+		}
+		Private::AddPaddingStat(m_stats, Private::SizeClasses::Size(idx) - Private::SizeClasses::Size(Private::SizeClasses::Index(size)));
+		return { ptr, Private::SizeClasses::Size(idx) };
+	}
+
+	// Blocks stay in place while the size class doesn't change
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize)
+	{
+		bool const small = desc.size && desc.size <= Private::SizeClasses::MaxSize;
+		bool const newSmall = newSize && newSize <= Private::SizeClasses::MaxSize;
+		if (!small && !newSmall)
+		{
+			return allocator.Reallocate(desc, newSize);
+		}
+		if (small && newSmall && Private::SizeClasses::Index(desc.size) == Private::SizeClasses::Index(newSize))
+		{
+			return { desc.ptr, newSize };
+		}
+		return Private::ReallocateByCopy(*this, *this, desc, newSize);
+	}
+
+	bool Expand(MemDesc& desc, uint64_t delta)
+	{
+		uint64_t const newSize = desc.size + delta;
+		if (desc.size == 0 || desc.size > Private::SizeClasses::MaxSize)
+		{
+			return allocator.Expand(desc, delta);
+		}
+		if (newSize > Private::SizeClasses::MaxSize || Private::SizeClasses::Index(desc.size) != Private::SizeClasses::Index(newSize))
+		{
+			return false;
+		}
+		desc.size = newSize;
+		return true;
+	}
+
+	uint64_t GoodSize(uint64_t size) const
+	{
+		if (size == 0 || size > Private::SizeClasses::MaxSize)
+		{
+			return allocator.GoodSize(size);
+		}
+		return Private::SizeClasses::Size(Private::SizeClasses::Index(size));
+	}
+
+	void Deallocate(MemDesc desc)
+	{
+		Private::LatencySample sample(m_stats, true);
+		if (desc.size == 0 || desc.size > Private::SizeClasses::MaxSize)
+		{
+			allocator.Deallocate(desc);
+			return;
+		}
+
+		uint64_t const idx = Private::SizeClasses::Index(desc.size);
+		Private::AddDeallocateStat(m_stats, Private::SizeClasses::Size(idx));
+		Node* node = reinterpret_cast<Node*>(desc.ptr);
+		node->next = classes[idx].list;
+		classes[idx].list = node;
+	}
+
+	// Slabs are carved out of Allocator memory, so it knows about every slot
+	bool Owns(MemDesc desc) const { return allocator.Owns(desc); }
+
+	bool Owns(MemDesc desc, void const* owner) const { return Private::Owns(allocator, desc, owner); }
+
+	Private::AllocatorStatsReportPtr GetStats() const
+	{
+		auto report = std::make_unique<Private::AllocatorStatsReport>();
+		report->stats = m_stats.Read();
+		report->nested.push_back(std::move(allocator.GetStats()));
+		return std::move(report);
+	}
+
+private:
+	struct Node
+	{
+		Node* next;
+	};
+
+	struct SizeClass
+	{
+		Node* list = nullptr;
+		uint8_t* slabPtr = nullptr;
+		uint8_t* end = nullptr;
+	};
+
+	void* AllocateSlot(uint64_t idx)
+	{
+		SizeClass& sizeClass = classes[idx];
+		uint64_t const slotSize = Private::SizeClasses::Size(idx);
+		void* ptr = nullptr;
+		if (sizeClass.list)
+		{
+			ptr = sizeClass.list;
+			sizeClass.list = sizeClass.list->next;
+		}
+		else
+		{
+			if (sizeClass.end - sizeClass.slabPtr < static_cast<ptrdiff_t>(slotSize) && !AllocateSlab(sizeClass, slotSize))
+			{
+				return nullptr;
+			}
+			ptr = sizeClass.slabPtr;
+			sizeClass.slabPtr += slotSize;
+		}
+		Private::AddAllocationStat(m_stats, slotSize);
+		return ptr;
+	}
+
+	bool AllocateSlab(SizeClass& sizeClass, uint64_t slotSize)
+	{
+		uint64_t const slabSize = Private::AlignUp(slotSize * MinSlotsPerSlab, PageSize);
+		MemDesc slab = allocator.Allocate(slabSize, PageSize);
+		if (!slab.ptr)
+		{
+			return false;
+		}
+		sizeClass.slabPtr = reinterpret_cast<uint8_t*>(slab.ptr);
+		sizeClass.end = sizeClass.slabPtr + slabSize;
+		return true;
+	}
+
+	Allocator allocator;
+	SizeClass classes[Private::SizeClasses::Count];
+	Private::AllocatorCounters m_stats = "SlabAllocator";
+};
+
+} // namespace Memory
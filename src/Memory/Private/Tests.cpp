@@ -1,8 +1,41 @@
 #include "Tests.h"
 #include "Utils/Testy.h"
 
+#include "AtomicSharedHandle.h"
+#include "CompactingHeap.h"
+#include "IntrusiveHandle.h"
 #include "MemDesc.h"
+#include "Memory.h"
+#include "MemoryResource.h"
+#include "Pool.h"
+#include "Reclamation.h"
+#include "ScopedArena.h"
+#include "SharedHandle.h"
+#include "StdAllocator.h"
+#include "UniqueHandle.h"
 #include "Allocators.h"
+#include "AllocationTrace.h"
+#include "BitmappedBlockAllocator.h"
+#include "BuddyAllocator.h"
+#include "CallSites.h"
+#include "ConcurrentFreelistAllocator.h"
+#include "LockedAllocator.h"
+#include "MemoryExport.h"
+#include "MemoryTags.h"
+#include "PageMap.h"
+#include "RegionAllocator.h"
+#include "SlabAllocator.h"
+#include "ThreadCachedAllocator.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory_resource>
+#include <thread>
+#include <vector>
 
 using namespace Memory;
 
@@ -39,6 +72,35 @@ void TestLinearAllocator(std::string const& name)
 	ASSERT(sixteenBytes.ptr, "Can deallocate last block of memory");
 }
 
+template <size_t Size>
+using DefaultRegionAllocator = RegionAllocator<Size>;
+
+void TestRegionAllocator()
+{
+	TEST("Test RegionAllocator");
+
+	RegionAllocator<64_mB> ator;
+	MemDesc first = ator.Allocate(16);
+	ASSERT(first.ptr, "Allocate from the reserved region");
+	MemDesc big = ator.Allocate(8_mB);
+	ASSERT(big.ptr, "Pages are committed as the region grows");
+	std::memset(big.ptr, 0xab, big.size);
+
+	ator.Deallocate(big);
+	MemDesc again = ator.Allocate(8_mB);
+	ASSERT(again.ptr == big.ptr, "Purged pages are reused");
+	std::memset(again.ptr, 0xcd, again.size);
+	ator.Deallocate(again);
+
+	MemDesc tooBig = ator.Allocate(64_mB);
+	ASSERT(tooBig.ptr == nullptr, "Can't allocate more than the region");
+
+	RegionAllocator<4_mB, true> hugeAtor;
+	MemDesc huge = hugeAtor.Allocate(3_mB);
+	ASSERT(huge.ptr && (reinterpret_cast<uintptr_t>(huge.ptr) & (2_mB - 1)) == 0, "Huge page regions are aligned to 2 Mb");
+	std::memset(huge.ptr, 0xef, huge.size);
+}
+
 struct TestAllocator
 {
 	static int counter;
@@ -86,13 +148,25 @@ struct TestStackAllocator1
 		return allocator.Allocate(size);
 	}
 
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		++testStackAllocatorCounter1;
+		return allocator.Allocate(size, alignment);
+	}
+
 	void Deallocate(MemDesc desc)
 	{
 		--testStackAllocatorCounter1;
 		allocator.Deallocate(desc);
 	}
 
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize) { return allocator.Reallocate(desc, newSize); }
+
+	uint64_t GoodSize(uint64_t size) const { return allocator.GoodSize(size); }
+
 	bool Owns(MemDesc desc) const { return allocator.Owns(desc); }
+
+	Private::AllocatorStatsReportPtr GetStats() const { return allocator.GetStats(); }
 private:
 	StackAllocator<Size> allocator;
 };
@@ -106,6 +180,12 @@ struct TestStackAllocator2
 		return allocator.Allocate(size);
 	}
 
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		++testStackAllocatorCounter2;
+		return allocator.Allocate(size, alignment);
+	}
+
 	void Deallocate(MemDesc desc)
 	{
 		--testStackAllocatorCounter2;
@@ -164,12 +244,1618 @@ void TestFreelistAllocator()
 	ASSERT(testStackAllocatorCounter1 == 2, "Deallocate to the free list");
 }
 
+void TestBatchedFreelistAllocator()
+{
+	TEST("Test FreelistAllocator with a size range");
+	testStackAllocatorCounter1 = 0;
+
+	{
+		FreelistAllocator<TestStackAllocator1<1024>, 49, 64, 4, 6> ator;
+		MemDesc first = ator.Allocate(49);
+		ASSERT(first.ptr && testStackAllocatorCounter1 == 4 && ator.Length() == 3, "Refill the list with a batch of blocks");
+		ASSERT(ator.GoodSize(50) == 64, "Blocks of the range are as big as its upper bound");
+
+		MemDesc blocks[8] = { first };
+		for (int i = 1; i < 8; ++i)
+		{
+			blocks[i] = ator.Allocate(49 + i * 2);
+		}
+		ASSERT(testStackAllocatorCounter1 == 8 && ator.Length() == 0, "Every size in the range comes from the list");
+
+		MemDesc outside = ator.Allocate(65);
+		ASSERT(outside.ptr && testStackAllocatorCounter1 == 9, "Sizes out of the range go to the allocator");
+		ator.Deallocate(outside);
+
+		for (MemDesc desc : blocks)
+		{
+			ator.Deallocate(desc);
+		}
+		ASSERT(ator.Length() == 6 && testStackAllocatorCounter1 == 6, "Blocks over the list limit go back to the allocator");
+
+		MemDesc grown = ator.Reallocate(ator.Allocate(50), 64);
+		ASSERT(grown.ptr && grown.size == 64 && ator.Length() == 5, "Blocks are resized in place within the range");
+		ator.Deallocate(grown);
+		ASSERT(ator.GetStats()->stats.hits == 7 && ator.GetStats()->stats.misses == 2, "Hits and misses are counted");
+		ASSERT(ator.GetStats()->stats.countDeallocated == 9 && ator.GetStats()->stats.unallocated == 0, "Blocks given back over the list limit are counted as freed");
+	}
+	ASSERT(testStackAllocatorCounter1 == 0, "The list goes back to the allocator on destruction");
+}
+
+void TestBitmappedBlockAllocator()
+{
+	TEST("Test BitmappedBlockAllocator");
+
+	BitmappedBlockAllocator<MallocAllocator, 48, 100> ator;
+	ASSERT(ator.FreeBlocks() == 100, "All blocks are free at construction");
+
+	MemDesc first = ator.Allocate(48);
+	ASSERT(first.ptr && ator.Owns(first), "Allocate a block");
+	ASSERT(ator.Allocate(49).ptr == nullptr, "Can't allocate more than a block");
+	ASSERT(ator.Allocate(16, 32).ptr == nullptr, "Can't align more than the blocks are");
+	MemDesc aligned = ator.Allocate(8, 16);
+	ASSERT(aligned.ptr && (reinterpret_cast<uintptr_t>(aligned.ptr) & 15) == 0, "Blocks are aligned to the power of two dividing their size");
+
+	std::vector<MemDesc> blocks;
+	for (MemDesc desc = ator.Allocate(40); desc.ptr && blocks.size() < 100; desc = ator.Allocate(40))
+	{
+		blocks.push_back(desc);
+	}
+	ASSERT(blocks.size() == 98 && ator.FreeBlocks() == 0, "Allocate every block");
+
+	ator.Deallocate(blocks[70]);
+	ASSERT(ator.FreeBlocks() == 1, "Deallocated block is free");
+	MemDesc again = ator.Allocate(48);
+	ASSERT(again.ptr == blocks[70].ptr, "Freed block is reused");
+
+	MemDesc outside = { &first, 48 };
+	ASSERT(!ator.Owns(outside), "Doesn't own memory outside of its blocks");
+
+	ator.DeallocateAll();
+	ASSERT(ator.FreeBlocks() == 100, "Deallocate all blocks at once");
+	ASSERT(ator.Allocate(48).ptr == first.ptr, "Blocks are reused after deallocating all");
+
+	testStackAllocatorCounter1 = 0;
+	FallbackAllocator<BitmappedBlockAllocator<MallocAllocator, 64, 64>, TestStackAllocator1<4096>> fallback;
+	std::vector<MemDesc> handles;
+	for (int i = 0; i < 100; ++i)
+	{
+		handles.push_back(fallback.Allocate(sizeof(uint64_t) + sizeof(uint64_t), 8));
+	}
+	ASSERT(handles[99].ptr && testStackAllocatorCounter1 == 36, "Falls back when the blocks run out");
+	fallback.Deallocate(handles[99]);
+	ASSERT(testStackAllocatorCounter1 == 35, "Blocks past the last one are owned by the fallback allocator");
+	handles.pop_back();
+	for (MemDesc desc : handles)
+	{
+		fallback.Deallocate(desc);
+	}
+	ASSERT(testStackAllocatorCounter1 == 0, "Blocks go back to the allocator that owns them");
+}
+
+void TestSlabAllocator()
+{
+	TEST("Test SlabAllocator");
+	testStackAllocatorCounter1 = 0;
+
+	using Classes = Memory::Private::SizeClasses;
+	for (uint64_t idx = 0; idx < Classes::Count; ++idx)
+	{
+		ASSERT(Classes::Index(Classes::Size(idx)) == idx, "Size class table is consistent");
+	}
+	ASSERT(Classes::Size(Classes::Count - 1) == Classes::MaxSize, "Last size class is the biggest size");
+	for (uint64_t size = 1; size <= Classes::MaxSize; ++size)
+	{
+		uint64_t const idx = Classes::Index(size);
+		ASSERT(Classes::Size(idx) >= size && (idx == 0 || Classes::Size(idx - 1) < size), "Sizes map to the smallest fitting class");
+	}
+
+	SlabAllocator<TestStackAllocator1<64 * 1024>> ator;
+	ASSERT(testStackAllocatorCounter1 == 0, "No allocations at construction");
+
+	MemDesc first = ator.Allocate(40);
+	ASSERT(first.ptr && first.size == 40 && testStackAllocatorCounter1 == 1, "Allocate a slab for the first block");
+	MemDesc second = ator.Allocate(40);
+	ASSERT(second.ptr && testStackAllocatorCounter1 == 1, "Next block of the class comes from the same slab");
+	ASSERT(reinterpret_cast<uint8_t*>(second.ptr) - reinterpret_cast<uint8_t*>(first.ptr) == 40, "Slots are carved one after another");
+
+	ator.Deallocate(first);
+	MemDesc third = ator.Allocate(33);
+	ASSERT(third.ptr == first.ptr && testStackAllocatorCounter1 == 1, "Freed slots are reused by the same class");
+
+	MemDesc other = ator.Allocate(1000);
+	ASSERT(other.ptr && testStackAllocatorCounter1 == 2, "Another class gets its own slab");
+	ASSERT(ator.Owns(other) && ator.Owns(third), "Slots are owned");
+
+	MemDesc big = ator.Allocate(5000);
+	ASSERT(big.ptr && testStackAllocatorCounter1 == 3, "Sizes above the classes go to the allocator");
+	ator.Deallocate(big);
+	ASSERT(testStackAllocatorCounter1 == 2, "Sizes above the classes are deallocated by the allocator");
+}
+
+void TestBuddyAllocator()
+{
+	TEST("Test BuddyAllocator");
+
+	BuddyAllocator<1024, 64> ator;
+	MemDesc a = ator.Allocate(64);
+	MemDesc b = ator.Allocate(50);
+	MemDesc c = ator.Allocate(128);
+	ASSERT(a.ptr && b.ptr && c.ptr && b.size == 50, "Allocate blocks of different sizes");
+	uint8_t* const base = reinterpret_cast<uint8_t*>(a.ptr);
+	ASSERT(reinterpret_cast<uint8_t*>(b.ptr) == base + 64, "Small block is taken from the split buddy");
+	ASSERT(reinterpret_cast<uint8_t*>(c.ptr) == base + 128, "Blocks are aligned to their size");
+	ASSERT(ator.Owns(a) && ator.Owns(c), "Owns its blocks");
+
+	ator.Deallocate(a);
+	MemDesc d = ator.Allocate(64);
+	ASSERT(d.ptr == a.ptr, "Reuse a freed block which is not the last one");
+
+	MemDesc noMoreBytes = ator.Allocate(1024);
+	ASSERT(noMoreBytes.ptr == nullptr, "Can't allocate the whole region while blocks are in use");
+
+	ator.Deallocate(d);
+	ator.Deallocate(b);
+	MemDesc merged = ator.Allocate(128);
+	ASSERT(merged.ptr == a.ptr, "Freed buddies are merged");
+	ator.Deallocate(merged);
+
+	auto stats = ator.GetStats();
+	ASSERT(stats->stats.freeBytes == 1024 - 128, "Free bytes are reported");
+	ASSERT(stats->stats.largestFreeBlock == 512, "Largest free block is reported");
+
+	ator.Deallocate(c);
+	MemDesc whole = ator.Allocate(1024);
+	ASSERT(whole.ptr == a.ptr, "All blocks are merged back into the whole region");
+}
+
+void TestPageMap()
+{
+	TEST("Test PageMap");
+
+	Private::PageMap& pageMap = Private::GetPageMap();
+	int owner = 0;
+	void* ptr = Private::MapPages(3 * 4096);
+	ASSERT(pageMap.Lookup(ptr) == nullptr, "Pages nobody registered have no owner");
+	pageMap.Register(static_cast<uint8_t*>(ptr) + 100, 8192, &owner);
+	ASSERT(pageMap.Lookup(static_cast<uint8_t*>(ptr) + 3 * 4096 - 1) == &owner && pageMap.Lookup(ptr) == &owner, "Every page touching the range is registered");
+	pageMap.Unregister(ptr, 3 * 4096);
+	ASSERT(pageMap.Lookup(static_cast<uint8_t*>(ptr) + 4096) == nullptr, "Unregistered pages have no owner");
+	uint8_t tag = 1;
+	ASSERT(pageMap.Lookup(ptr, tag) == nullptr && tag == 0, "Blocks start without a tag");
+	pageMap.SetByte(static_cast<uint8_t*>(ptr) + 16, Private::PageMap::TagLane, 3);
+	pageMap.Lookup(static_cast<uint8_t*>(ptr) + 16, tag);
+	ASSERT(tag == 3, "Blocks keep their tag");
+	pageMap.Lookup(ptr, tag);
+	ASSERT(tag == 0, "Blocks 16 bytes apart have their own tags");
+	ASSERT(pageMap.GetByte(static_cast<uint8_t*>(ptr) + 16, Private::PageMap::SizeLane) == 0, "Lanes keep their own bytes");
+	pageMap.SetByte(static_cast<uint8_t*>(ptr) + 16, Private::PageMap::TagLane, 0);
+	pageMap.SetWord(static_cast<uint8_t*>(ptr) + 4096 + 100, 5000);
+	ASSERT(pageMap.GetWord(static_cast<uint8_t*>(ptr) + 4096) == 5000 && pageMap.GetWord(ptr) == 0, "Pages keep their own word");
+	pageMap.SetWord(static_cast<uint8_t*>(ptr) + 4096, 0);
+	Private::ReleaseAddressSpace(ptr, 3 * 4096);
+
+	using Deep = FallbackAllocator<
+		SlabAllocator<RegionAllocator<1_mB>>,
+		FallbackAllocator<
+			RegionAllocator<1_mB>,
+			FallbackAllocator<
+				BuddyAllocator<1_mB, 64>,
+				MallocAllocator
+			>
+		>
+	>;
+	auto deep = std::make_unique<Deep>();
+	std::vector<MemDesc> blocks;
+	for (int i = 0; i < 64; ++i)
+	{
+		blocks.push_back(deep->Allocate(64_kB - 64));
+	}
+	void const* firstOwner = pageMap.Lookup(blocks.front().ptr);
+	void const* nestedOwner = pageMap.Lookup(blocks[20].ptr);
+	ASSERT(firstOwner && nestedOwner && nestedOwner != firstOwner, "Nested allocators register their own pages");
+	ASSERT(pageMap.Lookup(blocks.back().ptr) == nullptr, "Small malloc blocks aren't in the page map");
+	for (MemDesc desc : blocks)
+	{
+		deep->Deallocate(desc);
+	}
+	MemDesc again = deep->Allocate(64_kB - 64);
+	ASSERT(pageMap.Lookup(again.ptr) == firstOwner, "Blocks go back to the allocator that owns their pages");
+	deep->Deallocate(again);
+	void* region = blocks.front().ptr;
+	deep.reset();
+	ASSERT(pageMap.Lookup(region) == nullptr, "Pages are unregistered with their allocator");
+
+	FreelistAllocator<StackAllocator<64>, 48> freelist;
+	uint8_t foreign[48];
+	ASSERT(!freelist.Owns({ foreign, sizeof(foreign) }), "FreelistAllocator doesn't own blocks of its size from elsewhere");
+}
+
+void TestThreadCachedAllocator()
+{
+	TEST("Test ThreadCachedAllocator");
+	testStackAllocatorCounter1 = 0;
+
+	using Allocator = ThreadCachedAllocator<TestStackAllocator1<64 * 1024>, 64>;
+	Allocator ator;
+	ASSERT(testStackAllocatorCounter1 == 0, "No allocations at construction");
+
+	MemDesc first = ator.Allocate(24);
+	ASSERT(first.ptr && first.size == 24, "Allocate a small block");
+	ASSERT(testStackAllocatorCounter1 == Allocator::BatchSize, "Cache is refilled with a batch of blocks");
+
+	ator.Deallocate(first);
+	MemDesc second = ator.Allocate(32);
+	ASSERT(second.ptr == first.ptr, "Blocks of the same size class are reused from the cache");
+	ator.Deallocate(second);
+
+	MemDesc big = ator.Allocate(128);
+	ASSERT(big.ptr && testStackAllocatorCounter1 == Allocator::BatchSize + 1, "Big blocks bypass the cache");
+	ator.Deallocate(big);
+	ASSERT(testStackAllocatorCounter1 == Allocator::BatchSize, "Big blocks are deallocated by the allocator");
+
+	std::vector<MemDesc> blocks;
+	for (uint32_t i = 0; i < Allocator::BatchSize * 4; ++i)
+	{
+		blocks.push_back(ator.Allocate(48));
+	}
+	int const allocatedBlocks = testStackAllocatorCounter1;
+
+	std::thread remote([&ator, &blocks]()
+	{
+		for (MemDesc desc : blocks)
+		{
+			ator.Deallocate(desc);
+		}
+	});
+	remote.join();
+	ASSERT(testStackAllocatorCounter1 == allocatedBlocks, "Remote frees don't touch the allocator");
+
+	for (uint32_t i = 0; i < Allocator::BatchSize * 4; ++i)
+	{
+		blocks[i] = ator.Allocate(48);
+	}
+	ASSERT(testStackAllocatorCounter1 == allocatedBlocks, "Remotely freed blocks are reused");
+	for (MemDesc desc : blocks)
+	{
+		ator.Deallocate(desc);
+	}
+	Private::AllocatorStats const stats = ator.GetStats()->stats;
+	ASSERT(stats.countDeallocated == stats.countAllocated && stats.unallocated == 0, "Only blocks callers free count as deallocations");
+}
+
+void TestConcurrentFreelistAllocator()
+{
+	TEST("Test ConcurrentFreelistAllocator");
+	testStackAllocatorCounter1 = 0;
+
+	{
+		using Allocator = ConcurrentFreelistAllocator<TestStackAllocator1<64 * 1024>, 32, 8>;
+		Allocator ator;
+		MemDesc first = ator.Allocate(32);
+		ASSERT(first.ptr && testStackAllocatorCounter1 == 8, "Empty list is refilled with a batch of blocks");
+		ator.Deallocate(first);
+		MemDesc again = ator.Allocate(32);
+		ASSERT(again.ptr == first.ptr, "Freed blocks are reused");
+		MemDesc other = ator.Allocate(48);
+		ASSERT(other.ptr && testStackAllocatorCounter1 == 9, "Other sizes go to the parent");
+		ator.Deallocate(other);
+		ator.Deallocate(again);
+	}
+	ASSERT(testStackAllocatorCounter1 == 0, "The list goes back to the parent on destruction");
+
+	// Every thread stamps the blocks it holds, a block handed out twice gets overwritten
+	ConcurrentFreelistAllocator<RegionAllocator<64_mB>, 64> ator;
+	std::atomic<bool> corrupted = { false };
+	std::vector<std::thread> threads;
+	for (uint64_t t = 0; t < 8; ++t)
+	{
+		threads.emplace_back([&ator, &corrupted, t]()
+		{
+			MemDesc held[16];
+			for (int i = 0; i < 20000; ++i)
+			{
+				for (uint64_t j = 0; j < 16; ++j)
+				{
+					held[j] = ator.Allocate(64);
+					static_cast<uint64_t*>(held[j].ptr)[1] = t * 16 + j;
+				}
+				for (uint64_t j = 0; j < 16; ++j)
+				{
+					if (static_cast<uint64_t*>(held[j].ptr)[1] != t * 16 + j)
+					{
+						corrupted = true;
+					}
+					ator.Deallocate(held[j]);
+				}
+			}
+		});
+	}
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+	ASSERT(!corrupted, "Blocks aren't handed out twice under contention");
+}
+
+void TestAllocatorStats()
+{
+	TEST("Test allocator stats");
+
+	HeapAllocator<4096> heap;
+	MemDesc small = heap.Allocate(10);
+	MemDesc medium = heap.Allocate(100);
+	MemDesc big = heap.Allocate(1000);
+	heap.Deallocate(big);
+	heap.Deallocate(medium);
+	MemDesc again = heap.Allocate(16);
+	Private::AllocatorStats stats = heap.GetStats()->stats;
+	ASSERT(stats.countAllocated == 4 && stats.sizes[3] == 1 && stats.sizes[4] == 1 && stats.sizes[6] == 1 && stats.sizes[9] == 1, "Allocations are counted by log2 of their size");
+	ASSERT(stats.unallocated == 26 && stats.peakUnallocated == 1110, "Peak keeps the high-water mark");
+	heap.Deallocate(again);
+	heap.Deallocate(small);
+
+	uint64_t sampled = 0;
+	for (uint32_t i = 0; i < 2 * Private::AllocatorCounters::LatencySamplePeriod; ++i)
+	{
+		heap.Deallocate(heap.Allocate(64));
+	}
+	stats = heap.GetStats()->stats;
+	for (uint32_t i = 0; i < Private::LatencyBuckets; ++i)
+	{
+		sampled += stats.allocateLatency[i] + stats.deallocateLatency[i];
+	}
+	ASSERT(sampled >= 2 && sampled <= 6, "One in LatencySamplePeriod calls is timed");
+
+	ConcurrentFreelistAllocator<RegionAllocator<64_mB>, 64> shared;
+	std::vector<std::thread> threads;
+	// More threads than shard slots, the ones left over share a shard
+	for (int t = 0; t < 24; ++t)
+	{
+		threads.emplace_back([&shared]()
+		{
+			for (int i = 0; i < 10000; ++i)
+			{
+				shared.Deallocate(shared.Allocate(64));
+			}
+		});
+	}
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+	stats = shared.GetStats()->stats;
+	ASSERT(stats.countAllocated == 240000 && stats.countDeallocated == 240000 && stats.unallocated == 0, "Sharded counters merge exactly");
+	ASSERT(stats.hits + stats.misses == 240000, "Hits and misses are kept across threads");
+
+	// Blocks allocated here and freed on another thread, never more than a thousand live
+	ConcurrentFreelistAllocator<RegionAllocator<64_mB>, 64> handedOff;
+	for (int round = 0; round < 100; ++round)
+	{
+		std::vector<MemDesc> blocks;
+		for (int i = 0; i < 1000; ++i)
+		{
+			blocks.push_back(handedOff.Allocate(64));
+		}
+		std::thread([&handedOff, &blocks]()
+		{
+			for (MemDesc desc : blocks)
+			{
+				handedOff.Deallocate(desc);
+			}
+		}).join();
+	}
+	stats = handedOff.GetStats()->stats;
+	ASSERT(stats.unallocated == 0 && stats.peakUnallocated <= 1000 * 64, "Peak is the live bytes of all the threads together");
+}
+
+static bool IsAligned(MemDesc desc, uint64_t alignment)
+{
+	return (reinterpret_cast<uintptr_t>(desc.ptr) & (alignment - 1)) == 0;
+}
+
+template <typename Allocator>
+void TestAlignedAllocator(std::string const& name, uint64_t maxAlignment)
+{
+	TEST(name);
+
+	Allocator ator;
+	// An odd sized block first, so the next one isn't aligned by chance
+	MemDesc odd = ator.Allocate(24, 8);
+	ASSERT(odd.ptr && odd.size == 24, "Size is already a multiple of the alignment");
+	std::vector<MemDesc> blocks;
+	for (uint64_t alignment = 1; alignment <= maxAlignment; alignment *= 2)
+	{
+		MemDesc desc = ator.Allocate(alignment + 1, alignment);
+		ASSERT(desc.ptr && IsAligned(desc, alignment), "Block is aligned");
+		ASSERT(desc.size >= Private::AlignUp(alignment + 1, alignment) && desc.size % alignment == 0, "Size is rounded up to the alignment");
+		std::memset(desc.ptr, 0xab, desc.size);
+		blocks.push_back(desc);
+	}
+	for (MemDesc desc : blocks)
+	{
+		ator.Deallocate(desc);
+	}
+	ator.Deallocate(odd);
+}
+
+void TestAlignment()
+{
+	TEST("Test aligned allocations");
+
+	StackAllocator<64> stack;
+	MemDesc oneByte = stack.Allocate(1);
+	MemDesc aligned = stack.Allocate(8, 16);
+	ASSERT(aligned.ptr && IsAligned(aligned, 16) && aligned.size == 16, "Skip to the next aligned address");
+	stack.Deallocate(aligned);
+	stack.Deallocate(oneByte);
+	ASSERT(stack.GetStats()->stats.padding > 8, "Padding shows up in the stats");
+
+	FreelistAllocator<StackAllocator<1024>, 64> freelist;
+	MemDesc block = freelist.Allocate(64, 64);
+	freelist.Deallocate(block);
+	MemDesc fromList = freelist.Allocate(56, 32);
+	ASSERT(fromList.ptr == block.ptr && fromList.size == 64, "Aligned blocks of the list size come from the list");
+	freelist.Deallocate(fromList);
+
+	struct alignas(64) Aligned
+	{
+		uint8_t data[8];
+	};
+	MemDesc global = Memory::Allocate(sizeof(Aligned), alignof(Aligned));
+	ASSERT(global.ptr && IsAligned(global, 64), "Global allocator aligns blocks");
+	Memory::Deallocate(global);
+
+	// Past the slab sizes too, with REPLACE_NEW_DELETE that is Memory::Allocate
+	for (uint64_t size : { 1, 100, 4096, 10000, 100000 })
+	{
+		uint8_t* bytes = new uint8_t[size];
+		ASSERT(IsAligned({ bytes, size }, __STDCPP_DEFAULT_NEW_ALIGNMENT__), "operator new keeps the default new alignment");
+		delete[] bytes;
+	}
+
+	// Sized and unsized deletes free what new took
+	MemoryTag const tag = RegisterMemoryTag("Test operator delete");
+	{
+		ScopedMemoryTag guard(tag);
+		for (std::size_t size : { 0, 1, 100, 144, 3000, 4000, 4096, 5000, 100000 })
+		{
+			::operator delete(::operator new(size));
+			::operator delete(::operator new(size), size);
+			::operator delete(::operator new(size, std::align_val_t(64)), std::align_val_t(64));
+			::operator delete(::operator new(size, std::align_val_t(64)), size, std::align_val_t(64));
+		}
+	}
+	ASSERT(GetMemoryTagUsage(tag) == 0, "Deletes free the size new allocated");
+
+	UniqueHandle<Aligned> unique = MakeUnique<Aligned>();
+	ASSERT(IsAligned({ &*unique, sizeof(Aligned) }, 64), "MakeUnique aligns over-aligned types");
+	SharedHandle<Aligned> shared = MakeShared<Aligned>();
+	ASSERT(IsAligned({ shared.Get(), sizeof(Aligned) }, 64), "MakeShared aligns over-aligned types");
+}
+
+void TestReallocation()
+{
+	TEST("Test Reallocate and Expand");
+
+	StackAllocator<256> stack;
+	MemDesc first = stack.Allocate(32);
+	ASSERT(stack.Expand(first, 32) && first.size == 64, "Last block grows in place");
+	ASSERT(stack.Allocate(32).ptr && !stack.Expand(first, 32), "Only the last block grows in place");
+	std::memset(first.ptr, 0xab, first.size);
+	MemDesc moved = stack.Reallocate(first, 96);
+	ASSERT(moved.ptr && moved.ptr != first.ptr && reinterpret_cast<uint8_t*>(moved.ptr)[63] == 0xab, "Other blocks are moved with their contents");
+	MemDesc grown = stack.Reallocate(moved, 128);
+	ASSERT(grown.ptr == moved.ptr && grown.size == 128, "Reallocate grows the last block in place");
+
+	RegionAllocator<64_mB> region;
+	MemDesc big = region.Allocate(1_mB);
+	ASSERT(region.Expand(big, 8_mB) && big.size == 9_mB, "Region commits pages for the grown block");
+	std::memset(big.ptr, 0xcd, big.size);
+
+	BuddyAllocator<1024, 64> buddy;
+	MemDesc a = buddy.Allocate(64);
+	ASSERT(buddy.GoodSize(100) == 128, "Buddy blocks are powers of two");
+	ASSERT(buddy.Expand(a, 192) && a.size == 256, "Block merges with its free buddies");
+	MemDesc b = buddy.Allocate(64);
+	ASSERT(b.ptr == reinterpret_cast<uint8_t*>(a.ptr) + 256, "Merged buddies are in use");
+	MemDesc shrunk = buddy.Reallocate(a, 64);
+	ASSERT(shrunk.ptr == a.ptr, "Shrinking stays in place");
+	MemDesc c = buddy.Allocate(128);
+	ASSERT(c.ptr == reinterpret_cast<uint8_t*>(a.ptr) + 128, "Shrinking frees the right halves");
+
+	SlabAllocator<RegionAllocator<1_mB>> slab;
+	MemDesc slot = slab.Allocate(33);
+	ASSERT(slab.GoodSize(33) == 40, "Good size is the size class");
+	MemDesc sameClass = slab.Reallocate(slot, 40);
+	ASSERT(sameClass.ptr == slot.ptr, "Same size class stays in place");
+	MemDesc otherClass = slab.Reallocate(sameClass, 100);
+	ASSERT(otherClass.ptr && otherClass.ptr != slot.ptr, "Other size class moves");
+
+	FallbackAllocator<StackAllocator<64>, MallocAllocator> fallback;
+	MemDesc small = fallback.Allocate(32);
+	std::memset(small.ptr, 0xef, small.size);
+	MemDesc spilled = fallback.Reallocate(small, 1000);
+	ASSERT(spilled.ptr && reinterpret_cast<uint8_t*>(spilled.ptr)[31] == 0xef, "Block that doesn't fit moves to the fallback");
+	fallback.Deallocate(spilled);
+
+	MallocAllocator malloc;
+	MemDesc mapped = malloc.Allocate(MallocAllocator::MapThreshold);
+	ASSERT(malloc.GoodSize(MallocAllocator::MapThreshold + 1) % 4096 == 0, "Mapped blocks are whole pages");
+	std::memset(mapped.ptr, 0x12, mapped.size);
+	MemDesc remapped = malloc.Reallocate(mapped, 64_mB);
+	ASSERT(remapped.ptr && remapped.size == 64_mB, "Mapped blocks are remapped");
+	ASSERT(reinterpret_cast<uint8_t*>(remapped.ptr)[MallocAllocator::MapThreshold - 1] == 0x12, "Remapping keeps the contents");
+	std::memset(remapped.ptr, 0x34, remapped.size);
+	malloc.Deallocate(remapped);
+
+	MemDesc global = Memory::Reallocate({}, 100);
+	ASSERT(global.ptr, "Reallocating nothing allocates");
+	global = Memory::Reallocate(global, 100000);
+	ASSERT(global.ptr && global.size == 100000, "Global allocator reallocates");
+	Memory::Deallocate(global);
+}
+
+void TestAllocationTrace()
+{
+	TEST("Test allocation trace");
+
+	char const* path = "allocation_trace_test.bin";
+	ASSERT(Memory::StartTrace(path), "Trace starts");
+	ASSERT(!Memory::StartTrace(path), "Only one trace runs at a time");
+	MemDesc small = Memory::Allocate(120);
+	MemDesc aligned = Memory::Allocate(100, 64);
+	MemDesc grown = Memory::Reallocate(small, 5000);
+	MemDesc threaded;
+	std::thread([&threaded]() { threaded = Memory::Allocate(300); Memory::Deallocate(threaded); }).join();
+	Memory::Deallocate(aligned);
+	Memory::Deallocate(grown);
+	Memory::StopTrace();
+	MemDesc const untraced = Memory::Allocate(8);
+	Memory::Deallocate(untraced);
+
+	std::vector<Private::TraceEvent> events;
+	ASSERT(Private::ReadTrace(path, events), "Trace reads back");
+	std::remove(path);
+	// With operator new replaced the trace also has the allocations of std::thread,
+	// small is sized to stay out of their size class so its freed slot isn't reused by them
+	events.erase(std::remove_if(events.begin(), events.end(), [&](Private::TraceEvent const& e)
+	{
+		void const* ptrs[] = { small.ptr, aligned.ptr, grown.ptr, threaded.ptr, untraced.ptr };
+		return std::find(std::begin(ptrs), std::end(ptrs), reinterpret_cast<void const*>(e.id)) == std::end(ptrs);
+	}), events.end());
+	ASSERT(events.size() == 8, "Every call is recorded until the trace stops");
+	ASSERT(std::is_sorted(events.begin(), events.end(), [](auto const& lhs, auto const& rhs) { return lhs.time < rhs.time; }), "Events are in time order");
+
+	using Private::TraceEventType;
+	auto const Find = [&events](TraceEventType type, void const* ptr)
+	{
+		return std::find_if(events.begin(), events.end(), [&](Private::TraceEvent const& e) { return e.type == type && e.id == reinterpret_cast<uint64_t>(ptr); });
+	};
+	auto alloc = Find(TraceEventType::Allocate, small.ptr);
+	ASSERT(alloc != events.end() && alloc->size == 120 && alloc->alignmentLog2 == 0, "Allocation has its size");
+	auto alignedAlloc = Find(TraceEventType::Allocate, aligned.ptr);
+	ASSERT(alignedAlloc != events.end() && alignedAlloc->alignmentLog2 == 6, "Allocation has its alignment");
+	auto realloc = Find(TraceEventType::Reallocate, small.ptr);
+	ASSERT(realloc != events.end() && realloc->size == 5000, "Reallocation has the new size");
+	ASSERT((realloc + 1)->type == TraceEventType::Reallocated && (realloc + 1)->id == reinterpret_cast<uint64_t>(grown.ptr), "Moved block comes after the reallocation");
+	auto dealloc = Find(TraceEventType::Deallocate, grown.ptr);
+	ASSERT(dealloc != events.end() && dealloc->size == grown.size, "Deallocation has the block size");
+	ASSERT(std::count_if(events.begin(), events.end(), [&](auto const& e) { return e.thread != alloc->thread; }) == 2, "Threads are told apart");
+}
+
+static Memory::CallSite& GetMacroCallSite()
+{
+	return MEMORY_CALL_SITE();
+}
+
+void TestCallSites()
+{
+	TEST("Test call site routing");
+
+	static Memory::CallSite hot(__FILE__, __LINE__, "TestCallSites hot");
+	static Memory::CallSite cold(__FILE__, __LINE__, "TestCallSites cold");
+	ASSERT(&GetMacroCallSite() == &GetMacroCallSite(), "A line has one site");
+	ASSERT(std::strstr(GetMacroCallSite().function, "GetMacroCallSite"), "Sites are named after the function they are in");
+	ASSERT(hot.id != cold.id && hot.route == 0, "Sites get their own ids and start on the global allocator");
+
+	std::vector<MemDesc> blocks;
+	for (int i = 0; i < 100; ++i)
+	{
+		blocks.push_back(Memory::Allocate(48, hot));
+	}
+	for (int i = 0; i < 10; ++i)
+	{
+		blocks.push_back(Memory::Allocate(48, 16, cold));
+	}
+	ASSERT(hot.count >= 100 && hot.bytes >= 4800 && cold.count >= 10, "Sites count what they allocate");
+
+	char const* path = "call_site_profile_test.txt";
+	ASSERT(Memory::WriteCallSiteProfile(path), "Profile is written");
+	ASSERT(Memory::LoadCallSiteProfile(path, 1), "Profile loads");
+	ASSERT(hot.route != 0 && cold.route == 0, "Only the hottest sites get a pool");
+	static Memory::CallSite late(__FILE__, hot.line, hot.function);
+	ASSERT(late.route == hot.route, "Sites that run after the profile is loaded are routed too");
+
+	MemDesc routed = Memory::Allocate(44, hot);
+	MemDesc global = Memory::Allocate(48, cold);
+	ASSERT(Private::FindCallSiteRoute(routed) && !Private::FindCallSiteRoute(global), "Routed blocks come from the pool");
+	std::memset(routed.ptr, 7, routed.size);
+	ASSERT(Memory::Expand(routed, 4) && Private::FindCallSiteRoute(routed), "Routed blocks grow in place within their size class");
+	routed = Memory::Reallocate(routed, 5000);
+	ASSERT(routed.ptr && !Private::FindCallSiteRoute(routed) && static_cast<uint8_t*>(routed.ptr)[43] == 7, "Blocks the pool can't serve move to the global allocator");
+	MemDesc big = Memory::Allocate(8192, hot);
+	ASSERT(big.ptr && !Private::FindCallSiteRoute(big), "Sizes past the pool go to the global allocator");
+	blocks.push_back(Memory::Allocate(48, hot));
+	Memory::Deallocate(routed);
+	Memory::Deallocate(global);
+	Memory::Deallocate(big);
+
+	FILE* empty = std::fopen(path, "w");
+	ASSERT(empty && std::fclose(empty) == 0, "Empty profile is written");
+	ASSERT(Memory::LoadCallSiteProfile(path, 1) && hot.route == 0 && late.route == 0, "Sites missing from a profile go back to the global allocator");
+	std::remove(path);
+	ASSERT(!Memory::LoadCallSiteProfile(path), "Missing profile doesn't load");
+
+	ASSERT(Private::FindCallSiteRoute(blocks.back()), "Blocks stay in the pool after the site leaves it");
+	for (MemDesc desc : blocks)
+	{
+		Memory::Deallocate(desc);
+	}
+}
+
+void TestMemoryTags()
+{
+	TEST("Test memory tags");
+
+	MemoryTag const tag = RegisterMemoryTag("Test tag");
+	MemoryTag const other = RegisterMemoryTag("Test other tag");
+	ASSERT(tag != MemoryTag::Untagged && tag != other && RegisterMemoryTag("Test tag") == tag, "A name gives one tag");
+	ASSERT(std::strcmp(GetMemoryTagName(tag), "Test tag") == 0, "Tags have their names");
+
+	MemDesc block = Memory::Allocate(1000, tag);
+	MemDesc aligned = Memory::Allocate(100, 64, tag);
+	ASSERT(GetMemoryTagUsage(tag) == block.size + aligned.size, "Tagged blocks are counted under their tag");
+	block = Memory::Reallocate(block, 3000);
+	ASSERT(GetMemoryTagUsage(tag) == block.size + aligned.size, "Reallocation counts the new size under the block's tag");
+	Memory::Deallocate(aligned);
+	MemDesc untagged = Memory::Allocate(700);
+	{
+		ScopedMemoryTag guard(other);
+		MemDesc scoped = Memory::Allocate(500);
+		{
+			ScopedMemoryTag nested(tag);
+			MemDesc inner = Memory::Allocate(200);
+			ASSERT(GetMemoryTagUsage(tag) == block.size + inner.size, "Untagged calls use the innermost guard");
+			Memory::Deallocate(scoped);
+			Memory::Deallocate(inner);
+		}
+		ASSERT(GetMemoryTagUsage(tag) == block.size && GetMemoryTagUsage(other) == 0, "Blocks are taken off the tag they were allocated with");
+		Memory::Deallocate(block);
+		Memory::Deallocate(untagged);
+		ASSERT(GetMemoryTagUsage(tag) == 0 && GetMemoryTagUsage(other) == 0, "Untagged blocks aren't taken off the current tag");
+		MemDesc guarded = Memory::Allocate(300);
+		ASSERT(GetMemoryTagUsage(other) == guarded.size, "Guards tag what is allocated under them");
+		Memory::Deallocate(guarded);
+	}
+	MemDesc after = Memory::Allocate(100);
+	ASSERT(GetMemoryTagUsage(other) == 0, "Guards restore the tag before them");
+	Memory::Deallocate(after);
+
+	std::vector<std::vector<MemDesc>> kept(4);
+	std::vector<std::thread> threads;
+	for (auto& blocks : kept)
+	{
+		threads.emplace_back([&blocks, tag]()
+		{
+			for (int i = 0; i < 1000; ++i)
+			{
+				blocks.push_back(Memory::Allocate(256, tag));
+				if (i % 2)
+				{
+					Memory::Deallocate(blocks.back());
+					blocks.pop_back();
+				}
+			}
+		});
+	}
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+	ASSERT(GetMemoryTagUsage(tag) == 4 * 500 * 256, "Threads fold their counts when they exit");
+	for (auto& blocks : kept)
+	{
+		for (MemDesc desc : blocks)
+		{
+			Memory::Deallocate(desc);
+		}
+	}
+	ASSERT(GetMemoryTagUsage(tag) == 0, "Blocks freed on another thread are taken off");
+
+	// Blocks of the fold size are checked against the budgets one by one
+	static std::vector<MemDesc> cache;
+	static int softCalls = 0;
+	static int hardCalls = 0;
+	uint64_t const blockSize = Private::TagFoldBytes;
+	SetMemoryBudget(tag, 4 * blockSize, [](MemoryTag, uint64_t) { ++softCalls; }, 8 * blockSize, [](MemoryTag, uint64_t)
+	{
+		++hardCalls;
+		for (MemDesc desc : cache)
+		{
+			Memory::Deallocate(desc);
+		}
+		cache.clear();
+	});
+	cache.push_back(Memory::Allocate(blockSize, tag));
+	cache.push_back(Memory::Allocate(blockSize, tag));
+	std::vector<MemDesc> blocks;
+	for (int i = 0; i < 2; ++i)
+	{
+		blocks.push_back(Memory::Allocate(blockSize, tag));
+	}
+	ASSERT(softCalls == 0, "Soft budget isn't called below it");
+	blocks.push_back(Memory::Allocate(blockSize, tag));
+	ASSERT(softCalls == 1, "Soft budget is called when the tag goes over it");
+	for (int i = 0; i < 4; ++i)
+	{
+		blocks.push_back(Memory::Allocate(blockSize, tag));
+	}
+	ASSERT(blocks.back().ptr && hardCalls == 1 && cache.empty(), "Hard budget callback can make room");
+	MemDesc refused = Memory::Allocate(blockSize, tag);
+	for (int i = 0; i < 4 && refused.ptr; ++i)
+	{
+		blocks.push_back(refused);
+		refused = Memory::Allocate(blockSize, tag);
+	}
+	ASSERT(!refused.ptr && GetMemoryTagUsage(tag) <= 8 * blockSize, "Hard budget refuses what goes over it");
+	ASSERT(softCalls == 1, "Soft budget is called once per crossing");
+	SetMemoryBudget(tag, 0, nullptr, 0, nullptr);
+	for (MemDesc desc : blocks)
+	{
+		Memory::Deallocate(desc);
+	}
+	ASSERT(GetMemoryTagUsage(tag) == 0, "Tag is empty again");
+
+	// Blocks far below the fold size are checked one by one near the hard budget
+	blocks.clear();
+	SetMemoryBudget(tag, 0, nullptr, 1_mB, nullptr);
+	MemDesc small = Memory::Allocate(1_kB, tag);
+	while (small.ptr)
+	{
+		blocks.push_back(small);
+		small = Memory::Allocate(1_kB, tag);
+	}
+	uint32_t granted = 0;
+	for (int i = 0; i < 64; ++i)
+	{
+		MemDesc more = Memory::Allocate(1_kB, tag);
+		if (more.ptr)
+		{
+			++granted;
+			blocks.push_back(more);
+		}
+	}
+	ASSERT(granted == 0 && GetMemoryTagUsage(tag) <= 1_mB, "Small blocks don't go over the hard budget");
+	Memory::Deallocate(blocks.back());
+	blocks.pop_back();
+	small = Memory::Allocate(1_kB, tag);
+	ASSERT(small.ptr, "A freed block makes room under the hard budget");
+	blocks.push_back(small);
+	SetMemoryBudget(tag, 0, nullptr, 0, nullptr);
+	for (MemDesc desc : blocks)
+	{
+		Memory::Deallocate(desc);
+	}
+	ASSERT(GetMemoryTagUsage(tag) == 0, "Tag is empty again");
+}
+
+void TestHeapProfile()
+{
+	TEST("Test heap profile");
+
+	struct ProfileTotals
+	{
+		unsigned long long liveCount = 0, liveBytes = 0, totalCount = 0, totalBytes = 0, rate = 0;
+	};
+	auto const ReadTotals = []()
+	{
+		ProfileTotals totals;
+		Memory::WriteHeapProfile("heap_profile_test.txt", HeapProfileFormat::Pprof);
+		if (std::FILE* file = std::fopen("heap_profile_test.txt", "r"))
+		{
+			std::fscanf(file, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%llu", &totals.liveCount, &totals.liveBytes, &totals.totalCount, &totals.totalBytes, &totals.rate);
+			std::fclose(file);
+		}
+		return totals;
+	};
+
+	std::vector<MemDesc> blocks;
+	blocks.reserve(10);
+	ProfileTotals const before = ReadTotals();
+	// Every allocation is sampled at a rate of one byte
+	Memory::StartHeapProfile(1);
+	for (int i = 0; i < 10; ++i)
+	{
+		blocks.push_back(Memory::Allocate(1000));
+	}
+	Memory::StopHeapProfile();
+	ProfileTotals const sampled = ReadTotals();
+	ASSERT(sampled.rate == 1, "Profile has the sample rate");
+	ASSERT(sampled.liveCount - before.liveCount == 10 && sampled.liveBytes - before.liveBytes == 10000, "Sampled blocks are live");
+	ASSERT(sampled.totalBytes - before.totalBytes == 10000, "Sampled blocks are counted");
+
+	for (MemDesc const& block : blocks)
+	{
+		Memory::Deallocate(block);
+	}
+	ProfileTotals const freed = ReadTotals();
+	ASSERT(freed.liveBytes == before.liveBytes && freed.totalBytes == sampled.totalBytes, "Freed blocks only leave the live bytes");
+
+	Memory::StartHeapProfile(1_mB);
+	uint64_t sampledBefore = ReadTotals().totalCount;
+	for (int i = 0; i < 1000; ++i)
+	{
+		Memory::Deallocate(Memory::Allocate(1_kB));
+	}
+	Memory::StopHeapProfile();
+	uint64_t const samples = ReadTotals().totalCount - sampledBefore;
+	ASSERT(samples < 10, "Allocations are sampled by bytes");
+
+	ASSERT(Memory::WriteHeapProfile("heap_profile_test.txt", HeapProfileFormat::FoldedTotal), "Folded profile is written");
+	unsigned long long bytes = 0;
+	if (std::FILE* file = std::fopen("heap_profile_test.txt", "r"))
+	{
+		char line[4096];
+		if (std::fgets(line, sizeof(line), file))
+		{
+			char const* value = std::strrchr(line, ' ');
+			bytes = value ? std::strtoull(value + 1, nullptr, 10) : 0;
+		}
+		std::fclose(file);
+	}
+	ASSERT(bytes >= 10000, "Folded stacks end with the estimated bytes");
+	std::remove("heap_profile_test.txt");
+}
+
+void TestMemoryExport()
+{
+	TEST("Test memory usage export");
+
+	FallbackAllocator<HeapAllocator<64>, HeapAllocator<1024>> allocator;
+	MemDesc small = allocator.Allocate(100);
+	MemDesc big = allocator.Allocate(100);
+	auto stats = allocator.GetStats();
+
+	std::string json;
+	Private::WriteJson(json, *stats, 4096);
+	ASSERT(json.find("\"resident\":4096,\"allocator\":{\"name\":\"FallbackAllocator\",\"proxy\":true,\"nested\":[{\"name\":\"HeapAllocator\"") != std::string::npos, "Json nests the allocators");
+	ASSERT(json.find("\"countAllocated\":2,\"totalAllocated\":200") != std::string::npos, "Json has the counters");
+	ASSERT(std::count(json.begin(), json.end(), '{') == std::count(json.begin(), json.end(), '}'), "Json objects are closed");
+
+	std::string prometheus;
+	Private::WritePrometheus(prometheus, *stats, 4096);
+	char const* labels = "{allocator=\"HeapAllocator\",path=\"FallbackAllocator/HeapAllocator[1]\"";
+	ASSERT(prometheus.find("memory_resident_bytes 4096\n") != std::string::npos, "Prometheus has the resident memory");
+	ASSERT(prometheus.find(std::string("memory_allocations_total") + labels + "} 2\n") != std::string::npos, "Siblings of a type are told apart by index");
+	ASSERT(prometheus.find(std::string("memory_allocation_size_bytes_bucket") + labels + ",le=\"63\"} 0\n") != std::string::npos, "Buckets below the sizes are empty");
+	ASSERT(prometheus.find(std::string("memory_allocation_size_bytes_bucket") + labels + ",le=\"127\"} 2\n") != std::string::npos, "Buckets are cumulative");
+	ASSERT(prometheus.find(std::string("memory_allocation_size_bytes_sum") + labels + "} 200\n") != std::string::npos, "Histogram sums the sizes");
+	ASSERT(prometheus.find("FallbackAllocator\"}") == std::string::npos, "Proxies have no series");
+	allocator.Deallocate(big);
+	allocator.Deallocate(small);
+
+	auto const ReadText = [](char const* path)
+	{
+		std::string text;
+		if (std::FILE* file = std::fopen(path, "rb"))
+		{
+			char buffer[4096];
+			size_t read = 0;
+			while ((read = std::fread(buffer, 1, sizeof(buffer), file)) > 0)
+			{
+				text.append(buffer, read);
+			}
+			std::fclose(file);
+		}
+		return text;
+	};
+	ASSERT(Memory::WriteMemoryUsage("memory_usage_test.json", MemoryUsageFormat::Json), "Memory usage is written");
+	ASSERT(ReadText("memory_usage_test.json").find("\"name\":\"ThreadCachedAllocator\"") != std::string::npos, "Global allocator is written");
+	std::remove("memory_usage_test.json");
+
+	ASSERT(Memory::StartMemoryExporter("memory_usage_test.prom", MemoryExportTarget::File, MemoryUsageFormat::Prometheus, 10), "File exporter starts");
+	ASSERT(!Memory::StartMemoryExporter("memory_usage_test", MemoryExportTarget::SharedMemory, MemoryUsageFormat::Json, 10), "One exporter runs at a time");
+	Memory::Deallocate(Memory::Allocate(100));
+	Memory::StopMemoryExporter();
+	ASSERT(ReadText("memory_usage_test.prom").find("memory_allocations_total{allocator=\"ThreadCachedAllocator\"") != std::string::npos, "Exporter leaves the last snapshot");
+	std::remove("memory_usage_test.prom");
+
+	ASSERT(Memory::StartMemoryExporter("memory_usage_test", MemoryExportTarget::SharedMemory, MemoryUsageFormat::Json, 10), "Shared memory exporter starts");
+	std::string snapshot;
+	auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (!Private::ReadSharedSnapshot("memory_usage_test", snapshot) && std::chrono::steady_clock::now() < deadline)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	ASSERT(snapshot.find("{\"timestamp\":") == 0 && snapshot.back() == '\n', "Snapshot is read whole from shared memory");
+	Memory::StopMemoryExporter();
+	ASSERT(!Private::ReadSharedSnapshot("memory_usage_test", snapshot), "Segment goes away with the exporter");
+}
+
+void TestSharedHandles()
+{
+	TEST("Test SharedHandle, WeakHandle and IntrusiveHandle");
+
+	using Tracked = Testy::InstanceCounted;
+	std::atomic<int> alive{ 0 };
+
+	SharedHandle<Tracked> shared = MakeShared<Tracked>(1, &alive);
+	ASSERT(sizeof(shared) == sizeof(void*), "SharedHandle is one pointer");
+	WeakHandle<Tracked> weak = shared;
+	{
+		SharedHandle<Tracked> copy = shared;
+		ASSERT(shared.UseCount() == 2 && copy->value == 1, "Copies share the object");
+		SharedHandle<Tracked> locked = weak.Lock();
+		ASSERT(locked && shared.UseCount() == 3, "Weak handle locks while the object lives");
+	}
+	ASSERT(shared.UseCount() == 1 && !weak.Expired(), "Copies give their reference back");
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; ++t)
+	{
+		threads.emplace_back([&shared, &weak]()
+		{
+			for (int i = 0; i < 100000; ++i)
+			{
+				SharedHandle<Tracked> copy = shared;
+				WeakHandle<Tracked> observer = copy;
+				SharedHandle<Tracked> locked = observer.Lock();
+			}
+		});
+	}
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+	ASSERT(shared.UseCount() == 1 && alive == 1, "Atomic counts survive copies from many threads");
+
+	shared = nullptr;
+	ASSERT(alive == 0 && weak.Expired() && !weak.Lock(), "Last shared handle destroys the object, weak ones expire");
+
+	using PlainShared = SharedHandle<Tracked, PlainRefCount>;
+	PlainShared plain = MakeShared<Tracked, PlainRefCount>(2, &alive);
+	PlainShared plainCopy = plain;
+	ASSERT(plain.UseCount() == 2 && plainCopy->value == 2, "Plain counts share the object too");
+	plain = nullptr;
+	plainCopy = nullptr;
+	ASSERT(alive == 0, "Plain counts destroy the object");
+
+	struct Node : RefCounted<>, Testy::InstanceCounted
+	{
+		using InstanceCounted::InstanceCounted;
+
+		IntrusiveHandle<Node> Self() { return IntrusiveHandle<Node>(this); }
+	};
+	IntrusiveHandle<Node> node = MakeIntrusive<Node>(3, &alive);
+	ASSERT(sizeof(node) == sizeof(void*) && node->GetRefCount() == 1, "Intrusive handle holds the only reference");
+	IntrusiveHandle<Node> self = node->Self();
+	ASSERT(self.Get() == node.Get() && node->GetRefCount() == 2, "Handles come from a raw pointer to the object");
+	node = nullptr;
+	ASSERT(alive == 1 && self->value == 3, "Object lives while a handle does");
+	self = nullptr;
+	ASSERT(alive == 0, "Last intrusive handle destroys the object");
+
+	struct Big : RefCounted<>
+	{
+		uint8_t data[292];
+	};
+	MemoryTag const tag = RegisterMemoryTag("Test intrusive handles");
+	{
+		ScopedMemoryTag guard(tag);
+		for (int i = 0; i < 1000; ++i)
+		{
+			IntrusiveHandle<Big> big = MakeIntrusive<Big>();
+		}
+	}
+	ASSERT(GetMemoryTagUsage(tag) == 0, "Intrusive objects are freed with the size of their block");
+}
+
+void TestHandleAllocation()
+{
+	TEST("Test handles over allocators and array handles");
+
+	using Tracked = Testy::InstanceCounted;
+	std::atomic<int> alive{ 0 };
+
+	using Heap = HeapAllocator<4096>;
+	using HeapRef = AllocatorRef<Heap>;
+	using HeapUnique = UniqueHandle<Tracked, HeapRef>;
+	ASSERT(sizeof(UniqueHandle<Tracked>) == sizeof(MemDesc), "Stateless allocation takes no room in UniqueHandle");
+	ASSERT(sizeof(HeapUnique) == sizeof(MemDesc) + sizeof(Heap*), "Allocator reference is one pointer in UniqueHandle");
+	ASSERT(sizeof(SharedHandle<Tracked, AtomicRefCount, HeapRef>) == sizeof(void*), "SharedHandle keeps the allocator in its block");
+
+	struct Node : RefCounted<>, Tracked
+	{
+		using Tracked::Tracked;
+	};
+	ASSERT(sizeof(IntrusiveHandle<Node, HeapRef>) == sizeof(void*), "IntrusiveHandle keeps the allocator in its block");
+
+	Heap heap;
+	{
+		HeapUnique unique = AllocateUnique<Tracked>(HeapRef(heap), 1, &alive);
+		SharedHandle<Tracked, AtomicRefCount, HeapRef> shared = AllocateShared<Tracked>(HeapRef(heap), 2, &alive);
+		WeakHandle<Tracked, AtomicRefCount, HeapRef> weak = shared;
+		ASSERT(heap.Owns({ &*unique, sizeof(Tracked) }) && heap.Owns({ shared.Get(), sizeof(Tracked) }), "Handles allocate from the allocator they are given");
+		IntrusiveHandle<Node, HeapRef> intrusive = AllocateIntrusive<Node>(HeapRef(heap), 3, &alive);
+		ASSERT(heap.Owns({ intrusive.Get(), sizeof(Node) }) && intrusive->value == 3, "Intrusive handles allocate from the allocator they are given");
+		ASSERT(alive == 3 && unique->value == 1 && weak.Lock()->value == 2, "Objects are built in the allocator's blocks");
+	}
+	ASSERT(alive == 0 && heap.Mark() == 0, "Blocks go back to the allocator they came from");
+
+	{
+		UniqueHandle<Tracked[]> array = MakeUniqueArray<Tracked>(5);
+		ASSERT(array.Count() == 5 && array[4].value == 0, "Unique array value-initializes its elements");
+		UniqueHandle<Tracked[], HeapRef> heapArray = MakeUniqueArray<Tracked>(3, HeapRef(heap));
+		for (uint64_t i = 0; i < heapArray.Count(); ++i)
+		{
+			heapArray[i] = Tracked(static_cast<int>(i), nullptr);
+		}
+		ASSERT(heapArray.Count() == 3 && heapArray[2].value == 2 && heap.Owns({ &heapArray[0], sizeof(Tracked) }), "Unique array lives in the allocator");
+	}
+	ASSERT(heap.Mark() == 0, "Unique array goes back in one block");
+
+	struct alignas(64) Aligned
+	{
+		uint8_t data[8];
+	};
+	SharedHandle<uint64_t[]> numbers = MakeSharedArray<uint64_t>(100);
+	SharedHandle<uint64_t[]> copy = numbers;
+	copy[99] = 42;
+	ASSERT(numbers.Count() == 100 && numbers[0] == 0 && numbers[99] == 42 && numbers.UseCount() == 2, "Shared array is one block for all its copies");
+	SharedHandle<Aligned[]> aligned = MakeSharedArray<Aligned>(3);
+	ASSERT(IsAligned({ &aligned[1], sizeof(Aligned) }, 64), "Shared array aligns over-aligned elements");
+	{
+		using HeapSharedArray = SharedHandle<Tracked[], PlainRefCount, HeapRef>;
+		HeapSharedArray shared = MakeSharedArray<Tracked, PlainRefCount>(4, HeapRef(heap));
+		ASSERT(shared.Count() == 4 && heap.Owns({ shared.Get(), sizeof(Tracked) }), "Shared array lives in the allocator");
+	}
+	ASSERT(heap.Mark() == 0, "Shared array goes back to the allocator");
+
+	uint64_t const tooMany = UINT64_MAX / sizeof(uint64_t);
+	ASSERT(!MakeUniqueArray<uint64_t>(tooMany) && !MakeSharedArray<uint64_t>(tooMany), "Arrays too big for a block aren't allocated");
+}
+
+void TestAtomicSharedHandle()
+{
+	TEST("Test AtomicSharedHandle");
+
+	struct Snapshot : Testy::InstanceCounted
+	{
+		Snapshot(uint64_t v, std::atomic<int>& alive) : InstanceCounted(0, &alive), version(v), copy(v) {}
+
+		uint64_t version;
+		uint64_t copy;
+	};
+	std::atomic<int> alive{ 0 };
+	{
+		AtomicSharedHandle<Snapshot> published = MakeShared<Snapshot>(0, alive);
+		SharedHandle<Snapshot> first = published.Load();
+		ASSERT(first && first->version == 0 && first.UseCount() == 2, "Load shares the published snapshot");
+
+		SharedHandle<Snapshot> stale = first;
+		published.Store(MakeShared<Snapshot>(1, alive));
+		ASSERT(alive == 2 && first->version == 0, "Readers keep the snapshot they loaded");
+		ASSERT(!published.CompareExchange(stale, MakeShared<Snapshot>(2, alive)) && stale->version == 1, "Failed exchange loads the current snapshot");
+		ASSERT(published.CompareExchange(stale, MakeShared<Snapshot>(2, alive)) && published.Load()->version == 2, "Exchange from the current snapshot goes through");
+		first = nullptr;
+		stale = nullptr;
+		ASSERT(alive == 1, "Replaced snapshots go with their last reader");
+
+		std::atomic<bool> done{ false };
+		std::atomic<bool> torn{ false };
+		std::vector<std::thread> readers;
+		for (int t = 0; t < 4; ++t)
+		{
+			readers.emplace_back([&published, &done, &torn]()
+			{
+				uint64_t last = 0;
+				while (!done)
+				{
+					SharedHandle<Snapshot> snapshot = published.Load();
+					torn = torn || snapshot->version != snapshot->copy || snapshot->version < last;
+					last = snapshot->version;
+				}
+			});
+		}
+		for (uint64_t version = 3; version < 20000; ++version)
+		{
+			published.Store(MakeShared<Snapshot>(version, alive));
+		}
+		done = true;
+		for (std::thread& reader : readers)
+		{
+			reader.join();
+		}
+		ASSERT(!torn && alive == 1, "Readers see whole snapshots in order while a writer replaces them");
+	}
+	ASSERT(alive == 0, "Last snapshot goes with the handle");
+}
+
+// Treiber stack, pop retires the node it took off
+template <typename Reclamation>
+class ReclaimedStack
+{
+public:
+	struct Node
+	{
+		uint64_t value;
+		Node* next;
+	};
+
+	void Push(uint64_t value)
+	{
+		MemDesc const desc = Memory::Allocate(sizeof(Node), alignof(Node));
+		Node* node = new (desc.ptr) Node{ value, m_head.load(std::memory_order_relaxed) };
+		while (!m_head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	bool Pop(uint64_t& value)
+	{
+		typename Reclamation::Guard guard;
+		for (;;)
+		{
+			Node* node = guard.Protect(m_head);
+			if (!node)
+			{
+				return false;
+			}
+			// The guard keeps node from being freed and reused, so next is still its next
+			if (m_head.compare_exchange_weak(node, node->next, std::memory_order_acquire, std::memory_order_relaxed))
+			{
+				value = node->value;
+				Reclamation::Retire({ node, sizeof(Node) });
+				return true;
+			}
+		}
+	}
+
+private:
+	std::atomic<Node*> m_head{ nullptr };
+};
+
+template <typename Reclamation>
+bool StressReclaimedStack()
+{
+	ReclaimedStack<Reclamation> stack;
+	std::atomic<uint64_t> popped{ 0 };
+	std::vector<std::thread> threads;
+	for (uint64_t t = 0; t < 4; ++t)
+	{
+		threads.emplace_back([&stack, &popped, t]()
+		{
+			uint64_t sum = 0;
+			for (uint64_t i = 1; i <= 20000; ++i)
+			{
+				stack.Push(t * 20000 + i);
+				uint64_t value = 0;
+				if (stack.Pop(value))
+				{
+					sum += value;
+				}
+			}
+			popped += sum;
+		});
+	}
+	for (std::thread& thread : threads)
+	{
+		thread.join();
+	}
+	uint64_t value = 0;
+	uint64_t sum = popped;
+	while (stack.Pop(value))
+	{
+		sum += value;
+	}
+	Reclamation::Flush();
+	return sum == 80000ull * 80001 / 2 && Reclamation::GetPendingCount() == 0;
+}
+
+void TestReclamation()
+{
+	TEST("Test epoch and hazard pointer reclamation");
+
+	ASSERT(StressReclaimedStack<EpochReclamation>(), "Stack under epochs loses nothing and frees everything");
+	ASSERT(StressReclaimedStack<HazardPointerReclamation>(), "Stack under hazard pointers loses nothing and frees everything");
+
+	std::atomic<int> step{ 0 };
+	std::atomic<void*> shared{ nullptr };
+	auto const Reader = [&step, &shared](auto guard)
+	{
+		guard->Protect(shared);
+		step = 1;
+		while (step != 2)
+		{
+			std::this_thread::yield();
+		}
+	};
+
+	{
+		std::thread reader([&Reader]()
+		{
+			EpochReclamation::Guard guard;
+			Reader(&guard);
+		});
+		while (step != 1)
+		{
+			std::this_thread::yield();
+		}
+		for (int i = 0; i < 10; ++i)
+		{
+			EpochReclamation::Retire(Memory::Allocate(64));
+		}
+		EpochReclamation::Flush();
+		EpochReclamation::Flush();
+		ASSERT(EpochReclamation::GetPendingCount() == 10, "A thread in a region holds back retired blocks");
+		step = 2;
+		reader.join();
+		EpochReclamation::Flush();
+		EpochReclamation::Flush();
+		ASSERT(EpochReclamation::GetPendingCount() == 0, "Blocks go once the region ends");
+	}
+
+	{
+		step = 0;
+		MemDesc const held = Memory::Allocate(64);
+		shared = held.ptr;
+		std::thread reader([&Reader]()
+		{
+			HazardPointerReclamation::Guard guard;
+			Reader(&guard);
+		});
+		while (step != 1)
+		{
+			std::this_thread::yield();
+		}
+		shared = nullptr;
+		HazardPointerReclamation::Retire(held);
+		for (int i = 0; i < 10; ++i)
+		{
+			HazardPointerReclamation::Retire(Memory::Allocate(64));
+		}
+		HazardPointerReclamation::Flush();
+		ASSERT(HazardPointerReclamation::GetPendingCount() == 1, "Only the protected block is held back");
+		step = 2;
+		reader.join();
+		HazardPointerReclamation::Flush();
+		ASSERT(HazardPointerReclamation::GetPendingCount() == 0, "Protected block goes once the guard does");
+	}
+}
+
+void TestPool()
+{
+	TEST("Test Pool");
+
+	static_assert(sizeof(PoolHandle32) == 4 && sizeof(PoolHandle64) == 8, "Handles are one integer");
+
+	using Entity = Testy::InstanceCounted;
+	std::atomic<int> alive{ 0 };
+	{
+		using EntityPool = Pool<Entity, PoolHandle32, GlobalAllocation, 16>;
+		EntityPool pool;
+		std::vector<PoolHandle32> handles;
+		for (int i = 0; i < 100; ++i)
+		{
+			handles.push_back(pool.Create(i, &alive));
+		}
+		ASSERT(pool.Count() == 100 && alive == 100, "Objects are created");
+		ASSERT(pool[handles[42]].value == 42 && pool.Get(handles[99])->value == 99, "Handles find their objects across chunks");
+
+		for (int i = 0; i < 100; i += 2)
+		{
+			ASSERT(pool.Destroy(handles[i]), "Live handles destroy their object");
+		}
+		ASSERT(pool.Count() == 50 && alive == 50, "Destroyed objects are gone");
+		ASSERT(!pool.Destroy(handles[0]) && !pool.IsValid(handles[0]) && !pool.Get(handles[0]), "Stale handles are caught");
+		ASSERT(!pool.IsValid(PoolHandle32()), "Null handle is never valid");
+
+		bool odd = true;
+		int sum = 0;
+		size_t visited = 0;
+		for (auto it = pool.begin(); it != pool.end(); ++it)
+		{
+			odd &= (it->value & 1) == 1;
+			sum += it->value;
+			odd &= pool.Get(it.GetHandle()) == &*it;
+			++visited;
+		}
+		ASSERT(visited == 50 && odd && sum == 2500, "Iteration visits the live objects only");
+		Entity* const fifteenth = &*++EntityPool::Iterator<false>(&pool, 14);
+		ASSERT(&*pool.begin() + 15 == fifteenth, "Objects of a chunk are contiguous");
+		for (int i = 1; i < 100; i += 2)
+		{
+			ASSERT(pool[handles[i]].value == i, "Moved objects keep their handles");
+		}
+
+		PoolHandle32 const reused = pool.Create(1000, &alive);
+		ASSERT(reused.GetIndex() == handles[98].GetIndex() && reused != handles[98], "Slots are reused with a new generation");
+		ASSERT(!pool.IsValid(handles[98]) && pool[reused].value == 1000, "Reused slots don't revive stale handles");
+
+		pool.Clear();
+		ASSERT(pool.Count() == 0 && alive == 0 && !pool.IsValid(handles[1]), "Clear destroys everything");
+		pool.Create(7, &alive);
+	}
+	ASSERT(alive == 0, "Pool destroys its objects");
+
+	// Two generation bits leave two lifetimes per slot
+	Pool<int, PoolHandle<uint32_t, 30>> small;
+	auto first = small.Create(1);
+	small.Destroy(first);
+	auto second = small.Create(2);
+	ASSERT(second.GetIndex() == first.GetIndex() && second.GetGeneration() == 3, "Second lifetime has the next odd generation");
+	small.Destroy(second);
+	auto third = small.Create(3);
+	ASSERT(third.GetIndex() != first.GetIndex() && !small.IsValid(first) && !small.IsValid(second), "Slots retire before their generation wraps");
+
+	ScopedArena scope;
+	Pool<uint64_t, PoolHandle64, ArenaAllocation> arenaPool;
+	for (uint64_t i = 0; i < 1000; ++i)
+	{
+		arenaPool.Create(i);
+	}
+	uint64_t total = 0;
+	for (uint64_t value : arenaPool)
+	{
+		total += value;
+	}
+	ASSERT(total == 499500, "Pools take any allocation policy");
+}
+
+void TestCompactingHeap()
+{
+	TEST("Test CompactingHeap");
+
+	using Heap = CompactingHeap;
+	auto heap = std::make_unique<Heap>(1_mB);
+	auto const Fill = [&heap](Heap::Handle handle, uint8_t value)
+	{
+		MemDesc const desc = heap->Get(handle);
+		std::memset(desc.ptr, value, desc.size);
+	};
+	auto const Holds = [&heap](Heap::Handle handle, uint8_t value)
+	{
+		MemDesc const desc = heap->Get(handle);
+		return desc.size >= 100 && std::all_of(static_cast<uint8_t*>(desc.ptr), static_cast<uint8_t*>(desc.ptr) + desc.size, [value](uint8_t b) { return b == value; });
+	};
+
+	std::vector<Heap::Handle> handles;
+	for (int i = 0; i < 1000; ++i)
+	{
+		handles.push_back(heap->Allocate(100));
+		Fill(handles.back(), static_cast<uint8_t>(i));
+	}
+	uint64_t const used = heap->GetUsedBytes();
+	ASSERT(used == 1000 * 128, "Blocks are packed with their headers");
+	void* const lastBlock = heap->Get(handles.back()).ptr;
+	for (int i = 0; i < 1000; i += 2)
+	{
+		heap->Deallocate(handles[i]);
+	}
+	ASSERT(!heap->IsValid(handles[0]) && !heap->Get(handles[0]).ptr, "Freed handles go stale");
+	ASSERT(heap->GetFreeBytes() == 500 * 128 && heap->GetUsedBytes() == used, "Freed blocks leave holes");
+
+	// A zero budget still walks BudgetCheckBytes per call
+	int steps = 1;
+	while (!heap->Compact(std::chrono::nanoseconds(0)))
+	{
+		++steps;
+		if (steps == 2)
+		{
+			// Frees and allocations during a pass
+			heap->Deallocate(handles[1]);
+			handles[1] = heap->Allocate(100);
+			Fill(handles[1], 1);
+		}
+	}
+	ASSERT(steps > 2, "Compaction is incremental");
+	ASSERT(heap->GetFreeBytes() == 0 && heap->GetUsedBytes() == 500 * 128, "Compaction closes every hole");
+	ASSERT(heap->Get(handles.back()).ptr != lastBlock, "Blocks move down");
+	bool intact = true;
+	for (int i = 1; i < 1000; i += 2)
+	{
+		intact &= Holds(handles[i], static_cast<uint8_t>(i));
+	}
+	ASSERT(intact, "Moved blocks keep their contents");
+
+	auto small = std::make_unique<Heap>(64_kB);
+	std::vector<Heap::Handle> blocks;
+	for (Heap::Handle handle = small->Allocate(1000); !handle.IsNull(); handle = small->Allocate(1000))
+	{
+		blocks.push_back(handle);
+	}
+	for (size_t i = 0; i < blocks.size(); i += 2)
+	{
+		small->Deallocate(blocks[i]);
+	}
+	ASSERT(!small->Allocate(20000).IsNull(), "Full heap compacts to make room");
+
+	using Tracked = Testy::InstanceCounted;
+	std::atomic<int> alive{ 0 };
+	{
+		auto first = MakeRelocatable<Tracked>(*heap, 1, &alive);
+		auto second = MakeRelocatable<Tracked>(*heap, 2, &alive);
+		Tracked* const before = second.Get();
+		first = {};
+		while (!heap->Compact(std::chrono::milliseconds(1)))
+		{
+		}
+		ASSERT(alive == 1 && !first, "Relocatable handle destroys its object");
+		ASSERT(second.Get() != before && second->value == 2, "Relocatable object is found after it moved");
+	}
+	ASSERT(alive == 0, "Relocatable handles clean up");
+}
+
+void TestScopedArena()
+{
+	TEST("Test ScopedArena");
+
+	StackAllocator<256> stack;
+	stack.Allocate(16);
+	uint64_t const mark = stack.Mark();
+	MemDesc first = stack.Allocate(64);
+	stack.Allocate(64);
+	stack.Rewind(mark);
+	MemDesc again = stack.Allocate(32);
+	ASSERT(again.ptr == first.ptr, "Rewinding frees everything after the mark");
+
+	MemDesc outer;
+	MemDesc inner;
+	{
+		ScopedArena outerScope;
+		outer = ArenaAllocate(100, 16);
+		ASSERT(outer.ptr && IsAligned(outer, 16), "Allocate from the thread's arena");
+		{
+			ScopedArena innerScope;
+			inner = ArenaAllocate(1_mB, 64);
+			ASSERT(inner.ptr && IsAligned(inner, 64), "Allocate in a nested scope");
+			std::memset(inner.ptr, 0xab, inner.size);
+		}
+		MemDesc reused = ArenaAllocate(1_mB, 64);
+		ASSERT(reused.ptr == inner.ptr, "Nested scope is rewound on its own");
+
+		MemDesc grown = ArenaReallocate(reused, 2_mB);
+		ASSERT(grown.ptr == reused.ptr, "Last block grows in place");
+		ArenaDeallocate(grown);
+		MemDesc popped = ArenaAllocate(1_mB, 64);
+		ASSERT(popped.ptr == reused.ptr, "Deallocating the last block gives it back");
+
+		UniqueHandle<uint64_t, ArenaAllocation> handle = MakeUnique<uint64_t, ArenaAllocation>(42ull);
+		ASSERT(*handle == 42, "UniqueHandle can live in the arena");
+	}
+	MemDesc afterScope = ArenaAllocate(16, 16);
+	ASSERT(afterScope.ptr == outer.ptr, "Outer scope rewinds everything");
+	ArenaDeallocate(afterScope);
+
+	{
+		ScopedArena outerScope;
+		MemDesc last = ArenaAllocate(100, 16);
+		std::memset(last.ptr, 0x11, last.size);
+		{
+			ScopedArena innerScope;
+			ArenaDeallocate(last);
+			MemDesc grown = ArenaReallocate(last, 200);
+			ASSERT(grown.ptr != last.ptr && static_cast<uint8_t*>(grown.ptr)[99] == 0x11, "Block from before a nested scope is copied into it, not grown across its mark");
+		}
+		MemDesc next = ArenaAllocate(100, 16);
+		std::memset(next.ptr, 0x22, next.size);
+		ASSERT(next.ptr >= static_cast<uint8_t*>(last.ptr) + last.size && static_cast<uint8_t*>(last.ptr)[99] == 0x11, "Block from before a nested scope is still there after it");
+	}
+	afterScope = ArenaAllocate(16, 16);
+	ASSERT(afterScope.ptr == outer.ptr, "Outer scope rewinds the copies too");
+	ArenaDeallocate(afterScope);
+
+	std::thread other([&afterScope]()
+	{
+		MemDesc desc = ArenaAllocate(16, 16);
+		afterScope = desc;
+		ArenaDeallocate(desc);
+	});
+	other.join();
+	ASSERT(afterScope.ptr && afterScope.ptr != outer.ptr, "Every thread has its own arena");
+}
+
+void TestStdAdapters()
+{
+	TEST("Test std allocator adapters");
+
+	struct alignas(64) Aligned
+	{
+		uint8_t data[24];
+	};
+
+	StackAllocator<64_kB> stack;
+	{
+		std::vector<int, StdAllocator<int, StackAllocator<64_kB>>> vector{ StdAllocator<int, StackAllocator<64_kB>>(stack) };
+		vector.reserve(1024);
+		for (int i = 0; i < 1000; ++i)
+		{
+			vector.push_back(i);
+		}
+		ASSERT(vector.back() == 999 && stack.Owns({ vector.data(), 1 }), "std::vector allocates with StdAllocator");
+	}
+	// The stack only takes back its top block, and only when the size matches
+	ASSERT(stack.Mark() == 0, "StdAllocator gives blocks back with their sizes");
+	{
+		std::vector<Aligned, StdAllocator<Aligned, StackAllocator<64_kB>>> aligned{ StdAllocator<Aligned, StackAllocator<64_kB>>(stack) };
+		aligned.resize(3);
+		ASSERT(reinterpret_cast<uintptr_t>(aligned.data()) % 64 == 0, "StdAllocator keeps the alignment of the type");
+	}
+	stack.Rewind(0);
+
+	MemoryResource<StackAllocator<64_kB>> resource(stack);
+	{
+		std::pmr::vector<int> vector{ &resource };
+		vector.resize(1000);
+		ASSERT(stack.Owns({ vector.data(), 1 }), "std::pmr::vector allocates from MemoryResource");
+	}
+	ASSERT(stack.Mark() == 0, "MemoryResource gives blocks back with their sizes");
+	{
+		std::pmr::vector<Aligned> aligned{ &resource };
+		aligned.resize(3);
+		ASSERT(reinterpret_cast<uintptr_t>(aligned.data()) % 64 == 0, "MemoryResource keeps the requested alignment");
+		std::pmr::map<int, int> map{ &resource };
+		for (int i = 0; i < 100; ++i)
+		{
+			map[i] = i;
+		}
+		ASSERT(map.size() == 100 && stack.Owns({ &map[0], 1 }), "std::pmr::map allocates from MemoryResource");
+	}
+
+	MemoryResource<StackAllocator<64_kB>> sameAllocator(stack);
+	ASSERT(resource.is_equal(sameAllocator), "Resources over the same allocator are equal");
+}
+
 void TestMemory()
 {
 	TestMemDesc();
 	TestLinearAllocator<StackAllocator>("Tets StackAllocator");
 	TestLinearAllocator<HeapAllocator>("Tets HeapAllocator");
+	TestLinearAllocator<DefaultRegionAllocator>("Test RegionAllocator as linear allocator");
+	TestRegionAllocator();
 	TestFallbackAllocator();
 	TestSegregatorAllocator();
 	TestFreelistAllocator();
+	TestBatchedFreelistAllocator();
+	TestBitmappedBlockAllocator();
+	TestSlabAllocator();
+	TestBuddyAllocator();
+	TestPageMap();
+	TestThreadCachedAllocator();
+	TestConcurrentFreelistAllocator();
+	TestAllocatorStats();
+	TestAlignment();
+	TestReallocation();
+	TestAllocationTrace();
+	TestCallSites();
+	TestMemoryTags();
+	TestHeapProfile();
+	TestMemoryExport();
+	TestSharedHandles();
+	TestAtomicSharedHandle();
+	TestHandleAllocation();
+	TestReclamation();
+	TestPool();
+	TestCompactingHeap();
+	TestScopedArena();
+	TestStdAdapters();
+	TestAlignedAllocator<StackAllocator<16 * 1024>>("Test aligned StackAllocator", 1024);
+	TestAlignedAllocator<HeapAllocator<16 * 1024>>("Test aligned HeapAllocator", 1024);
+	TestAlignedAllocator<RegionAllocator<1_mB>>("Test aligned RegionAllocator", 64_kB);
+	TestAlignedAllocator<MallocAllocator>("Test aligned MallocAllocator", 64_kB);
+	TestAlignedAllocator<BuddyAllocator<1_mB, 64>>("Test aligned BuddyAllocator", 64_kB);
+	TestAlignedAllocator<SlabAllocator<RegionAllocator<1_mB>>>("Test aligned SlabAllocator", 64_kB);
+	TestAlignedAllocator<ThreadCachedAllocator<SlabAllocator<RegionAllocator<1_mB>>>>("Test aligned ThreadCachedAllocator", 64_kB);
+	TestAlignedAllocator<LockedAllocator<SlabAllocator<RegionAllocator<1_mB>>>>("Test aligned LockedAllocator", 64_kB);
+	TestAlignedAllocator<SegregatorAllocator<StackAllocator<4096>, MallocAllocator, 64>>("Test aligned SegregatorAllocator", 4096);
 }
\ No newline at end of file
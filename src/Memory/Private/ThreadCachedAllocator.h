@@ -0,0 +1,410 @@
+#pragma once
+#include "Allocators.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+namespace Memory
+{
+
+/*
+Puts a per-thread cache of small blocks in front of Allocator.
+
+Allocator itself is only ever touched with the mutex held, and only to refill
+a cache with a batch of blocks or to serve sizes above MaxCachedSize.
+Freed small blocks go to the cache of the thread that frees them, whichever
+thread allocated them. When a cache list grows past MaxListLength a batch of
+blocks is pushed to a lock-free remote-free queue of its size class, and a
+cache that runs dry adopts the whole queue in one exchange before taking the
+lock to refill.
+
+Cached blocks are Granularity aligned. Bigger alignments go to Allocator with
+the lock held, and the blocks it returns are cached by their size when freed.
+
+Nothing here goes through operator new, so this can sit behind a replaced one.
+The lock is recursive for the stats reports built while it is held.
+*/
+template <typename Allocator, size_t MaxCachedSize = 256>
+class ThreadCachedAllocator
+{
+public:
+	static constexpr uint64_t Granularity = 16;
+	static constexpr uint64_t ClassCount = MaxCachedSize / Granularity;
+	static constexpr uint32_t BatchSize = 32;
+	static constexpr uint32_t MaxListLength = 2 * BatchSize;
+
+	static_assert(MaxCachedSize % Granularity == 0, "MaxCachedSize should be a multiple of the granularity");
+
+	ThreadCachedAllocator() = default;
+	ThreadCachedAllocator(ThreadCachedAllocator&&) = delete;
+	ThreadCachedAllocator(ThreadCachedAllocator const&) = delete;
+	ThreadCachedAllocator& operator=(ThreadCachedAllocator&&) = delete;
+	ThreadCachedAllocator& operator=(ThreadCachedAllocator const&) = delete;
+
+	// Other threads that used this instance should have exited by now,
+	// the destroying thread is detached here.
+	~ThreadCachedAllocator()
+	{
+		ThreadState& state = GetThreadState();
+		if (state.owner == this)
+		{
+			state.owner = nullptr;
+			state.cache = nullptr;
+		}
+
+		Cache* it = m_caches;
+		while (it)
+		{
+			Cache* next = it->next;
+			std::free(it);
+			it = next;
+		}
+	}
+
+	MemDesc Allocate(uint64_t size)
+	{
+		Private::LatencySample sample(m_stats, false);
+		if (size == 0 || size > MaxCachedSize)
+		{
+			std::lock_guard<std::recursive_mutex> lock(m_mutex);
+			return allocator.Allocate(size);
+		}
+
+		void* ptr = AllocateCached(ClassIndex(size));
+		return { ptr, ptr ? size : 0 };
+	}
+
+	MemDesc Allocate(uint64_t size, uint64_t alignment)
+	{
+		Private::LatencySample sample(m_stats, false);
+		uint64_t const alignedSize = Private::AlignUp(size, alignment);
+		if (size == 0 || alignedSize > MaxCachedSize || alignment > Granularity)
+		{
+			std::lock_guard<std::recursive_mutex> lock(m_mutex);
+			return allocator.Allocate(size, alignment);
+		}
+
+		void* ptr = AllocateCached(ClassIndex(alignedSize));
+		if (!ptr)
+		{
+			return { nullptr, 0 };
+		}
+		Private::AddPaddingStat(m_stats, alignedSize - size);
+		return { ptr, alignedSize };
+	}
+
+	// Blocks stay in place while the size class doesn't change
+	MemDesc Reallocate(MemDesc desc, uint64_t newSize)
+	{
+		bool const cached = desc.size && desc.size <= MaxCachedSize;
+		bool const newCached = newSize && newSize <= MaxCachedSize;
+		if (!cached && !newCached)
+		{
+			std::lock_guard<std::recursive_mutex> lock(m_mutex);
+			return allocator.Reallocate(desc, newSize);
+		}
+		if (cached && newCached && ClassIndex(desc.size) == ClassIndex(newSize))
+		{
+			return { desc.ptr, newSize };
+		}
+		return Private::ReallocateByCopy(*this, *this, desc, newSize);
+	}
+
+	bool Expand(MemDesc& desc, uint64_t delta)
+	{
+		uint64_t const newSize = desc.size + delta;
+		if (desc.size == 0 || desc.size > MaxCachedSize)
+		{
+			std::lock_guard<std::recursive_mutex> lock(m_mutex);
+			return allocator.Expand(desc, delta);
+		}
+		if (newSize > MaxCachedSize || ClassIndex(desc.size) != ClassIndex(newSize))
+		{
+			return false;
+		}
+		desc.size = newSize;
+		return true;
+	}
+
+	uint64_t GoodSize(uint64_t size) const
+	{
+		if (size == 0 || size > MaxCachedSize)
+		{
+			std::lock_guard<std::recursive_mutex> lock(m_mutex);
+			return allocator.GoodSize(size);
+		}
+		return ClassSize(ClassIndex(size));
+	}
+
+	void Deallocate(MemDesc desc)
+	{
+		Private::LatencySample sample(m_stats, true);
+		if (desc.size == 0 || desc.size > MaxCachedSize)
+		{
+			std::lock_guard<std::recursive_mutex> lock(m_mutex);
+			allocator.Deallocate(desc);
+			return;
+		}
+		DeallocateCached(desc);
+	}
+
+	// owner is what the page map has for desc, only sizes past the cache use it
+	void Deallocate(MemDesc desc, void const* owner)
+	{
+		Private::LatencySample sample(m_stats, true);
+		if (desc.size == 0 || desc.size > MaxCachedSize)
+		{
+			std::lock_guard<std::recursive_mutex> lock(m_mutex);
+			Private::Deallocate(allocator, desc, owner);
+			return;
+		}
+		DeallocateCached(desc);
+	}
+
+	bool Owns(MemDesc desc) const
+	{
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		if (desc.size == 0 || desc.size > MaxCachedSize)
+		{
+			return allocator.Owns(desc);
+		}
+		return allocator.Owns({ desc.ptr, ClassSize(ClassIndex(desc.size)) });
+	}
+
+	Private::AllocatorStatsReportPtr GetStats() const
+	{
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		auto report = std::make_unique<Private::AllocatorStatsReport>();
+		report->stats = m_stats.Read();
+		report->nested.push_back(std::move(allocator.GetStats()));
+		return std::move(report);
+	}
+
+private:
+	struct Node
+	{
+		Node* next;
+	};
+
+	// The first block of a batch also links the batches together
+	struct Batch
+	{
+		Node* next;
+		Batch* nextBatch;
+	};
+	static_assert(sizeof(Batch) <= Granularity, "Smallest block should fit a batch header");
+
+	struct Cache
+	{
+		Node* lists[ClassCount] = {};
+		uint32_t lengths[ClassCount] = {};
+		// Batches adopted from the remote-free queue
+		Batch* stash[ClassCount] = {};
+		Cache* next = nullptr;
+		bool inUse = false;
+	};
+
+	struct ThreadState
+	{
+		ThreadCachedAllocator* owner = nullptr;
+		Cache* cache = nullptr;
+		bool released = false;
+	};
+
+	struct CacheReleaser
+	{
+		~CacheReleaser()
+		{
+			ThreadState& state = GetThreadState();
+			if (state.owner)
+			{
+				state.owner->ReleaseCache(state.cache);
+			}
+			state.released = true;
+		}
+	};
+
+	static constexpr uint64_t ClassIndex(uint64_t size) { return (size - 1) / Granularity; }
+	static constexpr uint64_t ClassSize(uint64_t idx) { return (idx + 1) * Granularity; }
+
+	void* AllocateCached(uint64_t idx)
+	{
+		Cache* cache = GetCache();
+		if (!cache)
+		{
+			std::lock_guard<std::recursive_mutex> lock(m_mutex);
+			return allocator.Allocate(ClassSize(idx), Granularity).ptr;
+		}
+
+		if (!cache->lists[idx] && !Refill(*cache, idx))
+		{
+			return nullptr;
+		}
+		Node* node = cache->lists[idx];
+		cache->lists[idx] = node->next;
+		--cache->lengths[idx];
+		Private::AddAllocationStat(m_stats, ClassSize(idx));
+		return node;
+	}
+
+	void DeallocateCached(MemDesc desc)
+	{
+		uint64_t const idx = ClassIndex(desc.size);
+		Cache* cache = GetCache();
+		if (!cache)
+		{
+			std::lock_guard<std::recursive_mutex> lock(m_mutex);
+			allocator.Deallocate({ desc.ptr, ClassSize(idx) });
+			return;
+		}
+
+		Private::AddDeallocateStat(m_stats, ClassSize(idx));
+		Node* node = reinterpret_cast<Node*>(desc.ptr);
+		node->next = cache->lists[idx];
+		cache->lists[idx] = node;
+		if (++cache->lengths[idx] > MaxListLength)
+		{
+			FlushBatch(*cache, idx);
+		}
+	}
+
+	static ThreadState& GetThreadState()
+	{
+		static thread_local ThreadState state;
+		return state;
+	}
+
+	// Returns nullptr when the calling thread is already tearing down, or when its
+	// cache belongs to another instance of the same allocator type.
+	Cache* GetCache()
+	{
+		ThreadState& state = GetThreadState();
+		if (state.owner == this)
+		{
+			return state.cache;
+		}
+		if (state.owner || state.released)
+		{
+			return nullptr;
+		}
+
+		static thread_local CacheReleaser releaser;
+		(void)releaser;
+
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		Cache* cache = m_caches;
+		while (cache && cache->inUse)
+		{
+			cache = cache->next;
+		}
+		if (!cache)
+		{
+			cache = new (std::malloc(sizeof(Cache))) Cache();
+			cache->next = m_caches;
+			m_caches = cache;
+		}
+		cache->inUse = true;
+		state.owner = this;
+		state.cache = cache;
+		return cache;
+	}
+
+	void ReleaseCache(Cache* cache)
+	{
+		for (uint64_t idx = 0; idx < ClassCount; ++idx)
+		{
+			if (cache->lists[idx])
+			{
+				Batch* batch = reinterpret_cast<Batch*>(cache->lists[idx]);
+				PushRemote(idx, batch, batch);
+				cache->lists[idx] = nullptr;
+				cache->lengths[idx] = 0;
+			}
+			if (Batch* first = cache->stash[idx])
+			{
+				Batch* last = first;
+				while (last->nextBatch)
+				{
+					last = last->nextBatch;
+				}
+				PushRemote(idx, first, last);
+				cache->stash[idx] = nullptr;
+			}
+		}
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		cache->inUse = false;
+	}
+
+	void PushRemote(uint64_t idx, Batch* first, Batch* last)
+	{
+		Batch* head = m_remoteFree[idx].load(std::memory_order_relaxed);
+		do
+		{
+			last->nextBatch = head;
+		} while (!m_remoteFree[idx].compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	void FlushBatch(Cache& cache, uint64_t idx)
+	{
+		Node* first = cache.lists[idx];
+		Node* last = first;
+		for (uint32_t i = 1; i < BatchSize; ++i)
+		{
+			last = last->next;
+		}
+		cache.lists[idx] = last->next;
+		cache.lengths[idx] -= BatchSize;
+		last->next = nullptr;
+		Batch* batch = reinterpret_cast<Batch*>(first);
+		PushRemote(idx, batch, batch);
+	}
+
+	bool Refill(Cache& cache, uint64_t idx)
+	{
+		if (!cache.stash[idx])
+		{
+			cache.stash[idx] = m_remoteFree[idx].exchange(nullptr, std::memory_order_acquire);
+		}
+		if (Batch* batch = cache.stash[idx])
+		{
+			cache.stash[idx] = batch->nextBatch;
+			Node* first = reinterpret_cast<Node*>(batch);
+			uint32_t length = 0;
+			for (Node* it = first; it; it = it->next)
+			{
+				++length;
+			}
+			cache.lists[idx] = first;
+			cache.lengths[idx] = length;
+			return true;
+		}
+
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		for (uint32_t i = 0; i < BatchSize; ++i)
+		{
+			MemDesc desc = allocator.Allocate(ClassSize(idx), Granularity);
+			if (!desc.ptr)
+			{
+				break;
+			}
+			Node* node = reinterpret_cast<Node*>(desc.ptr);
+			node->next = cache.lists[idx];
+			cache.lists[idx] = node;
+			++cache.lengths[idx];
+		}
+		return cache.lists[idx] != nullptr;
+	}
+
+	mutable std::recursive_mutex m_mutex;
+	Allocator allocator;
+	Cache* m_caches = nullptr;
+	std::atomic<Batch*> m_remoteFree[ClassCount] = {};
+	// Blocks handed out count as allocations and blocks callers give back to a cache
+	// as deallocations, refills aren't counted, the same way FreelistAllocator counts its list.
+	// Shards keep the threads off each other's counters.
+	Private::AllocatorCounters m_stats = "ThreadCachedAllocator";
+};
+
+} // namespace Memory
@@ -0,0 +1,231 @@
+#include "VirtualMemory.h"
+#include "BitUtils.h"
+#include "Memory.h"
+#include "Utils/Assert.h"
+
+#ifdef _WIN32
+#include "Windows.h"
+#include <psapi.h>
+#else
+#include <cerrno>
+#include <cstdio>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace Memory
+{
+namespace Private
+{
+
+#ifdef _WIN32
+
+uint64_t GetPageSize()
+{
+	static uint64_t const pageSize = []()
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return static_cast<uint64_t>(info.dwPageSize);
+	}();
+	return pageSize;
+}
+
+void* ReserveAddressSpace(uint64_t size, uint64_t alignment)
+{
+	void* ptr = VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+	if (!ptr || (reinterpret_cast<uintptr_t>(ptr) & (alignment - 1)) == 0)
+	{
+		return ptr;
+	}
+	// Windows can't release a part of a reservation, so find an aligned spot and reserve it again
+	for (int attempt = 0; attempt < 8; ++attempt)
+	{
+		VirtualFree(ptr, 0, MEM_RELEASE);
+		ptr = VirtualAlloc(nullptr, size + alignment, MEM_RESERVE, PAGE_NOACCESS);
+		if (!ptr)
+		{
+			return nullptr;
+		}
+		uintptr_t const aligned = (reinterpret_cast<uintptr_t>(ptr) + alignment - 1) & ~(alignment - 1);
+		VirtualFree(ptr, 0, MEM_RELEASE);
+		ptr = VirtualAlloc(reinterpret_cast<void*>(aligned), size, MEM_RESERVE, PAGE_NOACCESS);
+		if (ptr)
+		{
+			return ptr;
+		}
+	}
+	return nullptr;
+}
+
+void ReleaseAddressSpace(void* ptr, uint64_t)
+{
+	VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+bool CommitPages(void* ptr, uint64_t size)
+{
+	return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+}
+
+void PurgePages(void* ptr, uint64_t size, bool lazy)
+{
+	if (lazy)
+	{
+		VirtualAlloc(ptr, size, MEM_RESET, PAGE_READWRITE);
+	}
+	else
+	{
+		VirtualFree(ptr, size, MEM_DECOMMIT);
+		VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE);
+	}
+}
+
+void AdviseHugePages(void*, uint64_t)
+{
+	// Large pages need SeLockMemoryPrivilege and can't be committed lazily
+}
+
+void* MapPages(uint64_t size)
+{
+	return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+void* RemapPages(void*, uint64_t, uint64_t)
+{
+	// There is no mremap(), pages can't be moved to another address
+	return nullptr;
+}
+
+bool ResizePagesInPlace(void*, uint64_t oldSize, uint64_t newSize)
+{
+	// A reservation can't grow or shrink, only what fits in its last page
+	return AlignUp(newSize, GetPageSize()) == AlignUp(oldSize, GetPageSize());
+}
+
+#else
+
+uint64_t GetPageSize()
+{
+	static uint64_t const pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+	return pageSize;
+}
+
+void* ReserveAddressSpace(uint64_t size, uint64_t alignment)
+{
+	uint64_t const reserved = size + alignment - GetPageSize();
+	void* ptr = mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED)
+	{
+		return nullptr;
+	}
+	// Trim the unaligned head and the tail
+	uintptr_t const begin = reinterpret_cast<uintptr_t>(ptr);
+	uintptr_t const aligned = (begin + alignment - 1) & ~(alignment - 1);
+	if (aligned != begin)
+	{
+		munmap(ptr, aligned - begin);
+	}
+	uint64_t const tail = begin + reserved - (aligned + size);
+	if (tail)
+	{
+		munmap(reinterpret_cast<void*>(aligned + size), tail);
+	}
+	return reinterpret_cast<void*>(aligned);
+}
+
+void ReleaseAddressSpace(void* ptr, uint64_t size)
+{
+	munmap(ptr, size);
+}
+
+bool CommitPages(void* ptr, uint64_t size)
+{
+	return mprotect(ptr, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+void PurgePages(void* ptr, uint64_t size, bool lazy)
+{
+#ifdef MADV_FREE
+	// MADV_FREE needs Linux 4.5, fall back to MADV_DONTNEED on older kernels
+	if (lazy && madvise(ptr, size, MADV_FREE) == 0)
+	{
+		return;
+	}
+#else
+	(void)lazy;
+#endif
+	madvise(ptr, size, MADV_DONTNEED);
+}
+
+void AdviseHugePages(void* ptr, uint64_t size)
+{
+#ifdef MADV_HUGEPAGE
+	madvise(ptr, size, MADV_HUGEPAGE);
+#else
+	(void)ptr; (void)size;
+#endif
+}
+
+void* MapPages(uint64_t size)
+{
+	void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+void* RemapPages(void* ptr, uint64_t oldSize, uint64_t newSize)
+{
+#ifdef MREMAP_MAYMOVE
+	void* newPtr = mremap(ptr, AlignUp(oldSize, GetPageSize()), AlignUp(newSize, GetPageSize()), MREMAP_MAYMOVE);
+	return newPtr == MAP_FAILED ? nullptr : newPtr;
+#else
+	(void)ptr; (void)oldSize; (void)newSize;
+	return nullptr;
+#endif
+}
+
+bool ResizePagesInPlace(void* ptr, uint64_t oldSize, uint64_t newSize)
+{
+	uint64_t const oldMapped = AlignUp(oldSize, GetPageSize());
+	uint64_t const newMapped = AlignUp(newSize, GetPageSize());
+	if (newMapped == oldMapped)
+	{
+		return true;
+	}
+#ifdef MREMAP_MAYMOVE
+	return mremap(ptr, oldMapped, newMapped, 0) != MAP_FAILED;
+#else
+	return false;
+#endif
+}
+
+#endif
+
+} // namespace Private
+
+uint64_t GetResidentMemory()
+{
+#if defined ( _WIN32 )
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		return counters.WorkingSetSize;
+	}
+	return 0;
+#elif defined ( __linux__ )
+	FILE* statm = std::fopen("/proc/self/statm", "r");
+	if (!statm)
+	{
+		return 0;
+	}
+	unsigned long long total = 0;
+	unsigned long long resident = 0;
+	int const read = std::fscanf(statm, "%llu %llu", &total, &resident);
+	std::fclose(statm);
+	return read == 2 ? resident * Private::GetPageSize() : 0;
+#else
+	return 0;
+#endif
+}
+
+} // namespace Memory
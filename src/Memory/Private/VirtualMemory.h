@@ -0,0 +1,37 @@
+#pragma once
+#include <cinttypes>
+
+namespace Memory
+{
+namespace Private
+{
+	uint64_t GetPageSize();
+
+	// Reserves address space only, nothing is accessible until committed.
+	// alignment should be a power of two, page size or more.
+	void* ReserveAddressSpace(uint64_t size, uint64_t alignment);
+
+	void ReleaseAddressSpace(void* ptr, uint64_t size);
+
+	// Makes reserved pages accessible, physical memory is only used once they are touched
+	bool CommitPages(void* ptr, uint64_t size);
+
+	// Gives physical pages back to the OS, the range stays committed. After an eager purge it reads
+	// back as zeroes. Lazy purge lets the OS take the pages back only under memory pressure,
+	// until then they can keep their old contents, so don't count on either.
+	void PurgePages(void* ptr, uint64_t size, bool lazy);
+
+	// Asks for transparent huge pages, no-op where not supported
+	void AdviseHugePages(void* ptr, uint64_t size);
+
+	// Reserves and commits page aligned memory in one go, release it with ReleaseAddressSpace()
+	void* MapPages(uint64_t size);
+
+	// Resizes memory from MapPages(), moving the pages instead of copying them when it can't
+	// grow in place. Returns nullptr where that isn't supported, the old mapping is still valid then.
+	void* RemapPages(void* ptr, uint64_t oldSize, uint64_t newSize);
+
+	// Resizes memory from MapPages() without moving it, returns false when it can't
+	bool ResizePagesInPlace(void* ptr, uint64_t oldSize, uint64_t newSize);
+} // namespace Private
+} // namespace Memory
@@ -0,0 +1,146 @@
+#pragma once
+#include "Utils/Assert.h"
+#include "SharedHandle.h"
+
+#include <atomic>
+
+namespace Memory
+{
+
+/*
+A SharedHandle that threads can load and replace concurrently without locks,
+for read-mostly data published as snapshots: readers Load() the current one
+and keep it as long as they like, writers Store() or CompareExchange() the
+next version.
+
+Counts are split. The word holds the control block pointer in its low 48 bits
+and the readers between their load of the word and their increment of the
+strong count in the high 16. Load() takes one of those local references with
+a single fetch_add, which keeps the block alive while it increments the strong
+count, then gives the local one back. A writer that replaces the pointer moves
+the local count it took out into the strong count of the old block, so a
+reader that finds the pointer changed gives its reference back there.
+*/
+template <typename T, typename Allocation>
+class AtomicSharedHandle
+{
+public:
+	using Shared = SharedHandle<T, AtomicRefCount, Allocation>;
+
+	AtomicSharedHandle() = default;
+	AtomicSharedHandle(AtomicSharedHandle const&) = delete;
+	AtomicSharedHandle& operator=(AtomicSharedHandle const&) = delete;
+
+	AtomicSharedHandle(Shared desired)
+		: m_word(Pack(Release(desired)))
+	{
+	}
+
+	~AtomicSharedHandle()
+	{
+		Shared last = Exchange(nullptr);
+	}
+
+	Shared Load() const
+	{
+		uint64_t word = m_word.fetch_add(LocalOne, std::memory_order_acquire);
+		ControlBlock* const control = Control(word);
+		if (!control)
+		{
+			GiveBackLocal(word + LocalOne, nullptr);
+			return {};
+		}
+		AtomicRefCount::Increment(control->strong);
+		if (!GiveBackLocal(word + LocalOne, control))
+		{
+			// The writer that swapped control out moved our local reference into the strong count
+			control->strong.fetch_sub(1, std::memory_order_relaxed);
+		}
+		return Shared(control);
+	}
+
+	void Store(Shared desired)
+	{
+		Shared previous = Exchange(std::move(desired));
+	}
+
+	Shared Exchange(Shared desired)
+	{
+		uint64_t const word = m_word.exchange(Pack(Release(desired)), std::memory_order_acq_rel);
+		return TakeOver(word);
+	}
+
+	// Stores desired if the handle still holds expected, otherwise loads the current one into expected
+	bool CompareExchange(Shared& expected, Shared desired)
+	{
+		ControlBlock* const next = Release(desired);
+		uint64_t word = m_word.load(std::memory_order_relaxed);
+		while (Control(word) == expected.m_control)
+		{
+			if (m_word.compare_exchange_weak(word, Pack(next), std::memory_order_acq_rel, std::memory_order_relaxed))
+			{
+				Shared previous = TakeOver(word);
+				return true;
+			}
+		}
+		// desired wasn't stored, its reference is dropped
+		Shared unused(next);
+		expected = Load();
+		return false;
+	}
+
+private:
+	using ControlBlock = typename Shared::ControlBlock;
+
+	static constexpr uint32_t PointerBits = 48;
+	static constexpr uint64_t PointerMask = (1ull << PointerBits) - 1;
+	static constexpr uint64_t LocalOne = 1ull << PointerBits;
+
+	static_assert(sizeof(void*) == 8, "Local counts go in the unused top bits of 64-bit pointers");
+
+	static ControlBlock* Control(uint64_t word) { return reinterpret_cast<ControlBlock*>(word & PointerMask); }
+
+	static uint64_t Pack(ControlBlock* control)
+	{
+		uint64_t const word = reinterpret_cast<uint64_t>(control);
+		MY_ASSERT(!(word & ~PointerMask), "Pointer doesn't fit in 48 bits");
+		return word;
+	}
+
+	// Takes the reference out of a handle, it moves into the word
+	static ControlBlock* Release(Shared& handle)
+	{
+		ControlBlock* const control = handle.m_control;
+		handle.m_control = nullptr;
+		return control;
+	}
+
+	// The word's reference plus the local ones taken out with it
+	static Shared TakeOver(uint64_t word)
+	{
+		ControlBlock* const control = Control(word);
+		uint64_t const local = word >> PointerBits;
+		if (control && local)
+		{
+			control->strong.fetch_add(static_cast<uint32_t>(local), std::memory_order_relaxed);
+		}
+		return Shared(control);
+	}
+
+	// False once control isn't in the word anymore
+	bool GiveBackLocal(uint64_t word, ControlBlock* control) const
+	{
+		while (Control(word) == control && (word >> PointerBits))
+		{
+			if (m_word.compare_exchange_weak(word, word - LocalOne, std::memory_order_relaxed))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	mutable std::atomic<uint64_t> m_word{ 0 };
+};
+
+} // namespace Memory
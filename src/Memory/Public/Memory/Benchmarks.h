@@ -0,0 +1,3 @@
+#pragma once
+
+void BenchMemory();
\ No newline at end of file
@@ -0,0 +1,206 @@
+#pragma once
+#include "Utils/Assert.h"
+#include "Memory.h"
+#include "Pool.h"
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace Memory
+{
+namespace Private
+{
+	class AllocatorCounters;
+	struct AllocatorStatsReport;
+} // namespace Private
+
+/*
+Linear allocator over reserved address space whose blocks are reached through
+a table of handles instead of pointers, so they can be moved. Freed blocks
+leave holes, Compact() closes them by sliding the live blocks above them down
+and patching their table entries, then gives the pages above the new top back
+to the OS.
+
+Compaction is incremental. A pass walks the blocks from the bottom up and
+stops when the budget runs out, the next call carries on from there, while
+allocations and frees go on in between. Blocks freed behind the cursor are
+left for the next pass. Allocate() compacts all the way when the region is
+full rather than fail.
+
+Pointers from Get() are only good until the next Compact() or Allocate().
+Blocks are moved with memmove and are Granularity aligned. Only address space
+for size bytes is reserved up front, pages are committed as the heap grows.
+*/
+class CompactingHeap
+{
+public:
+	using Handle = PoolHandle64;
+
+	static constexpr uint64_t Granularity = 16;
+	static constexpr uint64_t CommitGranularity = 64_kB;
+	// Bytes walked between looks at the clock
+	static constexpr uint64_t BudgetCheckBytes = 16_kB;
+
+	explicit CompactingHeap(uint64_t size);
+	~CompactingHeap();
+
+	CompactingHeap(CompactingHeap&&) = delete;
+	CompactingHeap(CompactingHeap const&) = delete;
+	CompactingHeap& operator=(CompactingHeap&&) = delete;
+	CompactingHeap& operator=(CompactingHeap const&) = delete;
+
+	// Returns a null handle when the live blocks don't leave room for size bytes
+	Handle Allocate(uint64_t size);
+
+	void Deallocate(Handle handle);
+
+	bool IsValid(Handle handle) const
+	{
+		uint64_t const index = handle.GetIndex();
+		return (handle.GetGeneration() & 1) && index < entryCount && table[index].generation == handle.GetGeneration();
+	}
+
+	// Where the block is right now, an empty descriptor for stale handles
+	MemDesc Get(Handle handle) const
+	{
+		if (!IsValid(handle))
+		{
+			return {};
+		}
+		BlockHeader* header = reinterpret_cast<BlockHeader*>(table[handle.GetIndex()].block);
+		return { header + 1, header->size - sizeof(BlockHeader) };
+	}
+
+	// Moves blocks for about budget, returns true once there are no holes left
+	bool Compact(std::chrono::nanoseconds budget);
+
+	// Bytes in holes, Compact() gets them back
+	uint64_t GetFreeBytes() const { return holeBytes; }
+
+	// Bytes from the bottom of the region to the top block
+	uint64_t GetUsedBytes() const { return top - region; }
+
+	// Bytes moved by Compact() so far
+	uint64_t GetMovedBytes() const { return movedBytes; }
+
+	std::unique_ptr<Private::AllocatorStatsReport> GetStats() const;
+
+private:
+	static constexpr uint32_t NoEntry = ~0u;
+	static constexpr uint64_t FreeBlock = ~0ull;
+
+	// In front of every block, so the heap can be walked from the bottom
+	struct BlockHeader
+	{
+		uint64_t size;
+		uint64_t entry;
+	};
+	static_assert(sizeof(BlockHeader) % Granularity == 0, "Blocks should stay aligned after the header");
+
+	struct Entry
+	{
+		uint8_t* block;
+		// Odd while the entry is in use
+		uint32_t generation;
+		uint32_t nextFree;
+	};
+
+	uint64_t Room() const { return capacity - (top - region); }
+
+	bool GrowTable();
+	bool CommitUpTo(uint8_t* end);
+	void PurgeTail();
+
+	uint64_t const capacity;
+	uint64_t reservedSize = 0;
+	uint8_t* region = nullptr;
+	uint8_t* top = nullptr;
+	uint8_t* committedEnd = nullptr;
+	uint8_t* touchedEnd = nullptr;
+	uint64_t holeBytes = 0;
+
+	// Cursors of the pass in progress, live blocks below destination are packed
+	uint8_t* scan = nullptr;
+	uint8_t* destination = nullptr;
+	uint64_t movedBytes = 0;
+
+	Entry* table = nullptr;
+	uint64_t entryCount = 0;
+	uint64_t entryCapacity = 0;
+	uint32_t freeEntry = NoEntry;
+	std::unique_ptr<Private::AllocatorCounters> m_stats;
+};
+
+/*
+Owns an object in a CompactingHeap, like UniqueHandle but through the heap's
+handle table, so the object may move between accesses. T is moved with memmove.
+*/
+template <typename T, typename Heap>
+class RelocatableHandle
+{
+public:
+	RelocatableHandle() = default;
+	RelocatableHandle(RelocatableHandle const&) = delete;
+	RelocatableHandle& operator=(RelocatableHandle const&) = delete;
+
+	RelocatableHandle(Heap& heap, typename Heap::Handle handle)
+		: m_heap(&heap)
+		, m_handle(handle)
+	{
+	}
+
+	~RelocatableHandle()
+	{
+		if (IsValid())
+		{
+			Get()->~T();
+			m_heap->Deallocate(m_handle);
+		}
+	}
+
+	RelocatableHandle(RelocatableHandle&& other) noexcept
+	{
+		std::swap(m_heap, other.m_heap);
+		std::swap(m_handle, other.m_handle);
+	}
+
+	RelocatableHandle& operator=(RelocatableHandle&& other) noexcept
+	{
+		std::swap(m_heap, other.m_heap);
+		std::swap(m_handle, other.m_handle);
+		return *this;
+	}
+
+	bool IsValid() const { return m_heap && m_heap->IsValid(m_handle); }
+
+	operator bool() const { return IsValid(); }
+
+	// Good until the heap compacts
+	T* Get() const
+	{
+		MY_ASSERT(IsValid(), "Dereferencing invalid RelocatableHandle");
+		return static_cast<T*>(m_heap->Get(m_handle).ptr);
+	}
+
+	T& operator*() const { return *Get(); }
+	T* operator->() const { return Get(); }
+
+private:
+	Heap* m_heap = nullptr;
+	typename Heap::Handle m_handle;
+};
+
+template <typename T, typename Heap, typename ...Args>
+RelocatableHandle<T, Heap> MakeRelocatable(Heap& heap, Args&& ...args)
+{
+	static_assert(alignof(T) <= Heap::Granularity, "Blocks are only Granularity aligned");
+	typename Heap::Handle handle = heap.Allocate(sizeof(T));
+	MY_ASSERT(!handle.IsNull(), "Failed to allocate memory");
+	new (heap.Get(handle).ptr) T(std::forward<Args>(args)...);
+	return { heap, handle };
+}
+
+} // namespace Memory
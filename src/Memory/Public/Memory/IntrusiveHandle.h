@@ -0,0 +1,170 @@
+#pragma once
+#include "Utils/Assert.h"
+#include "Memory.h"
+#include "RefCount.h"
+
+#include <cstddef>
+#include <new>
+
+namespace Memory
+{
+
+// Base of types that carry their own reference count for IntrusiveHandle
+template <typename RefCountPolicy = AtomicRefCount>
+class RefCounted
+{
+public:
+	void AddRef() const { RefCountPolicy::Increment(m_refCount); }
+
+	// True when it was the last reference
+	bool Release() const { return RefCountPolicy::Decrement(m_refCount); }
+
+	uint32_t GetRefCount() const { return RefCountPolicy::Load(m_refCount); }
+
+protected:
+	RefCounted() = default;
+	~RefCounted() = default;
+
+	// A copy is a new object, nobody refers to it yet
+	RefCounted(RefCounted const&) {}
+	RefCounted& operator=(RefCounted const&) { return *this; }
+
+private:
+	mutable typename RefCountPolicy::Counter m_refCount{ 0 };
+};
+
+template <typename T, typename Allocation = GlobalAllocation>
+class IntrusiveHandle;
+
+template <typename T, typename Allocation, typename ...Args>
+IntrusiveHandle<T, Allocation> AllocateIntrusive(Allocation const& allocation, Args&& ...args);
+
+template <typename T, typename ...Args>
+IntrusiveHandle<T> MakeIntrusive(Args&& ...args);
+
+/*
+Shared owner of a T made by MakeIntrusive that counts references itself, with
+AddRef() and Release() like RefCounted gives. The handle is one pointer and
+the object can hand out handles to itself from a raw pointer.
+
+Allocation is where the block comes from, see GlobalAllocation. It is kept in
+a header in front of the object with the size of the block, stateless ones
+take no room.
+*/
+template <typename T, typename Allocation>
+class IntrusiveHandle
+{
+public:
+	IntrusiveHandle() = default;
+	IntrusiveHandle(std::nullptr_t) {};
+
+	// object has to come from AllocateIntrusive with the same Allocation
+	explicit IntrusiveHandle(T* object)
+		: m_object(object)
+	{
+		if (m_object)
+		{
+			m_object->AddRef();
+		}
+	}
+
+	~IntrusiveHandle()
+	{
+		Decrement();
+	}
+
+	IntrusiveHandle(IntrusiveHandle const& other)
+		: IntrusiveHandle(other.m_object)
+	{
+	}
+
+	IntrusiveHandle& operator=(IntrusiveHandle const& other)
+	{
+		IntrusiveHandle copy(other);
+		std::swap(m_object, copy.m_object);
+		return *this;
+	}
+
+	IntrusiveHandle(IntrusiveHandle&& other) noexcept
+	{
+		std::swap(m_object, other.m_object);
+	}
+
+	IntrusiveHandle& operator=(IntrusiveHandle&& other) noexcept
+	{
+		std::swap(m_object, other.m_object);
+		return *this;
+	}
+
+	bool IsValid() const { return m_object; }
+
+	operator bool() const { return IsValid(); }
+
+	T& operator*() const { return *Get(); }
+	T* operator->() const { return Get(); }
+
+	inline T* Get() const
+	{
+		MY_ASSERT(IsValid(), "Dereferencing invalid IntrusiveHandle");
+		return m_object;
+	}
+
+private:
+	template <typename U, typename A, typename ...Args>
+	friend IntrusiveHandle<U, A> AllocateIntrusive(A const& allocation, Args&& ...args);
+
+	struct Header : Allocation
+	{
+		Header(Allocation const& allocation, uint64_t size)
+			: Allocation(allocation)
+			, blockSize(size)
+		{
+		}
+
+		uint64_t blockSize;
+	};
+
+	// The object starts at the next multiple of its alignment after the header
+	static constexpr uint64_t DataOffset = (sizeof(Header) + alignof(T) - 1) / alignof(T) * alignof(T);
+	static constexpr uint64_t Alignment = alignof(T) > alignof(Header) ? alignof(T) : alignof(Header);
+
+	static Header* GetHeader(T* object)
+	{
+		return reinterpret_cast<Header*>(reinterpret_cast<uint8_t*>(object) - DataOffset);
+	}
+
+	void Decrement()
+	{
+		if (m_object && m_object->Release())
+		{
+			Header* header = GetHeader(m_object);
+			Allocation const allocation = *header;
+			uint64_t const blockSize = header->blockSize;
+			m_object->~T();
+			header->~Header();
+			allocation.Deallocate({ header, blockSize });
+		}
+		m_object = nullptr;
+	}
+
+	T* m_object = nullptr;
+};
+
+template <typename T, typename Allocation, typename ...Args>
+IntrusiveHandle<T, Allocation> AllocateIntrusive(Allocation const& allocation, Args&& ...args)
+{
+	using Handle = IntrusiveHandle<T, Allocation>;
+	MemDesc desc = allocation.Allocate(Handle::DataOffset + sizeof(T), Handle::Alignment);
+	MY_ASSERT(desc.ptr, "Failed to allocate memory");
+
+	new (desc.ptr) typename Handle::Header(allocation, desc.size);
+	return Handle(new (static_cast<uint8_t*>(desc.ptr) + Handle::DataOffset) T(std::forward<Args>(args)...));
+}
+
+template <typename T, typename ...Args>
+IntrusiveHandle<T> MakeIntrusive(Args&& ...args)
+{
+	return AllocateIntrusive<T>(GlobalAllocation(), std::forward<Args>(args)...);
+}
+
+} // namespace Memory
@@ -1,6 +1,9 @@
 #pragma once
 #include "MemDesc.h"
 
+#include <atomic>
+#include <type_traits>
+
 constexpr std::uint64_t operator""_kB(uint64_t v) { return v << 10; }
 constexpr std::uint64_t operator""_mB(uint64_t v) { return v << 20; }
 constexpr std::uint64_t operator""_gB(uint64_t v) { return v << 30; }
@@ -8,53 +11,258 @@ constexpr std::uint64_t operator""_gB(uint64_t v) { return v << 30; }
 namespace Memory
 {
 
-namespace Private
-{
-	struct AllocInfo
-	{
-		AllocInfo* next = nullptr;
-		const char* filename = nullptr;
-		const char* function = nullptr;
-		long line = 0;
-		uint64_t count = 0;
-		uint64_t totalBytes = 0;
-	};
-
-	extern AllocInfo* NextAllocInfo;
-} // namespace Private
-
+// Starts the heap profiler with the default rate before main(), see StartHeapProfile()
 //#define __ENABLE_ALLOCINFO
 
-#ifdef __ENABLE_ALLOCINFO
-
-#if defined ( WIN32 )
-#define __PRETTY_FUNCTION__ __FUNCSIG__
+// Allocations are sampled by the heap profiler inside Memory::Allocate(), the call site is on the sampled stack
+#if defined(_MSC_VER)
+#define MEMORY_FUNCTION __FUNCSIG__
+#else
+#define MEMORY_FUNCTION __PRETTY_FUNCTION__
 #endif
 
-#define ALLOCATE(sizeInBytes)\
-	Memory::Allocate(sizeInBytes);\
-	{\
-		static Memory::Private::AllocInfo info;\
-		if (info.count == 0) {\
-			info.filename = __FILE__;\
-			info.function = __PRETTY_FUNCTION__;\
-			info.line = __LINE__;\
-			Memory::Private::NextAllocInfo->next = &info;\
-			Memory::Private::NextAllocInfo = &info;\
-		}\
-		++info.count;\
-		info.totalBytes += sizeInBytes;\
-	}
+// The CallSite of this line in the enclosing function, registered the first time it runs
+#define MEMORY_CALL_SITE() ([](char const* function) -> Memory::CallSite& { static Memory::CallSite site(__FILE__, __LINE__, function); return site; }(MEMORY_FUNCTION))
+
+// Gives every ALLOCATE its own CallSite, LoadCallSiteProfile() can then route hot ones to pools of their own.
+// Set by the MEMORY_CALL_SITES CMake option.
+//#define MEMORY_CALL_SITES
+
+#ifdef MEMORY_CALL_SITES
+#define ALLOCATE(sizeInBytes) Memory::Allocate(sizeInBytes, MEMORY_CALL_SITE());
+#define ALLOCATE_ALIGNED(sizeInBytes, alignment) Memory::Allocate(sizeInBytes, alignment, MEMORY_CALL_SITE());
+// Allocation::Allocate(sizeInBytes, alignment) of a container's policy, GlobalAllocation ones get a CallSite
+#define ALLOCATE_FROM(Allocation, sizeInBytes, alignment) Memory::AllocateAt<Allocation>(sizeInBytes, alignment, MEMORY_CALL_SITE())
 #else
 #define ALLOCATE(sizeInBytes) Memory::Allocate(sizeInBytes);
+#define ALLOCATE_ALIGNED(sizeInBytes, alignment) Memory::Allocate(sizeInBytes, alignment);
+#define ALLOCATE_FROM(Allocation, sizeInBytes, alignment) Allocation::Allocate(sizeInBytes, alignment)
 #endif
 
+/*
+A place in the code that allocates. Sites count what they allocate, and
+WriteCallSiteProfile() writes the counts out. A profile loaded back with
+LoadCallSiteProfile(), in a later run or the same one, routes the hottest
+sites to pools of their own, so their blocks share pages only with each
+other instead of with everything else of the same size.
+Sites are static and are never unregistered.
+*/
+struct CallSite
+{
+	CallSite(char const* file, uint32_t line, char const* function);
+	CallSite(CallSite const&) = delete;
+	CallSite& operator=(CallSite const&) = delete;
+
+	char const* file;
+	char const* function;
+	uint32_t line;
+	// In the order sites first ran, only good for this run
+	uint32_t id;
+	// 1 + index of the pool serving the site, 0 for the global allocator
+	std::atomic<uint32_t> route{ 0 };
+	// Updates can get lost between threads, the profile only ranks sites
+	std::atomic<uint64_t> count{ 0 };
+	std::atomic<uint64_t> bytes{ 0 };
+	CallSite* next = nullptr;
+};
+
+/*
+Tags split the memory of the process by subsystem. A block is counted under
+the tag it is allocated with until it is freed, whichever tag is current then.
+Allocations that don't take a tag use the one of the innermost ScopedMemoryTag
+of the thread, Untagged outside of any. Tagged blocks come from the same
+allocators as the others, the page map keeps the tag of each for when it's freed.
+Counts are kept per thread and folded into the totals every 64 kB, totals and
+soft budgets can be off by that much for every thread. Within 64 kB of its hard
+budget a tag folds and checks every allocation.
+*/
+enum class MemoryTag : uint16_t
+{
+	Untagged = 0,
+};
+
+constexpr uint32_t MaxMemoryTags = 64;
+
+// The same name gives the same tag
+MemoryTag RegisterMemoryTag(char const* name);
+
+char const* GetMemoryTagName(MemoryTag tag);
+
+// Bytes allocated with tag that aren't freed yet
+uint64_t GetMemoryTagUsage(MemoryTag tag);
+
+// usedBytes is the total of tag, the call is made on the thread that went over.
+// What it allocates or frees doesn't trigger callbacks or fail on budgets.
+using MemoryBudgetCallback = void (*)(MemoryTag tag, uint64_t usedBytes);
+
+// onSoft is called when the tag goes over softBytes, a chance to shed caches.
+// An allocation that would take it over hardBytes calls onHard and fails if the tag is still over after it.
+// 0 bytes is no budget, callbacks can be null.
+void SetMemoryBudget(MemoryTag tag, uint64_t softBytes, MemoryBudgetCallback onSoft, uint64_t hardBytes, MemoryBudgetCallback onHard);
+
+// Tags what the thread allocates without a tag until it goes out of scope, guards nest
+class ScopedMemoryTag
+{
+public:
+	explicit ScopedMemoryTag(MemoryTag tag);
+	~ScopedMemoryTag();
+	ScopedMemoryTag(ScopedMemoryTag const&) = delete;
+	ScopedMemoryTag& operator=(ScopedMemoryTag const&) = delete;
+
+private:
+	MemoryTag m_previous;
+};
+
 MemDesc Allocate(uint64_t sizeInBytes);
 
+// alignment should be a power of two. The block is rounded up to a multiple of it,
+// deallocate it with the MemDesc returned from here.
+MemDesc Allocate(uint64_t sizeInBytes, uint64_t alignment);
+
+// Counted for site, from its pool when it has one and the pool serves the size
+MemDesc Allocate(uint64_t sizeInBytes, CallSite& site);
+MemDesc Allocate(uint64_t sizeInBytes, uint64_t alignment, CallSite& site);
+
+// Counted under tag, invalid when its hard budget refuses
+MemDesc Allocate(uint64_t sizeInBytes, MemoryTag tag);
+MemDesc Allocate(uint64_t sizeInBytes, uint64_t alignment, MemoryTag tag);
+
+// Resizes the block, in place when the allocator can, and keeps its contents up to the smaller size.
+// Alignment above alignof(std::max_align_t) isn't kept. Returns an invalid MemDesc when out of memory,
+// descriptor is still valid then.
+MemDesc Reallocate(MemDesc descriptor, uint64_t newSizeInBytes);
+
+// Grows the block in place, returns false when it can't
+bool Expand(MemDesc& descriptor, uint64_t deltaInBytes);
+
+// The size an allocation of sizeInBytes really takes, ask for that much to use the slack
+uint64_t GoodSize(uint64_t sizeInBytes);
+
 void Deallocate(MemDesc descriptor);
 
+// Top stacks of the heap profile
 void DumpAllocInfo();
 
 void DumpMemoryUsage();
 
+// Physical memory used by the process, 0 where it can't be queried
+uint64_t GetResidentMemory();
+
+// Streams every call above to path as compact binary events until stopped,
+// feed the file to TraceReplay to try it on other allocators.
+// Returns false when a trace is already running or the file can't be opened.
+bool StartTrace(char const* path);
+
+void StopTrace();
+
+enum class HeapProfileFormat
+{
+	// Legacy pprof heap profile with live and cumulative samples, read it with pprof <binary> <file>
+	Pprof,
+	// "caller;callee bytes" lines with estimated bytes, for flamegraph.pl and speedscope
+	FoldedLive,
+	FoldedTotal,
+};
+
+// Samples a stack every sampleRate allocated bytes on average and keeps the live and cumulative bytes
+// of each sampled stack. Other threads start sampling within a megabyte of their allocations.
+// Cheap enough to stay on, a thread pays a counter decrement per allocation between samples.
+void StartHeapProfile(uint64_t sampleRate = 512_kB);
+
+// Sampled blocks are still tracked until freed, the profile can be written afterwards
+void StopHeapProfile();
+
+bool WriteHeapProfile(char const* path, HeapProfileFormat format);
+
+enum class MemoryUsageFormat
+{
+	// One object per allocator with its nested ones under "nested", histograms as arrays of log2 buckets
+	Json,
+	// Prometheus text exposition, each allocator labelled with its path in the composition
+	Prometheus,
+};
+
+// Writes what DumpMemoryUsage() prints in a format other tools can read
+bool WriteMemoryUsage(char const* path, MemoryUsageFormat format);
+
+enum class MemoryExportTarget
+{
+	// Replaced whole on every snapshot, point a scraper or node_exporter's textfile collector at it
+	File,
+	// A named segment the MemoryStats tool reads from another process
+	SharedMemory,
+};
+
+// Snapshots the memory usage every periodMs on a background thread and writes it to the file or segment name.
+// Counters are read without locks, only threads refilling their cache from the shared pools can wait on it briefly.
+// Returns false when an exporter is already running or the segment can't be created.
+bool StartMemoryExporter(char const* name, MemoryExportTarget target, MemoryUsageFormat format, uint32_t periodMs = 1000);
+
+void StopMemoryExporter();
+
+// One line per site that allocated, the most allocations first
+bool WriteCallSiteProfile(char const* path);
+
+// Routes the first maxRoutes sites of a profile to pools of their own, sites are matched on their
+// function and line. Sites routed before that aren't in it go back to the global allocator,
+// their pools stay until the blocks in them are freed. At most 16 pools are ever made.
+bool LoadCallSiteProfile(char const* path, uint32_t maxRoutes = 8);
+
+/*
+Allocation policies tell containers where their memory comes from.
+Most are stateless, so a container pays nothing to hold one. Handles also
+take AllocatorRef, which carries a pointer to one allocator.
+FreesInBulk policies don't need blocks to be deallocated one by one,
+containers of trivially destructible elements skip their teardown then.
+*/
+struct GlobalAllocation
+{
+	static constexpr bool FreesInBulk = false;
+
+	static MemDesc Allocate(uint64_t sizeInBytes, uint64_t alignment) { return Memory::Allocate(sizeInBytes, alignment); }
+	static MemDesc Allocate(uint64_t sizeInBytes, uint64_t alignment, CallSite& site) { return Memory::Allocate(sizeInBytes, alignment, site); }
+	static MemDesc Reallocate(MemDesc descriptor, uint64_t newSizeInBytes) { return Memory::Reallocate(descriptor, newSizeInBytes); }
+	static void Deallocate(MemDesc descriptor) { Memory::Deallocate(descriptor); }
+	static uint64_t GoodSize(uint64_t sizeInBytes) { return Memory::GoodSize(sizeInBytes); }
+};
+
+// Allocation from an allocator a subsystem owns, it has to outlive what is allocated from it
+template <typename Alloc>
+class AllocatorRef
+{
+public:
+	static constexpr bool FreesInBulk = false;
+
+	AllocatorRef() = default;
+
+	AllocatorRef(Alloc& allocator)
+		: m_allocator(&allocator)
+	{
+	}
+
+	MemDesc Allocate(uint64_t sizeInBytes, uint64_t alignment) const { return m_allocator->Allocate(sizeInBytes, alignment); }
+	MemDesc Reallocate(MemDesc descriptor, uint64_t newSizeInBytes) const { return m_allocator->Reallocate(descriptor, newSizeInBytes); }
+	void Deallocate(MemDesc descriptor) const { m_allocator->Deallocate(descriptor); }
+	uint64_t GoodSize(uint64_t sizeInBytes) const { return m_allocator->GoodSize(sizeInBytes); }
+
+	Alloc* GetAllocator() const { return m_allocator; }
+
+private:
+	Alloc* m_allocator = nullptr;
+};
+
+// What ALLOCATE_FROM calls with sites on, other policies don't know about them
+template <typename Allocation>
+MemDesc AllocateAt(uint64_t sizeInBytes, uint64_t alignment, CallSite& site)
+{
+	if constexpr (std::is_same<Allocation, GlobalAllocation>::value)
+	{
+		return Allocation::Allocate(sizeInBytes, alignment, site);
+	}
+	else
+	{
+		return Allocation::Allocate(sizeInBytes, alignment);
+	}
+}
+
 } // namespace Memory
\ No newline at end of file
@@ -0,0 +1,61 @@
+#pragma once
+#include "MemDesc.h"
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+namespace Memory
+{
+
+/*
+std::pmr::memory_resource over any of our allocators, for std::pmr containers.
+Blocks go back with the size rounded up to the alignment, which is the size
+Alloc::Allocate(size, alignment) returned for them.
+The allocator has to outlive the resource.
+*/
+template <typename Alloc>
+class MemoryResource : public std::pmr::memory_resource
+{
+public:
+	explicit MemoryResource(Alloc& allocator) noexcept
+		: m_allocator(allocator)
+	{
+	}
+
+	MemoryResource(MemoryResource const&) = delete;
+	MemoryResource& operator=(MemoryResource const&) = delete;
+
+	Alloc& GetAllocator() const { return m_allocator; }
+
+private:
+	static uint64_t BlockSize(size_t bytes, size_t alignment)
+	{
+		return (bytes + alignment - 1) & ~static_cast<uint64_t>(alignment - 1);
+	}
+
+	void* do_allocate(size_t bytes, size_t alignment) override
+	{
+		MemDesc const desc = m_allocator.Allocate(BlockSize(bytes, alignment), alignment);
+		if (!desc.ptr)
+		{
+			throw std::bad_alloc();
+		}
+		return desc.ptr;
+	}
+
+	void do_deallocate(void* ptr, size_t bytes, size_t alignment) override
+	{
+		m_allocator.Deallocate({ ptr, BlockSize(bytes, alignment) });
+	}
+
+	bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override
+	{
+		MemoryResource const* resource = dynamic_cast<MemoryResource const*>(&other);
+		return resource && &resource->m_allocator == &m_allocator;
+	}
+
+	Alloc& m_allocator;
+};
+
+} // namespace Memory
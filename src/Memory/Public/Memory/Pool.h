@@ -0,0 +1,316 @@
+#pragma once
+#include "Utils/Assert.h"
+#include "Memory.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Memory
+{
+
+/*
+Refers to an object in a Pool. The low IndexBits are its slot, the rest is
+the generation of the slot when the object was created. Generations of live
+objects are odd, so a zero handle never refers to anything.
+*/
+template <typename Value, uint32_t IndexBits>
+class PoolHandle
+{
+public:
+	using ValueType = Value;
+
+	static constexpr uint32_t GenerationBits = sizeof(Value) * 8 - IndexBits;
+	static constexpr Value IndexMask = (Value(1) << IndexBits) - 1;
+	static constexpr Value GenerationMask = (Value(1) << GenerationBits) - 1;
+
+	static_assert(IndexBits > 0 && GenerationBits >= 2, "Handles need room for an index and at least two generation bits");
+
+	PoolHandle() = default;
+
+	PoolHandle(Value index, Value generation)
+		: m_value(index | (generation << IndexBits))
+	{
+	}
+
+	Value GetIndex() const { return m_value & IndexMask; }
+	Value GetGeneration() const { return m_value >> IndexBits; }
+	Value GetValue() const { return m_value; }
+
+	bool IsNull() const { return m_value == 0; }
+
+	bool operator==(PoolHandle const& other) const { return m_value == other.m_value; }
+	bool operator!=(PoolHandle const& other) const { return m_value != other.m_value; }
+
+private:
+	Value m_value = 0;
+};
+
+// A million objects with 2048 lifetimes per slot
+using PoolHandle32 = PoolHandle<uint32_t, 20>;
+// Four billion objects with two billion lifetimes per slot
+using PoolHandle64 = PoolHandle<uint64_t, 32>;
+
+/*
+Slot map of T objects that hands out generational handles.
+
+Objects are packed at the front of a chunked array, ChunkSize per chunk, so
+iterating goes over live objects only and in address order. Destroying an
+object moves the last one into its place: handles stay valid, pointers and
+references to objects are only good until the next Destroy(), and T has to be
+move constructible.
+
+Each handle goes through a slot that holds the generation and the position of
+its object. A stale handle has an old generation, so Get() and IsValid() find
+it out with one compare. Free slots are linked through their position field
+and reused most recently freed first. A slot whose generation would wrap is
+retired instead, a stale handle can never come back to life.
+
+Allocation is where chunks and the slot table live, see GlobalAllocation.
+*/
+template <typename T, typename Handle = PoolHandle32, typename Allocation = GlobalAllocation, size_t ChunkSize = 256>
+class Pool
+{
+	using Index = typename Handle::ValueType;
+
+public:
+	static_assert(ChunkSize && (ChunkSize & (ChunkSize - 1)) == 0, "ChunkSize should be a power of two");
+
+	Pool() = default;
+	Pool(Pool&&) = delete;
+	Pool(Pool const&) = delete;
+	Pool& operator=(Pool&&) = delete;
+	Pool& operator=(Pool const&) = delete;
+
+	~Pool()
+	{
+		Clear();
+		for (size_t i = 0; i < m_chunkCount; ++i)
+		{
+			Allocation::Deallocate(Chunks()[i]);
+		}
+		if (m_chunks.ptr)
+		{
+			Allocation::Deallocate(m_chunks);
+		}
+		if (m_slots.ptr)
+		{
+			Allocation::Deallocate(m_slots);
+		}
+	}
+
+	template <typename ...Args>
+	Handle Create(Args&& ...args)
+	{
+		if (m_count == m_chunkCount * ChunkSize)
+		{
+			AddChunk();
+		}
+		// Constructed first, nothing has changed yet if it throws
+		new (At(m_count)) T(std::forward<Args>(args)...);
+
+		Index index = m_freeHead;
+		if (index != NoSlot)
+		{
+			m_freeHead = Slots()[index].position;
+		}
+		else
+		{
+			if (m_slotCount == SlotCapacity())
+			{
+				GrowSlots();
+			}
+			index = static_cast<Index>(m_slotCount++);
+			Slots()[index].generation = 0;
+		}
+		MY_ASSERT(index <= Handle::IndexMask, "Pool is out of handle indices");
+
+		Slot& slot = Slots()[index];
+		slot.position = static_cast<Index>(m_count);
+		++slot.generation;
+		*SlotOf(m_count) = index;
+		++m_count;
+		return { index, slot.generation };
+	}
+
+	// Returns false for stale handles
+	bool Destroy(Handle handle)
+	{
+		if (!IsValid(handle))
+		{
+			return false;
+		}
+		Slot& slot = Slots()[handle.GetIndex()];
+		size_t const position = slot.position;
+		size_t const last = m_count - 1;
+		if (position != last)
+		{
+			At(position)->~T();
+			new (At(position)) T(std::move(*At(last)));
+			Index const moved = *SlotOf(last);
+			*SlotOf(position) = moved;
+			Slots()[moved].position = static_cast<Index>(position);
+		}
+		At(last)->~T();
+		--m_count;
+
+		slot.generation = (slot.generation + 1) & Handle::GenerationMask;
+		if (slot.generation)
+		{
+			slot.position = m_freeHead;
+			m_freeHead = handle.GetIndex();
+		}
+		return true;
+	}
+
+	bool IsValid(Handle handle) const
+	{
+		Index const index = handle.GetIndex();
+		return (handle.GetGeneration() & 1) && index < m_slotCount && Slots()[index].generation == handle.GetGeneration();
+	}
+
+	// nullptr for stale handles
+	T* Get(Handle handle)
+	{
+		return IsValid(handle) ? At(Slots()[handle.GetIndex()].position) : nullptr;
+	}
+
+	T const* Get(Handle handle) const
+	{
+		return IsValid(handle) ? At(Slots()[handle.GetIndex()].position) : nullptr;
+	}
+
+	T& operator[](Handle handle)
+	{
+		MY_ASSERT(IsValid(handle), "Dereferencing stale pool handle");
+		return *At(Slots()[handle.GetIndex()].position);
+	}
+
+	T const& operator[](Handle handle) const
+	{
+		MY_ASSERT(IsValid(handle), "Dereferencing stale pool handle");
+		return *At(Slots()[handle.GetIndex()].position);
+	}
+
+	size_t Count() const { return m_count; }
+
+	// Handle of the object at position in iteration order
+	Handle GetHandle(size_t position) const
+	{
+		MY_ASSERT(position < m_count, "Index out of bounds");
+		Index const index = *SlotOf(position);
+		return { index, Slots()[index].generation };
+	}
+
+	// Destroys every object, handles to them go stale. Chunks are kept for reuse.
+	void Clear()
+	{
+		while (m_count)
+		{
+			Destroy(GetHandle(m_count - 1));
+		}
+	}
+
+	template <bool Const>
+	class Iterator
+	{
+		using PoolType = typename std::conditional<Const, Pool const, Pool>::type;
+		using ValueType = typename std::conditional<Const, T const, T>::type;
+
+	public:
+		Iterator(PoolType* pool, size_t position)
+			: m_pool(pool)
+			, m_position(position)
+		{
+		}
+
+		ValueType& operator*() const { return *m_pool->At(m_position); }
+		ValueType* operator->() const { return m_pool->At(m_position); }
+
+		Iterator& operator++()
+		{
+			++m_position;
+			return *this;
+		}
+
+		bool operator==(Iterator const& other) const { return m_position == other.m_position; }
+		bool operator!=(Iterator const& other) const { return m_position != other.m_position; }
+
+		Handle GetHandle() const { return m_pool->GetHandle(m_position); }
+
+	private:
+		PoolType* m_pool;
+		size_t m_position;
+	};
+
+	Iterator<false> begin() { return { this, 0 }; }
+	Iterator<false> end() { return { this, m_count }; }
+	Iterator<true> begin() const { return { this, 0 }; }
+	Iterator<true> end() const { return { this, m_count }; }
+
+private:
+	static constexpr Index NoSlot = ~Index(0);
+
+	struct Slot
+	{
+		// Generation of the slot, odd while an object is in it
+		Index generation;
+		// Position of the object, or the next free slot
+		Index position;
+	};
+
+	// A chunk holds its objects and then the slot of each of them
+	static constexpr size_t SlotsOffset = (ChunkSize * sizeof(T) + alignof(Index) - 1) / alignof(Index) * alignof(Index);
+	static constexpr size_t ChunkBytes = SlotsOffset + ChunkSize * sizeof(Index);
+	static constexpr size_t ChunkAlignment = alignof(T) > alignof(Index) ? alignof(T) : alignof(Index);
+
+	MemDesc* Chunks() const { return static_cast<MemDesc*>(m_chunks.ptr); }
+	Slot* Slots() const { return static_cast<Slot*>(m_slots.ptr); }
+	size_t SlotCapacity() const { return m_slots.size / sizeof(Slot); }
+
+	T* At(size_t position) const
+	{
+		return reinterpret_cast<T*>(static_cast<uint8_t*>(Chunks()[position / ChunkSize].ptr) + (position % ChunkSize) * sizeof(T));
+	}
+
+	Index* SlotOf(size_t position) const
+	{
+		return reinterpret_cast<Index*>(static_cast<uint8_t*>(Chunks()[position / ChunkSize].ptr) + SlotsOffset) + position % ChunkSize;
+	}
+
+	void AddChunk()
+	{
+		if ((m_chunkCount + 1) * sizeof(MemDesc) > m_chunks.size)
+		{
+			m_chunks = Grow(m_chunks, sizeof(MemDesc) * (m_chunkCount + 1) * 2);
+		}
+		MemDesc const chunk = Allocation::Allocate(ChunkBytes, ChunkAlignment);
+		MY_ASSERT(chunk.ptr, "Failed to allocate memory");
+		Chunks()[m_chunkCount++] = chunk;
+	}
+
+	void GrowSlots()
+	{
+		m_slots = Grow(m_slots, sizeof(Slot) * (SlotCapacity() + 1) * 2);
+	}
+
+	// Chunk descriptors and slots are trivially copyable, the block can be reallocated in place
+	static MemDesc Grow(MemDesc desc, uint64_t size)
+	{
+		size = Allocation::GoodSize(size);
+		desc = desc.ptr ? Allocation::Reallocate(desc, size) : Allocation::Allocate(size, alignof(std::max_align_t));
+		MY_ASSERT(desc.ptr, "Failed to allocate memory");
+		return desc;
+	}
+
+	MemDesc m_chunks;
+	size_t m_chunkCount = 0;
+	MemDesc m_slots;
+	size_t m_slotCount = 0;
+	size_t m_count = 0;
+	Index m_freeHead = NoSlot;
+};
+
+} // namespace Memory
@@ -0,0 +1,99 @@
+#pragma once
+#include "Memory.h"
+
+#include <atomic>
+
+namespace Memory
+{
+
+/*
+Safe memory reclamation for lock-free structures. A node that was unlinked may
+still be read by threads that loaded a pointer to it earlier, so its block is
+retired instead of deallocated, and goes back through Memory::Deallocate()
+once no thread can be holding it.
+
+Readers hold a Guard while they use shared pointers and load them with
+Guard::Protect(). Guards belong to the thread that made them. Retired blocks
+are queued per thread and freed in batches, a thread that exits leaves what
+it couldn't free yet to Flush() or to the next thread that starts. Both
+policies have the same interface, a structure can take either.
+*/
+
+// A Guard is a critical region, they nest. Blocks retired in epoch e are freed once
+// the global epoch gets to e + 2, and it only moves on when every thread in a region
+// has seen the current one. Guards are cheap, a stalled reader holds back everything.
+struct EpochReclamation
+{
+	class Guard
+	{
+	public:
+		Guard();
+		~Guard();
+		Guard(Guard const&) = delete;
+		Guard& operator=(Guard const&) = delete;
+
+		template <typename T>
+		T* Protect(std::atomic<T*> const& source) const
+		{
+			return source.load(std::memory_order_acquire);
+		}
+	};
+
+	static void Retire(MemDesc descriptor);
+
+	// Moves the epoch on as far as it goes and frees what the calling thread and exited threads retired
+	static void Flush();
+
+	// Blocks the calling thread retired that aren't freed yet
+	static uint64_t GetPendingCount();
+};
+
+// A Guard takes one of the thread's hazard slots and Protect() publishes the pointer in
+// it. A retired block is freed once no slot holds its address, so a stalled reader holds
+// back only what it points at. Protected pointers have to point at the start of a block.
+struct HazardPointerReclamation
+{
+	static constexpr uint32_t SlotsPerThread = 8;
+
+	class Guard
+	{
+	public:
+		Guard();
+		~Guard();
+		Guard(Guard const&) = delete;
+		Guard& operator=(Guard const&) = delete;
+
+		// Good until the next Protect() or Reset() of this guard
+		template <typename T>
+		T* Protect(std::atomic<T*> const& source)
+		{
+			T* ptr = source.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				m_slot->store(ptr, std::memory_order_seq_cst);
+				// Still there after the hazard is visible, a scan from now on sees it
+				T* const current = source.load(std::memory_order_seq_cst);
+				if (current == ptr)
+				{
+					return ptr;
+				}
+				ptr = current;
+			}
+		}
+
+		void Reset() { m_slot->store(nullptr, std::memory_order_release); }
+
+	private:
+		std::atomic<void*>* m_slot;
+	};
+
+	static void Retire(MemDesc descriptor);
+
+	// Frees what the calling thread and exited threads retired that no slot holds
+	static void Flush();
+
+	// Blocks the calling thread retired that aren't freed yet
+	static uint64_t GetPendingCount();
+};
+
+} // namespace Memory
@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+namespace Memory
+{
+
+/*
+Reference count policies of SharedHandle, WeakHandle and RefCounted.
+
+Increments are relaxed, a new reference comes from an existing one so there is
+nothing to order. Decrements are acq_rel, the thread that drops the last one
+has to see every write made through the other references before it destroys
+the object.
+*/
+struct AtomicRefCount
+{
+	using Counter = std::atomic<uint32_t>;
+
+	static uint32_t Load(Counter const& counter) { return counter.load(std::memory_order_acquire); }
+	static void Increment(Counter& counter) { counter.fetch_add(1, std::memory_order_relaxed); }
+
+	// True when it was the last reference
+	static bool Decrement(Counter& counter) { return counter.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+
+	// Fails once the count is zero, a weak reference can't bring the object back
+	static bool IncrementIfNotZero(Counter& counter)
+	{
+		uint32_t count = counter.load(std::memory_order_relaxed);
+		while (count && !counter.compare_exchange_weak(count, count + 1, std::memory_order_relaxed))
+		{
+		}
+		return count != 0;
+	}
+};
+
+// For handles that never leave their thread
+struct PlainRefCount
+{
+	using Counter = uint32_t;
+
+	static uint32_t Load(Counter const& counter) { return counter; }
+	static void Increment(Counter& counter) { ++counter; }
+	static bool Decrement(Counter& counter) { return --counter == 0; }
+
+	static bool IncrementIfNotZero(Counter& counter)
+	{
+		if (counter)
+		{
+			++counter;
+		}
+		return counter != 0;
+	}
+};
+
+} // namespace Memory
@@ -0,0 +1,63 @@
+#pragma once
+#include "Memory.h"
+
+namespace Memory
+{
+
+using ArenaMark = uint64_t;
+
+// Every thread has a scratch arena: a linear allocator over reserved address space,
+// committed as it grows. Blocks go back all at once by rewinding to a mark,
+// ArenaDeallocate() only gives back the last block, if it's after the innermost mark.
+MemDesc ArenaAllocate(uint64_t sizeInBytes, uint64_t alignment);
+
+// Grows the last block in place, other blocks are copied and stay where they were until rewound.
+// A block from before the innermost mark is copied too, the copy goes with that mark's rewind.
+MemDesc ArenaReallocate(MemDesc descriptor, uint64_t newSizeInBytes);
+
+void ArenaDeallocate(MemDesc descriptor);
+
+ArenaMark GetArenaMark();
+
+void ArenaRewind(ArenaMark mark);
+
+/*
+Marks the thread's arena and rewinds to the mark when it goes out of scope,
+so everything allocated from the arena meanwhile is freed in O(1).
+Scopes nest, inner ones have to end first.
+*/
+class ScopedArena
+{
+public:
+	ScopedArena()
+		: m_mark(GetArenaMark())
+	{
+	}
+
+	ScopedArena(ScopedArena const&) = delete;
+	ScopedArena& operator=(ScopedArena const&) = delete;
+
+	~ScopedArena()
+	{
+		ArenaRewind(m_mark);
+	}
+
+	// Frees everything allocated in the scope so far
+	void Rewind() { ArenaRewind(m_mark); }
+
+private:
+	ArenaMark m_mark;
+};
+
+// Points a container at the thread's arena, blocks are freed by a ScopedArena
+struct ArenaAllocation
+{
+	static constexpr bool FreesInBulk = true;
+
+	static MemDesc Allocate(uint64_t sizeInBytes, uint64_t alignment) { return ArenaAllocate(sizeInBytes, alignment); }
+	static MemDesc Reallocate(MemDesc descriptor, uint64_t newSizeInBytes) { return ArenaReallocate(descriptor, newSizeInBytes); }
+	static void Deallocate(MemDesc descriptor) { ArenaDeallocate(descriptor); }
+	static uint64_t GoodSize(uint64_t sizeInBytes) { return sizeInBytes; }
+};
+
+} // namespace Memory
@@ -1,16 +1,55 @@
 #pragma once
-#include "Assert.h"
+#include "Utils/Assert.h"
 #include "Memory.h"
+#include "RefCount.h"
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
 
 namespace Memory
 {
 
-template <typename T>
+template <typename T, typename RefCountPolicy = AtomicRefCount, typename Allocation = GlobalAllocation>
+class SharedHandle;
+
+template <typename T, typename RefCountPolicy = AtomicRefCount, typename Allocation = GlobalAllocation>
+class WeakHandle;
+
+template <typename T, typename Allocation = GlobalAllocation>
+class AtomicSharedHandle;
+
+template <typename T, typename RefCountPolicy = AtomicRefCount, typename Allocation, typename ...Args>
+SharedHandle<T, RefCountPolicy, Allocation> AllocateShared(Allocation const& allocation, Args&& ...args);
+
+template <typename T, typename RefCountPolicy = AtomicRefCount, typename ...Args>
+SharedHandle<T, RefCountPolicy> MakeShared(Args&& ...args);
+
+template <typename T, typename RefCountPolicy = AtomicRefCount, typename Allocation = GlobalAllocation>
+SharedHandle<T[], RefCountPolicy, Allocation> MakeSharedArray(uint64_t count, Allocation const& allocation = Allocation());
+
+/*
+Shared owner of a T made by MakeShared, the object lives in one block after
+its reference counts. RefCountPolicy is AtomicRefCount for handles shared
+between threads, PlainRefCount when they never leave one.
+
+WeakHandle refers to the object without keeping it alive. The object is
+destroyed with the last SharedHandle, the block is freed with the last
+WeakHandle. A handle is one pointer to the block.
+
+Allocation is where the block comes from, see GlobalAllocation. It is kept in
+the block, stateless ones take no room. SharedHandle<T[]> shares an array,
+the length goes with the counts.
+*/
+template <typename T, typename RefCountPolicy, typename Allocation>
 class SharedHandle
 {
+	using Element = std::remove_extent_t<T>;
+	static constexpr bool IsArray = std::is_array<T>::value;
+
 public:
 	SharedHandle() = default;
-	SharedHandle(nullptr_t) {};
+	SharedHandle(std::nullptr_t) {};
 
 	~SharedHandle()
 	{
@@ -18,28 +57,24 @@ public:
 	}
 
 	SharedHandle(SharedHandle const& other)
-		: m_desc(other.m_desc)
-		, m_refCounter(other.m_refCounter)
-		, m_dataPtr(other.m_dataPtr)
+		: m_control(other.m_control)
 	{
-		Increment();
+		if (m_control)
+		{
+			RefCountPolicy::Increment(m_control->strong);
+		}
 	}
 
 	SharedHandle& operator=(SharedHandle const& other)
 	{
-		Decrement();
-		m_desc = other.m_desc;
-		m_refCounter = other.m_refCounter;
-		m_dataPtr = other.m_dataPtr;
-		Increment();
+		SharedHandle copy(other);
+		this->Swap(std::move(copy));
 		return *this;
 	}
 
 	void Swap(SharedHandle&& other) noexcept
 	{
-		std::swap(m_desc, other.m_desc);
-		std::swap(m_refCounter, other.m_refCounter);
-		std::swap(m_dataPtr, other.m_dataPtr);
+		std::swap(m_control, other.m_control);
 	}
 
 	SharedHandle(SharedHandle&& other) noexcept
@@ -53,93 +88,252 @@ public:
 		return *this;
 	}
 
-	bool IsValid() const { return m_refCounter && m_dataPtr; }
+	bool IsValid() const { return m_control; }
 
 	operator bool() const { return IsValid(); }
 
-	T& operator*() { return *Get(); }
-	T* operator->() { return Get(); }
+	// Racy with other threads, only good for tests and diagnostics
+	uint32_t UseCount() const { return m_control ? RefCountPolicy::Load(m_control->strong) : 0; }
+
+	Element& operator*() { return *Get(); }
+	Element* operator->() { return Get(); }
 
-	T const& operator*() const { return *Get(); }
-	T const* operator->() const { return Get(); }
+	Element const& operator*() const { return *Get(); }
+	Element const* operator->() const { return Get(); }
 
+	Element& operator[](uint64_t index) const
+	{
+		MY_ASSERT(index < Count(), "Index out of bounds");
+		return Data(m_control)[index];
+	}
 
-	inline T* Get() 
+	// Elements of an array, one for a single object
+	uint64_t Count() const
+	{
+		if constexpr (IsArray)
+		{
+			return m_control ? m_control->count : 0;
+		}
+		else
+		{
+			return m_control ? 1 : 0;
+		}
+	}
+
+	inline Element* Get()
 	{
 		MY_ASSERT(IsValid(), "Dereferencing invalid SharedHandle");
-		return reinterpret_cast<T*>(m_dataPtr);
+		return Data(m_control);
 	}
 
-	inline T const* Get() const 
+	inline Element const* Get() const
 	{
 		MY_ASSERT(IsValid(), "Dereferencing invalid SharedHandle");
-		return reinterpret_cast<T const*>(m_dataPtr); 
+		return Data(m_control);
 	}
+
 private:
-	template <typename T, typename ...Args>
-	friend SharedHandle<T> MakeShared(Args&& ...args);
+	template <typename U, typename P, typename A, typename ...Args>
+	friend SharedHandle<U, P, A> AllocateShared(A const& allocation, Args&& ...args);
+
+	template <typename U, typename P, typename A>
+	friend SharedHandle<U[], P, A> MakeSharedArray(uint64_t count, A const& allocation);
 
-	using RefCounter = uint64_t;
+	friend class WeakHandle<T, RefCountPolicy, Allocation>;
 
-	SharedHandle(MemDesc desc, void* dataPtr)
-		: m_desc(desc)
-		, m_refCounter(reinterpret_cast<RefCounter*>(desc.ptr))
-		, m_dataPtr(dataPtr)
+	template <typename U, typename A>
+	friend class AtomicSharedHandle;
+
+	struct Counts : Allocation
 	{
-		if (IsValid())
+		Counts(Allocation const& allocation, uint64_t size)
+			: Allocation(allocation)
+			, blockSize(size)
 		{
-			*m_refCounter = 1;
 		}
+
+		typename RefCountPolicy::Counter strong{ 1 };
+		// Weak handles, plus one held by all the strong ones together
+		typename RefCountPolicy::Counter weak{ 1 };
+		uint64_t blockSize;
+	};
+
+	struct ArrayCounts : Counts
+	{
+		using Counts::Counts;
+
+		uint64_t count = 0;
+	};
+
+	using ControlBlock = std::conditional_t<IsArray, ArrayCounts, Counts>;
+
+	// Elements start at the next multiple of their alignment after the counts
+	static constexpr uint64_t DataOffset = (sizeof(ControlBlock) + alignof(Element) - 1) / alignof(Element) * alignof(Element);
+	static constexpr uint64_t Alignment = alignof(Element) > alignof(ControlBlock) ? alignof(Element) : alignof(ControlBlock);
+
+	static Element* Data(ControlBlock* control)
+	{
+		return reinterpret_cast<Element*>(reinterpret_cast<uint8_t*>(control) + DataOffset);
 	}
 
-	void Increment()
+	static void Destroy(ControlBlock* control)
+	{
+		if constexpr (IsArray)
+		{
+			for (uint64_t i = control->count; i > 0; --i)
+			{
+				Data(control)[i - 1].~Element();
+			}
+		}
+		else
+		{
+			Data(control)->~T();
+		}
+	}
+
+	static void ReleaseWeak(ControlBlock* control)
 	{
-		if (IsValid())
+		if (RefCountPolicy::Decrement(control->weak))
 		{
-			++*m_refCounter;
+			Allocation const allocation = *control;
+			uint64_t const blockSize = control->blockSize;
+			control->~ControlBlock();
+			allocation.Deallocate({ control, blockSize });
 		}
 	}
 
+	// Takes over a strong reference
+	explicit SharedHandle(ControlBlock* control)
+		: m_control(control)
+	{
+	}
+
 	void Decrement()
 	{
-		if (IsValid())
+		if (m_control && RefCountPolicy::Decrement(m_control->strong))
 		{
-			if (*m_refCounter)
-			{
-				--*m_refCounter;
-			}
-			if (*m_refCounter == 0)
-			{
-				ReleaseReset();
-			}
+			Destroy(m_control);
+			ReleaseWeak(m_control);
 		}
+		m_control = nullptr;
 	}
 
-	void ReleaseReset()
+	ControlBlock* m_control = nullptr;
+};
+
+// Observes an object owned by SharedHandles, Lock() gets a SharedHandle while there are any
+template <typename T, typename RefCountPolicy, typename Allocation>
+class WeakHandle
+{
+	using Shared = SharedHandle<T, RefCountPolicy, Allocation>;
+	using ControlBlock = typename Shared::ControlBlock;
+
+public:
+	WeakHandle() = default;
+
+	WeakHandle(Shared const& shared)
+		: m_control(shared.m_control)
+	{
+		Increment();
+	}
+
+	~WeakHandle()
+	{
+		if (m_control)
+		{
+			Shared::ReleaseWeak(m_control);
+		}
+	}
+
+	WeakHandle(WeakHandle const& other)
+		: m_control(other.m_control)
+	{
+		Increment();
+	}
+
+	WeakHandle& operator=(WeakHandle const& other)
+	{
+		WeakHandle copy(other);
+		std::swap(m_control, copy.m_control);
+		return *this;
+	}
+
+	WeakHandle(WeakHandle&& other) noexcept
+	{
+		std::swap(m_control, other.m_control);
+	}
+
+	WeakHandle& operator=(WeakHandle&& other) noexcept
 	{
-		reinterpret_cast<T*>(m_dataPtr)->~T();
-		Deallocate(m_desc);
-		m_desc.ptr = nullptr;
-		m_dataPtr = nullptr;
-		m_refCounter = nullptr;
+		std::swap(m_control, other.m_control);
+		return *this;
+	}
+
+	bool Expired() const { return !m_control || RefCountPolicy::Load(m_control->strong) == 0; }
+
+	// Invalid handle once the object is gone
+	Shared Lock() const
+	{
+		if (m_control && RefCountPolicy::IncrementIfNotZero(m_control->strong))
+		{
+			return Shared(m_control);
+		}
+		return {};
+	}
+
+private:
+	void Increment()
+	{
+		if (m_control)
+		{
+			RefCountPolicy::Increment(m_control->weak);
+		}
 	}
 
-	MemDesc m_desc;
-	RefCounter* m_refCounter = nullptr;
-	void* m_dataPtr = nullptr;
+	ControlBlock* m_control = nullptr;
 };
 
 
-template <typename T, typename ...Args>
-SharedHandle<T> MakeShared(Args&& ...args)
+template <typename T, typename RefCountPolicy, typename Allocation, typename ...Args>
+SharedHandle<T, RefCountPolicy, Allocation> AllocateShared(Allocation const& allocation, Args&& ...args)
 {
-	const uint64_t dataPtrOffset = sizeof(SharedHandle<T>::RefCounter);
-	MemDesc desc = ALLOCATE(sizeof(T) + dataPtrOffset);
+	using Shared = SharedHandle<T, RefCountPolicy, Allocation>;
+	using ControlBlock = typename Shared::ControlBlock;
+	MemDesc desc = allocation.Allocate(Shared::DataOffset + sizeof(T), Shared::Alignment);
 	MY_ASSERT(desc.ptr, "Failed to allocate memory");
 
-	void* dataPtr = new (reinterpret_cast<uint8_t*>(desc.ptr) + dataPtrOffset) T(std::forward<Args>(args)...);
+	ControlBlock* control = new (desc.ptr) ControlBlock(allocation, desc.size);
+	new (Shared::Data(control)) T(std::forward<Args>(args)...);
+
+	return Shared(control);
+}
 
-	return { desc, dataPtr };
+template <typename T, typename RefCountPolicy, typename ...Args>
+SharedHandle<T, RefCountPolicy> MakeShared(Args&& ...args)
+{
+	return AllocateShared<T, RefCountPolicy>(GlobalAllocation(), std::forward<Args>(args)...);
+}
+
+// count value-initialized elements, an empty handle when count elements can't fit in a block
+template <typename T, typename RefCountPolicy, typename Allocation>
+SharedHandle<T[], RefCountPolicy, Allocation> MakeSharedArray(uint64_t count, Allocation const& allocation)
+{
+	using Shared = SharedHandle<T[], RefCountPolicy, Allocation>;
+	using ControlBlock = typename Shared::ControlBlock;
+	if (count > (UINT64_MAX - Shared::DataOffset) / sizeof(T))
+	{
+		return {};
+	}
+	MemDesc desc = allocation.Allocate(Shared::DataOffset + sizeof(T) * count, Shared::Alignment);
+	MY_ASSERT(desc.ptr, "Failed to allocate memory");
+
+	ControlBlock* control = new (desc.ptr) ControlBlock(allocation, desc.size);
+	Shared handle(control);
+	for (T* it = Shared::Data(control); control->count < count; ++it, ++control->count)
+	{
+		new (it) T();
+	}
+	return handle;
 }
 
-} // namespace Memory
\ No newline at end of file
+} // namespace Memory
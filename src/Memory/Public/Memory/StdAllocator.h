@@ -0,0 +1,71 @@
+#pragma once
+#include "MemDesc.h"
+
+#include <cstddef>
+#include <new>
+
+namespace Memory
+{
+
+/*
+Standard library allocator over any of our allocators.
+std containers give the element count back to deallocate(), so the block
+goes back with the same rounded size Alloc::Allocate() returned.
+Copies and rebinds share the allocator, it has to outlive the container.
+*/
+template <typename T, typename Alloc>
+class StdAllocator
+{
+public:
+	using value_type = T;
+
+	explicit StdAllocator(Alloc& allocator) noexcept
+		: m_allocator(&allocator)
+	{
+	}
+
+	template <typename U>
+	StdAllocator(StdAllocator<U, Alloc> const& other) noexcept
+		: m_allocator(other.GetAllocator())
+	{
+	}
+
+	T* allocate(size_t count)
+	{
+		MemDesc const desc = m_allocator->Allocate(BlockSize(count), alignof(T));
+		if (!desc.ptr)
+		{
+			throw std::bad_alloc();
+		}
+		return static_cast<T*>(desc.ptr);
+	}
+
+	void deallocate(T* ptr, size_t count)
+	{
+		m_allocator->Deallocate({ ptr, BlockSize(count) });
+	}
+
+	Alloc* GetAllocator() const { return m_allocator; }
+
+private:
+	static uint64_t BlockSize(size_t count)
+	{
+		return (sizeof(T) * count + alignof(T) - 1) & ~static_cast<uint64_t>(alignof(T) - 1);
+	}
+
+	Alloc* m_allocator = nullptr;
+};
+
+template <typename T, typename U, typename Alloc>
+bool operator==(StdAllocator<T, Alloc> const& lhs, StdAllocator<U, Alloc> const& rhs)
+{
+	return lhs.GetAllocator() == rhs.GetAllocator();
+}
+
+template <typename T, typename U, typename Alloc>
+bool operator!=(StdAllocator<T, Alloc> const& lhs, StdAllocator<U, Alloc> const& rhs)
+{
+	return !(lhs == rhs);
+}
+
+} // namespace Memory
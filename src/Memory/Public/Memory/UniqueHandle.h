@@ -1,16 +1,40 @@
 #pragma once
-#include "Assert.h"
+#include "Utils/Assert.h"
 #include "Memory.h"
 
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
 namespace Memory
 {
 
-template <typename T>
-class UniqueHandle
+template <typename T, typename Allocation = GlobalAllocation>
+class UniqueHandle;
+
+template <typename T, typename Allocation, typename ...Args>
+UniqueHandle<T, Allocation> AllocateUnique(Allocation const& allocation, Args&& ...args);
+
+template <typename T, typename Allocation = GlobalAllocation, typename ...Args>
+UniqueHandle<T, Allocation> MakeUnique(Args&& ...args);
+
+template <typename T, typename Allocation = GlobalAllocation>
+UniqueHandle<T[], Allocation> MakeUniqueArray(uint64_t count, Allocation const& allocation = Allocation());
+
+/*
+Allocation is where the object lives, see GlobalAllocation. The handle holds
+a copy of it, stateless ones take no room. UniqueHandle<T[]> owns an array,
+its length is in a header in front of the elements in the same block.
+*/
+template <typename T, typename Allocation>
+class UniqueHandle : private Allocation
 {
+	using Element = std::remove_extent_t<T>;
+	static constexpr bool IsArray = std::is_array<T>::value;
+
 public:
 	UniqueHandle() = default;
-	UniqueHandle(nullptr_t) {};
+	UniqueHandle(std::nullptr_t) {};
 	UniqueHandle(UniqueHandle const&) = delete;
 	UniqueHandle& operator=(UniqueHandle const&) = delete;
 
@@ -18,19 +42,19 @@ public:
 	{
 		if (IsValid())
 		{
-			Get()->~T();
-			Deallocate(m_desc);
+			Destroy();
+			Allocation::Deallocate(m_desc);
 		}
 	}
 
 	UniqueHandle(UniqueHandle&& other) noexcept
 	{
-		std::swap(m_desc, other.m_desc);
+		this->Swap(other);
 	}
 
 	UniqueHandle& operator=(UniqueHandle&& other) noexcept
 	{
-		std::swap(m_desc, other.m_desc);
+		this->Swap(other);
 		return *this;
 	}
 
@@ -38,45 +62,133 @@ public:
 
 	operator bool() const { return IsValid(); }
 
-	T& operator*() { return *Get(); }
-	T* operator->() { return Get(); }
+	Element& operator*() { return *Get(); }
+	Element* operator->() { return Get(); }
+
+	Element const& operator*() const { return *Get(); }
+	Element const* operator->() const { return Get(); }
+
+	Element& operator[](uint64_t index)
+	{
+		MY_ASSERT(index < Count(), "Index out of bounds");
+		return Get()[index];
+	}
+
+	Element const& operator[](uint64_t index) const
+	{
+		MY_ASSERT(index < Count(), "Index out of bounds");
+		return Get()[index];
+	}
 
-	T const& operator*() const { return *Get(); }
-	T const* operator->() const { return Get(); }
+	// Elements of an array, one for a single object
+	uint64_t Count() const
+	{
+		if constexpr (IsArray)
+		{
+			return IsValid() ? Header()->count : 0;
+		}
+		else
+		{
+			return IsValid() ? 1 : 0;
+		}
+	}
 
 private:
-	template <typename T, typename ...Args>
-	friend UniqueHandle<T> MakeUnique(Args&& ...args);
+	template <typename U, typename A, typename ...Args>
+	friend UniqueHandle<U, A> AllocateUnique(A const& allocation, Args&& ...args);
+
+	template <typename U, typename A>
+	friend UniqueHandle<U[], A> MakeUniqueArray(uint64_t count, A const& allocation);
+
+	struct ArrayHeader
+	{
+		uint64_t count;
+	};
+
+	// Elements start at the next multiple of their alignment after the header
+	static constexpr uint64_t DataOffset = IsArray ? (sizeof(ArrayHeader) + alignof(Element) - 1) / alignof(Element) * alignof(Element) : 0;
+	static constexpr uint64_t Alignment = IsArray && alignof(ArrayHeader) > alignof(Element) ? alignof(ArrayHeader) : alignof(Element);
 
-	UniqueHandle(MemDesc desc)
-		: m_desc(desc)
+	UniqueHandle(MemDesc desc, Allocation const& allocation)
+		: Allocation(allocation)
+		, m_desc(desc)
 	{
 	}
 
-	T* Get() 
+	void Swap(UniqueHandle& other)
+	{
+		std::swap(static_cast<Allocation&>(*this), static_cast<Allocation&>(other));
+		std::swap(m_desc, other.m_desc);
+	}
+
+	ArrayHeader* Header() const { return reinterpret_cast<ArrayHeader*>(m_desc.ptr); }
+
+	void Destroy()
+	{
+		if constexpr (IsArray)
+		{
+			for (uint64_t i = Header()->count; i > 0; --i)
+			{
+				Get()[i - 1].~Element();
+			}
+		}
+		else
+		{
+			Get()->~T();
+		}
+	}
+
+	Element* Get()
 	{
 		MY_ASSERT(IsValid(), "Dereferencing invalid UniqueHandle");
-		return reinterpret_cast<T*>(m_desc.ptr);
+		return reinterpret_cast<Element*>(static_cast<uint8_t*>(m_desc.ptr) + DataOffset);
 	}
 
-	T const* Get() const 
+	Element const* Get() const
 	{
 		MY_ASSERT(IsValid(), "Dereferencing invalid UniqueHandle");
-		return reinterpret_cast<T const*>(m_desc.ptr); 
+		return reinterpret_cast<Element const*>(static_cast<uint8_t const*>(m_desc.ptr) + DataOffset);
 	}
 
 	MemDesc m_desc;
 };
 
-template <typename T, typename ...Args>
-UniqueHandle<T> MakeUnique(Args&& ...args)
+template <typename T, typename Allocation, typename ...Args>
+UniqueHandle<T, Allocation> AllocateUnique(Allocation const& allocation, Args&& ...args)
 {
-	MemDesc desc = Allocate(sizeof(T));
+	MemDesc desc = allocation.Allocate(sizeof(T), alignof(T));
 	MY_ASSERT(desc.ptr, "Failed to allocate memory");
 
 	new (desc.ptr) T(std::forward<Args>(args)...);
 
-	return { desc };
+	return { desc, allocation };
+}
+
+template <typename T, typename Allocation, typename ...Args>
+UniqueHandle<T, Allocation> MakeUnique(Args&& ...args)
+{
+	return AllocateUnique<T>(Allocation(), std::forward<Args>(args)...);
+}
+
+// count value-initialized elements, an empty handle when count elements can't fit in a block
+template <typename T, typename Allocation>
+UniqueHandle<T[], Allocation> MakeUniqueArray(uint64_t count, Allocation const& allocation)
+{
+	using Handle = UniqueHandle<T[], Allocation>;
+	if (count > (UINT64_MAX - Handle::DataOffset) / sizeof(T))
+	{
+		return {};
+	}
+	MemDesc desc = allocation.Allocate(Handle::DataOffset + sizeof(T) * count, Handle::Alignment);
+	MY_ASSERT(desc.ptr, "Failed to allocate memory");
+
+	Handle handle(desc, allocation);
+	handle.Header()->count = 0;
+	for (T* it = handle.Get(); handle.Header()->count < count; ++it, ++handle.Header()->count)
+	{
+		new (it) T();
+	}
+	return handle;
 }
 
-} // namespace Memory
\ No newline at end of file
+} // namespace Memory
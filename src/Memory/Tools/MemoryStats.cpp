@@ -0,0 +1,51 @@
+/*
+Prints the memory usage another process publishes with
+Memory::StartMemoryExporter(name, MemoryExportTarget::SharedMemory, ...).
+
+	MemoryStats <segment name> [period in ms]
+
+Prints the latest snapshot once, or every period until interrupted. Snapshots
+are copied out of the segment without taking any lock, the process keeps
+allocating while it is read.
+*/
+#include "MemoryExport.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		std::fprintf(stderr, "Usage: %s <segment name> [period in ms]\n", argv[0]);
+		return 1;
+	}
+	char const* name = argv[1];
+	long const period = argc > 2 ? std::strtol(argv[2], nullptr, 10) : 0;
+
+	std::string snapshot;
+	for (;;)
+	{
+		if (!Memory::Private::ReadSharedSnapshot(name, snapshot))
+		{
+			std::fprintf(stderr, "No snapshot published under %s\n", name);
+			if (period <= 0)
+			{
+				return 1;
+			}
+		}
+		else
+		{
+			std::fwrite(snapshot.data(), 1, snapshot.size(), stdout);
+			std::fflush(stdout);
+		}
+		if (period <= 0)
+		{
+			return 0;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(period));
+	}
+}
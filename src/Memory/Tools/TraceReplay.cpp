@@ -0,0 +1,293 @@
+/*
+Replays a trace recorded with Memory::StartTrace() against allocator compositions.
+
+	TraceReplay <trace file> [composition]
+
+Runs all the compositions below when none is named. Each gets the events
+single-threaded in time order and reports the cycles spent in the allocator,
+the peak resident memory next to the peak of live requested bytes, the free
+space its pools hold at the end with how fragmented it is, and how many
+allocations fell through to malloc.
+
+Resident memory is sampled, and freed memory isn't always given back to the OS,
+so name one composition per run for RSS numbers that can be compared.
+*/
+#include "AllocationTrace.h"
+#include "GlobalAllocator.h"
+#include "Utils/Benchy.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+using namespace Memory;
+
+namespace
+{
+	// Terminal allocator of every composition, counts what the pools couldn't take
+	class CountingMallocAllocator : public MallocAllocator
+	{
+	public:
+		static uint64_t Allocations;
+
+		MemDesc Allocate(uint64_t size)
+		{
+			++Allocations;
+			return MallocAllocator::Allocate(size);
+		}
+
+		MemDesc Allocate(uint64_t size, uint64_t alignment)
+		{
+			++Allocations;
+			return MallocAllocator::Allocate(size, alignment);
+		}
+	};
+
+	uint64_t CountingMallocAllocator::Allocations = 0;
+
+	using SlabsAndBuddy =
+		FallbackAllocator<
+			SlabAllocator<RegionAllocator<16_mB, true>>,
+			FallbackAllocator<
+				SlabAllocator<BuddyAllocator<512_mB, 4_kB>>,
+				CountingMallocAllocator
+			>
+		>;
+
+	using Freelists =
+		SegregatorAllocator<
+			FallbackAllocator<
+				SegregatorAllocator<
+					FreelistAllocator<RegionAllocator<256_mB>, 1, 64, 32>,
+					FreelistAllocator<RegionAllocator<256_mB>, 65, 256, 32>,
+					64
+				>,
+				CountingMallocAllocator
+			>,
+			FallbackAllocator<BuddyAllocator<512_mB, 4_kB>, CountingMallocAllocator>,
+			256
+		>;
+
+	struct ReplayResult
+	{
+		uint64_t cycles = 0;
+		uint64_t allocations = 0;
+		uint64_t failures = 0;
+		uint64_t liveBytes = 0;
+		uint64_t peakLiveBytes = 0;
+		uint64_t baseResident = 0;
+		uint64_t peakResident = 0;
+		uint64_t freeBytes = 0;
+		uint64_t largestFreeBlocks = 0;
+	};
+
+	constexpr uint64_t ResidentSamplePeriod = 4096;
+
+	void CollectFreeSpace(Private::AllocatorStatsReportPtr const& report, ReplayResult& result)
+	{
+		result.freeBytes += report->stats.freeBytes;
+		result.largestFreeBlocks += report->stats.largestFreeBlock;
+		for (auto const& nested : report->nested)
+		{
+			CollectFreeSpace(nested, result);
+		}
+	}
+
+	// Pages are touched the way the program would, or they would never be resident
+	void Touch(MemDesc const& desc)
+	{
+		uint8_t* const bytes = static_cast<uint8_t*>(desc.ptr);
+		for (uint64_t offset = 0; offset < desc.size; offset += 4096)
+		{
+			bytes[offset] = 1;
+		}
+	}
+
+	template <typename Allocator>
+	ReplayResult Replay(std::vector<Private::TraceEvent> const& events, Allocator& allocator)
+	{
+		using Private::TraceEventType;
+
+		ReplayResult result;
+		result.baseResident = GetResidentMemory();
+		result.peakResident = result.baseResident;
+		CountingMallocAllocator::Allocations = 0;
+
+		// Requested sizes of the live blocks, by trace id
+		std::unordered_map<uint64_t, std::pair<MemDesc, uint64_t>> live;
+		live.reserve(events.size() / 2);
+		// Blocks a thread reallocated, tracked once its Reallocated event gives their id
+		std::unordered_map<uint32_t, MemDesc> moving;
+
+		auto const Release = [&](uint64_t id)
+		{
+			auto it = live.find(id);
+			if (it == live.end())
+			{
+				return;
+			}
+			uint64_t const start = Benchy::GetCPUCycles();
+			allocator.Deallocate(it->second.first);
+			result.cycles += Benchy::GetCPUCycles() - start;
+			result.liveBytes -= it->second.second;
+			live.erase(it);
+		};
+
+		auto const Track = [&](uint64_t id, MemDesc const& desc, uint64_t size)
+		{
+			++result.allocations;
+			if (!desc.ptr)
+			{
+				++result.failures;
+				return;
+			}
+			Touch(desc);
+			live[id] = { desc, size };
+			result.liveBytes += size;
+			if (result.liveBytes > result.peakLiveBytes)
+			{
+				result.peakLiveBytes = result.liveBytes;
+			}
+		};
+
+		for (size_t i = 0; i < events.size(); ++i)
+		{
+			Private::TraceEvent const& event = events[i];
+			switch (event.type)
+			{
+			case TraceEventType::Allocate:
+			{
+				// Frees are recorded before the block can be reused, only clock skew between cores leaves the id live
+				Release(event.id);
+				uint64_t const start = Benchy::GetCPUCycles();
+				MemDesc const desc = event.alignmentLog2
+					? allocator.Allocate(event.size, uint64_t(1) << event.alignmentLog2)
+					: allocator.Allocate(event.size);
+				result.cycles += Benchy::GetCPUCycles() - start;
+				Track(event.id, desc, event.size);
+				break;
+			}
+			case TraceEventType::Deallocate:
+				Release(event.id);
+				break;
+			case TraceEventType::Reallocate:
+			{
+				auto it = live.find(event.id);
+				MemDesc desc;
+				uint64_t const start = Benchy::GetCPUCycles();
+				if (it != live.end())
+				{
+					desc = allocator.Reallocate(it->second.first, event.size);
+				}
+				else
+				{
+					desc = allocator.Allocate(event.size);
+				}
+				result.cycles += Benchy::GetCPUCycles() - start;
+				if (!desc.ptr)
+				{
+					++result.allocations;
+					++result.failures;
+					break;
+				}
+				if (it != live.end())
+				{
+					result.liveBytes -= it->second.second;
+					live.erase(it);
+				}
+				moving[event.thread] = desc;
+				break;
+			}
+			case TraceEventType::Reallocated:
+			{
+				auto it = moving.find(event.thread);
+				if (it != moving.end())
+				{
+					Track(event.id, it->second, event.size);
+					moving.erase(it);
+				}
+				break;
+			}
+			}
+
+			if (i % ResidentSamplePeriod == 0)
+			{
+				uint64_t const resident = GetResidentMemory();
+				if (resident > result.peakResident)
+				{
+					result.peakResident = resident;
+				}
+			}
+		}
+
+		CollectFreeSpace(allocator.GetStats(), result);
+
+		for (auto const& block : live)
+		{
+			allocator.Deallocate(block.second.first);
+		}
+		// Reallocations the trace stopped in the middle of
+		for (auto const& block : moving)
+		{
+			allocator.Deallocate(block.second);
+		}
+		return result;
+	}
+
+	void PrintResult(char const* name, ReplayResult const& result, uint64_t eventCount)
+	{
+		auto const ToMB = [](uint64_t bytes) { return bytes / (1024. * 1024.); };
+		auto const Percent = [](uint64_t part, uint64_t total) { return total ? 100. * part / total : 0.; };
+
+		uint64_t const residentGrowth = result.peakResident - result.baseResident;
+		printf("%s\n", name);
+		printf("    Time:             %" PRIu64 " cycles, %.1f cycles per event\n", result.cycles, eventCount ? result.cycles / double(eventCount) : 0.);
+		printf("    Peak resident:    %.2f Mb, %.2f Mb above the start, peak live %.2f Mb\n", ToMB(result.peakResident), ToMB(residentGrowth), ToMB(result.peakLiveBytes));
+		printf("    Free at the end:  %.2f Mb, fragmentation %.2f%%\n", ToMB(result.freeBytes), result.freeBytes ? 100. - Percent(result.largestFreeBlocks, result.freeBytes) : 0.);
+		printf("    Malloc fallbacks: %" PRIu64 " of %" PRIu64 " allocations, %.2f%%\n", CountingMallocAllocator::Allocations, result.allocations, Percent(CountingMallocAllocator::Allocations, result.allocations));
+		if (result.failures)
+		{
+			printf("    Failed:           %" PRIu64 " allocations\n", result.failures);
+		}
+	}
+
+	template <typename Allocator>
+	void Run(char const* name, char const* only, std::vector<Private::TraceEvent> const& events)
+	{
+		if (only && std::strcmp(only, name) != 0)
+		{
+			return;
+		}
+		// Compositions hold big pools inline
+		auto allocator = std::make_unique<Allocator>();
+		ReplayResult const result = Replay(events, *allocator);
+		PrintResult(name, result, events.size());
+	}
+} // namespace
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		printf("Usage: TraceReplay <trace file> [global|slabs|freelists|malloc]\n");
+		return 1;
+	}
+
+	std::vector<Private::TraceEvent> events;
+	if (!Private::ReadTrace(argv[1], events))
+	{
+		printf("%s is not an allocation trace\n", argv[1]);
+		return 1;
+	}
+	printf("%zu events\n", events.size());
+
+	char const* only = argc > 2 ? argv[2] : nullptr;
+	Run<Private::GlobalComposition<CountingMallocAllocator>>("global", only, events);
+	Run<SlabsAndBuddy>("slabs", only, events);
+	Run<Freelists>("freelists", only, events);
+	Run<CountingMallocAllocator>("malloc", only, events);
+	return 0;
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <atomic>
 #include <string>
 
 namespace Testy
@@ -75,4 +76,51 @@ struct OnlyMovable
 	int value = 0;
 };
 
+// Keeps alive at the number of instances pointing to it, a null counter counts nothing
+struct InstanceCounted
+{
+	InstanceCounted() = default;
+	InstanceCounted(int v, std::atomic<int>* counter) : value(v), alive(counter)
+	{
+		if (alive)
+		{
+			++*alive;
+		}
+	}
+
+	InstanceCounted(InstanceCounted const& other) : value(other.value), alive(other.alive)
+	{
+		if (alive)
+		{
+			++*alive;
+		}
+	}
+
+	InstanceCounted& operator=(InstanceCounted const& other)
+	{
+		if (other.alive)
+		{
+			++*other.alive;
+		}
+		if (alive)
+		{
+			--*alive;
+		}
+		value = other.value;
+		alive = other.alive;
+		return *this;
+	}
+
+	~InstanceCounted()
+	{
+		if (alive)
+		{
+			--*alive;
+		}
+	}
+
+	int value = 0;
+	std::atomic<int>* alive = nullptr;
+};
+
 }
\ No newline at end of file
@@ -1,12 +1,20 @@
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <random>
+#include <thread>
+#include <vector>
 
 #include "DataStructures/Tests.h"
 #include "Memory/Tests.h"
+#include "Memory/Benchmarks.h"
 
 #include "DataStructures/BST.h"
 #include "DataStructures/BSTv1.h"
+#include "DataStructures/Vector.h"
+#include "Memory/ScopedArena.h"
 #include "Utils/Benchy.h"
 #include "Memory/Memory.h"
 
@@ -32,7 +40,7 @@ void RunTests()
 	TestDataStructures();
 }
 
-template <template <typename> class T, typename V>
+template <template <typename...> class T, typename V>
 void BenchBST(std::string const& name, std::random_device& rd)
 {
 	Benchy::Report report(name);
@@ -72,9 +80,200 @@ void BenchBST(std::string const& name, std::random_device& rd)
 	}
 }
 
+// Every thread does the same amount of work, so flat cycle counts mean linear scaling.
+// With crossThreadFree each thread frees the blocks allocated by its neighbour.
+void BenchAllocatorScaling(std::string const& name, bool crossThreadFree)
+{
+	Benchy::Report report(name);
+	int const count = 1000000;
+	unsigned const maxThreads = std::max(1u, std::thread::hardware_concurrency());
+
+	for (unsigned threads = 1; threads <= maxThreads; threads *= 2)
+	{
+		std::string const benchName = std::to_string(threads) + " threads allocating and deallocating 1 million blocks each";
+		for (int run = 0; run < 5; ++run)
+		{
+			std::vector<std::vector<Memory::MemDesc>> blocks(threads);
+			Benchy::Stopwatch sw(report, benchName);
+			std::vector<std::thread> workers;
+			for (unsigned t = 0; t < threads; ++t)
+			{
+				workers.emplace_back([&blocks, count, t, crossThreadFree]()
+				{
+					std::mt19937 gen(t);
+					std::uniform_int_distribution<> dist(8, 256);
+					std::vector<Memory::MemDesc>& mine = blocks[t];
+					mine.reserve(count);
+					for (int i = 0; i < count; ++i)
+					{
+						mine.push_back(Memory::Allocate(dist(gen)));
+						if (!crossThreadFree && i % 2)
+						{
+							Memory::Deallocate(mine.back());
+							mine.pop_back();
+						}
+					}
+				});
+			}
+			for (std::thread& worker : workers)
+			{
+				worker.join();
+			}
+			workers.clear();
+			for (unsigned t = 0; t < threads; ++t)
+			{
+				workers.emplace_back([&blocks, threads, t, crossThreadFree]()
+				{
+					for (Memory::MemDesc desc : blocks[crossThreadFree ? (t + 1) % threads : t])
+					{
+						Memory::Deallocate(desc);
+					}
+				});
+			}
+			for (std::thread& worker : workers)
+			{
+				worker.join();
+			}
+		}
+	}
+}
+
+// Per-node deallocation against dropping the whole tree with an arena rewind
+void BenchBSTTeardown(std::random_device& rd)
+{
+	Benchy::Report report("Bench BSTv1<int> teardown");
+	int const count = 1000000;
+	std::mt19937 gen(rd());
+	std::uniform_int_distribution<> dist(0, count);
+
+	for (int i = 0; i < 10; ++i)
+	{
+		{
+			auto tree = std::make_unique<BSTv1<int>>();
+			{
+				Benchy::Stopwatch sw(report, "Adding 1 million random elements");
+				for (int i = 0; i < count; ++i)
+				{
+					tree->Add(dist(gen));
+				}
+			}
+			Benchy::Stopwatch sw(report, "Tearing down, deallocating node by node");
+			tree.reset();
+		}
+		{
+			Memory::ScopedArena arena;
+			auto tree = std::make_unique<BSTv1<int, Memory::ArenaAllocation>>();
+			{
+				Benchy::Stopwatch sw(report, "Adding 1 million random elements to the arena");
+				for (int i = 0; i < count; ++i)
+				{
+					tree->Add(dist(gen));
+				}
+			}
+			Benchy::Stopwatch sw(report, "Tearing down, rewinding the arena");
+			tree.reset();
+			arena.Rewind();
+		}
+	}
+}
+
+#ifdef MEMORY_CALL_SITES
+// Tree nodes from the ALLOCATE_FROM sites of BSTv1 interleaved with blocks of node-like sizes from
+// another site, first from the global allocator, then with the sites routed to pools by the profile of those runs
+void BenchBSTCallSiteRouting(std::random_device& rd)
+{
+	Benchy::Report report("Bench BSTv1<int> call site routing");
+	int const count = 1000000;
+	std::mt19937 gen(rd());
+	std::uniform_int_distribution<> dist(0, count);
+	std::uniform_int_distribution<> noiseSize(16, 64);
+	static Memory::CallSite noiseSite(__FILE__, __LINE__, "BenchBSTCallSiteRouting noise");
+	uint64_t found = 0;
+
+	auto const Run = [&](std::string const& name)
+	{
+		std::vector<Memory::MemDesc> noise;
+		noise.reserve(count);
+		BSTv1<int> tree;
+		{
+			Benchy::Stopwatch sw(report, name + ": adding 1 million random elements");
+			for (int i = 0; i < count; ++i)
+			{
+				tree.Add(dist(gen));
+				noise.push_back(Memory::Allocate(noiseSize(gen), noiseSite));
+			}
+		}
+		{
+			Benchy::Stopwatch sw(report, name + ": looking up 1 million random elements");
+			for (int i = 0; i < count; ++i)
+			{
+				found += tree.Find(dist(gen)) ? 1 : 0;
+			}
+		}
+		for (Memory::MemDesc desc : noise)
+		{
+			Memory::Deallocate(desc);
+		}
+	};
+
+	for (int run = 0; run < 5; ++run)
+	{
+		Run("GlobalAllocatorType");
+	}
+	char const* path = "bench_call_sites.txt";
+	if (!Memory::WriteCallSiteProfile(path) || !Memory::LoadCallSiteProfile(path))
+	{
+		std::cout << "Call site profile failed" << std::endl;
+		return;
+	}
+	std::remove(path);
+	for (int run = 0; run < 5; ++run)
+	{
+		Run("Routed by profile");
+	}
+	std::cout << "Elements found: " << found << std::endl;
+}
+#endif
+
+// Vector grows through Memory::Reallocate, std::vector copies on every doubling
+template <typename T>
+void BenchVectorGrowth(std::string const& name)
+{
+	Benchy::Report report(name);
+	int const count = 100000000;
+	for (int run = 0; run < 3; ++run)
+	{
+		T data;
+		Benchy::Stopwatch sw(report, "Pushing 100 million ints");
+		for (int i = 0; i < count; ++i)
+		{
+			data.push_back(i);
+		}
+	}
+}
+
+template <typename V>
+struct VectorPushBack : Vector<V>
+{
+	void push_back(V v) { this->Add(v); }
+};
+
 void RunBenchmarks()
 {
+	std::cout << "Resident memory before benchmarks: " << Memory::GetResidentMemory() / 1024 << " kB" << std::endl;
+
 	std::random_device rd;
 	BenchBST<BST, int>("Bench BST<int>", rd);
 	BenchBST<BSTv1, int>("Bench BSTv1<int>", rd);
+	BenchBSTTeardown(rd);
+#ifdef MEMORY_CALL_SITES
+	BenchBSTCallSiteRouting(rd);
+#endif
+	BenchAllocatorScaling("Bench Memory::Allocate thread scaling", false);
+	BenchAllocatorScaling("Bench Memory::Allocate thread scaling, cross-thread frees", true);
+	BenchVectorGrowth<VectorPushBack<int>>("Bench Vector<int> growth");
+	BenchVectorGrowth<std::vector<int>>("Bench std::vector<int> growth");
+	BenchMemory();
+
+	std::cout << "Resident memory after benchmarks: " << Memory::GetResidentMemory() / 1024 << " kB" << std::endl;
 }